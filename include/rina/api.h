@@ -221,6 +221,79 @@ void rina_flow_spec_unreliable(struct rina_flow_spec *spec);
  */
 unsigned int rina_flow_mss_get(int fd);
 
+/*
+ * Descriptor of an SDU for rina_flow_write_multi() and
+ * rina_flow_read_multi().
+ */
+struct rina_sdu {
+    void *buf;
+    uint32_t len;
+};
+
+/*
+ * Write up to @num SDUs to the flow @fd with a single system call, each
+ * SDU being described by an entry of @sdus. Returns the number of SDUs
+ * written, or -1 on error with errno set properly.
+ */
+int rina_flow_write_multi(int fd, const struct rina_sdu *sdus,
+                          unsigned int num);
+
+/*
+ * Read up to @num SDUs from the flow @fd with a single system call. On
+ * input, the len field of each entry of @sdus is the size of the buffer;
+ * on output, it is set to the length of the SDU received. SDUs that do
+ * not fit the corresponding buffer are left for the next read. Returns
+ * the number of SDUs read, 0 on EOF, or -1 on error with errno set
+ * properly.
+ */
+int rina_flow_read_multi(int fd, struct rina_sdu *sdus, unsigned int num);
+
+/*
+ * Shared-memory rings to exchange SDUs with a flow without issuing a
+ * system call for each SDU. SDUs posted with rina_ring_send() are
+ * transmitted by the system in the background (a system call is only
+ * issued to wake up the system after an idle period), while
+ * rina_ring_recv() takes the SDUs received on the flow.
+ */
+struct rina_ring;
+
+/*
+ * Attach a pair of RX/TX rings of @num_slots slots (a power of two)
+ * to the flow @fd. Each slot holds an SDU of up to @slot_size bytes.
+ * Returns NULL on error with errno set properly. The rings stay attached
+ * to @fd until it is closed.
+ */
+struct rina_ring *rina_flow_ring_attach(int fd, unsigned int num_slots,
+                                        unsigned int slot_size);
+
+/* Unmap the rings and release the resources allocated by
+ * rina_flow_ring_attach(). */
+void rina_flow_ring_detach(struct rina_ring *ring);
+
+/*
+ * Post an SDU on the TX ring. Returns @len on success, or -1 with errno
+ * set to EAGAIN if the ring is full (or EMSGSIZE if the SDU does not fit
+ * a slot).
+ */
+int rina_ring_send(struct rina_ring *ring, const void *buf, unsigned int len);
+
+/*
+ * Take an SDU from the RX ring, copying it in @buf. Returns the SDU
+ * length, 0 on EOF, or -1 with errno set to EAGAIN if the ring is empty
+ * (or EMSGSIZE if the SDU does not fit @len).
+ */
+int rina_ring_recv(struct rina_ring *ring, void *buf, unsigned int len);
+
+/* Number of SDUs posted on the TX ring and not yet transmitted. */
+unsigned int rina_ring_tx_pending(struct rina_ring *ring);
+
+/*
+ * Synchronize the rings with the system, and wait up to @timeout
+ * milliseconds (as in poll()) for the @events (POLLIN and/or POLLOUT)
+ * to happen on the rings. Returns the same values of poll().
+ */
+int rina_ring_poll(struct rina_ring *ring, short events, int timeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -171,6 +171,88 @@ struct rl_ioctl_info {
 #define RLITE_IOCTL_CHFLAGS _IOW(0xAF, 0x01, uint64_t)
 #define RLITE_IOCTL_MSS_GET _IOW(0xAF, 0x02, uint32_t *)
 
+/* Descriptor of a single SDU for the batched read/write ioctls. On
+ * write, 'len' is the length of the SDU stored at 'buf'. On read, 'len'
+ * is the size of the buffer on input, and the length of the SDU
+ * received on output. */
+struct rl_sdu_desc {
+    uint64_t buf;
+    uint32_t len;
+    uint32_t pad1;
+};
+
+/* Argument of the batched read/write ioctls: an array of 'num' SDU
+ * descriptors. The ioctl returns the number of SDUs read or written. */
+struct rl_ioctl_sdu_batch {
+    uint64_t descs;
+    uint32_t num;
+    uint32_t pad1;
+};
+
+#define RL_SDU_BATCH_MAX 64
+
+#define RLITE_IOCTL_SDU_WRITE_MULTI _IOW(0xAF, 0x03, struct rl_ioctl_sdu_batch)
+#define RLITE_IOCTL_SDU_READ_MULTI _IOW(0xAF, 0x04, struct rl_ioctl_sdu_batch)
+
+/*
+ * Shared-memory rings between an application and a flow. The memory
+ * area returned by mmap() on the rlite-io device contains an RX ring and
+ * a TX ring. Each ring starts with a struct rl_ring_hdr, followed by an
+ * array of num_slots struct rl_ring_slot, followed (at offset
+ * RL_RING_DATA_OFS) by num_slots buffers of slot_size bytes each.
+ * Head and tail are free running indices: the producer writes the slot
+ * (head % num_slots) and then increments head, while the consumer reads
+ * the slot (tail % num_slots) and then increments tail. The application
+ * is the producer for the TX ring and the consumer for the RX ring.
+ * The TX ring is drained by a kernel worker. When the worker goes idle it
+ * sets RL_RING_F_NEED_KICK in the TX ring flags, and the application must
+ * then issue RLITE_IOCTL_RING_KICK after posting new SDUs. The RX ring is
+ * refilled on receive and when poll() is called on the device, which is
+ * otherwise only used to wait for the rings.
+ */
+struct rl_ring_hdr {
+    uint32_t head;
+    uint32_t pad1[15];
+    uint32_t tail;
+    uint32_t pad2[15];
+    uint32_t num_slots;
+    uint32_t slot_size;
+#define RL_RING_F_EOF (1 << 0)       /* RX ring */
+#define RL_RING_F_NEED_KICK (1 << 1) /* TX ring */
+    uint32_t flags;
+    uint32_t pad3[13];
+};
+
+struct rl_ring_slot {
+    uint32_t len;
+    uint32_t pad1;
+};
+
+#define RL_RING_SLOTS_MAX 4096
+#define RL_RING_SLOT_SIZE_MAX 65536
+#define RL_RING_DATA_OFS(_n)                                                   \
+    ((sizeof(struct rl_ring_hdr) + (_n) * sizeof(struct rl_ring_slot) + 63) & \
+     ~63UL)
+#define RL_RING_SLOT(_hdr, _i)                                                 \
+    (((struct rl_ring_slot *)((_hdr) + 1)) + (_i))
+#define RL_RING_BUF(_hdr, _i)                                                  \
+    (((uint8_t *)(_hdr)) + RL_RING_DATA_OFS((_hdr)->num_slots) +              \
+     (_i) * (_hdr)->slot_size)
+
+/* Argument of RLITE_IOCTL_RING_SETUP. The application specifies the
+ * number of slots (a power of two) and the slot size; the kernel
+ * returns the actual slot size and the layout of the area to mmap(). */
+struct rl_ioctl_ring_req {
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t rx_ofs;
+    uint32_t tx_ofs;
+    uint64_t mmap_size;
+};
+
+#define RLITE_IOCTL_RING_SETUP _IOWR(0xAF, 0x05, struct rl_ioctl_ring_req)
+#define RLITE_IOCTL_RING_KICK _IO(0xAF, 0x06)
+
 #define RLITE_MGMT_HDR_T_OUT_LOCAL_PORT 1
 #define RLITE_MGMT_HDR_T_OUT_DST_ADDR 2
 #define RLITE_MGMT_HDR_T_IN 3
@@ -201,9 +283,16 @@ struct rl_pci_match {
     rlm_cepid_t dst_cepid;
     rlm_cepid_t src_cepid;
     rlm_qosid_t qos_id;
-    rlm_qosid_t pad2;
+    /* Number of low-order bits of dst_addr that are ignored by the match
+     * (0 for an exact match). A dst-only entry with N range bits matches
+     * the aligned range of 2^N addresses containing dst_addr. The longest
+     * match (i.e. the smallest range) wins. */
+    uint32_t dst_range_bits;
 };
 
+/* Maximum value for rl_pci_match.dst_range_bits. */
+#define RL_PCI_MATCH_RANGE_BITS_MAX 63
+
 #define DTCP_PRESENT(_dc) ((_dc).flags != 0)
 
 struct dtcp_config {
@@ -237,11 +326,16 @@ struct dtcp_config {
         uint16_t data_rxms_max;
         uint16_t max_rtxq_len;
         uint32_t initial_rtx_timeout;
-        uint32_t pad2;
+        uint8_t cc_type; /* congestion control algorithm */
+        uint8_t pad2[3];
+#define RLITE_CC_T_DEFAULT 0
+#define RLITE_CC_T_RENO 1
+#define RLITE_CC_T_CUBIC 2
     } rtx;
 
     uint32_t initial_a; /* A */
-    uint32_t bandwidth; /* in bps */
+    uint32_t pad3;
+    uint64_t bandwidth; /* in bps, used for sender pacing */
 };
 
 struct rl_flow_config {
@@ -293,6 +387,7 @@ struct rl_rmt_stats {
     uint64_t ttl_drop;
     uint64_t noflow_drop;
     uint64_t other_drop;
+    uint64_t ecn_mark;
 };
 
 /* IPCP statistics. All counters must be 64 bits wide. */
@@ -67,6 +67,9 @@ enum {
     RLITE_KER_IPCP_CONFIG_GET_RESP,  /* 35 */
     RLITE_KER_IPCP_SCHED_WRR,        /* 36 */
     RLITE_KER_IPCP_SCHED_PFIFO,      /* 37 */
+    RLITE_KER_IPCP_SCHED_DRR,        /* 38 */
+    RLITE_KER_IPCP_SCHED_PRIO_DRR,   /* 39 */
+    RLITE_KER_IPCP_SCHED_FQ_CODEL,   /* 40 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -471,4 +474,60 @@ struct rl_kmsg_ipcp_sched_pfifo {
     rlm_qosid_t prio_levels;
 };
 
+/* application --> kernel message to configure a DRR PDU scheduler. */
+struct rl_kmsg_ipcp_sched_drr {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+
+    /* Quantum size in bytes. */
+    uint32_t quantum;
+
+    /* DRR weights are dwords. */
+    struct rl_msg_array_field weights;
+};
+
+/* application --> kernel message to configure a hierarchical PDU
+ * scheduler, with strict priority levels on top of DRR classes. */
+struct rl_kmsg_ipcp_sched_prio_drr {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+
+    /* Quantum size in bytes. */
+    uint32_t quantum;
+
+    /* Number of strict priority levels. */
+    rlm_qosid_t prio_levels;
+
+    /* Weights of the DRR classes (dwords). */
+    struct rl_msg_array_field weights;
+};
+
+/* application --> kernel message to configure an FQ-CoDel PDU scheduler. */
+struct rl_kmsg_ipcp_sched_fq_codel {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+
+    /* Quantum size in bytes. */
+    uint32_t quantum;
+
+    /* Number of flow queues. */
+    uint32_t flows;
+
+    /* CoDel acceptable queueing delay, in microseconds. */
+    uint32_t target_us;
+
+    /* CoDel sliding window, in microseconds. */
+    uint32_t interval_us;
+
+    /* Mark data transfer PDUs with ECN rather than dropping them. */
+    uint8_t ecn;
+    uint8_t pad1[3];
+};
+
 #endif /* __RLITE_KER_H__ */
@@ -24,39 +24,480 @@
 
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/interrupt.h>
+#include <linux/skbuff.h>
 #include "rlite-kernel.h"
 
+#ifndef RL_SKB
 /*
- * Allocate a buffer to hold PDU header and data.
- * The returned buffer has zero length (i.e. it's empty).
+ * Packet buffers are allocated from dedicated slab caches: one for the
+ * struct rl_buf headers, and one for each size class of raw buffers
+ * (header included). Raw buffers bigger than the largest class are
+ * allocated with kmalloc(). On top of the slab caches, each CPU keeps a
+ * small stack of free objects for each cache, which is refilled and
+ * drained in batches, using the slab bulk interface. Since buffers are
+ * allocated and freed both in process and softirq context, the per-CPU
+ * stacks are accessed with bottom halves disabled. As a consequence,
+ * buffers must not be allocated or freed in hardirq context (which is
+ * not the case for the rlite datapath).
+ * A raw buffer may also wrap the data of a received skb (see
+ * rl_buf_adopt_skb()), in which case it is released together with the skb.
+ * Raw buffers of the Ethernet MTU class are instead carved out of page
+ * fragments, which are reference counted through their page. In this way
+ * the data can be handed to an skb built in place (see rl_buf_build_skb()),
+ * which keeps the memory alive after the raw buffer is released.
  */
-struct rl_buf *
-rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
+
+static const unsigned int rl_rawbuf_sizes[] = {
+    256,  /* control PDUs and small SDUs */
+    2048, /* up to Ethernet MTU-sized PDUs */
+    9216, /* jumbo frames */
+};
+
+#define RL_RAWBUF_CLASSES ARRAY_SIZE(rl_rawbuf_sizes)
+/* Index of the struct rl_buf cache, right after the raw buffer ones. */
+#define RL_BUF_HDR_CACHE RL_RAWBUF_CLASSES
+/* Index of the cache (and class) of the raw buffers that wrap an
+ * adopted skb, which only consist of the struct rl_rawbuf. */
+#define RL_RAWBUF_SKB (RL_RAWBUF_CLASSES + 1)
+#define RL_BUF_CACHES (RL_RAWBUF_CLASSES + 2)
+/* Class used for raw buffers allocated with kmalloc(). */
+#define RL_RAWBUF_KMALLOC RL_BUF_CACHES
+/* Class of the raw buffers allocated from page fragments, which has no
+ * slab cache. Past the end of these buffers there is room for the struct
+ * skb_shared_info needed by build_skb(). */
+#define RL_RAWBUF_FRAG 1
+#define RL_RAWBUF_FRAG_SIZE                                                    \
+    (SKB_DATA_ALIGN(2048) + SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+/* Maximum number of free objects kept per CPU (for each cache), and
+ * number of objects moved from/to the slab at once. */
+#define RL_BUF_PCPU_MAX 64
+#define RL_BUF_PCPU_BATCH 16
+
+struct rl_buf_objstack {
+    unsigned int count;
+    void *objs[RL_BUF_PCPU_MAX];
+};
+
+struct rl_buf_pcpu {
+    struct rl_buf_objstack stacks[RL_BUF_CACHES];
+};
+
+static struct kmem_cache *rl_buf_caches[RL_BUF_CACHES];
+static struct rl_buf_pcpu __percpu *rl_buf_pcpu;
+
+static const char *rl_buf_cache_names[RL_BUF_CACHES] = {
+    "rl_rawbuf_256", "rl_rawbuf_2048", "rl_rawbuf_9216",
+    "rl_buf",        "rl_rawbuf_skb",
+};
+
+static inline unsigned int
+rl_rawbuf_class(size_t size)
+{
+    unsigned int i;
+
+    for (i = 0; i < RL_RAWBUF_CLASSES; i++) {
+        if (size <= rl_rawbuf_sizes[i]) {
+            return i;
+        }
+    }
+
+    return RL_RAWBUF_KMALLOC;
+}
+
+#ifndef RL_HAVE_KMEM_CACHE_BULK
+static int
+kmem_cache_alloc_bulk(struct kmem_cache *kc, gfp_t gfp, size_t n, void **p)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        p[i] = kmem_cache_alloc(kc, gfp);
+        if (!p[i]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static void
+kmem_cache_free_bulk(struct kmem_cache *kc, size_t n, void **p)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        kmem_cache_free(kc, p[i]);
+    }
+}
+#endif /* !RL_HAVE_KMEM_CACHE_BULK */
+
+/* Pop an object from the per-CPU stack of cache 'idx', refilling the stack
+ * from the slab if it is empty. To be called with bottom halves
+ * disabled. Returns NULL if the refill fails. */
+static inline void *
+rl_buf_objstack_pop(struct rl_buf_pcpu *pcpu, unsigned int idx)
+{
+    struct rl_buf_objstack *st = pcpu->stacks + idx;
+
+    if (unlikely(st->count == 0)) {
+        st->count = kmem_cache_alloc_bulk(rl_buf_caches[idx],
+                                          GFP_ATOMIC | __GFP_NOWARN,
+                                          RL_BUF_PCPU_BATCH, st->objs);
+        if (unlikely(st->count == 0)) {
+            return NULL;
+        }
+    }
+
+    return st->objs[--st->count];
+}
+
+/* Push an object to the per-CPU stack of cache 'idx', giving a batch of
+ * objects back to the slab if the stack is full. To be called with bottom
+ * halves disabled. */
+static inline void
+rl_buf_objstack_push(struct rl_buf_pcpu *pcpu, unsigned int idx, void *obj)
+{
+    struct rl_buf_objstack *st = pcpu->stacks + idx;
+
+    if (unlikely(st->count == RL_BUF_PCPU_MAX)) {
+        st->count -= RL_BUF_PCPU_BATCH;
+        kmem_cache_free_bulk(rl_buf_caches[idx], RL_BUF_PCPU_BATCH,
+                             st->objs + st->count);
+    }
+    st->objs[st->count++] = obj;
+}
+
+/* Allocate a raw buffer able to hold 'size' bytes. To be called with
+ * bottom halves disabled. */
+static inline struct rl_rawbuf *
+__rl_rawbuf_alloc(struct rl_buf_pcpu *pcpu, size_t size)
+{
+    unsigned int cls = rl_rawbuf_class(sizeof(struct rl_rawbuf) + size);
+    struct rl_rawbuf *raw;
+
+    if (cls == RL_RAWBUF_FRAG) {
+        raw = netdev_alloc_frag(RL_RAWBUF_FRAG_SIZE);
+    } else if (likely(cls != RL_RAWBUF_KMALLOC)) {
+        raw = rl_buf_objstack_pop(pcpu, cls);
+    } else {
+        raw = kmalloc(sizeof(*raw) + size, GFP_ATOMIC | __GFP_NOWARN);
+    }
+    if (unlikely(!raw)) {
+        return NULL;
+    }
+    rl_memtrack_account(RL_MT_BUFDATA, 1);
+    raw->size = size;
+    raw->cls  = cls;
+    raw->data = raw->buf;
+    raw->skb  = NULL;
+    raw->lent = false;
+    atomic_set(&raw->refcnt, 1);
+
+    return raw;
+}
+
+/* To be called with bottom halves disabled. */
+static inline void
+__rl_rawbuf_free(struct rl_buf_pcpu *pcpu, struct rl_rawbuf *raw)
+{
+    rl_memtrack_account(RL_MT_BUFDATA, -1);
+    if (unlikely(raw->cls == RL_RAWBUF_KMALLOC)) {
+        kfree(raw);
+        return;
+    }
+    if (raw->cls == RL_RAWBUF_FRAG) {
+        /* An skb built around the data may still hold the page. */
+        skb_free_frag(raw);
+        return;
+    }
+    if (raw->skb) {
+        consume_skb(raw->skb);
+    }
+    rl_buf_objstack_push(pcpu, raw->cls, raw);
+}
+
+/* Allocate a buffer from the per-CPU stacks. To be called with bottom
+ * halves disabled. */
+static struct rl_buf *
+__rl_buf_alloc(struct rl_buf_pcpu *pcpu, size_t real_size)
 {
     struct rl_buf *rb;
-#ifndef RL_SKB
-    size_t real_size = hdroom + size + tailroom;
-    uint8_t *kbuf;
 
-    rb = rl_alloc(sizeof(*rb), gfp, RL_MT_BUFHDR);
+    rb = rl_buf_objstack_pop(pcpu, RL_BUF_HDR_CACHE);
     if (unlikely(!rb)) {
-        RPV(1, "Out of memory\n");
         return NULL;
     }
 
-    kbuf = rl_alloc(sizeof(*rb->raw) + real_size, gfp, RL_MT_BUFDATA);
-    if (unlikely(!kbuf)) {
-        rl_free(rb, RL_MT_BUFHDR);
-        RPV(1, "Out of memory\n");
+    rb->raw = __rl_rawbuf_alloc(pcpu, real_size);
+    if (unlikely(!rb->raw)) {
+        rl_buf_objstack_push(pcpu, RL_BUF_HDR_CACHE, rb);
         return NULL;
     }
+    rl_memtrack_account(RL_MT_BUFHDR, 1);
+
+    return rb;
+}
 
-    rb->raw       = (struct rl_rawbuf *)kbuf;
+/* Slow path for rl_buf_alloc(), used when the per-CPU stacks cannot be
+ * refilled. Unlike the fast path, this honors 'gfp' (and may sleep). */
+static struct rl_buf *
+rl_buf_alloc_slow(size_t real_size, gfp_t gfp)
+{
+    unsigned int cls = rl_rawbuf_class(sizeof(struct rl_rawbuf) + real_size);
+    struct rl_buf *rb;
+
+    rb = kmem_cache_alloc(rl_buf_caches[RL_BUF_HDR_CACHE], gfp);
+    if (unlikely(!rb)) {
+        return NULL;
+    }
+
+    if (cls == RL_RAWBUF_FRAG) {
+        /* Page fragments cannot honor 'gfp'. */
+        cls = RL_RAWBUF_KMALLOC;
+    }
+    if (cls != RL_RAWBUF_KMALLOC) {
+        rb->raw = kmem_cache_alloc(rl_buf_caches[cls], gfp);
+    } else {
+        rb->raw = kmalloc(sizeof(*rb->raw) + real_size, gfp);
+    }
+    if (unlikely(!rb->raw)) {
+        kmem_cache_free(rl_buf_caches[RL_BUF_HDR_CACHE], rb);
+        return NULL;
+    }
+    rl_memtrack_account(RL_MT_BUFHDR, 1);
+    rl_memtrack_account(RL_MT_BUFDATA, 1);
     rb->raw->size = real_size;
+    rb->raw->cls  = cls;
+    rb->raw->data = rb->raw->buf;
+    rb->raw->skb  = NULL;
+    rb->raw->lent = false;
     atomic_set(&rb->raw->refcnt, 1);
-    rb->pci = (struct rina_pci *)(rb->raw->buf + hdroom);
+
+    return rb;
+}
+
+/* Release a buffer to the per-CPU stacks. To be called with bottom
+ * halves disabled. */
+static inline void
+__rl_buf_release(struct rl_buf_pcpu *pcpu, struct rl_buf *rb)
+{
+    if (atomic_dec_and_test(&rb->raw->refcnt)) {
+        __rl_rawbuf_free(pcpu, rb->raw);
+    }
+    rl_memtrack_account(RL_MT_BUFHDR, -1);
+    rl_buf_objstack_push(pcpu, RL_BUF_HDR_CACHE, rb);
+}
+
+/* Initialize the fields of a newly allocated buffer. */
+static inline void
+rl_buf_setup(struct rl_buf *rb, size_t hdroom)
+{
+    rb->pci = (struct rina_pci *)(rb->raw->data + hdroom);
     rb->len = 0;
     rb_list_init(&rb->node);
+    RL_BUF_RMT(rb).lower_flow = NULL;
+}
+
+int
+rl_bufs_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < RL_BUF_CACHES; i++) {
+        size_t size;
+
+        if (i == RL_RAWBUF_FRAG) {
+            continue; /* no slab cache */
+        } else if (i == RL_BUF_HDR_CACHE) {
+            size = sizeof(struct rl_buf);
+        } else if (i == RL_RAWBUF_SKB) {
+            size = sizeof(struct rl_rawbuf);
+        } else {
+            size = rl_rawbuf_sizes[i];
+        }
+
+        rl_buf_caches[i] = kmem_cache_create(rl_buf_cache_names[i], size, 0,
+                                             SLAB_HWCACHE_ALIGN, NULL);
+        if (!rl_buf_caches[i]) {
+            goto err;
+        }
+    }
+
+    rl_buf_pcpu = alloc_percpu(struct rl_buf_pcpu);
+    if (!rl_buf_pcpu) {
+        goto err;
+    }
+
+    return 0;
+err:
+    while (i > 0) {
+        kmem_cache_destroy(rl_buf_caches[--i]);
+    }
+    return -ENOMEM;
+}
+
+void
+rl_bufs_fini(void)
+{
+    unsigned int i;
+    int cpu;
+
+    /* Give all the cached objects back to the slabs. */
+    for_each_possible_cpu (cpu) {
+        struct rl_buf_pcpu *pcpu = per_cpu_ptr(rl_buf_pcpu, cpu);
+
+        for (i = 0; i < RL_BUF_CACHES; i++) {
+            if (pcpu->stacks[i].count) {
+                kmem_cache_free_bulk(rl_buf_caches[i], pcpu->stacks[i].count,
+                                     pcpu->stacks[i].objs);
+                pcpu->stacks[i].count = 0;
+            }
+        }
+    }
+    free_percpu(rl_buf_pcpu);
+
+    for (i = 0; i < RL_BUF_CACHES; i++) {
+        kmem_cache_destroy(rl_buf_caches[i]);
+    }
+}
+
+/*
+ * Wrap a received skb into a rl_buf, so that the packet can be passed to
+ * the upper layers without copying. On success the skb is owned by the
+ * returned buffer. The skb data must be linear, and not shared with
+ * anybody else, since the upper layers may modify the packet headers;
+ * NULL is returned otherwise (or if memory is not available), and the
+ * caller is expected to fall back to copying.
+ */
+struct rl_buf *
+rl_buf_adopt_skb(struct sk_buff *skb)
+{
+    struct rl_buf_pcpu *pcpu;
+    struct rl_rawbuf *raw;
+    struct rl_buf *rb = NULL;
+
+    if (skb_is_nonlinear(skb) || skb_shared(skb) || skb_cloned(skb)) {
+        return NULL;
+    }
+
+    local_bh_disable();
+    pcpu = this_cpu_ptr(rl_buf_pcpu);
+    raw  = rl_buf_objstack_pop(pcpu, RL_RAWBUF_SKB);
+    if (likely(raw)) {
+        rb = rl_buf_objstack_pop(pcpu, RL_BUF_HDR_CACHE);
+        if (unlikely(!rb)) {
+            rl_buf_objstack_push(pcpu, RL_RAWBUF_SKB, raw);
+        }
+    }
+    local_bh_enable();
+
+    if (unlikely(!rb)) {
+        return NULL;
+    }
+    rl_memtrack_account(RL_MT_BUFHDR, 1);
+    rl_memtrack_account(RL_MT_BUFDATA, 1);
+
+    skb_orphan(skb);
+    raw->size = skb_end_pointer(skb) - skb->head;
+    raw->cls  = RL_RAWBUF_SKB;
+    raw->data = skb->head;
+    raw->skb  = skb;
+    raw->lent = false;
+    atomic_set(&raw->refcnt, 1);
+
+    rb->raw = raw;
+    rb->pci = (struct rina_pci *)skb->data;
+    rb->len = skb->len;
+    rb_list_init(&rb->node);
+    RL_BUF_RMT(rb).lower_flow = NULL;
+
+    return rb;
+}
+EXPORT_SYMBOL(rl_buf_adopt_skb);
+
+/*
+ * Build an skb around the data of 'rb', so that the PDU can be transmitted
+ * without copying. The skb takes its own reference on the page fragment
+ * backing the raw buffer, so that 'rb' is still owned (and must be freed)
+ * by the caller, and the data outlives it until the skb is released.
+ * The raw buffer must not be shared with clones (whose PCI may still be
+ * updated), and must provide at least 'hdroom' bytes of headroom and
+ * 'tailroom' bytes of tailroom. Each raw buffer can only be lent once, since
+ * the struct skb_shared_info lives in the buffer itself: if the transmission
+ * must be retried, the caller falls back to copying. NULL is returned when
+ * any of these conditions is not met.
+ */
+struct sk_buff *
+rl_buf_build_skb(struct rl_buf *rb, unsigned int hdroom, unsigned int tailroom)
+{
+    struct rl_rawbuf *raw = rb->raw;
+    uint8_t *end = (uint8_t *)raw + SKB_WITH_OVERHEAD(RL_RAWBUF_FRAG_SIZE);
+    struct sk_buff *skb;
+
+    if (raw->cls != RL_RAWBUF_FRAG || raw->lent ||
+        atomic_read(&raw->refcnt) != 1 ||
+        RL_BUF_DATA(rb) - raw->buf < hdroom ||
+        end - (RL_BUF_DATA(rb) + rb->len) < tailroom) {
+        return NULL;
+    }
+
+    /* The skb head starts after the struct rl_rawbuf, so that the network
+     * stack cannot overwrite it through the headroom. */
+    skb = build_skb(raw->buf, RL_RAWBUF_FRAG_SIZE - sizeof(*raw));
+    if (unlikely(!skb)) {
+        return NULL;
+    }
+    get_page(virt_to_head_page(raw));
+    raw->lent = true;
+
+    skb_reserve(skb, RL_BUF_DATA(rb) - raw->buf);
+    skb_put(skb, rb->len);
+
+    return skb;
+}
+EXPORT_SYMBOL(rl_buf_build_skb);
+
+#else /* RL_SKB */
+
+int
+rl_bufs_init(void)
+{
+    return 0;
+}
+
+void
+rl_bufs_fini(void)
+{
+}
+#endif /* RL_SKB */
+
+/*
+ * Allocate a buffer to hold PDU header and data.
+ * The returned buffer has zero length (i.e. it's empty).
+ */
+struct rl_buf *
+rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
+{
+    struct rl_buf *rb;
+#ifndef RL_SKB
+    size_t real_size = hdroom + size + tailroom;
+
+    local_bh_disable();
+    rb = __rl_buf_alloc(this_cpu_ptr(rl_buf_pcpu), real_size);
+    local_bh_enable();
+
+    if (unlikely(!rb)) {
+        rb = rl_buf_alloc_slow(real_size, gfp);
+        if (unlikely(!rb)) {
+            RPV(1, "Out of memory\n");
+            return NULL;
+        }
+    }
+
+    rl_buf_setup(rb, hdroom);
 
 #else  /* RL_SKB */
     rb = alloc_skb(hdroom + size + tailroom, gfp);
@@ -67,25 +508,71 @@ rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
     }
 
     skb_reserve(rb, hdroom);
-#endif /* RL_SKB */
-
     RL_BUF_RMT(rb).lower_flow = NULL;
+#endif /* RL_SKB */
 
     return rb;
 }
 EXPORT_SYMBOL(rl_buf_alloc);
 
+/*
+ * Allocate up to 'n' buffers with the same geometry, appending them to
+ * 'list'. Returns the number of buffers actually allocated.
+ */
+unsigned int
+rl_buf_alloc_bulk(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp,
+                  struct rb_list *list, unsigned int n)
+{
+    struct rl_buf *rb;
+    unsigned int i = 0;
+#ifndef RL_SKB
+    size_t real_size = hdroom + size + tailroom;
+    struct rl_buf_pcpu *pcpu;
+
+    /* Grab as many buffers as possible from the per-CPU stacks, with
+     * bottom halves disabled only once. */
+    local_bh_disable();
+    pcpu = this_cpu_ptr(rl_buf_pcpu);
+    for (; i < n; i++) {
+        rb = __rl_buf_alloc(pcpu, real_size);
+        if (unlikely(!rb)) {
+            break;
+        }
+        rl_buf_setup(rb, hdroom);
+        rb_list_enq(rb, list);
+    }
+    local_bh_enable();
+#endif /* !RL_SKB */
+
+    /* Regular path for the remaining ones. */
+    for (; i < n; i++) {
+        rb = rl_buf_alloc(size, hdroom, tailroom, gfp);
+        if (unlikely(!rb)) {
+            break;
+        }
+        rb_list_enq(rb, list);
+    }
+
+    return i;
+}
+EXPORT_SYMBOL(rl_buf_alloc_bulk);
+
 struct rl_buf *
 rl_buf_clone(struct rl_buf *rb, gfp_t gfp)
 {
     struct rl_buf *crb;
 
 #ifndef RL_SKB
-    crb = rl_alloc(sizeof(*crb), gfp, RL_MT_BUFHDR);
+    local_bh_disable();
+    crb = rl_buf_objstack_pop(this_cpu_ptr(rl_buf_pcpu), RL_BUF_HDR_CACHE);
+    local_bh_enable();
     if (unlikely(!crb)) {
-        return NULL;
+        crb = kmem_cache_alloc(rl_buf_caches[RL_BUF_HDR_CACHE], gfp);
+        if (unlikely(!crb)) {
+            return NULL;
+        }
     }
-
+    rl_memtrack_account(RL_MT_BUFHDR, 1);
     BUG_ON(rb == NULL);
     /* Increment the raw buffer reference counter. */
     atomic_inc(&rb->raw->refcnt);
@@ -114,13 +601,38 @@ void
 __rl_buf_free(struct rl_buf *rb)
 {
 #ifndef RL_SKB
-    if (atomic_dec_and_test(&rb->raw->refcnt)) {
-        rl_free(rb->raw, RL_MT_BUFDATA);
-    }
 
-    rl_free(rb, RL_MT_BUFHDR);
+    local_bh_disable();
+    __rl_buf_release(this_cpu_ptr(rl_buf_pcpu), rb);
+    local_bh_enable();
 #else  /* RL_SKB */
     kfree_skb(rb);
 #endif /* RL_SKB */
 }
 EXPORT_SYMBOL(__rl_buf_free);
+
+/*
+ * Free all the buffers in 'list', leaving it empty.
+ */
+void
+rl_buf_free_bulk(struct rb_list *list)
+{
+    struct rl_buf *rb, *tmp;
+#ifndef RL_SKB
+    struct rl_buf_pcpu *pcpu;
+
+    local_bh_disable();
+    pcpu = this_cpu_ptr(rl_buf_pcpu);
+    rb_list_foreach_safe (rb, tmp, list) {
+        rb_list_del(rb);
+        __rl_buf_release(pcpu, rb);
+    }
+    local_bh_enable();
+#else  /* RL_SKB */
+    rb_list_foreach_safe (rb, tmp, list) {
+        rb_list_del(rb);
+        kfree_skb(rb);
+    }
+#endif /* RL_SKB */
+}
+EXPORT_SYMBOL(rl_buf_free_bulk);
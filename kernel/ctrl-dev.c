@@ -141,7 +141,8 @@ struct rl_dm {
     /* Bitmap to manage port ids. */
     DECLARE_BITMAP(port_id_bitmap, PORT_ID_BITMAP_SIZE);
 
-    /* Hash tables to store information about each flow. */
+    /* Hash tables to store information about each flow. Updates are
+     * serialized by flows_lock, while lookups are protected by RCU. */
     DECLARE_HASHTABLE(flow_table, PORT_ID_HASHTABLE_BITS);
     DECLARE_HASHTABLE(flow_table_by_cep, CEP_ID_HASHTABLE_BITS);
     uint32_t uid_cnt;
@@ -667,6 +668,7 @@ ipcp_add(struct rl_dm *dm, struct rl_kmsg_ipcp_create *req,
 
     entry->ops = factory->ops;
     entry->flags |= factory->use_cep_ids ? RL_K_IPCP_USE_CEP_IDS : 0;
+    entry->flags |= factory->integrity ? RL_K_IPCP_INTEGRITY : 0;
     *ipcp_id = entry->id;
 
 out:
@@ -940,14 +942,14 @@ application_del_by_rc(struct rl_ctrl *rc)
     }
 }
 
-/* To be called under FLOCK or FRLOCK. */
+/* To be called under FLOCK, FRLOCK or rcu_read_lock(). */
 struct flow_entry *
 flow_lookup(struct rl_dm *dm, rl_port_t port_id)
 {
     struct flow_entry *entry;
     struct hlist_head *head;
     head = &dm->flow_table[hash_min(port_id, HASH_BITS(dm->flow_table))];
-    hlist_for_each_entry (entry, head, node) {
+    hlist_for_each_entry_rcu (entry, head, node) {
         if (entry->local_port == port_id) {
             return entry;
         }
@@ -957,21 +959,35 @@ flow_lookup(struct rl_dm *dm, rl_port_t port_id)
 }
 EXPORT_SYMBOL(flow_lookup);
 
+/* Lookups are lockless. The flow tables are RCU-protected, and a flow
+ * whose reference counter already dropped to zero is being removed,
+ * so it cannot be taken anymore (see __flow_put()). Such a flow may
+ * still be in the table together with a new flow using the same port
+ * or CEP id, so the lookup goes on with the next entries. */
 struct flow_entry *
 flow_get(struct rl_dm *dm, rl_port_t port_id)
 {
-    struct flow_entry *flow;
+    struct flow_entry *entry;
+    struct hlist_head *head;
 
-    FRLOCK(dm);
-    flow = flow_lookup(dm, port_id);
-    if (flow) {
-        atomic_inc(&flow->refcnt);
-        PV("FLOWREFCNT %u ++: %u\n", flow->local_port,
-           atomic_read(&flow->refcnt));
+    rcu_read_lock();
+
+    head = &dm->flow_table[hash_min(port_id, HASH_BITS(dm->flow_table))];
+    hlist_for_each_entry_rcu (entry, head, node) {
+        if (entry->local_port == port_id) {
+            if (!atomic_inc_not_zero(&entry->refcnt)) {
+                continue; /* being removed */
+            }
+            PV("FLOWREFCNT %u ++: %u\n", entry->local_port,
+               atomic_read(&entry->refcnt));
+            rcu_read_unlock();
+            return entry;
+        }
     }
-    FRUNLOCK(dm);
 
-    return flow;
+    rcu_read_unlock();
+
+    return NULL;
 }
 EXPORT_SYMBOL(flow_get);
 
@@ -993,21 +1009,23 @@ flow_get_by_cep(struct rl_dm *dm, rlm_cepid_t cep_id)
     struct flow_entry *entry;
     struct hlist_head *head;
 
-    FRLOCK(dm);
+    rcu_read_lock();
 
     head = &dm->flow_table_by_cep[hash_min(cep_id,
                                            HASH_BITS(dm->flow_table_by_cep))];
-    hlist_for_each_entry (entry, head, node_cep) {
+    hlist_for_each_entry_rcu (entry, head, node_cep) {
         if (entry->local_cep == cep_id) {
-            atomic_inc(&entry->refcnt);
+            if (!atomic_inc_not_zero(&entry->refcnt)) {
+                continue; /* being removed */
+            }
             PV("FLOWREFCNT %u ++: %u\n", entry->local_port,
                atomic_read(&entry->refcnt));
-            FRUNLOCK(dm);
+            rcu_read_unlock();
             return entry;
         }
     }
 
-    FRUNLOCK(dm);
+    rcu_read_unlock();
 
     return NULL;
 }
@@ -1124,32 +1142,37 @@ __flow_put(struct flow_entry *entry, bool lock)
     ipcp = entry->txrx.ipcp;
     dm   = ipcp->dm;
 
-    if (lock) {
-        FLOCK(dm);
-    }
-
-    /* Although the flow reference counter does not generally need to be
-     * accessed under FLOCK(), here it is necessary to avoid a race
-     * condition. If we decremented the reference counter before taking
-     * the FLOCK, a CPU could call flow_get (or similar) after the
-     * reference counter drops to 0 and before the FLOCK is taken,
-     * which would basically result into a double free. */
-    if (!atomic_dec_and_test(&entry->refcnt)) {
-        /* Flow is still being used by someone. */
-        FUNLOCK(dm);
+    /* Fast path: this is not the last reference, so the flow cannot
+     * go away and there is no need to take the FLOCK. */
+    if (atomic_add_unless(&entry->refcnt, -1, 1)) {
         return;
     }
 
-    entry->flags |= RL_FLOW_DEALLOCATED;
+    if (lock) {
+        FLOCK(dm);
+    }
 
-    /* We postpone flow removal, at least for MPL, and also allow
-     * cwq and rtxq to be drained. We check the flag
-     * to make sure that this flow_entry() invocation is not due to a
-     * postponed removal, so that we avoid postponing forever. */
+    /* We are likely dropping the last reference, and this must be done
+     * under FLOCK to serialize with the other puts and with the
+     * postponed removal logic below. Lockless lookups cannot take
+     * a flow whose reference counter is zero, so the counter must
+     * never drop to zero for a flow that is not going to be removed. */
     if (!(entry->flags & RL_FLOW_DEL_POSTPONED) &&
         (entry->flags & RL_FLOW_ALLOCATED) &&
         !(entry->flags & RL_FLOW_NEVER_BOUND)) {
-        entry->flags |= RL_FLOW_DEL_POSTPONED;
+        if (atomic_add_unless(&entry->refcnt, -1, 1)) {
+            /* Someone took a reference in the meanwhile. */
+            if (lock) {
+                FUNLOCK(dm);
+            }
+            return;
+        }
+
+        /* We postpone flow removal, at least for MPL, and also allow
+         * cwq and rtxq to be drained. We check the flag
+         * to make sure that this flow_entry() invocation is not due to a
+         * postponed removal, so that we avoid postponing forever. */
+        entry->flags |= RL_FLOW_DEALLOCATED | RL_FLOW_DEL_POSTPONED;
         spin_lock_bh(&dtp->lock);
         if (dtp->cwq_len > 0 || !rb_list_empty(&dtp->rtxq)) {
             PD("Flow removal postponed, cwq contains "
@@ -1163,11 +1186,9 @@ __flow_put(struct flow_entry *entry, bool lock)
         }
         spin_unlock_bh(&dtp->lock);
 
-        /* Reference counter is zero here, we need to reset it
-         * to 1 and let the delayed remove function do its job. */
-        atomic_inc(&entry->refcnt);
-        PV("FLOWREFCNT %u ++: %u\n", entry->local_port,
-           atomic_read(&entry->refcnt));
+        /* Keep the reference we were going to drop, and let the delayed
+         * remove function drop it. This way the reference counter never
+         * drops to zero before the flow is removed. */
         flows_putq_add(entry, msecs_to_jiffies(
                                   ipcp->flow_del_wait_ms) /* should be MPL */);
         if (lock) {
@@ -1176,11 +1197,23 @@ __flow_put(struct flow_entry *entry, bool lock)
         return;
     }
 
-    /* Detach from tables. */
-    hash_del(&entry->node);
+    if (!atomic_dec_and_test(&entry->refcnt)) {
+        /* Flow is still being used by someone. */
+        if (lock) {
+            FUNLOCK(dm);
+        }
+        return;
+    }
+
+    entry->flags |= RL_FLOW_DEALLOCATED;
+
+    /* Detach from tables. Lockless readers may still see the entry
+     * until the end of the RCU grace period (see flows_removew_func()),
+     * but they cannot take a reference to it anymore. */
+    hash_del_rcu(&entry->node);
     bitmap_clear(dm->port_id_bitmap, entry->local_port, 1);
     if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        hash_del(&entry->node_cep);
+        hash_del_rcu(&entry->node_cep);
         bitmap_clear(dm->cep_id_bitmap, entry->local_cep, 1);
     }
 
@@ -1201,8 +1234,6 @@ flow_del(struct flow_entry *entry)
     struct rl_kmsg_flow_deallocated ntfy;
     struct ipcp_entry *upper_ipcp;
     struct ipcp_entry *ipcp;
-    struct rl_buf *tmp;
-    struct rl_buf *rb;
     struct dtp *dtp;
 
 #if 0
@@ -1224,10 +1255,7 @@ flow_del(struct flow_entry *entry)
 
     /* dtp_fini() may print txrx.rx_qsize, so we purge the queue after
      * calling that function. */
-    rb_list_foreach_safe (rb, tmp, &entry->txrx.rx_q) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-    }
+    rl_buf_free_bulk(&entry->txrx.rx_q);
     entry->txrx.rx_qsize = 0;
 
     if (upper_ipcp) {
@@ -1277,6 +1305,7 @@ flow_del(struct flow_entry *entry)
     rl_iodevs_probe_flow_references(entry);
 
     PD("flow entry %u removed\n", entry->local_port);
+    free_percpu(entry->stats);
     rl_free(entry, RL_MT_FLOW);
 
     if (!ipcp->ops.flow_deallocated) {
@@ -1328,6 +1357,10 @@ flows_removew_func(struct work_struct *w)
     }
     FUNLOCK(dm);
 
+    /* The entries have been removed from the flow tables, wait for the
+     * lockless readers to go away before destroying them. */
+    synchronize_rcu();
+
     /* Destroy the entries without holding the lock (but still grab
      * the lock to modify flow->node_rm). */
     list_for_each_entry_safe (flow, tmp, &removeq, node_rm) {
@@ -1359,6 +1392,13 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
         return -ENOMEM;
     }
 
+    entry->stats = alloc_percpu_gfp(struct rl_flow_stats, gfp);
+    if (!entry->stats) {
+        rl_free(entry, RL_MT_FLOW);
+        *pentry = NULL;
+        return -ENOMEM;
+    }
+
     FLOCK(dm);
 
     /* Try to alloc a port id and a cep id from the bitmaps, cep
@@ -1396,9 +1436,10 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
         entry->flags = RL_FLOW_PENDING | RL_FLOW_NEVER_BOUND;
         memcpy(&entry->spec, flowspec, sizeof(*flowspec));
         txrx_init(&entry->txrx, ipcp);
-        hash_add(dm->flow_table, &entry->node, entry->local_port);
+        hash_add_rcu(dm->flow_table, &entry->node, entry->local_port);
         if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            hash_add(dm->flow_table_by_cep, &entry->node_cep, entry->local_cep);
+            hash_add_rcu(dm->flow_table_by_cep, &entry->node_cep,
+                         entry->local_cep);
         }
         entry->uid = dm->uid_cnt++; /* generate an unique id */
         INIT_LIST_HEAD(&entry->node_rm);
@@ -1429,6 +1470,7 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
     } else {
         FUNLOCK(dm);
 
+        free_percpu(entry->stats);
         rl_free(entry, RL_MT_FLOW);
         *pentry = NULL;
         ret     = -ENOSPC;
@@ -2511,6 +2553,7 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     struct flow_entry *flow;
     struct dtp *dtp;
     int ret = 0;
+    int cpu;
 
     flow = flow_get(rc->dm, req->port_id);
     if (!flow) {
@@ -2522,12 +2565,22 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     resp.hdr.msg_type = RLITE_KER_FLOW_STATS_RESP;
     resp.hdr.event_id = req->hdr.event_id;
 
+    /* Collect rl_io device stats from all the CPUs. */
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_flow_stats *cpustats = per_cpu_ptr(flow->stats, cpu);
+
+        resp.stats.tx_pkt += cpustats->tx_pkt;
+        resp.stats.tx_byte += cpustats->tx_byte;
+        resp.stats.rx_pkt += cpustats->rx_pkt;
+        resp.stats.rx_byte += cpustats->rx_byte;
+        resp.stats.rx_overrun_pkt += cpustats->rx_overrun_pkt;
+        resp.stats.rx_overrun_byte += cpustats->rx_overrun_byte;
+    }
+
     spin_lock_bh(&flow->txrx.rx_lock);
     spin_lock_bh(&dtp->lock);
 
-    /* Copy in rl_io device stats. */
-    memcpy(&resp.stats, &flow->stats, sizeof(resp.stats));
-
     /* Copy in DTP state. */
     resp.dtp.snd_lwe                = dtp->snd_lwe;
     resp.dtp.snd_rwe                = dtp->snd_rwe;
@@ -3181,6 +3234,9 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_CONFIG_GET_REQ]   = rl_ipcp_config_get,
     [RLITE_KER_IPCP_SCHED_WRR]        = rl_ipcp_sched_config,
     [RLITE_KER_IPCP_SCHED_PFIFO]      = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_DRR]        = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_PRIO_DRR]   = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_FQ_CODEL]   = rl_ipcp_sched_config,
 #ifdef RL_MEMTRACK
     [RLITE_KER_MEMTRACK_DUMP] = rl_memtrack_dump,
 #endif /* RL_MEMTRACK */
@@ -3669,8 +3725,15 @@ rlite_init(void)
     INIT_LIST_HEAD(&rl_global.ipcp_factories);
     hash_init(rl_global.netns_table);
 
+    ret = rl_bufs_init();
+    if (ret) {
+        PE("Failed to initialize packet buffers\n");
+        return ret;
+    }
+
     ret = misc_register(&rl_ctrl_misc);
     if (ret) {
+        rl_bufs_fini();
         PE("Failed to register rlite misc device\n");
         return ret;
     }
@@ -3678,6 +3741,7 @@ rlite_init(void)
     ret = misc_register(&rl_io_misc);
     if (ret) {
         misc_deregister(&rl_ctrl_misc);
+        rl_bufs_fini();
         PE("Failed to register rlite-io misc device\n");
         return ret;
     }
@@ -3700,6 +3764,7 @@ rlite_fini(void)
 {
     misc_deregister(&rl_io_misc);
     misc_deregister(&rl_ctrl_misc);
+    rl_bufs_fini();
 }
 
 module_init(rlite_init);
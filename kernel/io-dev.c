@@ -38,6 +38,9 @@
 #include <linux/spinlock.h>
 #include <linux/uio.h>
 #include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 static LIST_HEAD(rl_iodevs);
 static DEFINE_MUTEX(rl_iodevs_lock);
@@ -65,6 +68,88 @@ hms_time(void)
 /* Userspace queue threshold in bytes. */
 #define RL_RXQ_SIZE_MAX (1 << 20)
 
+/* Kernel side of a shared-memory ring pair (see struct rl_ring_hdr).
+ * The geometry is private to the kernel, since the ring headers can be
+ * modified by the application. */
+struct rl_io_ring {
+    void *mem;
+    size_t size;
+    struct rl_ring_hdr *rx;
+    struct rl_ring_hdr *tx;
+    uint8_t *rx_bufs;
+    uint8_t *tx_bufs;
+    struct rl_ring_slot *rx_slots;
+    struct rl_ring_slot *tx_slots;
+    uint32_t num_slots;
+    uint32_t slot_size;
+
+    /* RX state, protected by the txrx rx_lock. */
+    uint32_t rx_head;
+    uint32_t rx_tail_seen;
+    rlm_seq_t *rx_seqnums;
+
+    /* TX state, only used by tx_work (which does not run concurrently
+     * with itself). The work is kicked by the application through
+     * RLITE_IOCTL_RING_KICK, and by the wakeups on the flow tx_wqh. */
+    struct flow_entry *flow; /* NULL once the ring is detached */
+    struct work_struct tx_work;
+    wait_queue_entry_t tx_wait;
+    uint32_t tx_tail;
+};
+
+/* Copy an SDU into the RX ring, if there is room. To be called under the
+ * txrx rx_lock. The caller still owns 'rb'. */
+static int
+rl_io_ring_rx_put(struct rl_io_ring *ring, struct rl_buf *rb)
+{
+    uint32_t tail = smp_load_acquire(&ring->rx->tail);
+    uint32_t i;
+
+    if (unlikely(rb->len > ring->slot_size)) {
+        return -EMSGSIZE;
+    }
+
+    if (ring->rx_head - tail >= ring->num_slots) {
+        return -ENOBUFS;
+    }
+
+    i = ring->rx_head & (ring->num_slots - 1);
+    memcpy(ring->rx_bufs + i * ring->slot_size, RL_BUF_DATA(rb), rb->len);
+    ring->rx_slots[i].len = rb->len;
+    ring->rx_seqnums[i]   = RL_BUF_RX(rb).cons_seqnum;
+    smp_store_release(&ring->rx->head, ++ring->rx_head);
+
+    return 0;
+}
+
+/* Queue an SDU to the userspace rx queue of 'txrx', under the rx_lock. */
+static void
+rl_sdu_rx_enq(struct txrx *txrx, struct flow_entry *flow, struct rl_buf *rb,
+              bool qlimit)
+{
+    if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
+        /* This is useful when flow control is not used on a flow. */
+        RPD(1,
+            "dropping PDU [length %lu] to avoid userspace rx queue "
+            "overrun\n",
+            (long unsigned)rb->len);
+        this_cpu_inc(flow->stats->rx_overrun_pkt);
+        this_cpu_add(flow->stats->rx_overrun_byte, rb->len);
+        rl_buf_free(rb);
+    } else if (txrx->ring && rb_list_empty(&txrx->rx_q) &&
+               rl_io_ring_rx_put(txrx->ring, rb) == 0) {
+        /* Delivered directly into the shared-memory ring. */
+        this_cpu_inc(flow->stats->rx_pkt);
+        this_cpu_add(flow->stats->rx_byte, rb->len);
+        rl_buf_free(rb);
+    } else {
+        rb_list_enq(rb, &txrx->rx_q);
+        txrx->rx_qsize += rl_buf_truesize(rb);
+        this_cpu_inc(flow->stats->rx_pkt);
+        this_cpu_add(flow->stats->rx_byte, rb->len);
+    }
+}
+
 int
 rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                struct rl_buf *rb, bool qlimit)
@@ -89,21 +174,7 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     spin_lock_bh(&txrx->rx_lock);
-    if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
-        /* This is useful when flow control is not used on a flow. */
-        RPD(1,
-            "dropping PDU [length %lu] to avoid userspace rx queue "
-            "overrun\n",
-            (long unsigned)rb->len);
-        flow->stats.rx_overrun_pkt++;
-        flow->stats.rx_overrun_byte += rb->len;
-        rl_buf_free(rb);
-    } else {
-        rb_list_enq(rb, &txrx->rx_q);
-        txrx->rx_qsize += rl_buf_truesize(rb);
-        flow->stats.rx_pkt++;
-        flow->stats.rx_byte += rb->len;
-    }
+    rl_sdu_rx_enq(txrx, flow, rb, qlimit);
     spin_unlock_bh(&txrx->rx_lock);
     wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
 
@@ -111,6 +182,38 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
 }
 EXPORT_SYMBOL(rl_sdu_rx_flow);
 
+/* Batched version of rl_sdu_rx_flow(), for a burst of in-order SDUs
+ * received on 'flow'. If the flow is used by an application, the rx_lock
+ * is taken once and the readers are woken up once for the whole burst.
+ * All the SDUs in 'rbs' are consumed. */
+int
+rl_sdu_rx_flow_multi(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                     struct rb_list *rbs, bool qlimit)
+{
+    struct txrx *txrx = &flow->txrx;
+    struct rl_buf *rb, *tmp;
+    int ret = 0;
+
+    if (flow->upper.ipcp) {
+        rb_list_foreach_safe (rb, tmp, rbs) {
+            rb_list_del(rb);
+            ret |= rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        }
+        return ret;
+    }
+
+    spin_lock_bh(&txrx->rx_lock);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        rb_list_del(rb);
+        rl_sdu_rx_enq(txrx, flow, rb, qlimit);
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+    wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_sdu_rx_flow_multi);
+
 int
 rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port)
 {
@@ -172,6 +275,7 @@ struct rl_io {
     uint8_t mode;
     struct flow_entry *flow;
     struct txrx *txrx;
+    struct rl_io_ring *ring;
 
     struct list_head node;
 };
@@ -195,6 +299,14 @@ rl_io_open(struct inode *inode, struct file *f)
     return 0;
 }
 
+/* Maximum number of segments of a large stream write that are pushed to
+ * the IPCP as a single batch. */
+#define RL_IO_WRITE_SEGS_MAX 64
+
+static int rl_io_sdu_write_batch(struct ipcp_entry *ipcp,
+                                 struct flow_entry *flow, struct rb_list *rbs,
+                                 unsigned flags);
+
 static ssize_t
 rl_io_write_iter(struct kiocb *iocb,
 #ifdef RL_HAVE_CHRDEV_RW_ITER
@@ -220,6 +332,10 @@ rl_io_write_iter(struct kiocb *iocb,
     bool mgmt_sdu;
     bool something_sent = false;
     DECLARE_WAITQUEUE(wait, current);
+    struct rb_list segs;
+    unsigned int nsegs = 0;
+    size_t seglen      = 0;
+    bool segmented;
     ssize_t ret = 0;
 
     if (unlikely(!rio->txrx)) {
@@ -256,6 +372,14 @@ rl_io_write_iter(struct kiocb *iocb,
         return -EMSGSIZE;
     }
 
+    /* Large stream writes are segmented into SDUs of max_sdu_size bytes
+     * up front, and the segments are pushed to the IPCP in batches, so
+     * that EFCP processes (and sequences) them under a single DTP lock
+     * round trip. */
+    segmented = !mgmt_sdu && left > ipcp->max_sdu_size &&
+                ipcp->ops.sdu_write_multi;
+    rb_list_init(&segs);
+
     while (left) {
         size_t copylen = min(left, (size_t)ipcp->max_sdu_size);
 
@@ -285,6 +409,39 @@ rl_io_write_iter(struct kiocb *iocb,
 #endif /* AIO_RW */
         rl_buf_append(rb, copylen);
 
+        if (segmented) {
+            size_t written;
+
+            rb_list_enq(rb, &segs);
+            nsegs++;
+            seglen += copylen;
+            left -= copylen;
+            tot += copylen;
+            if (left && nsegs < RL_IO_WRITE_SEGS_MAX) {
+                continue;
+            }
+
+            ret = rl_io_sdu_write_batch(ipcp, flow, &segs, flags);
+            rl_buf_free_bulk(&segs);
+            /* Only the last segment can be shorter than max_sdu_size. */
+            written = ret > 0 ? min((size_t)ret * ipcp->max_sdu_size, seglen)
+                              : 0;
+            if (ret > 0) {
+                something_sent = true;
+                this_cpu_add(flow->stats->tx_pkt, ret);
+                this_cpu_add(flow->stats->tx_byte, written);
+            }
+            if (unlikely(ret < (ssize_t)nsegs)) {
+                /* Partial write. */
+                tot -= seglen - written;
+                seglen = 0;
+                break;
+            }
+            nsegs  = 0;
+            seglen = 0;
+            continue;
+        }
+
         if (unlikely(mgmt_sdu)) {
             struct ipcp_entry *lower_ipcp;
             struct flow_entry *lower_flow;
@@ -358,8 +515,14 @@ rl_io_write_iter(struct kiocb *iocb,
         something_sent = true;
         left -= copylen;
         tot += copylen;
-        flow->stats.tx_pkt++;
-        flow->stats.tx_byte += copylen;
+        this_cpu_inc(flow->stats->tx_pkt);
+        this_cpu_add(flow->stats->tx_byte, copylen);
+    }
+
+    if (unlikely(seglen)) {
+        /* Segments not pushed because of an error. */
+        rl_buf_free_bulk(&segs);
+        tot -= seglen;
     }
 
     return something_sent ? tot : ret;
@@ -385,7 +548,13 @@ rl_io_read_iter(struct kiocb *iocb,
 #else  /* AIO_RW */
     size_t ulen = iov_length(to, iov_cnt);
 #endif /* AIO_RW */
-    ssize_t ret = 0;
+    /* On stream flows a single read() drains as many queued SDUs as
+     * they fit into the user buffer, and acknowledges them at once. */
+    bool stream           = flow && !flow->cfg.msg_boundaries;
+    rlm_seq_t cons_seqnum = 0;
+    bool consumed         = false;
+    size_t copied         = 0;
+    ssize_t ret           = 0;
 
     if (unlikely(!txrx)) {
         return -ENXIO;
@@ -402,6 +571,12 @@ rl_io_read_iter(struct kiocb *iocb,
 
         spin_lock_bh(&txrx->rx_lock);
         if (rb_list_empty(&txrx->rx_q)) {
+            if (copied) {
+                /* Don't wait for more data. */
+                spin_unlock_bh(&txrx->rx_lock);
+                break;
+            }
+
             if (unlikely(txrx->flags & RL_TXRX_EOF)) {
                 /* Report the EOF condition to userspace reader. */
                 ret = 0;
@@ -429,28 +604,39 @@ rl_io_read_iter(struct kiocb *iocb,
 
         if (unlikely(ulen < rb->len)) {
             /* Partial SDU read, don't consume the rb. */
-            ret = rl_buf_copy_to_user(rb, to, ulen);
+            ret = rl_buf_copy_to_user(rb, to, copied, ulen);
             if (likely(ret >= 0)) {
                 rl_buf_custom_pop(rb, ret);
+                copied += ret;
             }
             spin_unlock_bh(&txrx->rx_lock);
+            break;
+        }
 
-        } else {
-            /* Complete SDU read, consume the rb. */
-            rb_list_del(rb);
-            txrx->rx_qsize -= rl_buf_truesize(rb);
+        /* Complete SDU read, consume the rb. */
+        rb_list_del(rb);
+        txrx->rx_qsize -= rl_buf_truesize(rb);
+        spin_unlock_bh(&txrx->rx_lock);
+
+        ret = rl_buf_copy_to_user(rb, to, copied, rb->len);
+        if (unlikely(ret < 0)) {
+            /* Put the SDU back, so that it is not lost. */
+            spin_lock_bh(&txrx->rx_lock);
+            rb_list_enq_head(rb, &txrx->rx_q);
+            txrx->rx_qsize += rl_buf_truesize(rb);
             spin_unlock_bh(&txrx->rx_lock);
+            break;
+        }
 
-            ret = rl_buf_copy_to_user(rb, to, rb->len);
-            if (flow && flow->sdu_rx_consumed && ret >= 0) {
-                flow->sdu_rx_consumed(flow, RL_BUF_RX(rb).cons_seqnum,
-                                      blocking);
-            }
+        cons_seqnum = RL_BUF_RX(rb).cons_seqnum;
+        consumed    = true;
+        copied += ret;
+        ulen -= ret;
+        rl_buf_free(rb);
 
-            rl_buf_free(rb);
+        if (!stream) {
+            break;
         }
-
-        break;
     }
 
     __set_current_state(TASK_RUNNING);
@@ -459,9 +645,304 @@ rl_io_read_iter(struct kiocb *iocb,
         remove_wait_queue(&txrx->rx_wqh, &wait);
     }
 
+    if (consumed && flow && flow->sdu_rx_consumed) {
+        /* A single cumulative update for all the SDUs consumed. */
+        flow->sdu_rx_consumed(flow, cons_seqnum, blocking);
+    }
+
+    return copied ? copied : ret;
+}
+
+/* Write a batch of SDUs, sleeping if needed. The PDUs written are removed
+ * from 'rbs', and their number is returned. */
+static int
+rl_io_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                      struct rb_list *rbs, unsigned flags)
+{
+    struct rl_buf *rb = NULL; /* pending PDU, if sdu_write_multi is missing */
+    DECLARE_WAITQUEUE(wait, current);
+    int n   = 0;
+    int ret = 0;
+
+    if (flags & RL_RMT_F_MAYSLEEP) {
+        add_wait_queue(flow->txrx.tx_wqh, &wait);
+    }
+
+    while (rb || !rb_list_empty(rbs)) {
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        if (ipcp->ops.sdu_write_multi) {
+            /* The DTP lock is taken only once for the whole batch. */
+            ret = ipcp->ops.sdu_write_multi(ipcp, flow, rbs, flags);
+            if (ret > 0) {
+                n += ret;
+                ret = 0;
+            }
+        } else {
+            if (!rb) {
+                rb = rb_list_front(rbs);
+                rb_list_del(rb);
+            }
+            ret = ipcp->ops.sdu_write(ipcp, flow, rb, flags);
+            if (ret != -EAGAIN) {
+                rb = NULL; /* consumed */
+                n += (ret == 0);
+            }
+        }
+
+        if (ret == 0) {
+            continue;
+        }
+
+        if (ret != -EAGAIN || signal_pending(current) ||
+            !(flags & RL_RMT_F_MAYSLEEP)) {
+            /* We avoid restarting the system call, for the same reason
+             * explained in rl_io_write_iter(). */
+            if (ret == -EAGAIN && signal_pending(current)) {
+                ret = -EINTR;
+            }
+            break;
+        }
+
+        /* No room to write, let's sleep. */
+        schedule();
+    }
+
+    __set_current_state(TASK_RUNNING);
+    if (flags & RL_RMT_F_MAYSLEEP) {
+        remove_wait_queue(flow->txrx.tx_wqh, &wait);
+    }
+
+    if (rb) {
+        rl_buf_free(rb);
+    }
+
+    return n ? n : ret;
+}
+
+/* Transmit the SDUs posted by the application on the TX ring, without
+ * sleeping. Batches are pushed through rl_io_sdu_write_batch(), so that
+ * IPCPs supporting sdu_write_multi take the DTP lock once per batch.
+ * Returns 0 if the ring has been drained up to the head observed, -EAGAIN
+ * on backpressure, or -ENOMEM if buffers could not be allocated. */
+static int
+rl_io_ring_txsync(struct rl_io_ring *ring, struct flow_entry *flow)
+{
+    struct ipcp_entry *ipcp = flow->txrx.ipcp;
+    uint32_t head;
+    int ret = 0;
+
+    head = smp_load_acquire(&ring->tx->head);
+    if (unlikely(head - ring->tx_tail > ring->num_slots)) {
+        RPD(1, "Invalid TX ring head %u (tail %u)\n", head, ring->tx_tail);
+        return 0;
+    }
+
+    while (ring->tx_tail != head) {
+        uint32_t tail = ring->tx_tail;
+        unsigned int n, i;
+        struct rb_list rbs;
+        size_t bytes = 0;
+
+        rb_list_init(&rbs);
+        for (n = 0; tail != head && n < RL_SDU_BATCH_MAX; tail++, n++) {
+            uint32_t len;
+            struct rl_buf *rb;
+
+            i   = tail & (ring->num_slots - 1);
+            len = READ_ONCE(ring->tx_slots[i].len);
+            if (unlikely(len > ring->slot_size || len > ipcp->max_sdu_size)) {
+                break; /* handled below */
+            }
+            rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+            if (unlikely(!rb)) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(RL_BUF_DATA(rb), ring->tx_bufs + i * ring->slot_size, len);
+            rl_buf_append(rb, len);
+            rb_list_enq(rb, &rbs);
+        }
+
+        if (n == 0) {
+            if (ret == 0 && tail != head) {
+                /* Invalid SDU length: skip the slot rather than stalling
+                 * the ring. */
+                RPD(1, "Dropping invalid SDU from TX ring\n");
+                ring->tx_tail++;
+                continue;
+            }
+            break;
+        }
+
+        ret = rl_io_sdu_write_batch(ipcp, flow, &rbs, /*flags=*/0);
+        rl_buf_free_bulk(&rbs);
+        if (ret <= 0) {
+            ret = -EAGAIN; /* backpressure or error */
+            break;
+        }
+        for (i = 0; i < ret; i++) {
+            uint32_t j = (ring->tx_tail + i) & (ring->num_slots - 1);
+
+            bytes += READ_ONCE(ring->tx_slots[j].len);
+        }
+        this_cpu_add(flow->stats->tx_pkt, ret);
+        this_cpu_add(flow->stats->tx_byte, bytes);
+        ring->tx_tail += ret;
+        smp_store_release(&ring->tx->tail, ring->tx_tail);
+        if (ret < n) {
+            ret = -EAGAIN;
+            break;
+        }
+        ret = 0;
+    }
+
     return ret;
 }
 
+/* Drain the TX ring until it is empty, or until the lower layers push
+ * back (in which case a wakeup on the flow tx_wqh kicks us again). Before
+ * going idle, ask the application for a kick on the next post, and check
+ * again for SDUs posted in the meantime (see rina_ring_send()). */
+static void
+rl_io_ring_tx_worker(struct work_struct *w)
+{
+    struct rl_io_ring *ring = container_of(w, struct rl_io_ring, tx_work);
+    struct flow_entry *flow = READ_ONCE(ring->flow);
+    uint32_t tail           = ring->tx_tail;
+    int ret;
+
+    if (unlikely(!flow)) {
+        return; /* detached */
+    }
+
+    WRITE_ONCE(ring->tx->flags, 0);
+    for (;;) {
+        ret = rl_io_ring_txsync(ring, flow);
+        if (ret == -EAGAIN) {
+            break;
+        }
+        /* On allocation failure, the next kick retries the slots that
+         * were not transmitted. */
+        WRITE_ONCE(ring->tx->flags, RL_RING_F_NEED_KICK);
+        smp_mb();
+        if (ret || READ_ONCE(ring->tx->head) == ring->tx_tail) {
+            break;
+        }
+        WRITE_ONCE(ring->tx->flags, 0);
+    }
+
+    if (ring->tx_tail != tail) {
+        /* Wake up the pollers waiting for TX ring space. */
+        rl_write_restart_flow(flow);
+    }
+}
+
+/* Invoked when the writers of the flow are restarted, possibly in softirq
+ * context and with the wait queue lock held. */
+static int
+rl_io_ring_tx_wake(wait_queue_entry_t *wait, unsigned mode, int sync,
+                   void *key)
+{
+    struct rl_io_ring *ring = container_of(wait, struct rl_io_ring, tx_wait);
+
+    if (READ_ONCE(ring->tx->head) != READ_ONCE(ring->tx_tail)) {
+        schedule_work(&ring->tx_work);
+    }
+
+    return 0;
+}
+
+/* Stop transmitting from the TX ring, before the flow goes away. */
+static void
+rl_io_ring_tx_stop(struct rl_io_ring *ring)
+{
+    struct flow_entry *flow = ring->flow;
+
+    if (!flow) {
+        return;
+    }
+    WRITE_ONCE(ring->flow, NULL);
+    remove_wait_queue(flow->txrx.tx_wqh, &ring->tx_wait);
+    cancel_work_sync(&ring->tx_work);
+}
+
+/* Account for the SDUs consumed by the application from the RX ring,
+ * and move to the RX ring the SDUs that did not fit into it on receive. */
+static void
+rl_io_ring_rxsync(struct rl_io *rio, struct rl_io_ring *ring)
+{
+    struct flow_entry *flow = rio->flow;
+    struct txrx *txrx       = rio->txrx;
+    rlm_seq_t cons_seqnum   = 0;
+    bool consumed           = false;
+    uint32_t tail;
+
+    spin_lock_bh(&txrx->rx_lock);
+    tail = smp_load_acquire(&ring->rx->tail);
+    if (tail != ring->rx_tail_seen &&
+        ring->rx_head - tail <= ring->num_slots) {
+        cons_seqnum        = ring->rx_seqnums[(tail - 1) &
+                                       (ring->num_slots - 1)];
+        ring->rx_tail_seen = tail;
+        consumed           = true;
+    }
+
+    while (!rb_list_empty(&txrx->rx_q)) {
+        struct rl_buf *rb = rb_list_front(&txrx->rx_q);
+        int ret           = rl_io_ring_rx_put(ring, rb);
+
+        if (ret == -ENOBUFS) {
+            break;
+        }
+        if (unlikely(ret)) {
+            RPD(1, "dropping SDU [length %u] larger than ring slots\n",
+                rb->len);
+            this_cpu_inc(flow->stats->rx_overrun_pkt);
+            this_cpu_add(flow->stats->rx_overrun_byte, rb->len);
+        }
+        rb_list_del(rb);
+        txrx->rx_qsize -= rl_buf_truesize(rb);
+        rl_buf_free(rb);
+    }
+
+    if (rb_list_empty(&txrx->rx_q) && (txrx->flags & RL_TXRX_EOF)) {
+        smp_store_release(&ring->rx->flags, RL_RING_F_EOF);
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+
+    /* Let EFCP know about the SDUs consumed (once per sync). */
+    if (consumed && flow->sdu_rx_consumed) {
+        flow->sdu_rx_consumed(flow, cons_seqnum, /*maysleep=*/false);
+    }
+}
+
+/* Poll handler for file descriptors with a shared-memory ring. The TX
+ * ring is drained by the tx_work, which is only kicked from here in case
+ * a previous drain stopped on allocation failure. */
+static unsigned int
+rl_io_ring_poll(struct rl_io *rio, struct rl_io_ring *ring)
+{
+    unsigned int mask = 0;
+
+    if (READ_ONCE(ring->tx->head) != READ_ONCE(ring->tx_tail)) {
+        schedule_work(&ring->tx_work);
+    }
+    rl_io_ring_rxsync(rio, ring);
+
+    if (READ_ONCE(ring->rx_head) != READ_ONCE(ring->rx->tail) ||
+        (READ_ONCE(ring->rx->flags) & RL_RING_F_EOF)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    if (READ_ONCE(ring->tx->head) - READ_ONCE(ring->tx_tail) <
+        ring->num_slots) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+
+    return mask;
+}
+
 static unsigned int
 rl_io_poll(struct file *f, poll_table *wait)
 {
@@ -477,6 +958,10 @@ rl_io_poll(struct file *f, poll_table *wait)
     poll_wait(f, &txrx->rx_wqh, wait);
     poll_wait(f, txrx->tx_wqh, wait);
 
+    if (rio->ring && txrx->ring == rio->ring) {
+        return rl_io_ring_poll(rio, rio->ring);
+    }
+
     spin_lock_bh(&txrx->rx_lock);
     if (!rb_list_empty(&txrx->rx_q) || (txrx->flags & RL_TXRX_EOF)) {
         /* Userspace can read when the flow rxq is not empty
@@ -633,6 +1118,15 @@ rl_io_release_internal(struct rl_io *rio)
         rio->flow = NULL;
         rio->txrx = NULL;
         IODEVS_UNLOCK();
+        if (rio->ring) {
+            /* Detach the ring, which is freed on release. */
+            spin_lock_bh(&flow->txrx.rx_lock);
+            if (flow->txrx.ring == rio->ring) {
+                flow->txrx.ring = NULL;
+            }
+            spin_unlock_bh(&flow->txrx.rx_lock);
+            rl_io_ring_tx_stop(rio->ring);
+        }
         flow_put(flow);
     } break;
 
@@ -658,6 +1152,358 @@ rl_io_release_internal(struct rl_io *rio)
     return 0;
 }
 
+/* Copy in the array of SDU descriptors of a batched read/write ioctl. */
+static struct rl_sdu_desc *
+rl_io_sdu_descs_get(void __user *argp, struct rl_sdu_desc __user **udescs,
+                    unsigned int *num)
+{
+    struct rl_ioctl_sdu_batch batch;
+    struct rl_sdu_desc *descs;
+    size_t size;
+
+    if (copy_from_user(&batch, argp, sizeof(batch))) {
+        return ERR_PTR(-EFAULT);
+    }
+
+    if (batch.num == 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    *udescs = (struct rl_sdu_desc __user *)(uintptr_t)batch.descs;
+    *num    = min_t(unsigned int, batch.num, RL_SDU_BATCH_MAX);
+    size    = *num * sizeof(*descs);
+    descs   = rl_alloc(size, GFP_KERNEL, RL_MT_MISC);
+    if (!descs) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    if (copy_from_user(descs, *udescs, size)) {
+        rl_free(descs, RL_MT_MISC);
+        return ERR_PTR(-EFAULT);
+    }
+
+    return descs;
+}
+
+static long
+rl_io_ioctl_sdu_write_multi(struct rl_io *rio, struct file *f,
+                            void __user *argp)
+{
+    unsigned flags = (f->f_flags & O_NONBLOCK) ? 0 : RL_RMT_F_MAYSLEEP;
+    struct flow_entry *flow = rio->flow;
+    struct rl_sdu_desc __user *udescs;
+    struct rl_sdu_desc *descs;
+    struct ipcp_entry *ipcp;
+    struct rb_list rbs;
+    unsigned int num, i;
+    long ret = 0;
+
+    if (unlikely(rio->mode != RLITE_IO_MODE_APPL_BIND || !flow)) {
+        return -ENXIO;
+    }
+    ipcp = rio->txrx->ipcp;
+
+    descs = rl_io_sdu_descs_get(argp, &udescs, &num);
+    if (IS_ERR(descs)) {
+        return PTR_ERR(descs);
+    }
+
+    /* Copy in all the SDUs. Message boundaries are always preserved. */
+    rb_list_init(&rbs);
+    for (i = 0; i < num; i++) {
+        size_t len = descs[i].len;
+        struct rl_buf *rb;
+
+        if (unlikely(len > ipcp->max_sdu_size)) {
+            ret = -EMSGSIZE;
+            break;
+        }
+
+        rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+        if (unlikely(!rb)) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        if (unlikely(copy_from_user(RL_BUF_DATA(rb),
+                                    (void __user *)(uintptr_t)descs[i].buf,
+                                    len))) {
+            rl_buf_free(rb);
+            ret = -EFAULT;
+            break;
+        }
+        rl_buf_append(rb, len);
+        rb_list_enq(rb, &rbs);
+    }
+
+    if (!rb_list_empty(&rbs)) {
+        /* Write as many SDUs as possible. */
+        size_t bytes = 0;
+
+        ret = rl_io_sdu_write_batch(ipcp, flow, &rbs, flags);
+        for (i = 0; (long)i < ret; i++) {
+            bytes += descs[i].len;
+        }
+        if (ret > 0) {
+            this_cpu_add(flow->stats->tx_pkt, ret);
+            this_cpu_add(flow->stats->tx_byte, bytes);
+        }
+        rl_buf_free_bulk(&rbs);
+    }
+
+    rl_free(descs, RL_MT_MISC);
+
+    return ret;
+}
+
+static long
+rl_io_ioctl_sdu_read_multi(struct rl_io *rio, struct file *f,
+                           void __user *argp)
+{
+    struct flow_entry *flow = rio->flow; /* NULL if mgmt */
+    bool blocking           = !(f->f_flags & O_NONBLOCK);
+    struct txrx *txrx       = rio->txrx;
+    DECLARE_WAITQUEUE(wait, current);
+    struct rl_sdu_desc __user *udescs;
+    struct rl_sdu_desc *descs;
+    struct rl_buf *rb;
+    struct rb_list rbs;
+    unsigned int num, n = 0;
+    long ret = 0;
+
+    if (unlikely(!txrx)) {
+        return -ENXIO;
+    }
+
+    descs = rl_io_sdu_descs_get(argp, &udescs, &num);
+    if (IS_ERR(descs)) {
+        return PTR_ERR(descs);
+    }
+
+    rb_list_init(&rbs);
+
+    if (blocking) {
+        add_wait_queue(&txrx->rx_wqh, &wait);
+    }
+
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        spin_lock_bh(&txrx->rx_lock);
+        if (rb_list_empty(&txrx->rx_q)) {
+            if (unlikely(txrx->flags & RL_TXRX_EOF)) {
+                /* Report the EOF condition to userspace reader. */
+                spin_unlock_bh(&txrx->rx_lock);
+                break;
+            }
+
+            spin_unlock_bh(&txrx->rx_lock);
+            if (signal_pending(current)) {
+                ret = -EINTR; /* -ERESTARTSYS */
+                break;
+            }
+
+            if (!blocking) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            /* Nothing to read, let's sleep. */
+            schedule();
+            continue;
+        }
+
+        /* Dequeue as many complete SDUs as possible while holding the
+         * lock. Partial reads are not supported by the batched read. */
+        while (n < num && !rb_list_empty(&txrx->rx_q)) {
+            rb = rb_list_front(&txrx->rx_q);
+            if (rb->len > descs[n].len) {
+                break;
+            }
+            rb_list_del(rb);
+            txrx->rx_qsize -= rl_buf_truesize(rb);
+            rb_list_enq(rb, &rbs);
+            n++;
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+
+        if (n == 0) {
+            ret = -EMSGSIZE;
+        }
+        break;
+    }
+
+    __set_current_state(TASK_RUNNING);
+
+    if (blocking) {
+        remove_wait_queue(&txrx->rx_wqh, &wait);
+    }
+
+    if (n) {
+        rlm_seq_t cons_seqnum = 0;
+        struct rb_list done;
+        unsigned int i = 0;
+
+        rb_list_init(&done);
+        while (!rb_list_empty(&rbs)) {
+            rb = rb_list_front(&rbs);
+            if (copy_to_user((void __user *)(uintptr_t)descs[i].buf,
+                             RL_BUF_DATA(rb), rb->len) ||
+                put_user(rb->len, &udescs[i].len)) {
+                break;
+            }
+            cons_seqnum = RL_BUF_RX(rb).cons_seqnum;
+            rb_list_del(rb);
+            rb_list_enq(rb, &done);
+            i++;
+        }
+
+        if (unlikely(i < n)) {
+            /* Put the SDUs that could not be copied back at the head of
+             * the queue, in their original order, so that they are not
+             * lost. Report the SDUs copied so far, if any. */
+            struct rb_list rev;
+
+            rb_list_init(&rev);
+            while (!rb_list_empty(&rbs)) {
+                rb = rb_list_front(&rbs);
+                rb_list_del(rb);
+                rb_list_enq_head(rb, &rev);
+            }
+            spin_lock_bh(&txrx->rx_lock);
+            while (!rb_list_empty(&rev)) {
+                rb = rb_list_front(&rev);
+                rb_list_del(rb);
+                rb_list_enq_head(rb, &txrx->rx_q);
+                txrx->rx_qsize += rl_buf_truesize(rb);
+            }
+            spin_unlock_bh(&txrx->rx_lock);
+        }
+        ret = i ? i : -EFAULT;
+
+        /* Let EFCP know about the SDUs consumed, just once. */
+        if (i && flow && flow->sdu_rx_consumed) {
+            flow->sdu_rx_consumed(flow, cons_seqnum, blocking);
+        }
+        rl_buf_free_bulk(&done);
+    }
+
+    rl_free(descs, RL_MT_MISC);
+
+    return ret;
+}
+
+/* Maximum amount of memory for the buffers of a ring. */
+#define RL_RING_BUFS_MAX (32 << 20)
+
+static void
+rl_io_ring_free(struct rl_io_ring *ring)
+{
+    /* A kick may have scheduled the work after the ring was detached. */
+    cancel_work_sync(&ring->tx_work);
+    if (ring->mem) {
+        vfree(ring->mem);
+    }
+    if (ring->rx_seqnums) {
+        rl_free(ring->rx_seqnums, RL_MT_IODEV);
+    }
+    rl_free(ring, RL_MT_IODEV);
+}
+
+static long
+rl_io_ioctl_ring_setup(struct rl_io *rio, void __user *argp)
+{
+    struct rl_ioctl_ring_req req;
+    struct rl_io_ring *ring;
+    struct txrx *txrx = rio->txrx;
+    size_t area;
+
+    if (rio->mode != RLITE_IO_MODE_APPL_BIND || !rio->flow) {
+        return -ENXIO;
+    }
+
+    if (rio->ring) {
+        /* Rings cannot be resized. */
+        return -EBUSY;
+    }
+
+    if (copy_from_user(&req, argp, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    if (!is_power_of_2(req.num_slots) || req.num_slots > RL_RING_SLOTS_MAX ||
+        req.slot_size == 0 || req.slot_size > RL_RING_SLOT_SIZE_MAX) {
+        return -EINVAL;
+    }
+    req.slot_size = ALIGN(req.slot_size, 64);
+    if ((size_t)req.num_slots * req.slot_size > RL_RING_BUFS_MAX) {
+        return -EINVAL;
+    }
+
+    ring = rl_alloc(sizeof(*ring), GFP_KERNEL | __GFP_ZERO, RL_MT_IODEV);
+    if (!ring) {
+        return -ENOMEM;
+    }
+    INIT_WORK(&ring->tx_work, rl_io_ring_tx_worker);
+    init_waitqueue_func_entry(&ring->tx_wait, rl_io_ring_tx_wake);
+
+    ring->rx_seqnums = rl_alloc(req.num_slots * sizeof(ring->rx_seqnums[0]),
+                                GFP_KERNEL, RL_MT_IODEV);
+    area = PAGE_ALIGN(RL_RING_DATA_OFS(req.num_slots) +
+                      (size_t)req.num_slots * req.slot_size);
+    ring->size = 2 * area;
+    ring->mem  = vmalloc_user(ring->size); /* zeroed */
+    if (!ring->rx_seqnums || !ring->mem) {
+        rl_io_ring_free(ring);
+        return -ENOMEM;
+    }
+
+    ring->num_slots = req.num_slots;
+    ring->slot_size = req.slot_size;
+    ring->rx        = (struct rl_ring_hdr *)ring->mem;
+    ring->tx        = (struct rl_ring_hdr *)(ring->mem + area);
+    ring->rx_slots  = RL_RING_SLOT(ring->rx, 0);
+    ring->tx_slots  = RL_RING_SLOT(ring->tx, 0);
+    ring->rx_bufs   = (uint8_t *)ring->rx + RL_RING_DATA_OFS(req.num_slots);
+    ring->tx_bufs   = (uint8_t *)ring->tx + RL_RING_DATA_OFS(req.num_slots);
+    ring->rx->num_slots = ring->tx->num_slots = req.num_slots;
+    ring->rx->slot_size = ring->tx->slot_size = req.slot_size;
+    ring->tx->flags     = RL_RING_F_NEED_KICK;
+
+    req.rx_ofs    = 0;
+    req.tx_ofs    = area;
+    req.mmap_size = ring->size;
+    if (copy_to_user(argp, &req, sizeof(req))) {
+        rl_io_ring_free(ring);
+        return -EFAULT;
+    }
+
+    /* Attach the ring to the flow. From now on, received SDUs are
+     * delivered into the ring. */
+    rio->ring  = ring;
+    ring->flow = rio->flow;
+    add_wait_queue(rio->flow->txrx.tx_wqh, &ring->tx_wait);
+    spin_lock_bh(&txrx->rx_lock);
+    txrx->ring = ring;
+    spin_unlock_bh(&txrx->rx_lock);
+
+    return 0;
+}
+
+static int
+rl_io_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+
+    if (!rio->ring) {
+        return -ENXIO;
+    }
+
+    /* The ring memory is freed on release, which cannot happen while
+     * the mapping exists. */
+    return remap_vmalloc_range(vma, rio->ring->mem, vma->vm_pgoff);
+}
+
 static long
 rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
@@ -706,6 +1552,25 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         break;
     }
 
+    case RLITE_IOCTL_SDU_WRITE_MULTI:
+        ret = rl_io_ioctl_sdu_write_multi(rio, f, argp);
+        break;
+
+    case RLITE_IOCTL_SDU_READ_MULTI:
+        ret = rl_io_ioctl_sdu_read_multi(rio, f, argp);
+        break;
+
+    case RLITE_IOCTL_RING_SETUP:
+        ret = rl_io_ioctl_ring_setup(rio, argp);
+        break;
+
+    case RLITE_IOCTL_RING_KICK:
+        if (!rio->ring || !READ_ONCE(rio->ring->flow)) {
+            return -ENXIO;
+        }
+        schedule_work(&rio->ring->tx_work);
+        break;
+
     default:
         ret = -EINVAL;
         break;
@@ -723,6 +1588,9 @@ rl_io_release(struct inode *inode, struct file *f)
     IODEVS_LOCK();
     list_del(&rio->node);
     IODEVS_UNLOCK();
+    if (rio->ring) {
+        rl_io_ring_free(rio->ring);
+    }
     rl_free(rio, RL_MT_IODEV);
 
     return 0;
@@ -748,6 +1616,7 @@ static const struct file_operations rl_io_fops = {
     .aio_read  = rl_io_read_iter,
 #endif /* AIO_RW */
     .poll           = rl_io_poll,
+    .mmap           = rl_io_mmap,
     .unlocked_ioctl = rl_io_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = rl_io_compat_ioctl,
@@ -78,6 +78,16 @@ rl_free(void *obj, rl_memtrack_t type)
 }
 EXPORT_SYMBOL(rl_free);
 
+/* Account for objects that are not allocated through rl_alloc(), e.g.
+ * because they come from a dedicated slab cache. */
+void
+rl_memtrack_account(rl_memtrack_t type, int delta)
+{
+    BUG_ON(type >= RL_MT_MAX);
+    atomic_add(delta, mt_count + type);
+}
+EXPORT_SYMBOL(rl_memtrack_account);
+
 void
 rl_memtrack_dump_stats(void)
 {
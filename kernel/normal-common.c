@@ -25,6 +25,8 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
 #include "rlite/utils.h"
 #include "rlite-kernel.h"
 
@@ -36,11 +38,15 @@ dtp_init(struct dtp *dtp)
     spin_lock_init(&dtp->lock);
     rb_list_init(&dtp->cwq);
     dtp->cwq_len = dtp->max_cwq_len = 0;
-    rb_list_init(&dtp->seqq);
+    dtp->seqq     = NULL;
     dtp->seqq_len = 0;
     rb_list_init(&dtp->rtxq);
     dtp->rtxq_len = dtp->max_rtxq_len = 0;
+    dtp->rtx_heap                     = NULL;
+    dtp->rtx_heap_cap                 = 0;
     dtp->flags                        = 0;
+    rb_list_init(&dtp->pacer.q);
+    dtp->pacer.qlen = 0;
 }
 EXPORT_SYMBOL(dtp_init);
 
@@ -48,7 +54,6 @@ void
 dtp_fini(struct dtp *dtp)
 {
     struct flow_entry *flow = container_of(dtp, struct flow_entry, dtp);
-    struct rl_buf *rb, *tmp;
 
 #if 0
     dtp_dump(dtp);
@@ -58,6 +63,18 @@ dtp_fini(struct dtp *dtp)
         del_timer_sync(&dtp->rcv_inact_tmr);
         del_timer_sync(&dtp->rtx_tmr);
         del_timer_sync(&dtp->a_tmr);
+
+        /* Empty the pacer queue first, so that the pacer work does not
+         * arm the pacer timer again. */
+        spin_lock_bh(&dtp->lock);
+        if (dtp->pacer.qlen) {
+            PD("dropping %u PDUs from the pacer queue\n", dtp->pacer.qlen);
+        }
+        rl_buf_free_bulk(&dtp->pacer.q);
+        dtp->pacer.qlen = 0;
+        spin_unlock_bh(&dtp->lock);
+        hrtimer_cancel(&dtp->pacer.timer);
+        cancel_work_sync(&dtp->pacer.work);
     }
 
     spin_lock_bh(&dtp->lock);
@@ -67,28 +84,47 @@ dtp_fini(struct dtp *dtp)
            "and %u bytes from rxq\n",
            dtp->cwq_len, dtp->seqq_len, dtp->rtxq_len, flow->txrx.rx_qsize);
     }
-    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-    }
+    rl_buf_free_bulk(&dtp->cwq);
     dtp->cwq_len = 0;
 
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
+    dtp_seqq_flush(dtp);
+    if (dtp->seqq) {
+        rl_free(dtp->seqq, RL_MT_MISC);
+        dtp->seqq = NULL;
     }
-    dtp->seqq_len = 0;
 
-    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-    }
+    rl_buf_free_bulk(&dtp->rtxq);
     dtp->rtxq_len = 0;
+    if (dtp->rtx_heap) {
+        rl_free(dtp->rtx_heap, RL_MT_MISC);
+        dtp->rtx_heap     = NULL;
+        dtp->rtx_heap_cap = 0;
+    }
 
     spin_unlock_bh(&dtp->lock);
 }
 EXPORT_SYMBOL(dtp_fini);
 
+/* Drop all the PDUs in the sequencing queue, returning how many they
+ * were. To be called under the DTP lock. */
+unsigned int
+dtp_seqq_flush(struct dtp *dtp)
+{
+    unsigned int n = dtp->seqq_len;
+    unsigned int i;
+
+    for (i = 0; dtp->seqq_len && i < RL_SEQQ_SLOTS; i++) {
+        if (dtp->seqq[i]) {
+            rl_buf_free(dtp->seqq[i]);
+            dtp->seqq[i] = NULL;
+            dtp->seqq_len--;
+        }
+    }
+
+    return n;
+}
+EXPORT_SYMBOL(dtp_seqq_flush);
+
 void
 dtp_dump(struct dtp *dtp)
 {
@@ -133,51 +169,235 @@ dtp_dump(struct dtp *dtp)
 }
 EXPORT_SYMBOL(dtp_dump);
 
-#define PDUFT_PERFLOW_KEY(daddr, dcep) ((daddr) | (dcep) << 16)
+/*
+ * The PDUFT is implemented with two resizable hash tables (rhashtable),
+ * so that lookups run under RCU without taking any lock, and the tables
+ * grow (and shrink) automatically as entries are added (or removed).
+ * The destination-based table is keyed by the (masked) destination address
+ * and the number of range bits, so that an entry can cover an aligned
+ * range of addresses; a longest prefix match is carried out by probing
+ * the table once for each range size in use, starting from exact
+ * matches. The per-flow table is keyed by the addresses, the CEP-ids and
+ * the QoS-id of struct rl_pci_match, and does not support ranges.
+ * Updates are serialized by the
+ * 'pduft_lock' spinlock, which also protects the 'pduft_entries' list
+ * (used to walk the whole table on flush). Removed entries are freed
+ * (and their flow reference is dropped) after an RCU grace period.
+ */
+static const struct rhashtable_params pduft_dst_params = {
+    .head_offset         = offsetof(struct pduft_entry, node),
+    .key_offset          = offsetof(struct pduft_entry, dkey),
+    .key_len             = offsetof(struct pduft_dst_key, range_bits) +
+                   sizeof(uint32_t),
+    .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params pduft_perflow_params = {
+    .head_offset         = offsetof(struct pduft_entry, node),
+    .key_offset          = offsetof(struct pduft_entry, match),
+    .key_len             = offsetof(struct rl_pci_match, qos_id) +
+                   sizeof(rlm_qosid_t),
+    .automatic_shrinking = true,
+};
+
+int
+rl_pduft_init(struct rl_normal *priv)
+{
+    int ret;
+
+    spin_lock_init(&priv->pduft_lock);
+    INIT_LIST_HEAD(&priv->pduft_entries);
+    RCU_INIT_POINTER(priv->pduft_dflt, NULL);
+    priv->perflow_present = false;
+    priv->pduft_ranges    = 0;
+    memset(priv->pduft_range_cnt, 0, sizeof(priv->pduft_range_cnt));
+
+    ret = rhashtable_init(&priv->pdu_ft, &pduft_dst_params);
+    if (ret) {
+        return ret;
+    }
+
+    ret = rhashtable_init(&priv->pdu_ft_perflow, &pduft_perflow_params);
+    if (ret) {
+        rhashtable_destroy(&priv->pdu_ft);
+        return ret;
+    }
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_pduft_init);
+
+void
+rl_pduft_fini(struct rl_normal *priv)
+{
+    rl_pduft_flush(priv->ipcp);
+    rhashtable_destroy(&priv->pdu_ft);
+    rhashtable_destroy(&priv->pdu_ft_perflow);
+    /* Wait for the pending pduft_entry_free_rcu() callbacks, which
+     * release the references to the N-1 flows. */
+    rcu_barrier();
+}
+EXPORT_SYMBOL(rl_pduft_fini);
+
+static void
+pduft_entry_free_rcu(struct rcu_head *head)
+{
+    struct pduft_entry *entry = container_of(head, struct pduft_entry, rcu);
+
+    flow_put(entry->flow);
+    rl_free(entry, RL_MT_PDUFT);
+}
+
+/* Helpers to access the hash table where entries matching 'match' are
+ * stored, i.e. the per-flow table if the source address is specified,
+ * or the destination-based table otherwise. */
+static inline bool
+pduft_match_in_perflow(const struct rl_pci_match *match)
+{
+    return match->src_addr != RL_ADDR_NULL;
+}
+
+static int
+pduft_table_insert(struct rl_normal *priv, struct pduft_entry *entry)
+{
+    if (pduft_match_in_perflow(&entry->match)) {
+        return rhashtable_insert_fast(&priv->pdu_ft_perflow, &entry->node,
+                                      pduft_perflow_params);
+    }
+    return rhashtable_insert_fast(&priv->pdu_ft, &entry->node,
+                                  pduft_dst_params);
+}
 
+static int
+pduft_table_replace(struct rl_normal *priv, struct pduft_entry *old,
+                    struct pduft_entry *entry)
+{
+    if (pduft_match_in_perflow(&entry->match)) {
+        return rhashtable_replace_fast(&priv->pdu_ft_perflow, &old->node,
+                                       &entry->node, pduft_perflow_params);
+    }
+    return rhashtable_replace_fast(&priv->pdu_ft, &old->node, &entry->node,
+                                   pduft_dst_params);
+}
+
+static void
+pduft_table_remove(struct rl_normal *priv, struct pduft_entry *entry)
+{
+    if (pduft_match_in_perflow(&entry->match)) {
+        rhashtable_remove_fast(&priv->pdu_ft_perflow, &entry->node,
+                               pduft_perflow_params);
+    } else {
+        rhashtable_remove_fast(&priv->pdu_ft, &entry->node, pduft_dst_params);
+    }
+}
+
+static inline void
+pduft_dst_key_init(struct pduft_dst_key *key, rlm_addr_t addr,
+                   unsigned int range_bits)
+{
+    key->addr       = addr & ~((((rlm_addr_t)1) << range_bits) - 1);
+    key->range_bits = range_bits;
+}
+
+/* Account for an entry of the destination-based table being added
+ * (inc == true) or removed. To be called under the pduft_lock. */
+static void
+pduft_ranges_update(struct rl_normal *priv, struct pduft_entry *entry,
+                    bool inc)
+{
+    unsigned int bits = entry->dkey.range_bits;
+
+    if (pduft_match_in_perflow(&entry->match)) {
+        return;
+    }
+
+    if (inc) {
+        if (priv->pduft_range_cnt[bits]++ == 0) {
+            WRITE_ONCE(priv->pduft_ranges,
+                       priv->pduft_ranges | (((u64)1) << bits));
+        }
+    } else if (--priv->pduft_range_cnt[bits] == 0) {
+        WRITE_ONCE(priv->pduft_ranges,
+                   priv->pduft_ranges & ~(((u64)1) << bits));
+    }
+}
+
+/* Longest prefix match on the destination-based table. To be called under
+ * RCU read lock or under the pduft_lock. */
+static struct pduft_entry *
+pduft_dst_lookup(struct rl_normal *priv, rlm_addr_t dst_addr)
+{
+    u64 ranges = READ_ONCE(priv->pduft_ranges);
+    struct pduft_entry *entry;
+    struct pduft_dst_key key;
+
+    /* Scan the range sizes in use from the smallest to the largest one.
+     * In the common case there are only exact entries, and a single
+     * lookup is needed. */
+    while (ranges) {
+        pduft_dst_key_init(&key, dst_addr, __ffs64(ranges));
+        entry = rhashtable_lookup_fast(&priv->pdu_ft, &key, pduft_dst_params);
+        if (entry) {
+            return entry;
+        }
+        ranges &= ranges - 1;
+    }
+
+    return NULL;
+}
+
+/* To be called under RCU read lock or under the pduft_lock. */
 static struct pduft_entry *
 pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
 {
     struct pduft_entry *entry;
-    struct hlist_head *head;
 
     /* If the per-flow table is not empty, lookup there first. */
-    if (priv->perflow_present) {
-        head = &priv->pdu_ft_perflow[hash_min(
-            PDUFT_PERFLOW_KEY(pci->dst_addr, pci->dst_cepid),
-            HASH_BITS(priv->pdu_ft_perflow))];
-        hlist_for_each_entry (entry, head, node) {
-            if (entry->match.dst_addr == pci->dst_addr &&
-                entry->match.src_addr == pci->src_addr &&
-                entry->match.dst_cepid == pci->dst_cepid &&
-                entry->match.src_cepid == pci->src_cepid &&
-                entry->match.qos_id == pci->qos_id) {
-                return entry;
-            }
+    if (READ_ONCE(priv->perflow_present)) {
+        entry = rhashtable_lookup_fast(&priv->pdu_ft_perflow, pci,
+                                       pduft_perflow_params);
+        if (entry) {
+            return entry;
         }
     }
 
     /* Lookup the regular (destination-based) table. */
-    head = &priv->pdu_ft[hash_min(pci->dst_addr, HASH_BITS(priv->pdu_ft))];
-    hlist_for_each_entry (entry, head, node) {
-        if (entry->match.dst_addr == pci->dst_addr) {
-            return entry;
-        }
+    return pduft_dst_lookup(priv, pci->dst_addr);
+}
+
+/* Lookup the exact entry specified by 'match' (which may be either
+ * dst-only or per-flow). To be called under the pduft_lock. */
+static struct pduft_entry *
+pduft_lookup_exact(struct rl_normal *priv, const struct rl_pci_match *match)
+{
+    struct pduft_dst_key key;
+
+    if (pduft_match_in_perflow(match)) {
+        return rhashtable_lookup_fast(&priv->pdu_ft_perflow, match,
+                                      pduft_perflow_params);
     }
 
-    return NULL;
+    pduft_dst_key_init(&key, match->dst_addr, match->dst_range_bits);
+    return rhashtable_lookup_fast(&priv->pdu_ft, &key, pduft_dst_params);
 }
 
+/* Lockless lookup. The returned flow is not referenced: the caller relies
+ * on the flow removal being postponed (see __flow_put()). */
 struct flow_entry *
 rl_pduft_lookup(struct rl_normal *priv, const struct rl_pci_match *pci)
 {
     struct pduft_entry *entry;
-    struct flow_entry *flow;
+    struct flow_entry *flow = NULL;
 
-    read_lock_bh(&priv->pduft_lock);
+    rcu_read_lock();
     entry = pduft_lookup_internal(priv, pci);
-    flow  = entry ? entry->flow : priv->pduft_dflt;
-    read_unlock_bh(&priv->pduft_lock);
+    if (!entry) {
+        entry = rcu_dereference(priv->pduft_dflt);
+    }
+    if (entry) {
+        flow = entry->flow;
+    }
+    rcu_read_unlock();
 
     return flow;
 }
@@ -194,7 +414,23 @@ static bool
 rl_pduft_match_is_perflow(const struct rl_pci_match *match)
 {
     return match->dst_addr != RL_ADDR_NULL && match->src_addr != RL_ADDR_NULL &&
-           match->dst_cepid != 0 && match->src_cepid != 0;
+           match->dst_cepid != 0 && match->src_cepid != 0 &&
+           match->dst_range_bits == 0;
+}
+
+/* The default entry is the one with a null destination and no range. */
+static inline bool
+rl_pduft_match_is_dflt(const struct rl_pci_match *match)
+{
+    return match->dst_addr == RL_ADDR_NULL && match->dst_range_bits == 0;
+}
+
+/* To be called under the pduft_lock. */
+static void
+pduft_perflow_update(struct rl_normal *priv)
+{
+    WRITE_ONCE(priv->perflow_present,
+               atomic_read(&priv->pdu_ft_perflow.nelems) != 0);
 }
 
 int
@@ -202,7 +438,8 @@ rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
              struct flow_entry *flow)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
+    struct pduft_entry *entry, *old;
+    int ret = 0;
 
     if (!rl_pduft_match_is_dstonly(match) &&
         !rl_pduft_match_is_perflow(match)) {
@@ -210,80 +447,113 @@ rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
         return -EINVAL;
     }
 
-    write_lock_bh(&priv->pduft_lock);
+    if (match->dst_range_bits > RL_PCI_MATCH_RANGE_BITS_MAX) {
+        PE("Invalid route: too many range bits (%u)\n",
+           match->dst_range_bits);
+        return -EINVAL;
+    }
 
-    if (match->dst_addr == RL_ADDR_NULL) {
-        /* Default entry. */
-        priv->pduft_dflt = flow;
-    } else {
-        entry = pduft_lookup_internal(priv, match);
+    /* Entries are never modified in place, since lockless readers may
+     * be accessing them. We always allocate a new entry, and replace
+     * the old one (if any). */
+    entry = rl_alloc(sizeof(*entry), GFP_ATOMIC | __GFP_ZERO, RL_MT_PDUFT);
+    if (!entry) {
+        return -ENOMEM;
+    }
+    entry->match = *match;
+    entry->flow  = flow;
+    pduft_dst_key_init(&entry->dkey, match->dst_addr, match->dst_range_bits);
+    /* Store the masked address, so that the match of a range entry is
+     * consistent with its key (e.g. for dumps and deletions). */
+    entry->match.dst_addr = entry->dkey.addr;
+    INIT_LIST_HEAD(&entry->lnode);
+    flow_get_ref(flow);
 
-        if (!entry) {
-            entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
-            if (!entry) {
-                write_unlock_bh(&priv->pduft_lock);
-                return -ENOMEM;
-            }
+    spin_lock_bh(&priv->pduft_lock);
 
-            if (rl_pduft_match_is_dstonly(match)) {
-                hash_add(priv->pdu_ft, &entry->node, match->dst_addr);
-            } else {
-                BUG_ON(!rl_pduft_match_is_perflow(match));
-                hash_add(priv->pdu_ft_perflow, &entry->node,
-                         PDUFT_PERFLOW_KEY(match->dst_addr, match->dst_cepid));
-                priv->perflow_present = true;
-            }
+    if (rl_pduft_match_is_dflt(match)) {
+        /* Default entry. */
+        old = rcu_dereference_protected(priv->pduft_dflt,
+                                        lockdep_is_held(&priv->pduft_lock));
+        rcu_assign_pointer(priv->pduft_dflt, entry);
+    } else {
+        old = pduft_lookup_exact(priv, match);
+        if (old) {
+            ret = pduft_table_replace(priv, old, entry);
         } else {
-            flow_put(entry->flow);
+            ret = pduft_table_insert(priv, entry);
+        }
+        if (ret) {
+            spin_unlock_bh(&priv->pduft_lock);
+            flow_put(flow);
+            rl_free(entry, RL_MT_PDUFT);
+            return ret;
         }
+        list_add_tail(&entry->lnode, &priv->pduft_entries);
+        pduft_ranges_update(priv, entry, /*inc=*/true);
+        pduft_perflow_update(priv);
+    }
 
-        entry->flow  = flow;
-        entry->match = *match;
+    if (old) {
+        if (!list_empty(&old->lnode)) {
+            pduft_ranges_update(priv, old, /*inc=*/false);
+        }
+        list_del_init(&old->lnode);
     }
-    write_unlock_bh(&priv->pduft_lock);
 
-    flow_get_ref(flow);
+    spin_unlock_bh(&priv->pduft_lock);
 
-    return 0;
+    if (old) {
+        call_rcu(&old->rcu, pduft_entry_free_rcu);
+    }
+
+    return ret;
 }
 EXPORT_SYMBOL(rl_pduft_set);
 
+/* To be called under the pduft_lock. The caller is responsible for
+ * freeing the entry (after a grace period). */
 static void
 pduft_entry_unlink(struct rl_normal *priv, struct pduft_entry *entry)
 {
-    hash_del(&entry->node);
-    if (hash_empty(priv->pdu_ft_perflow)) {
-        priv->perflow_present = false;
+    pduft_table_remove(priv, entry);
+    list_del_init(&entry->lnode);
+    pduft_ranges_update(priv, entry, /*inc=*/false);
+    pduft_perflow_update(priv);
+}
+
+/* To be called under the pduft_lock. */
+static bool
+pduft_dflt_unlink(struct rl_normal *priv)
+{
+    struct pduft_entry *dflt;
+
+    dflt = rcu_dereference_protected(priv->pduft_dflt,
+                                     lockdep_is_held(&priv->pduft_lock));
+    if (!dflt) {
+        return false;
     }
-    flow_put(entry->flow);
+    RCU_INIT_POINTER(priv->pduft_dflt, NULL);
+    call_rcu(&dflt->rcu, pduft_entry_free_rcu);
+
+    return true;
 }
 
 int
 rl_pduft_flush(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
-    struct hlist_node *tmp;
-    int bucket;
+    struct pduft_entry *entry, *tmp;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
 
-    if (priv->pduft_dflt) {
-        flow_put(priv->pduft_dflt);
-        priv->pduft_dflt = NULL;
-    }
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
-        pduft_entry_unlink(priv, entry);
-        rl_free(entry, RL_MT_PDUFT);
-    }
-    hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
-    {
+    pduft_dflt_unlink(priv);
+    list_for_each_entry_safe (entry, tmp, &priv->pduft_entries, lnode) {
         pduft_entry_unlink(priv, entry);
-        rl_free(entry, RL_MT_PDUFT);
+        call_rcu(&entry->rcu, pduft_entry_free_rcu);
     }
 
-    write_unlock_bh(&priv->pduft_lock);
+    spin_unlock_bh(&priv->pduft_lock);
 
     return 0;
 }
@@ -293,44 +563,97 @@ int
 rl_pduft_flush_by_flow(struct ipcp_entry *ipcp, const struct flow_entry *flow)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
-    struct hlist_node *tmp;
-    int bucket;
+    struct pduft_entry *entry, *tmp;
+    LIST_HEAD(removed);
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
 
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
+    list_for_each_entry_safe (entry, tmp, &priv->pduft_entries, lnode) {
         if (entry->flow == flow) {
             pduft_entry_unlink(priv, entry);
-            rl_free(entry, RL_MT_PDUFT);
+            list_add_tail(&entry->lnode, &removed);
         }
     }
 
-    hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
-    {
-        if (entry->flow == flow) {
-            pduft_entry_unlink(priv, entry);
-            rl_free(entry, RL_MT_PDUFT);
-        }
+    spin_unlock_bh(&priv->pduft_lock);
+
+    if (list_empty(&removed)) {
+        return 0;
     }
 
-    write_unlock_bh(&priv->pduft_lock);
+    /* This is called (in process context) while 'flow' is going away, so
+     * we cannot defer the release of the flow references with call_rcu():
+     * wait for the readers here instead. */
+    synchronize_rcu();
+    list_for_each_entry_safe (entry, tmp, &removed, lnode) {
+        list_del(&entry->lnode);
+        flow_put(entry->flow);
+        rl_free(entry, RL_MT_PDUFT);
+    }
 
     return 0;
 }
 EXPORT_SYMBOL(rl_pduft_flush_by_flow);
 
+/* Return an array with the distinct N-1 flows referenced by the PDUFT,
+ * taking a reference to each of them. The caller must release the
+ * references and free the array with RL_MT_PDUFT. */
+struct flow_entry **
+rl_pduft_flows_get(struct rl_normal *priv, unsigned int *num)
+{
+    struct pduft_entry *entry, *dflt;
+    struct flow_entry **flows;
+    unsigned int max = 1;
+    unsigned int i;
+
+    *num = 0;
+
+    spin_lock_bh(&priv->pduft_lock);
+
+    list_for_each_entry (entry, &priv->pduft_entries, lnode) {
+        max++;
+    }
+    flows = rl_alloc(max * sizeof(flows[0]), GFP_ATOMIC, RL_MT_PDUFT);
+    if (!flows) {
+        spin_unlock_bh(&priv->pduft_lock);
+        return NULL;
+    }
+
+    dflt = rcu_dereference_protected(priv->pduft_dflt,
+                                     lockdep_is_held(&priv->pduft_lock));
+    if (dflt) {
+        flows[(*num)++] = dflt->flow;
+    }
+    list_for_each_entry (entry, &priv->pduft_entries, lnode) {
+        for (i = 0; i < *num; i++) {
+            if (flows[i] == entry->flow) {
+                break;
+            }
+        }
+        if (i == *num) {
+            flows[(*num)++] = entry->flow;
+        }
+    }
+    for (i = 0; i < *num; i++) {
+        flow_get_ref(flows[i]);
+    }
+
+    spin_unlock_bh(&priv->pduft_lock);
+
+    return flows;
+}
+EXPORT_SYMBOL(rl_pduft_flows_get);
+
 int
 rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
     pduft_entry_unlink(priv, entry);
-    write_unlock_bh(&priv->pduft_lock);
+    spin_unlock_bh(&priv->pduft_lock);
 
-    rl_free(entry, RL_MT_PDUFT);
+    call_rcu(&entry->rcu, pduft_entry_free_rcu);
 
     return 0;
 }
@@ -339,30 +662,25 @@ EXPORT_SYMBOL(rl_pduft_del);
 int
 rl_pduft_del_addr(struct ipcp_entry *ipcp, const struct rl_pci_match *match)
 {
-    struct rl_normal *priv    = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry = NULL;
-    int ret                   = -1;
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_entry *entry;
+    int ret = -1;
 
-    write_lock_bh(&priv->pduft_lock);
-    if (match->dst_addr == RL_ADDR_NULL) {
+    spin_lock_bh(&priv->pduft_lock);
+    if (rl_pduft_match_is_dflt(match)) {
         /* Default entry. */
-        if (priv->pduft_dflt) {
-            flow_put(priv->pduft_dflt);
-            priv->pduft_dflt = NULL;
-            ret              = 0;
+        if (pduft_dflt_unlink(priv)) {
+            ret = 0;
         }
     } else {
-        entry = pduft_lookup_internal(priv, match);
+        entry = pduft_lookup_exact(priv, match);
         if (entry) {
             pduft_entry_unlink(priv, entry);
+            call_rcu(&entry->rcu, pduft_entry_free_rcu);
             ret = 0;
         }
     }
-    write_unlock_bh(&priv->pduft_lock);
-
-    if (entry) {
-        rl_free(entry, RL_MT_PDUFT);
-    }
+    spin_unlock_bh(&priv->pduft_lock);
 
     return ret;
 }
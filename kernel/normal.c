@@ -37,6 +37,11 @@
 #include <linux/spinlock.h>
 #include <linux/delay.h>
 #include <linux/poll.h>
+#include <linux/jhash.h>
+#include <net/checksum.h>
+#ifdef RL_HAVE_INT_SQRT_H
+#include <linux/int_sqrt.h>
+#endif
 #include <asm/div64.h>
 
 #define RMTQ_MAX_SIZE (1 << 17)
@@ -73,6 +78,16 @@ struct rina_pci_ctrl {
     rl_seq_t my_rwe; /* sent but unused */
 } __attribute__((__packed__));
 
+/* SACK and SNACK control PDUs carry a list of blocks right after the
+ * control PCI. Each block covers the sequence numbers in [start, end),
+ * which have been received out of order (SACK) or are missing (SNACK). */
+struct rina_sack_block {
+    rl_seq_t start;
+    rl_seq_t end;
+} __attribute__((__packed__));
+
+#define RL_SACK_BLOCKS_MAX 4
+
 static inline void
 rl_buf_pci_pop(struct rl_buf *rb)
 {
@@ -89,7 +104,7 @@ static inline int
 rl_buf_pci_push(struct rl_buf *rb)
 {
 #ifndef RL_SKB
-    if (unlikely((uint8_t *)(RL_BUF_PCI(rb) - 1) < &rb->raw->buf[0])) {
+    if (unlikely((uint8_t *)(RL_BUF_PCI(rb) - 1) < rb->raw->data)) {
         RPD(1, "No space to push another PCI\n");
         return -1;
     }
@@ -181,6 +196,15 @@ sched_pfifo_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
     return sched_pfifo_do_config(sched, req->max_queue_size, req->prio_levels);
 }
 
+static int
+sched_pfifo_clone(struct rl_sched *sched, struct rl_sched *src)
+{
+    struct rl_sched_pfifo *src_priv = RL_SCHED_PRIV(src);
+
+    return sched_pfifo_do_config(sched, src_priv->max_queue_size,
+                                 src_priv->num_queues);
+}
+
 static int
 sched_pfifo_init(struct rl_sched *sched)
 {
@@ -200,16 +224,13 @@ sched_pfifo_fini(struct rl_sched *sched)
 
     for (i = 0; i < sched_priv->num_queues; i++) {
         struct rl_sched_pfifo_queue *pq = sched_priv->queues + i;
-        struct rl_buf *rb, *tmp;
 
-        rb_list_foreach_safe (rb, tmp, &pq->q) {
-            rb_list_del(rb);
-            rl_buf_free(rb);
-        }
+        rl_buf_free_bulk(&pq->q);
         pq->qlen = 0;
     }
 
     rl_free(sched_priv->queues, RL_MT_SHIM);
+    sched_priv->queues = NULL;
 }
 
 static int
@@ -258,6 +279,7 @@ static struct rl_sched_ops rl_sched_pfifo_ops = {
     .init      = sched_pfifo_init,
     .fini      = sched_pfifo_fini,
     .config    = sched_pfifo_config,
+    .clone     = sched_pfifo_clone,
     .enq       = sched_pfifo_enq,
     .deq       = sched_pfifo_deq};
 
@@ -287,13 +309,73 @@ struct rl_sched_wrr {
     unsigned int cur_class;
 };
 
+/* Replace the current queues (if any) with 'num_queues' empty ones. */
+static int
+sched_wrr_queues_alloc(struct rl_sched *sched, unsigned int max_queue_size,
+                       unsigned int quantum, rl_qosid_t num_queues)
+{
+    struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    /* Clean up the old queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new queues. */
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->num_queues     = num_queues;
+    sched_priv->quantum        = quantum;
+    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
+                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->queues) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        rb_list_init(&sched_priv->queues[i].q);
+    }
+
+    sched_priv->cur_class = 0;
+
+    return 0;
+}
+
+/* Normalize a weight to the minimum one, so that the class with the
+ * minimum weight gets exactly 'quantum' bytes per round. */
+static unsigned int
+sched_weight_normalize(unsigned int weight, unsigned int min_weight,
+                       unsigned int quantum)
+{
+    uint64_t norm_weight = weight;
+
+    norm_weight <<= 20;
+    do_div(norm_weight, min_weight);
+    norm_weight *= quantum;
+    norm_weight >>= 20;
+
+    return norm_weight;
+}
+
+/* Return the minimum among 'num' weights. */
+static unsigned int
+sched_weights_min(const unsigned int weights[], rl_qosid_t num)
+{
+    unsigned int min_weight = -1;
+    rl_qosid_t i;
+
+    for (i = 0; i < num; i++) {
+        min_weight = min(min_weight, weights[i]);
+    }
+
+    return min_weight;
+}
+
 static int
 sched_wrr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
                     unsigned int quantum, rl_qosid_t num_queues,
                     unsigned int weights[])
 {
     struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
-    unsigned int min_weight         = -1;
+    unsigned int min_weight;
     int i;
 
     if (quantum == 0 || num_queues == 0 || max_queue_size == 0) {
@@ -302,41 +384,41 @@ sched_wrr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
     }
 
     /* Find the minimum weight and check that it is not 0. */
-    for (i = 0; i < num_queues; i++) {
-        min_weight = min(min_weight, weights[i]);
-    }
+    min_weight = sched_weights_min(weights, num_queues);
     if (min_weight < 1) {
         return -1;
     }
 
-    /* Clean up the old queues (if any). */
-    sched->ops.fini(sched);
-
-    /* Build the new queues. */
-    sched_priv->max_queue_size = max_queue_size;
-    sched_priv->num_queues     = num_queues;
-    sched_priv->quantum        = quantum;
-    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
-                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
-    if (!sched_priv->queues) {
+    if (sched_wrr_queues_alloc(sched, max_queue_size, quantum, num_queues)) {
         return -ENOMEM;
     }
 
     for (i = 0; i < num_queues; i++) {
         struct rl_sched_wrr_queue *wrrq = sched_priv->queues + i;
-        uint64_t norm_weight            = weights[i];
-
-        /* Normalize the weight to the minimum one. */
-        norm_weight <<= 20;
-        do_div(norm_weight, min_weight);
-        norm_weight *= quantum;
-        norm_weight >>= 20;
-        wrrq->weight = wrrq->credit = norm_weight;
-        rb_list_init(&wrrq->q);
-        wrrq->qlen = 0;
+
+        wrrq->weight = wrrq->credit =
+            sched_weight_normalize(weights[i], min_weight, quantum);
     }
 
-    sched_priv->cur_class = 0;
+    return 0;
+}
+
+static int
+sched_wrr_clone(struct rl_sched *sched, struct rl_sched *src)
+{
+    struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_sched_wrr *src_priv   = RL_SCHED_PRIV(src);
+    int i;
+
+    if (sched_wrr_queues_alloc(sched, src_priv->max_queue_size,
+                               src_priv->quantum, src_priv->num_queues)) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < src_priv->num_queues; i++) {
+        sched_priv->queues[i].weight = sched_priv->queues[i].credit =
+            src_priv->queues[i].weight;
+    }
 
     return 0;
 }
@@ -373,16 +455,13 @@ sched_wrr_fini(struct rl_sched *sched)
 
     for (i = 0; i < sched_priv->num_queues; i++) {
         struct rl_sched_wrr_queue *wrrq = sched_priv->queues + i;
-        struct rl_buf *rb, *tmp;
 
-        rb_list_foreach_safe (rb, tmp, &wrrq->q) {
-            rb_list_del(rb);
-            rl_buf_free(rb);
-        }
+        rl_buf_free_bulk(&wrrq->q);
         wrrq->qlen = 0;
     }
 
     rl_free(sched_priv->queues, RL_MT_SHIM);
+    sched_priv->queues = NULL;
 }
 
 static int
@@ -452,182 +531,1269 @@ static struct rl_sched_ops rl_sched_wrr_ops = {
     .init      = sched_wrr_init,
     .fini      = sched_wrr_fini,
     .config    = sched_wrr_config,
+    .clone     = sched_wrr_clone,
     .enq       = sched_wrr_enq,
     .deq       = sched_wrr_deq,
 };
 
-/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
- * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
- * compiler may need to insert padding. */
-#define RL_PCI_LEN                                                             \
-    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
-     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+/* Deficit round robin classes, used by both the "drr" and the "prio-drr"
+ * schedulers. The deficit counters are in bytes, so that the share of
+ * each class is proportional to its quantum regardless of PDU sizes. */
+struct rl_sched_drr_classes {
+    struct rl_sched_drr_class {
+        struct rb_list q;
+        int qlen;
+        /* Bytes added to the deficit at each round (normalized weight). */
+        unsigned int quantum;
+        /* Bytes that the class can still send in the current round. */
+        unsigned int deficit;
+    } * classes;
 
-#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+    /* Number of DRR classes. */
+    rl_qosid_t num_classes;
 
-/* Maximum and minimum values for the congestion control window. */
-#define RL_CGWIN_MIN 4
-#define RL_CGWIN_MAX (1U << 16)
+    /* Current class to dequeue from. */
+    rl_qosid_t cur_class;
 
-/* To be called under DTP lock */
-static void
-dtp_snd_reset(struct flow_entry *flow)
-{
-    struct dtcp_config *dc = &flow->cfg.dtcp;
-    struct dtp *dtp        = &flow->dtp;
+    /* True if the current class has already received its quantum
+     * for this round. */
+    bool cur_credited;
 
-    dtp->flags |= DTP_F_DRF_SET;
-    /* InitialSeqNumPolicy */
-    dtp->next_seq_num_to_use = 0;
-    dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
-    dtp->last_seq_num_sent      = -1;
-    dtp->last_ctrl_seq_num_rcvd = 0;
-    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
-        dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
-        dtp->cgwin = RL_CGWIN_MIN;
-    }
-}
+    /* Number of PDUs queued across all the classes. */
+    unsigned int backlog;
+};
 
-/* To be called under DTP lock */
 static void
-dtp_rcv_reset(struct flow_entry *flow)
+sched_drr_classes_fini(struct rl_sched_drr_classes *dc)
 {
-    struct dtcp_config *dc = &flow->cfg.dtcp;
-    struct dtp *dtp        = &flow->dtp;
+    rl_qosid_t i;
 
-    dtp->flags |= DTP_F_DRF_EXPECTED;
-    dtp->rcv_lwe = dtp->rcv_next_seq_num = dtp->rcv_rwe = 0;
-    dtp->max_seq_num_rcvd                               = -1;
-#if 0
-    /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
-    dtp->next_snd_ctl_seq = 0;
-#endif
-    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
-        dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
+    if (!dc->classes) {
+        return;
     }
-    dtp->last_lwe_sent      = 0;
-    dtp->last_seq_num_acked = 0;
+
+    for (i = 0; i < dc->num_classes; i++) {
+        rl_buf_free_bulk(&dc->classes[i].q);
+    }
+
+    rl_free(dc->classes, RL_MT_SHIM);
+    dc->classes = NULL;
+    dc->backlog = 0;
 }
 
-static void
-snd_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+/* Build 'num_classes' empty classes. The quanta are taken from 'quanta'
+ * if not NULL, otherwise they are computed from 'weights' and 'quantum'.
+ * The caller must have already released the old classes (if any). */
+static int
+sched_drr_classes_init(struct rl_sched_drr_classes *dc, rl_qosid_t num_classes,
+                       unsigned int quantum, const unsigned int weights[],
+                       const struct rl_sched_drr_classes *quanta)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
-
-    spin_lock_bh(&dtp->lock);
+    unsigned int min_weight = 0;
+    rl_qosid_t i;
 
-    del_timer(&dtp->rtx_tmr);
+    if (!quanta) {
+        min_weight = sched_weights_min(weights, num_classes);
+        BUG_ON(min_weight < 1);
+    }
 
-    dtp_dump(dtp);
+    dc->classes = rl_alloc(num_classes * sizeof(dc->classes[0]),
+                           GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!dc->classes) {
+        return -ENOMEM;
+    }
 
-    /* Re-initialize send-side state variables. */
-    dtp_snd_reset(flow);
+    for (i = 0; i < num_classes; i++) {
+        struct rl_sched_drr_class *c = dc->classes + i;
 
-    /* Flush the retransmission queue. */
-    PD("dropping %u PDUs from rtxq\n", dtp->rtxq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        dtp->rtxq_len--;
+        rb_list_init(&c->q);
+        c->quantum = quanta ? quanta->classes[i].quantum
+                            : sched_weight_normalize(weights[i], min_weight,
+                                                     quantum);
     }
+    dc->num_classes  = num_classes;
+    dc->cur_class    = 0;
+    dc->cur_credited = false;
+    dc->backlog      = 0;
 
-    /* Flush the closed window queue */
-    PD("dropping %u PDUs from cwq\n", dtp->cwq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->tx_err++;
-        dtp->cwq_len--;
-    }
+    return 0;
+}
 
-    /* Send control ack PDU */
+static int
+sched_drr_classes_enq(struct rl_sched_drr_classes *dc, rl_qosid_t drr_class,
+                      struct rl_buf *rb, unsigned int max_queue_size)
+{
+    struct rl_sched_drr_class *c =
+        dc->classes + min((rl_qosid_t)(dc->num_classes - 1), drr_class);
 
-    /* Send transfer PDU with zero length. */
+    if (c->qlen > max_queue_size) {
+        return -1;
+    }
 
-    /* Notify user flow that there has been no activity for a while */
+    rb_list_enq(rb, &c->q);
+    c->qlen += rl_buf_truesize(rb);
+    dc->backlog++;
 
-    spin_unlock_bh(&dtp->lock);
+    return 0;
+}
 
-    /* Wake up processes sleeping on write(), since cwq and rtxq have been
-     * emptied. */
-    rl_write_restart_flow(flow);
+static inline void
+sched_drr_classes_next(struct rl_sched_drr_classes *dc)
+{
+    dc->cur_class    = sched_next_class(dc->cur_class, dc->num_classes);
+    dc->cur_credited = false;
 }
 
-static void
-rcv_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+/* Classic DRR dequeue: a backlogged class receives its quantum once per
+ * round and keeps sending while the PDU at the head fits its deficit.
+ * Classes that become empty lose their residual deficit. The number of
+ * rounds needed to find a PDU is bounded by the ratio between the PDU
+ * size and the quantum, so the quantum should not be smaller than the
+ * MTU of the lower flows. */
+static struct rl_buf *
+sched_drr_classes_deq(struct rl_sched_drr_classes *dc)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
+    if (dc->backlog == 0) {
+        return NULL;
+    }
 
-    spin_lock_bh(&dtp->lock);
+    for (;;) {
+        struct rl_sched_drr_class *c = dc->classes + dc->cur_class;
+        struct rl_buf *rb;
 
-    /* Re-initialize receive-side state variables. */
-    dtp_rcv_reset(flow);
+        if (rb_list_empty(&c->q)) {
+            c->deficit = 0;
+            sched_drr_classes_next(dc);
+            continue;
+        }
+
+        if (!dc->cur_credited) {
+            c->deficit += c->quantum;
+            dc->cur_credited = true;
+        }
+
+        rb = rb_list_front(&c->q);
+        if (rb->len > c->deficit) {
+            /* Not enough credit left, the residual deficit is kept
+             * for the next round. */
+            sched_drr_classes_next(dc);
+            continue;
+        }
 
-    /* Flush sequencing queue. */
-    PD("dropping %u PDUs from seqq\n", dtp->seqq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
         rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->rx_err++;
-        dtp->seqq_len--;
-    }
+        c->qlen -= rl_buf_truesize(rb);
+        BUG_ON(c->qlen < 0);
+        c->deficit -= rb->len;
+        dc->backlog--;
+        if (rb_list_empty(&c->q)) {
+            c->deficit = 0;
+            sched_drr_classes_next(dc);
+        }
 
-    spin_unlock_bh(&dtp->lock);
+        return rb;
+    }
 }
 
-static int rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags);
+struct rl_sched_drr {
+    /* Classes indexed by qos_id. */
+    struct rl_sched_drr_classes drr;
 
-static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
-                                       struct flow_entry *flow,
-                                       bool ack_immediate);
+    /* Maximum size of each queue, in bytes. */
+    unsigned int max_queue_size;
 
-static void
-a_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+    /* Quantum in bytes. */
+    unsigned int quantum;
+};
+
+static int
+sched_drr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                    unsigned int quantum, rl_qosid_t num_queues,
+                    const unsigned int weights[],
+                    const struct rl_sched_drr_classes *quanta)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.a_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct ipcp_entry *ipcp = flow->txrx.ipcp;
-    struct dtp *dtp         = &flow->dtp;
-    struct rl_buf *crb;
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
 
-    RPV(1, "A tmr callback\n");
+    if (quantum == 0 || num_queues == 0 || max_queue_size == 0) {
+        /* Invalid parameters. */
+        return -1;
+    }
 
-    spin_lock_bh(&dtp->lock);
+    if (!quanta && sched_weights_min(weights, num_queues) < 1) {
+        return -1;
+    }
+
+    /* Clean up the old queues (if any) and build the new ones. */
+    sched->ops.fini(sched);
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->quantum        = quantum;
+
+    return sched_drr_classes_init(&sched_priv->drr, num_queues, quantum,
+                                  weights, quanta);
+}
+
+static int
+sched_drr_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_drr *req = (struct rl_kmsg_ipcp_sched_drr *)bmsg;
+
+    return sched_drr_do_config(sched, req->max_queue_size, req->quantum,
+                               req->weights.num_elements,
+                               req->weights.slots.dwords, /*quanta=*/NULL);
+}
+
+static int
+sched_drr_clone(struct rl_sched *sched, struct rl_sched *src)
+{
+    struct rl_sched_drr *src_priv = RL_SCHED_PRIV(src);
+
+    return sched_drr_do_config(sched, src_priv->max_queue_size,
+                               src_priv->quantum, src_priv->drr.num_classes,
+                               /*weights=*/NULL, &src_priv->drr);
+}
+
+static int
+sched_drr_init(struct rl_sched *sched)
+{
+    unsigned int weights[2] = {1, 4};
+
+    return sched_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*quantum=*/2000, /*num_queues=*/2,
+                               /*weights=*/weights, /*quanta=*/NULL);
+}
+
+static void
+sched_drr_fini(struct rl_sched *sched)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+
+    sched_drr_classes_fini(&sched_priv->drr);
+}
+
+static int
+sched_drr_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+
+    return sched_drr_classes_enq(&sched_priv->drr, RL_BUF_PCI(rb)->qos_id, rb,
+                                 sched_priv->max_queue_size);
+}
+
+static struct rl_buf *
+sched_drr_deq(struct rl_sched *sched)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+
+    return sched_drr_classes_deq(&sched_priv->drr);
+}
+
+static struct rl_sched_ops rl_sched_drr_ops = {
+    .name      = "drr",
+    .priv_size = sizeof(struct rl_sched_drr),
+    .init      = sched_drr_init,
+    .fini      = sched_drr_fini,
+    .config    = sched_drr_config,
+    .clone     = sched_drr_clone,
+    .enq       = sched_drr_enq,
+    .deq       = sched_drr_deq,
+};
+
+/* Two-level scheduler: the first 'prio_levels' QoS ids are served in
+ * strict priority order (0 is the highest), and the remaining ones are
+ * mapped to DRR classes, which share what is left of the link. */
+struct rl_sched_prio_drr {
+    /* Strict priority queues, indexed by qos_id. */
+    struct rl_sched_pfifo_queue *prio;
+
+    /* Number of strict priority levels (may be 0). */
+    rl_qosid_t prio_levels;
+
+    /* DRR classes, indexed by (qos_id - prio_levels). */
+    struct rl_sched_drr_classes drr;
+
+    /* Maximum size of each queue, in bytes. */
+    unsigned int max_queue_size;
+
+    /* Quantum in bytes. */
+    unsigned int quantum;
+};
+
+static int
+sched_prio_drr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                         unsigned int quantum, rl_qosid_t prio_levels,
+                         rl_qosid_t num_classes, const unsigned int weights[],
+                         const struct rl_sched_drr_classes *quanta)
+{
+    struct rl_sched_prio_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t i;
+
+    if (quantum == 0 || num_classes == 0 || max_queue_size == 0) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    if (!quanta && sched_weights_min(weights, num_classes) < 1) {
+        return -1;
+    }
+
+    /* Clean up the old queues (if any) and build the new ones. */
+    sched->ops.fini(sched);
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->quantum        = quantum;
+    sched_priv->prio_levels    = prio_levels;
+    if (prio_levels) {
+        sched_priv->prio =
+            rl_alloc(prio_levels * sizeof(sched_priv->prio[0]),
+                     GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+        if (!sched_priv->prio) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < prio_levels; i++) {
+            rb_list_init(&sched_priv->prio[i].q);
+        }
+    }
+
+    return sched_drr_classes_init(&sched_priv->drr, num_classes, quantum,
+                                  weights, quanta);
+}
+
+static int
+sched_prio_drr_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_prio_drr *req =
+        (struct rl_kmsg_ipcp_sched_prio_drr *)bmsg;
+
+    return sched_prio_drr_do_config(
+        sched, req->max_queue_size, req->quantum, req->prio_levels,
+        req->weights.num_elements, req->weights.slots.dwords, /*quanta=*/NULL);
+}
+
+static int
+sched_prio_drr_clone(struct rl_sched *sched, struct rl_sched *src)
+{
+    struct rl_sched_prio_drr *src_priv = RL_SCHED_PRIV(src);
+
+    return sched_prio_drr_do_config(sched, src_priv->max_queue_size,
+                                    src_priv->quantum, src_priv->prio_levels,
+                                    src_priv->drr.num_classes,
+                                    /*weights=*/NULL, &src_priv->drr);
+}
+
+static int
+sched_prio_drr_init(struct rl_sched *sched)
+{
+    unsigned int weights[2] = {1, 4};
+
+    return sched_prio_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                                    /*quantum=*/2000, /*prio_levels=*/1,
+                                    /*num_classes=*/2, /*weights=*/weights,
+                                    /*quanta=*/NULL);
+}
+
+static void
+sched_prio_drr_fini(struct rl_sched *sched)
+{
+    struct rl_sched_prio_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t i;
+
+    if (sched_priv->prio) {
+        for (i = 0; i < sched_priv->prio_levels; i++) {
+            struct rl_sched_pfifo_queue *pq = sched_priv->prio + i;
+
+            rl_buf_free_bulk(&pq->q);
+            pq->qlen = 0;
+        }
+        rl_free(sched_priv->prio, RL_MT_SHIM);
+        sched_priv->prio = NULL;
+    }
+
+    sched_drr_classes_fini(&sched_priv->drr);
+}
+
+static int
+sched_prio_drr_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_prio_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t qos_id                    = RL_BUF_PCI(rb)->qos_id;
+    struct rl_sched_pfifo_queue *pq;
+
+    if (qos_id >= sched_priv->prio_levels) {
+        return sched_drr_classes_enq(&sched_priv->drr,
+                                     qos_id - sched_priv->prio_levels, rb,
+                                     sched_priv->max_queue_size);
+    }
+
+    pq = sched_priv->prio + qos_id;
+    if (pq->qlen > sched_priv->max_queue_size) {
+        return -1;
+    }
+
+    rb_list_enq(rb, &pq->q);
+    pq->qlen += rl_buf_truesize(rb);
+
+    return 0;
+}
+
+static struct rl_buf *
+sched_prio_drr_deq(struct rl_sched *sched)
+{
+    struct rl_sched_prio_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t i;
+
+    for (i = 0; i < sched_priv->prio_levels; i++) {
+        struct rl_sched_pfifo_queue *pq = sched_priv->prio + i;
+
+        if (!rb_list_empty(&pq->q)) {
+            struct rl_buf *rb = rb_list_front(&pq->q);
+
+            rb_list_del(rb);
+            pq->qlen -= rl_buf_truesize(rb);
+            BUG_ON(pq->qlen < 0);
+            return rb;
+        }
+    }
+
+    return sched_drr_classes_deq(&sched_priv->drr);
+}
+
+static struct rl_sched_ops rl_sched_prio_drr_ops = {
+    .name      = "prio-drr",
+    .priv_size = sizeof(struct rl_sched_prio_drr),
+    .init      = sched_prio_drr_init,
+    .fini      = sched_prio_drr_fini,
+    .config    = sched_prio_drr_config,
+    .clone     = sched_prio_drr_clone,
+    .enq       = sched_prio_drr_enq,
+    .deq       = sched_prio_drr_deq,
+};
+
+/* Set the ECN flag in the PCI of a PDU. No need to update the checksum,
+ * since it is computed right before passing the PDU to the lower IPCP
+ * (see rmt_tx_to_lower()). */
+static inline void
+rina_pci_set_ecn(struct rina_pci *pci)
+{
+    pci->pdu_flags |= PDU_F_ECN;
+}
+
+/*
+ * FQ-CoDel: PDUs are hashed into per-flow queues, which are served by
+ * DRR giving precedence to the queues that just became active. Each
+ * queue runs the CoDel AQM at dequeue time: when the sojourn time stays
+ * above 'target' for a whole 'interval', data transfer PDUs are marked
+ * with PDU_F_ECN (or dropped, if ECN is disabled) at an increasing rate
+ * until the delay goes back under the target.
+ */
+#define RL_FQ_CODEL_FLOWS_DFLT 64
+#define RL_FQ_CODEL_TARGET_US_DFLT 5000
+#define RL_FQ_CODEL_INTERVAL_US_DFLT 100000
+
+struct rl_codel_vars {
+    /* Time (ns) when the sojourn time will have been above target for
+     * a whole interval, or 0. */
+    u64 first_above_time;
+    /* Next time (ns) to mark or drop. */
+    u64 drop_next;
+    /* Number of marks/drops in the current dropping state, and in
+     * the previous one. */
+    unsigned int count;
+    unsigned int lastcount;
+    bool dropping;
+};
+
+struct rl_fq_codel_queue {
+    struct rb_list q;
+    int qlen;
+    int deficit;
+    struct rl_codel_vars cv;
+    /* Linkage in the new_flows or old_flows list, when active. */
+    struct list_head node;
+};
+
+/* The queues and the lists are allocated out of the scheduler private
+ * area, which is swapped byte-by-byte on reconfiguration. */
+struct rl_fq_codel_tab {
+    struct list_head new_flows;
+    struct list_head old_flows;
+    struct rl_fq_codel_queue queues[];
+};
+
+struct rl_sched_fq_codel {
+    struct rl_fq_codel_tab *tab;
+
+    /* Maximum size of each queue, in bytes. */
+    unsigned int max_queue_size;
+
+    /* Quantum in bytes. */
+    unsigned int quantum;
+
+    /* Number of flow queues. */
+    unsigned int flows;
+
+    /* CoDel parameters, in nanoseconds. */
+    u64 target;
+    u64 interval;
+
+    /* Mark rather than drop data transfer PDUs. */
+    bool ecn;
+};
+
+static int
+sched_fq_codel_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                         unsigned int quantum, unsigned int flows,
+                         unsigned int target_us, unsigned int interval_us,
+                         bool ecn)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_fq_codel_tab *tab;
+    unsigned int i;
+
+    if (max_queue_size == 0 || quantum == 0 || flows == 0 || flows > 65536 ||
+        target_us == 0 || interval_us < target_us) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    /* Clean up the old queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new queues. */
+    tab = rl_alloc(sizeof(*tab) + flows * sizeof(tab->queues[0]),
+                   GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!tab) {
+        return -ENOMEM;
+    }
+    INIT_LIST_HEAD(&tab->new_flows);
+    INIT_LIST_HEAD(&tab->old_flows);
+    for (i = 0; i < flows; i++) {
+        rb_list_init(&tab->queues[i].q);
+        INIT_LIST_HEAD(&tab->queues[i].node);
+    }
+
+    sched_priv->tab            = tab;
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->quantum        = quantum;
+    sched_priv->flows          = flows;
+    sched_priv->target         = (u64)target_us * NSEC_PER_USEC;
+    sched_priv->interval       = (u64)interval_us * NSEC_PER_USEC;
+    sched_priv->ecn            = ecn;
+
+    return 0;
+}
+
+static int
+sched_fq_codel_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_fq_codel *req =
+        (struct rl_kmsg_ipcp_sched_fq_codel *)bmsg;
+
+    return sched_fq_codel_do_config(sched, req->max_queue_size, req->quantum,
+                                    req->flows, req->target_us,
+                                    req->interval_us, req->ecn);
+}
+
+static int
+sched_fq_codel_clone(struct rl_sched *sched, struct rl_sched *src)
+{
+    struct rl_sched_fq_codel *src_priv = RL_SCHED_PRIV(src);
+
+    return sched_fq_codel_do_config(
+        sched, src_priv->max_queue_size, src_priv->quantum, src_priv->flows,
+        div_u64(src_priv->target, NSEC_PER_USEC),
+        div_u64(src_priv->interval, NSEC_PER_USEC),
+        src_priv->ecn);
+}
+
+static int
+sched_fq_codel_init(struct rl_sched *sched)
+{
+    return sched_fq_codel_do_config(
+        sched, /*max_queue_size=*/RMTQ_MAX_SIZE, /*quantum=*/1500,
+        /*flows=*/RL_FQ_CODEL_FLOWS_DFLT,
+        /*target_us=*/RL_FQ_CODEL_TARGET_US_DFLT,
+        /*interval_us=*/RL_FQ_CODEL_INTERVAL_US_DFLT, /*ecn=*/true);
+}
+
+static void
+sched_fq_codel_fini(struct rl_sched *sched)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    unsigned int i;
+
+    if (!sched_priv->tab) {
+        return;
+    }
+
+    for (i = 0; i < sched_priv->flows; i++) {
+        rl_buf_free_bulk(&sched_priv->tab->queues[i].q);
+    }
+
+    rl_free(sched_priv->tab, RL_MT_SHIM);
+    sched_priv->tab = NULL;
+}
+
+static int
+sched_fq_codel_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_fq_codel_tab *tab          = sched_priv->tab;
+    struct rina_pci *pci                 = RL_BUF_PCI(rb);
+    struct rl_fq_codel_queue *fq;
+    uint32_t hash;
+
+    hash = jhash_3words((uint32_t)pci->src_addr, (uint32_t)pci->dst_addr,
+                        ((uint32_t)pci->src_cep << 16) ^ pci->dst_cep ^
+                            ((uint32_t)pci->qos_id << 8),
+                        0);
+    fq = tab->queues + reciprocal_scale(hash, sched_priv->flows);
+
+    if (fq->qlen > sched_priv->max_queue_size) {
+        return -1;
+    }
+
+    RL_BUF_RMT(rb).enq_time = ktime_get_ns();
+    rb_list_enq(rb, &fq->q);
+    fq->qlen += rl_buf_truesize(rb);
+
+    if (list_empty(&fq->node)) {
+        /* The queue becomes active. */
+        list_add_tail(&fq->node, &tab->new_flows);
+        fq->deficit = sched_priv->quantum;
+    }
+
+    return 0;
+}
+
+/* Pop the head of a CoDel queue and tell whether the sojourn time has
+ * been above the target for at least an interval. */
+static struct rl_buf *
+codel_dodeq(struct rl_sched_fq_codel *sched_priv, struct rl_fq_codel_queue *fq,
+            u64 now, bool *ok_to_drop)
+{
+    struct rl_codel_vars *cv = &fq->cv;
+    struct rl_buf *rb;
+
+    *ok_to_drop = false;
+    if (rb_list_empty(&fq->q)) {
+        cv->first_above_time = 0;
+        return NULL;
+    }
+
+    rb = rb_list_front(&fq->q);
+    rb_list_del(rb);
+    fq->qlen -= rl_buf_truesize(rb);
+    BUG_ON(fq->qlen < 0);
+
+    if (now - RL_BUF_RMT(rb).enq_time < sched_priv->target ||
+        fq->qlen <= sched_priv->quantum) {
+        /* Went below the target (or the queue is almost empty), stay
+         * below it for at least an interval. */
+        cv->first_above_time = 0;
+    } else if (cv->first_above_time == 0) {
+        /* Just went above the target, start the interval. */
+        cv->first_above_time = now + sched_priv->interval;
+    } else if (now >= cv->first_above_time) {
+        *ok_to_drop = true;
+    }
+
+    return rb;
+}
+
+/* CoDel control law: the time between two marks/drops decreases with
+ * the square root of their number. */
+static inline u64
+codel_control_law(struct rl_sched_fq_codel *sched_priv, u64 t,
+                  unsigned int count)
+{
+    return t + div_u64(sched_priv->interval, int_sqrt(count));
+}
+
+/* Signal congestion on a PDU. Data transfer PDUs are marked if ECN is
+ * enabled, and true is returned. Otherwise the PDU is dropped and
+ * false is returned. */
+static bool
+codel_signal(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_ipcp_stats __percpu *stats = sched->ipcp->stats;
+
+    if (sched_priv->ecn && RL_BUF_PCI(rb)->pdu_type == PDU_T_DT) {
+        rina_pci_set_ecn(RL_BUF_PCI(rb));
+        this_cpu_inc(stats->rmt.ecn_mark);
+        return true;
+    }
+
+    rl_buf_free(rb);
+    this_cpu_inc(stats->rmt.queue_drop);
+
+    return false;
+}
+
+/* CoDel dequeue from a flow queue (RFC 8289). */
+static struct rl_buf *
+codel_deq(struct rl_sched *sched, struct rl_fq_codel_queue *fq)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_codel_vars *cv             = &fq->cv;
+    u64 now                              = ktime_get_ns();
+    struct rl_buf *rb;
+    bool ok_to_drop;
+
+    rb = codel_dodeq(sched_priv, fq, now, &ok_to_drop);
+    if (!rb) {
+        cv->dropping = false;
+        return NULL;
+    }
+
+    if (cv->dropping) {
+        if (!ok_to_drop) {
+            /* Sojourn time below target, leave the dropping state. */
+            cv->dropping = false;
+        }
+        while (cv->dropping && now >= cv->drop_next) {
+            cv->count++;
+            cv->drop_next = codel_control_law(sched_priv, cv->drop_next,
+                                              cv->count);
+            if (codel_signal(sched, rb)) {
+                return rb;
+            }
+            rb = codel_dodeq(sched_priv, fq, now, &ok_to_drop);
+            if (!rb || !ok_to_drop) {
+                cv->dropping = false;
+            }
+        }
+    } else if (ok_to_drop) {
+        unsigned int delta = cv->count - cv->lastcount;
+
+        cv->dropping = true;
+        /* If we were recently in the dropping state, start from the
+         * drop rate that controlled the queue the last time. */
+        if (delta > 1 && now - cv->drop_next < 16 * sched_priv->interval) {
+            cv->count = delta;
+        } else {
+            cv->count = 1;
+        }
+        cv->lastcount = cv->count;
+        cv->drop_next = codel_control_law(sched_priv, now, cv->count);
+        if (!codel_signal(sched, rb)) {
+            rb = codel_dodeq(sched_priv, fq, now, &ok_to_drop);
+        }
+    }
+
+    return rb;
+}
+
+static struct rl_buf *
+sched_fq_codel_deq(struct rl_sched *sched)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_fq_codel_tab *tab          = sched_priv->tab;
+
+    for (;;) {
+        struct list_head *head = &tab->new_flows;
+        struct rl_fq_codel_queue *fq;
+        struct rl_buf *rb;
+
+        if (list_empty(head)) {
+            head = &tab->old_flows;
+            if (list_empty(head)) {
+                return NULL;
+            }
+        }
+
+        fq = list_first_entry(head, struct rl_fq_codel_queue, node);
+        if (fq->deficit <= 0) {
+            /* Out of credit, move to the end of the old flows. */
+            fq->deficit += sched_priv->quantum;
+            list_move_tail(&fq->node, &tab->old_flows);
+            continue;
+        }
+
+        rb = codel_deq(sched, fq);
+        if (!rb) {
+            /* The queue is empty. A new flow goes through the old
+             * flows once, to prevent starvation of the old ones. */
+            if (head == &tab->new_flows && !list_empty(&tab->old_flows)) {
+                list_move_tail(&fq->node, &tab->old_flows);
+            } else {
+                list_del_init(&fq->node);
+            }
+            continue;
+        }
+
+        fq->deficit -= rb->len;
+
+        return rb;
+    }
+}
+
+static struct rl_sched_ops rl_sched_fq_codel_ops = {
+    .name      = "fq-codel",
+    .priv_size = sizeof(struct rl_sched_fq_codel),
+    .init      = sched_fq_codel_init,
+    .fini      = sched_fq_codel_fini,
+    .config    = sched_fq_codel_config,
+    .clone     = sched_fq_codel_clone,
+    .enq       = sched_fq_codel_enq,
+    .deq       = sched_fq_codel_deq,
+};
+
+/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
+ * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
+ * compiler may need to insert padding. */
+#define RL_PCI_LEN                                                             \
+    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
+     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+
+#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+
+/* Maximum and minimum values for the congestion control window. */
+#define RL_CGWIN_MIN 4
+#define RL_CGWIN_MAX (1U << 16)
+
+/*
+ * Congestion control algorithms for the DTCP sender.
+ */
+
+static LIST_HEAD(rl_cc_algos);
+
+static inline void
+cgwin_set(struct dtp *dtp, unsigned long cgwin)
+{
+    dtp->cgwin = clamp_t(unsigned long, cgwin, RL_CGWIN_MIN, RL_CGWIN_MAX);
+}
+
+/* Reno-like: slow start up to ssthresh, then additive increase by one
+ * PDU per window; multiplicative decrease on congestion. */
+struct rl_cc_reno {
+    unsigned int ssthresh;
+    /* PDUs acked since the last increment (congestion avoidance). */
+    unsigned int acked_cnt;
+};
+
+static void
+cc_reno_init(struct dtp *dtp)
+{
+    struct rl_cc_reno *r = RL_CC_PRIV(dtp);
+
+    r->ssthresh  = RL_CGWIN_MAX;
+    r->acked_cnt = 0;
+}
+
+static void
+cc_reno_on_ack(struct dtp *dtp, unsigned int acked, u64 rtt_ns)
+{
+    struct rl_cc_reno *r = RL_CC_PRIV(dtp);
+
+    if (dtp->cgwin < r->ssthresh) {
+        cgwin_set(dtp, dtp->cgwin + acked);
+        return;
+    }
+
+    r->acked_cnt += acked;
+    if (r->acked_cnt >= dtp->cgwin) {
+        r->acked_cnt -= dtp->cgwin;
+        cgwin_set(dtp, dtp->cgwin + 1);
+    }
+}
+
+static void
+cc_reno_on_congestion(struct dtp *dtp)
+{
+    struct rl_cc_reno *r = RL_CC_PRIV(dtp);
+
+    r->ssthresh  = max_t(unsigned int, dtp->cgwin >> 1, RL_CGWIN_MIN);
+    r->acked_cnt = 0;
+    cgwin_set(dtp, r->ssthresh);
+}
+
+static void
+cc_reno_on_rto(struct dtp *dtp)
+{
+    cc_reno_on_congestion(dtp);
+    cgwin_set(dtp, RL_CGWIN_MIN);
+}
+
+static struct rl_cc_ops rl_cc_reno_ops = {
+    .name          = "reno",
+    .type          = RLITE_CC_T_RENO,
+    .init          = cc_reno_init,
+    .on_ack        = cc_reno_on_ack,
+    .on_congestion = cc_reno_on_congestion,
+    .on_rto        = cc_reno_on_rto,
+};
+
+/* CUBIC (RFC 8312): after a congestion event the window follows
+ *     W(t) = C * (t - K)^3 + W_max
+ * where t is the time since the event, so that the growth is
+ * independent of the RTT and fast far from W_max. The RTT samples
+ * (ktime based) are used to track the minimum RTT, and to leave slow
+ * start as soon as the queueing delay grows (HyStart-like), rather
+ * than waiting for a loss. */
+#define RL_CUBIC_BETA 717 /* 0.7 * 1024 */
+#define RL_CUBIC_HYSTART_LOW_WINDOW 16
+#define RL_CUBIC_HYSTART_SAMPLES 8
+#define RL_CUBIC_HYSTART_DELAY_MIN (4 * NSEC_PER_MSEC)
+#define RL_CUBIC_HYSTART_DELAY_MAX (16 * NSEC_PER_MSEC)
+
+struct rl_cc_cubic {
+    unsigned int ssthresh;
+    /* Window before the last congestion event. */
+    unsigned int w_max;
+    /* Plateau of the cubic function and time (in ms) to reach it. */
+    unsigned int origin;
+    unsigned int k_ms;
+    /* PDUs acked since the last increment. */
+    unsigned int acked_cnt;
+    /* Reno-friendly window estimate, and its PDU counter. */
+    unsigned int w_est;
+    unsigned int est_cnt;
+    /* Consecutive slow start RTT samples with increased delay. */
+    unsigned int delay_cnt;
+    /* Start of the current congestion avoidance epoch (ns), or 0. */
+    u64 epoch_start;
+    /* Minimum RTT observed (ns), or 0. */
+    u64 min_rtt;
+};
+
+/* Integer cube root (bitwise). */
+static unsigned int
+cubic_root(u64 a)
+{
+    u64 r = 0;
+    int s;
+
+    for (s = 63; s >= 0; s -= 3) {
+        u64 b;
+
+        r <<= 1;
+        b = 3 * r * (r + 1) + 1;
+        if ((a >> s) >= b) {
+            a -= b << s;
+            r++;
+        }
+    }
+
+    return r;
+}
+
+static void
+cc_cubic_init(struct dtp *dtp)
+{
+    struct rl_cc_cubic *c = RL_CC_PRIV(dtp);
+
+    memset(c, 0, sizeof(*c));
+    c->ssthresh = RL_CGWIN_MAX;
+}
+
+static void
+cc_cubic_on_ack(struct dtp *dtp, unsigned int acked, u64 rtt_ns)
+{
+    struct rl_cc_cubic *c = RL_CC_PRIV(dtp);
+    unsigned int cgwin    = dtp->cgwin;
+    unsigned long target;
+    unsigned int cnt;
+    u64 t_ms, d, delta;
+
+    if (rtt_ns && (!c->min_rtt || rtt_ns < c->min_rtt)) {
+        c->min_rtt = rtt_ns;
+    }
+
+    if (cgwin < c->ssthresh) {
+        if (rtt_ns && cgwin >= RL_CUBIC_HYSTART_LOW_WINDOW) {
+            u64 thresh = clamp_t(u64, c->min_rtt >> 3,
+                                 RL_CUBIC_HYSTART_DELAY_MIN,
+                                 RL_CUBIC_HYSTART_DELAY_MAX);
+
+            if (rtt_ns > c->min_rtt + thresh) {
+                if (++c->delay_cnt >= RL_CUBIC_HYSTART_SAMPLES) {
+                    /* Queues are building up, stop the exponential
+                     * growth. */
+                    c->ssthresh = cgwin;
+                }
+            } else {
+                c->delay_cnt = 0;
+            }
+        }
+        cgwin_set(dtp, cgwin + acked);
+        return;
+    }
+
+    if (!c->epoch_start) {
+        c->epoch_start = ktime_get_ns();
+        c->acked_cnt   = 0;
+        c->est_cnt     = 0;
+        c->w_est       = cgwin;
+        if (c->w_max > cgwin) {
+            /* K = cbrt((W_max - W) / C), with C = 0.4 and K in ms. */
+            c->k_ms   = cubic_root((u64)(c->w_max - cgwin) * 2500000000ULL);
+            c->origin = c->w_max;
+        } else {
+            c->k_ms   = 0;
+            c->origin = cgwin;
+        }
+    }
+
+    /* Target window one RTT in the future. */
+    t_ms = div_u64(ktime_get_ns() - c->epoch_start + c->min_rtt,
+                   NSEC_PER_MSEC);
+    d     = t_ms > c->k_ms ? t_ms - c->k_ms : c->k_ms - t_ms;
+    d     = min_t(u64, d, 100000);
+    delta = div_u64(4 * d * d * d, 10000000000ULL); /* C * d^3 */
+    if (t_ms > c->k_ms) {
+        target = c->origin + delta;
+    } else {
+        target = c->origin > delta ? c->origin - delta : 0;
+    }
+    /* Do not grow by more than 50% per RTT. */
+    target = min_t(unsigned long, target, cgwin + (cgwin >> 1));
+
+    if (target > cgwin) {
+        cnt = cgwin / (target - cgwin);
+    } else {
+        cnt = 100 * cgwin;
+    }
+
+    /* Never be slower than Reno with the same beta, which grows by
+     * 3 * (1 - beta) / (1 + beta) PDUs per window. */
+    c->est_cnt += acked;
+    while (c->est_cnt >= (cgwin * 17) / 9) {
+        c->est_cnt -= (cgwin * 17) / 9;
+        c->w_est++;
+    }
+    if (c->w_est > cgwin) {
+        cnt = min(cnt, cgwin / (c->w_est - cgwin));
+    }
+
+    if (!cnt) {
+        cnt = 1;
+    }
+    c->acked_cnt += acked;
+    if (c->acked_cnt >= cnt) {
+        cgwin_set(dtp, cgwin + c->acked_cnt / cnt);
+        c->acked_cnt %= cnt;
+    }
+}
+
+static void
+cc_cubic_on_congestion(struct dtp *dtp)
+{
+    struct rl_cc_cubic *c = RL_CC_PRIV(dtp);
+    unsigned int cgwin    = dtp->cgwin;
+
+    c->epoch_start = 0;
+    c->delay_cnt   = 0;
+    /* Fast convergence: release bandwidth to the new flows. */
+    if (cgwin < c->w_max) {
+        c->w_max = (cgwin * (1024 + RL_CUBIC_BETA)) >> 11;
+    } else {
+        c->w_max = cgwin;
+    }
+    c->ssthresh =
+        max_t(unsigned int, (cgwin * RL_CUBIC_BETA) >> 10, RL_CGWIN_MIN);
+    cgwin_set(dtp, c->ssthresh);
+}
+
+static void
+cc_cubic_on_rto(struct dtp *dtp)
+{
+    cc_cubic_on_congestion(dtp);
+    cgwin_set(dtp, RL_CGWIN_MIN);
+}
+
+static struct rl_cc_ops rl_cc_cubic_ops = {
+    .name          = "cubic",
+    .type          = RLITE_CC_T_CUBIC,
+    .init          = cc_cubic_init,
+    .on_ack        = cc_cubic_on_ack,
+    .on_congestion = cc_cubic_on_congestion,
+    .on_rto        = cc_cubic_on_rto,
+};
+
+/* Return the congestion control algorithm of type 'type', falling back
+ * to the default one (CUBIC). */
+static const struct rl_cc_ops *
+rl_cc_get(uint8_t type)
+{
+    struct rl_cc_ops *cur;
+
+    list_for_each_entry (cur, &rl_cc_algos, node) {
+        if (cur->type == type) {
+            return cur;
+        }
+    }
+
+    if (type != RLITE_CC_T_DEFAULT) {
+        PI("Unknown congestion control type %u, using %s\n", type,
+           rl_cc_cubic_ops.name);
+    }
+
+    return &rl_cc_cubic_ops;
+}
+
+/* To be called under DTP lock */
+static void
+dtp_snd_reset(struct flow_entry *flow)
+{
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct dtp *dtp        = &flow->dtp;
+
+    dtp->flags |= DTP_F_DRF_SET;
+    /* InitialSeqNumPolicy */
+    dtp->next_seq_num_to_use = 0;
+    dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
+    dtp->last_seq_num_sent      = -1;
+    dtp->last_ctrl_seq_num_rcvd = 0;
+    dtp->rtx_recover_seq        = 0;
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
+        dtp->cgwin = RL_CGWIN_MIN;
+    }
+    dtp->cc->init(dtp);
+}
+
+/* To be called under DTP lock */
+static void
+dtp_rcv_reset(struct flow_entry *flow)
+{
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct dtp *dtp        = &flow->dtp;
+
+    dtp->flags |= DTP_F_DRF_EXPECTED;
+    dtp->rcv_lwe = dtp->rcv_next_seq_num = dtp->rcv_rwe = 0;
+    dtp->max_seq_num_rcvd                               = -1;
+#if 0
+    /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
+    dtp->next_snd_ctl_seq = 0;
+#endif
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
+    }
+    dtp->last_lwe_sent      = 0;
+    dtp->last_seq_num_acked = 0;
+}
+
+static void
+snd_inact_tmr_cb(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = (struct flow_entry *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats __percpu *stats = flow->txrx.ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
+    struct rl_buf *rb, *tmp;
+
+    spin_lock_bh(&dtp->lock);
+
+    del_timer(&dtp->rtx_tmr);
+
+    dtp_dump(dtp);
+
+    /* Re-initialize send-side state variables. */
+    dtp_snd_reset(flow);
+
+    /* Flush the retransmission queue (and its heap). */
+    PD("dropping %u PDUs from rtxq\n", dtp->rtxq_len);
+    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        dtp->rtxq_len--;
+    }
+
+    /* Flush the closed window queue */
+    PD("dropping %u PDUs from cwq\n", dtp->cwq_len);
+    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        this_cpu_inc(stats->tx_err);
+        dtp->cwq_len--;
+    }
+
+    /* Flush the pacer queue. */
+    PD("dropping %u PDUs from the pacer queue\n", dtp->pacer.qlen);
+    rb_list_foreach_safe (rb, tmp, &dtp->pacer.q) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        this_cpu_inc(stats->tx_err);
+        dtp->pacer.qlen--;
+    }
+
+    /* Send control ack PDU */
+
+    /* Send transfer PDU with zero length. */
+
+    /* Notify user flow that there has been no activity for a while */
+
+    spin_unlock_bh(&dtp->lock);
+
+    /* Wake up processes sleeping on write(), since cwq and rtxq have been
+     * emptied. */
+    rl_write_restart_flow(flow);
+}
+
+static void
+rcv_inact_tmr_cb(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = (struct flow_entry *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats __percpu *stats = flow->txrx.ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
+
+    spin_lock_bh(&dtp->lock);
+
+    /* Re-initialize receive-side state variables. */
+    dtp_rcv_reset(flow);
+
+    /* Flush sequencing queue. */
+    PD("dropping %u PDUs from seqq\n", dtp->seqq_len);
+    this_cpu_add(stats->rx_err, dtp_seqq_flush(dtp));
+
+    spin_unlock_bh(&dtp->lock);
+}
+
+static int rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags);
+
+static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
+                                       struct flow_entry *flow,
+                                       bool ack_immediate);
+
+static void
+a_tmr_cb(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.a_tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = (struct flow_entry *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct ipcp_entry *ipcp = flow->txrx.ipcp;
+    struct dtp *dtp         = &flow->dtp;
+    struct rl_buf *crb;
+
+    RPV(1, "A tmr callback\n");
+
+    spin_lock_bh(&dtp->lock);
     crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
     spin_unlock_bh(&dtp->lock);
 
@@ -652,6 +1818,146 @@ rtt_to_rtx(struct flow_entry *flow)
     return x > (two_a) ? x : (two_a);
 }
 
+/*
+ * The PDUs in the rtxq list are sorted by sequence number, which makes
+ * ACK processing cheap. The same PDUs are also indexed by retransmission
+ * time through a binary min-heap (dtp->rtx_heap), so that the rtx timer
+ * only needs to look at the PDUs that actually expired, and the cost of
+ * a timer fire does not grow with the window size. All the functions
+ * below are called under the DTP lock.
+ */
+#define RL_RTX_HEAP_INIT_CAP 64
+
+static inline bool
+rtx_heap_before(struct rl_buf *a, struct rl_buf *b)
+{
+    return time_before(RL_BUF_RTX(a).rtx_jiffies, RL_BUF_RTX(b).rtx_jiffies);
+}
+
+static inline void
+rtx_heap_set(struct dtp *dtp, unsigned int i, struct rl_buf *rb)
+{
+    dtp->rtx_heap[i]       = rb;
+    RL_BUF_RTX(rb).heap_idx = i;
+}
+
+static void
+rtx_heap_sift_up(struct dtp *dtp, unsigned int i)
+{
+    struct rl_buf *rb = dtp->rtx_heap[i];
+
+    while (i > 0) {
+        unsigned int parent = (i - 1) >> 1;
+
+        if (!rtx_heap_before(rb, dtp->rtx_heap[parent])) {
+            break;
+        }
+        rtx_heap_set(dtp, i, dtp->rtx_heap[parent]);
+        i = parent;
+    }
+    rtx_heap_set(dtp, i, rb);
+}
+
+static void
+rtx_heap_sift_down(struct dtp *dtp, unsigned int i)
+{
+    struct rl_buf *rb = dtp->rtx_heap[i];
+    unsigned int n    = dtp->rtxq_len;
+
+    for (;;) {
+        unsigned int child = (i << 1) + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            rtx_heap_before(dtp->rtx_heap[child + 1], dtp->rtx_heap[child])) {
+            child++;
+        }
+        if (!rtx_heap_before(dtp->rtx_heap[child], rb)) {
+            break;
+        }
+        rtx_heap_set(dtp, i, dtp->rtx_heap[child]);
+        i = child;
+    }
+    rtx_heap_set(dtp, i, rb);
+}
+
+/* Make room for one more entry in the heap. */
+static int
+rtx_heap_reserve(struct dtp *dtp)
+{
+    struct rl_buf **heap;
+    unsigned int cap;
+
+    if (likely(dtp->rtxq_len < dtp->rtx_heap_cap)) {
+        return 0;
+    }
+
+    cap  = dtp->rtx_heap_cap ? dtp->rtx_heap_cap << 1 : RL_RTX_HEAP_INIT_CAP;
+    heap = rl_alloc(cap * sizeof(*heap), GFP_ATOMIC, RL_MT_MISC);
+    if (unlikely(!heap)) {
+        return -ENOMEM;
+    }
+    if (dtp->rtx_heap) {
+        memcpy(heap, dtp->rtx_heap, dtp->rtxq_len * sizeof(*heap));
+        rl_free(dtp->rtx_heap, RL_MT_MISC);
+    }
+    dtp->rtx_heap     = heap;
+    dtp->rtx_heap_cap = cap;
+
+    return 0;
+}
+
+/* Insert a PDU into the heap. The caller must have called
+ * rtx_heap_reserve() and must increment rtxq_len. */
+static inline void
+rtx_heap_insert(struct dtp *dtp, struct rl_buf *rb)
+{
+    rtx_heap_set(dtp, dtp->rtxq_len, rb);
+    dtp->rtxq_len++;
+    rtx_heap_sift_up(dtp, dtp->rtxq_len - 1);
+}
+
+/* Remove a PDU from the heap, decrementing rtxq_len. */
+static void
+rtx_heap_remove(struct dtp *dtp, struct rl_buf *rb)
+{
+    unsigned int i = RL_BUF_RTX(rb).heap_idx;
+    struct rl_buf *last;
+
+    dtp->rtxq_len--;
+    last = dtp->rtx_heap[dtp->rtxq_len];
+    if (last != rb) {
+        rtx_heap_set(dtp, i, last);
+        rtx_heap_sift_down(dtp, i);
+        rtx_heap_sift_up(dtp, RL_BUF_RTX(last).heap_idx);
+    }
+}
+
+/* Reposition a PDU in the heap after its rtx_jiffies changed. */
+static inline void
+rtx_heap_update(struct dtp *dtp, struct rl_buf *rb)
+{
+    rtx_heap_sift_down(dtp, RL_BUF_RTX(rb).heap_idx);
+    rtx_heap_sift_up(dtp, RL_BUF_RTX(rb).heap_idx);
+}
+
+/* Arm the rtx timer for the PDU that is going to expire first, or stop
+ * it if the rtxq is empty. */
+static inline void
+rtx_tmr_update(struct dtp *dtp)
+{
+    if (dtp->rtxq_len) {
+        NPD("Forward rtx timer by %u\n",
+            jiffies_to_msecs(RL_BUF_RTX(dtp->rtx_heap[0]).rtx_jiffies -
+                             jiffies));
+        mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(dtp->rtx_heap[0]).rtx_jiffies);
+    } else {
+        del_timer(&dtp->rtx_tmr);
+    }
+}
+
 static void
 rtx_tmr_cb(
 #ifdef RL_HAVE_TIMER_SETUP
@@ -666,12 +1972,10 @@ rtx_tmr_cb(
 #else  /* !RL_HAVE_TIMER_SETUP */
     struct flow_entry *flow = (struct flow_entry *)arg;
 #endif /* !RL_HAVE_TIMER_SETUP */
-    struct ipcp_entry *ipcp     = flow->txrx.ipcp;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
+    struct ipcp_entry *ipcp              = flow->txrx.ipcp;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
     struct rl_buf *rb, *crb, *tmp;
-    long unsigned next_exp = ~0U;
-    bool next_exp_set      = false;
     struct rb_list rrbq;
 
     rb_list_init(&rrbq);
@@ -683,46 +1987,52 @@ rtx_tmr_cb(
      * retransmissions. */
     del_timer(&dtp->snd_inact_tmr);
 
-    /* We scan all the elements in the retransmission list, since they are
-     * sorted by ascending sequence number, and not by ascending expiration
-     * time. */
-    rb_list_foreach (rb, &dtp->rtxq) {
-        if (!time_before(jiffies, RL_BUF_RTX(rb).rtx_jiffies)) {
-            /* This rb should be retransmitted. We also invalidate
-             * RL_BUF_RTX(rb).jiffies, so that RTT is not updated on
-             * retransmitted packets. */
-            RL_BUF_RTX(rb).rtx_jiffies += rtt_to_rtx(flow);
-            RL_BUF_RTX(rb).jiffies = 0;
-
-            crb = rl_buf_clone(rb, GFP_ATOMIC);
-            if (unlikely(!crb)) {
-                RPV(1, "Out of memory\n");
-            } else {
-                rb_list_enq(crb, &rrbq);
-                stats->rtx_pkt++;
-                stats->rtx_byte += rb->len;
-            }
+    /* Pop the expired PDUs from the top of the heap. Each of them is
+     * rescheduled in the future, so that the loop terminates. Only
+     * the expired PDUs are cloned. */
+    while (dtp->rtxq_len) {
+        rb = dtp->rtx_heap[0];
+        if (time_before(jiffies, RL_BUF_RTX(rb).rtx_jiffies)) {
+            break;
         }
-        if (!next_exp_set ||
-            time_before(RL_BUF_RTX(rb).rtx_jiffies, next_exp)) {
-            next_exp     = RL_BUF_RTX(rb).rtx_jiffies;
-            next_exp_set = true;
+
+        /* This rb should be retransmitted. We also invalidate
+         * RL_BUF_RTX(rb).tx_time, so that RTT is not updated on
+         * retransmitted packets. */
+        RL_BUF_RTX(rb).rtx_jiffies = jiffies + rtt_to_rtx(flow);
+        RL_BUF_RTX(rb).tx_time     = 0;
+        rtx_heap_sift_down(dtp, 0);
+
+        if (RL_BUF_RTX(rb).sacked) {
+            /* A whole rtx timeout has passed since the last SACK for
+             * this PDU, and it is still not covered by the cumulative
+             * ACK. The receiver may have discarded it (e.g. on a seqq
+             * flush), so drop the mark: unless it is SACKed again, it
+             * will be retransmitted at the next timeout. */
+            RL_BUF_RTX(rb).sacked = false;
+            continue;
         }
-    }
 
-    if (!rb_list_empty(&rrbq)) {
-        /* Halve the congestion window on retransmission. */
-        dtp->cgwin >>= 1;
-        if (unlikely(dtp->cgwin < RL_CGWIN_MIN)) {
-            dtp->cgwin = RL_CGWIN_MIN;
+        crb = rl_buf_clone(rb, GFP_ATOMIC);
+        if (unlikely(!crb)) {
+            RPV(1, "Out of memory\n");
+        } else {
+            rb_list_enq(crb, &rrbq);
+            this_cpu_inc(stats->rtx_pkt);
+            this_cpu_add(stats->rtx_byte, rb->len);
         }
     }
 
-    if (next_exp_set) {
-        NPD("Forward rtx timer by %u\n", jiffies_to_msecs(next_exp - jiffies));
-        mod_timer(&dtp->rtx_tmr, next_exp);
+    if (!rb_list_empty(&rrbq)) {
+        /* Let the congestion control react to the timeout. The fast
+         * retransmissions of this window do not count as a further
+         * congestion event. */
+        dtp->rtx_recover_seq = dtp->next_seq_num_to_use;
+        dtp->cc->on_rto(dtp);
     }
 
+    rtx_tmr_update(dtp);
+
     spin_unlock_bh(&dtp->lock);
 
     /* Send PDUs popped out from RTX queue. */
@@ -742,7 +2052,108 @@ rtx_tmr_cb(
 static int rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
                                      bool maysleep);
 
-#define TKBK_INTVAL_MSEC 2
+/* Maximum burst that a paced sender can accumulate while idle or
+ * while waiting for the pacer timer, so that the timer and scheduling
+ * latencies do not reduce the achieved rate. */
+#define RL_PACER_BURST_NS (200 * NSEC_PER_USEC)
+
+/* Maximum number of PDUs in the pacer queue of a flow. */
+#define RL_PACER_QLEN_MAX 64
+
+static enum hrtimer_restart
+pacer_tmr_cb(struct hrtimer *tmr)
+{
+    struct flow_entry *flow =
+        container_of(tmr, struct flow_entry, dtp.pacer.timer);
+
+    /* Transmission cannot happen in hard interrupt context. */
+    schedule_work(&flow->dtp.pacer.work);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Start the pacer timer, if not already pending, to release the queued
+ * PDUs and wake up the writers when the next PDU can be released. */
+static inline void
+pacer_arm(struct dtp *dtp)
+{
+    if (!hrtimer_is_queued(&dtp->pacer.timer)) {
+        hrtimer_start(&dtp->pacer.timer, ns_to_ktime(dtp->pacer.next_ns),
+                      HRTIMER_MODE_ABS);
+    }
+}
+
+/* Charge the release of a PDU of 'len' bytes at time 'now' to the pacing
+ * budget of 'flow', without letting an idle sender accumulate more than
+ * RL_PACER_BURST_NS of budget. Pacing is enabled only by a configured
+ * bandwidth. Called under the DTP lock. */
+static inline void
+pacer_charge(struct flow_entry *flow, unsigned len, u64 now)
+{
+    struct dtp *dtp = &flow->dtp;
+    u64 delay;
+
+    if (!flow->cfg.dtcp.bandwidth) {
+        return;
+    }
+
+    delay = (u64)len * 8 * NSEC_PER_SEC;
+    delay = div64_u64(delay, flow->cfg.dtcp.bandwidth);
+    if (dtp->pacer.next_ns + RL_PACER_BURST_NS < now) {
+        dtp->pacer.next_ns = now - RL_PACER_BURST_NS;
+    }
+    dtp->pacer.next_ns += delay;
+}
+
+/* Release the PDUs in the pacer queue whose time has come, and wake up
+ * the writers once the queue is empty. */
+static void
+pacer_worker(struct work_struct *w)
+{
+    struct flow_entry *flow =
+        container_of(w, struct flow_entry, dtp.pacer.work);
+    struct ipcp_entry *ipcp              = flow->txrx.ipcp;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
+    u64 now                              = ktime_get_ns();
+    struct rl_buf *rb, *tmp;
+    struct rb_list txq;
+    bool drained;
+
+    rb_list_init(&txq);
+
+    spin_lock_bh(&dtp->lock);
+    while (dtp->pacer.qlen && now >= dtp->pacer.next_ns) {
+        rb = rb_list_front(&dtp->pacer.q);
+        rb_list_del(rb);
+        dtp->pacer.qlen--;
+        pacer_charge(flow, rb->len, now);
+        rb_list_enq(rb, &txq);
+    }
+    drained = !dtp->pacer.qlen;
+    if (!drained) {
+        pacer_arm(dtp);
+    }
+    spin_unlock_bh(&dtp->lock);
+
+    /* The PDUs have already been sequenced, so they cannot be given
+     * back to anybody. */
+    rb_list_foreach_safe (rb, tmp, &txq) {
+        unsigned len = rb->len;
+
+        rb_list_del(rb);
+        if (unlikely(rmt_tx(ipcp, rb, RL_RMT_F_CONSUME))) {
+            this_cpu_inc(stats->tx_err);
+        } else {
+            this_cpu_inc(stats->tx_pkt);
+            this_cpu_add(stats->tx_byte, len);
+        }
+    }
+
+    if (drained) {
+        rl_write_restart_flow(flow);
+    }
+}
 
 static int
 rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
@@ -752,6 +2163,7 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     unsigned long mpl      = 0;
     unsigned long r;
 
+    dtp->cc = rl_cc_get(dc->rtx.cc_type);
     dtp_snd_reset(flow);
     dtp_rcv_reset(flow);
 
@@ -801,6 +2213,14 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     setup_timer(&dtp->rtx_tmr, rtx_tmr_cb, (unsigned long)flow);
     setup_timer(&dtp->a_tmr, a_tmr_cb, (unsigned long)flow);
 #endif /* !RL_HAVE_TIMER_SETUP */
+#ifdef RL_HAVE_HRTIMER_SETUP
+    hrtimer_setup(&dtp->pacer.timer, pacer_tmr_cb, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+    hrtimer_init(&dtp->pacer.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dtp->pacer.timer.function = pacer_tmr_cb;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
+    INIT_WORK(&dtp->pacer.work, pacer_worker);
     dtp->flags |= DTP_F_TIMERS_INITIALIZED;
 
     dtp->rtt        = msecs_to_jiffies(flow->cfg.dtcp.rtx.initial_rtx_timeout);
@@ -814,73 +2234,18 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
         flow->sdu_rx_consumed = rl_normal_sdu_rx_consumed;
     }
 
-    if (flow->cfg.dtcp.bandwidth) {
-        uint64_t bs;
-
-        /* With the following definitions:
-         *      R := requested bandwidth in bps
-         *      M := token bucket timer period in milliseconds
-         *      B := refill amount in bytes for each timer period
-         * the following holds
-         *      B = R * M / 8000
-         * If the bandwidth is large enough, we can choose M = TKBK_INTVAL_MSEC
-         * and will be B >= 250. If B is not large enough, we choose a larger
-         * M, in such a way that B is still 250.
-         */
-        if (flow->cfg.dtcp.bandwidth < 4000) {
-            /* We don't accept to provide less than 4 Kbps, so that intval_ms
-             * can be always <= 500 milliseconds. */
-            flow->cfg.dtcp.bandwidth = 4000;
-        }
-        if (flow->cfg.dtcp.bandwidth < (2000000 / TKBK_INTVAL_MSEC)) {
-            dtp->tkbk.intval_ms = (2000000) / flow->cfg.dtcp.bandwidth;
-        } else {
-            dtp->tkbk.intval_ms = TKBK_INTVAL_MSEC;
-        }
-        bs = flow->cfg.dtcp.bandwidth * dtp->tkbk.intval_ms;
-        do_div(bs, 8000);
-        dtp->tkbk.bucket_size   = (unsigned long)bs;
-        dtp->tkbk.t_last_refill = ktime_get();
-    }
-
     return 0;
 }
 
 /* Internet checksum computation is endianness independent, so it can be
  * performed in host order. The caller is expected to store the result in
- * host order. */
-static uint32_t
+ * host order. The arch-optimized csum_partial() does the heavy lifting,
+ * and its 32 bit partial sum is folded into 16 bits. */
+static inline uint32_t
 inet_csum(const void *data, uint16_t len, uint32_t sum /* host endianness */)
 {
-    const uint8_t *addr = data;
-    uint32_t i;
-#if 0
-    char *sbuf = kmalloc(len * 2 + 10, GFP_ATOMIC);
-    for (i = 0; i < len; i++) {
-        sprintf(sbuf + 2 * i, "%02x", addr[i]);
-    }
-    printk("pkt: %s\n", sbuf);
-    kfree(sbuf);
-#endif
-
-    /* Checksum all the pairs of bytes first... */
-    for (i = 0; i < (len & ~1U); i += 2) {
-        sum += (u_int16_t)(*((u_int16_t *)(addr + i)));
-        if (sum > 0xFFFF)
-            sum -= 0xFFFF;
-    }
-    /*
-     * If there's a single byte left over, checksum it, too.
-     * Network byte order is big-endian, but we need to interpret
-     * it in host order.
-     */
-    if (i < len) {
-        sum += ntohs(addr[i] << 8);
-        if (sum > 0xFFFF)
-            sum -= 0xFFFF;
-    }
-
-    return sum;
+    return (uint16_t)~(__force uint16_t)csum_fold(
+        csum_partial(data, len, (__force __wsum)sum));
 }
 
 static inline uint16_t
@@ -890,6 +2255,36 @@ inet_wrapsum(uint32_t sum)
     return sum; /* host endianness */
 }
 
+/* The PCI checksum is a hop-by-hop check, and it is skipped on the
+ * N-1 flows whose transport already guarantees integrity. A NULL lower
+ * flow stands for self-delivery or for rl_sdu_rx_shortcut(), which is
+ * only used by shim-eth. */
+static inline bool
+rmt_csum_needed(struct rl_normal *priv, struct flow_entry *lower_flow)
+{
+    return priv->csum && lower_flow &&
+           !(lower_flow->txrx.ipcp->flags & RL_K_IPCP_INTEGRITY);
+}
+
+/* Look up the N-1 flow a PDU should be forwarded to. Returns NULL if the
+ * PDU is destined to this IPCP, or if there is no route. */
+static inline struct flow_entry *
+rmt_lower_flow(struct rl_normal *priv, const struct rina_pci *pci)
+{
+    struct rl_pci_match match;
+
+    match.dst_addr  = (rlm_addr_t)pci->dst_addr;
+    match.src_addr  = (rlm_addr_t)pci->src_addr;
+    match.dst_cepid = (rlm_cepid_t)pci->dst_cep;
+    match.src_cepid = (rlm_cepid_t)pci->src_cep;
+    match.qos_id    = (rlm_qosid_t)pci->qos_id;
+
+    /* For now we let rl_pduft_lookup() accept a rl_pci_match struct.
+     * In the future we may let this function accept RL_BUF_PCI(rb),
+     * so that we get rid of the format conversion. */
+    return rl_pduft_lookup(priv, &match);
+}
+
 static int
 rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
                 struct rl_buf *rb, unsigned flags)
@@ -901,6 +2296,13 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
 
     BUG_ON(!lower_ipcp);
 
+    if (rmt_csum_needed(ipcp->priv, lower_flow)) {
+        struct rina_pci *pci = RL_BUF_PCI(rb);
+
+        pci->pdu_csum = 0;
+        pci->pdu_csum = inet_wrapsum(inet_csum(pci, rb->len, 0));
+    }
+
     if (maysleep) {
         add_wait_queue(lower_flow->txrx.tx_wqh, &wait);
     }
@@ -929,8 +2331,8 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
             }
 
             if (flags & RL_RMT_F_CONSUME) {
-                struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-                stats->rmt.queue_drop++;
+                struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+                this_cpu_inc(stats->rmt.queue_drop);
                 rl_buf_free(rb);
                 rb = NULL;
                 /* The rb was managed somehow (dropped), so we must reset the
@@ -956,33 +2358,139 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
     return ret;
 }
 
+/* Batched version of rmt_tx_to_lower(), for PDUs that go through the same
+ * N-1 flow. PDUs are consumed from the head of 'rbs', and the number of
+ * PDUs consumed is returned. On error, the remaining PDUs are left in
+ * 'rbs'. The lower IPCP must support sdu_write_multi. */
+static int
+rmt_tx_to_lower_multi(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
+                      struct rb_list *rbs, unsigned flags)
+{
+    struct ipcp_entry *lower_ipcp = lower_flow->txrx.ipcp;
+    bool maysleep                 = flags & RL_RMT_F_MAYSLEEP;
+    DECLARE_WAITQUEUE(wait, current);
+    struct rl_buf *rb;
+    int n   = 0;
+    int ret = 0;
+
+    if (rmt_csum_needed(ipcp->priv, lower_flow)) {
+        rb_list_foreach (rb, rbs) {
+            struct rina_pci *pci = RL_BUF_PCI(rb);
+
+            pci->pdu_csum = 0;
+            pci->pdu_csum = inet_wrapsum(inet_csum(pci, rb->len, 0));
+        }
+    }
+
+    if (maysleep) {
+        add_wait_queue(lower_flow->txrx.tx_wqh, &wait);
+    }
+
+    while (!rb_list_empty(rbs)) {
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        ret = lower_ipcp->ops.sdu_write_multi(lower_ipcp, lower_flow, rbs,
+                                              flags & (~RL_RMT_F_CONSUME));
+        if (ret > 0) {
+            n += ret;
+            ret = 0;
+            continue;
+        }
+
+        if (ret != -EAGAIN) {
+            break;
+        }
+
+        /* Same logic as rmt_tx_to_lower(). */
+        if (maysleep) {
+            if (signal_pending(current)) {
+                ret = -EINTR; /* -ERESTARTSYS */
+                break;
+            }
+            schedule();
+            continue;
+        }
+
+        if (flags & RL_RMT_F_CONSUME) {
+            struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+            struct rl_buf *tmp;
+
+            rb_list_foreach_safe (rb, tmp, rbs) {
+                rb_list_del(rb);
+                rl_buf_free(rb);
+                this_cpu_inc(stats->rmt.queue_drop);
+                n++;
+            }
+            ret = 0;
+        }
+        break;
+    }
+
+    __set_current_state(TASK_RUNNING);
+    if (maysleep) {
+        remove_wait_queue(lower_flow->txrx.tx_wqh, &wait);
+    }
+
+    return n ? n : ret;
+}
+
+/* Dequeue the next PDU of an output port, giving precedence to the one
+ * refused by the lower IPCP. Called under the port qlock. */
+static inline struct rl_buf *
+sched_port_deq(struct rl_sched *sched)
+{
+    struct rl_buf *rb = sched->stash;
+
+    if (rb) {
+        sched->stash = NULL;
+        return rb;
+    }
+
+    return sched->ops.deq(sched);
+}
+
+/* Take a reference to the scheduler instance of an output port, if
+ * any. The reference must be released with sched_port_put(). */
+static inline struct rl_sched *
+sched_port_get(struct flow_entry *lower_flow)
+{
+    struct rl_sched *sched;
+
+    rcu_read_lock();
+    sched = READ_ONCE(lower_flow->upper.sched);
+    if (sched && !atomic_inc_not_zero(&sched->refcnt)) {
+        sched = NULL;
+    }
+    rcu_read_unlock();
+
+    return sched;
+}
+
+static inline void
+sched_port_put(struct rl_sched *sched)
+{
+    if (atomic_dec_and_test(&sched->refcnt)) {
+        complete(&sched->released);
+    }
+}
+
 static int
 rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 {
     struct rina_pci *pci = RL_BUF_PCI(rb);
     struct flow_entry *lower_flow;
-    struct rl_pci_match match;
     struct rl_normal *priv = ipcp->priv;
     struct rl_sched *sched;
     int ret = 0;
 
-    match.dst_addr  = (rlm_addr_t)pci->dst_addr;
-    match.src_addr  = (rlm_addr_t)pci->src_addr;
-    match.dst_cepid = (rlm_cepid_t)pci->dst_cep;
-    match.src_cepid = (rlm_cepid_t)pci->src_cep;
-    match.qos_id    = (rlm_qosid_t)pci->qos_id;
-
-    /* For now we let rl_pduft_lookup() accept a rl_pci_match struct.
-     * In the future we may let this function accept RL_BUF_PCI(rb),
-     * so that we get rid of the format conversion. */
-    lower_flow = rl_pduft_lookup(priv, &match);
-    if (unlikely(!lower_flow && match.dst_addr != ipcp->addr)) {
-        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    lower_flow = rmt_lower_flow(priv, pci);
+    if (unlikely(!lower_flow && pci->dst_addr != ipcp->addr)) {
+        struct rl_ipcp_stats __percpu *stats = ipcp->stats;
 
         RPD(1, "No route to IPCP %lu, dropping packet\n",
-            (long unsigned)match.dst_addr);
+            (long unsigned)pci->dst_addr);
         rl_buf_free(rb);
-        stats->rmt.noroute_drop++;
+        this_cpu_inc(stats->rmt.noroute_drop);
         /* Do not return -EHOSTUNREACH, this would break applications.
          * We assume the unreachability is temporary, and due to routing
          * rearrangements. */
@@ -991,7 +2499,7 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 
     if (!lower_flow) {
         /* This SDU gets loopbacked to this IPCP, since this is a
-         * self flow (match.dst_addr == ipcp->addr). */
+         * self flow (pci->dst_addr == ipcp->addr). */
         rb = ipcp->ops.sdu_rx(ipcp, rb, NULL /* unused */);
         BUG_ON(rb != NULL);
         return 0;
@@ -999,19 +2507,17 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 
     /* This SDU will be sent to a remote IPCP, using an N-1 flow. */
 
-    sched = priv->sched;
+    sched = sched_port_get(lower_flow);
     if (!sched) {
         /* Direct path, bypassing the PDU scheduler. */
         return rmt_tx_to_lower(ipcp, lower_flow, rb, flags);
 
     } else {
-        /* PDU scheduler path. */
-        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-        bool maysleep               = flags & RL_RMT_F_MAYSLEEP;
+        /* PDU scheduler path, using the instance of the output port. */
+        struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+        bool maysleep                        = flags & RL_RMT_F_MAYSLEEP;
         DECLARE_WAITQUEUE(wait, current);
 
-        RL_BUF_RMT(rb).lower_flow = lower_flow;
-
         if (!maysleep) {
             struct rl_buf *drb, *tmp;
             struct rb_list drbs;
@@ -1023,12 +2529,12 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
                 /* The queue backlog is becoming too large.
                  * Since we cannot sleep, we help the dequeuer to do its
                  * job, rather than dropping. */
-                struct rl_buf *drb = sched->ops.deq(sched);
+                struct rl_buf *drb = sched_port_deq(sched);
 
                 BUG_ON(!drb);
                 rb_list_enq(drb, &drbs);
             }
-            stats->rmt.queued_pkt++;
+            this_cpu_inc(stats->rmt.queued_pkt);
             spin_unlock_bh(&sched->qlock);
             rb = NULL;
 
@@ -1036,22 +2542,29 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
             flags |= RL_RMT_F_CONSUME;
             rb_list_foreach_safe (drb, tmp, &drbs) {
                 rb_list_del(drb);
-                lower_flow = RL_BUF_RMT(drb).lower_flow;
-                BUG_ON(!lower_flow);
                 rmt_tx_to_lower(ipcp, lower_flow, drb, flags);
             }
         } else {
             add_wait_queue(&sched->wqh, &wait);
             for (;;) {
+                bool dead;
                 int err;
 
                 set_current_state(TASK_INTERRUPTIBLE);
                 spin_lock_bh(&sched->qlock);
-                err = sched->ops.enq(sched, rb);
+                dead = sched->dead;
+                err  = dead ? -ENXIO : sched->ops.enq(sched, rb);
                 spin_unlock_bh(&sched->qlock);
                 if (err == 0) {
                     /* PDU enqueued to the scheduler. */
-                    stats->rmt.queued_pkt++;
+                    this_cpu_inc(stats->rmt.queued_pkt);
+                    break;
+                }
+
+                if (dead) {
+                    /* The output port is going away. */
+                    this_cpu_inc(stats->rmt.queue_drop);
+                    rl_buf_free(rb);
                     break;
                 }
 
@@ -1069,60 +2582,189 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
             remove_wait_queue(&sched->wqh, &wait);
         }
 
-        /* Kick the dequeuer, since we (most likely) enqueued a new PDU. */
-        schedule_work(&priv->sched_deq_work);
+        /* Kick the dequeuer of this port, since we (most likely) enqueued
+         * a new PDU. */
+        schedule_work(&sched->deq_work);
+        sched_port_put(sched);
     }
 
     return ret;
 }
 
+/* Maximum number of PDUs transmitted by a single run of the dequeue
+ * work, before yielding to other work items. */
+#define RL_SCHED_DEQ_BUDGET 64
+
+/* Dequeue work of an output port. It moves PDUs from the scheduler
+ * to the lower IPCP without ever sleeping: when the lower IPCP refuses
+ * a PDU, the PDU is stashed and the work stops; it is queued again by
+ * sched_port_tx_wake() as soon as the lower IPCP reports write space.
+ * A busy port does not hold back the other ports, which are served by
+ * their own work items, possibly on different CPUs. */
 static void
-sched_deq_worker(struct work_struct *w)
+sched_port_deq_worker(struct work_struct *w)
 {
-    struct rl_normal *priv = container_of(w, struct rl_normal, sched_deq_work);
-    struct rl_sched *sched = priv->sched;
-    struct rb_list ready;
+    struct rl_sched *sched = container_of(w, struct rl_sched, deq_work);
+    unsigned int budget    = RL_SCHED_DEQ_BUDGET;
+    struct rl_buf *rb;
 
-    if (unlikely(!sched)) {
-        return;
-    }
-
-    rb_list_init(&ready);
-
-    for (;;) {
-        struct rl_buf *rb, *tmp;
-        int i;
-
-        /* Dequeue a batch of PDUs. */
+    while (budget) {
         spin_lock_bh(&sched->qlock);
-        for (i = 0; i < 8; i++) {
-            rb = sched->ops.deq(sched);
-            if (!rb) {
-                break;
-            }
-            rb_list_enq(rb, &ready);
-        }
+        rb = sched_port_deq(sched);
         spin_unlock_bh(&sched->qlock);
-
-        if (rb_list_empty(&ready)) {
-            /* No more PDUs to dequeue, we can stop. */
+        if (!rb) {
             break;
         }
 
-        /* Transmit the PDUs out of the scheduler lock. */
-        rb_list_foreach_safe (rb, tmp, &ready) {
-            rb_list_del(rb);
-            BUG_ON(!RL_BUF_RMT(rb).lower_flow);
-            rmt_tx_to_lower(priv->ipcp, RL_BUF_RMT(rb).lower_flow, rb,
-                            RL_RMT_F_MAYSLEEP | RL_RMT_F_CONSUME);
+        if (rmt_tx_to_lower(sched->ipcp, sched->lower_flow, rb, 0) ==
+            -EAGAIN) {
+            spin_lock_bh(&sched->qlock);
+            BUG_ON(sched->stash);
+            sched->stash = rb;
+            spin_unlock_bh(&sched->qlock);
+            break;
         }
+        budget--;
+    }
+
+    if (budget < RL_SCHED_DEQ_BUDGET) {
+        /* Wake up processes that may be blocked waiting for more space on
+         * the scheduler queue. */
+        wake_up_interruptible_poll(&sched->wqh,
+                                   POLLOUT | POLLWRBAND | POLLWRNORM);
+    }
+
+    if (!budget) {
+        /* There may be more work to do. */
+        schedule_work(&sched->deq_work);
+    }
+}
+
+/* Invoked by rl_write_restart_flow() and rl_write_restart_flows() on
+ * the lower IPCP, possibly in softirq context and with the wait queue
+ * lock held, so the actual dequeue is deferred to the work. */
+static int
+sched_port_tx_wake(wait_queue_entry_t *wait, unsigned mode, int sync,
+                   void *key)
+{
+    struct rl_sched *sched = container_of(wait, struct rl_sched, tx_wait);
+
+    schedule_work(&sched->deq_work);
+
+    return 0;
+}
+
+static struct rl_sched *
+sched_alloc(struct rl_sched_ops *ops)
+{
+    struct rl_sched *sched;
+
+    sched = rl_alloc(sizeof(*sched) + ops->priv_size, GFP_KERNEL | __GFP_ZERO,
+                     RL_MT_SHIM);
+    if (!sched) {
+        return NULL;
+    }
+
+    sched->ops = *ops;
+    INIT_LIST_HEAD(&sched->ops.node);
+    spin_lock_init(&sched->qlock);
+    init_waitqueue_head(&sched->wqh);
+    INIT_LIST_HEAD(&sched->node);
+
+    return sched;
+}
+
+static void
+sched_free(struct rl_sched *sched)
+{
+    if (sched->stash) {
+        rl_buf_free(sched->stash);
+    }
+    if (sched->ops.fini) {
+        sched->ops.fini(sched);
+    }
+    rl_free(sched, RL_MT_SHIM);
+}
+
+/* Create the scheduler instance for the output port 'lower_flow', if
+ * a scheduler is installed and the port does not have one yet.
+ * Called under the sched_lock. */
+static int
+sched_port_create(struct rl_normal *priv, struct flow_entry *lower_flow)
+{
+    struct rl_sched *sched;
+
+    if (!priv->sched || lower_flow->upper.sched) {
+        return 0;
+    }
+
+    sched = sched_alloc(&priv->sched->ops);
+    if (!sched) {
+        return -ENOMEM;
+    }
+    if (sched->ops.clone(sched, priv->sched)) {
+        sched_free(sched);
+        return -ENOMEM;
+    }
 
-        if (true) {
-            /* Wake up processes that may be blocked waiting for more space on
-             * the scheduler queue. */
-            wake_up_interruptible_poll(&sched->wqh,
-                                       POLLOUT | POLLWRBAND | POLLWRNORM);
+    sched->ipcp       = priv->ipcp;
+    sched->lower_flow = lower_flow;
+    atomic_set(&sched->refcnt, 1); /* dropped by sched_port_destroy() */
+    init_completion(&sched->released);
+    INIT_WORK(&sched->deq_work, sched_port_deq_worker);
+    init_waitqueue_func_entry(&sched->tx_wait, sched_port_tx_wake);
+    add_wait_queue(lower_flow->txrx.tx_wqh, &sched->tx_wait);
+    list_add_tail(&sched->node, &priv->sched_ports);
+    WRITE_ONCE(lower_flow->upper.sched, sched);
+
+    return 0;
+}
+
+/* Destroy the scheduler instance of an output port, dropping the PDUs
+ * still queued. Concurrent rmt_tx() calls may still be using the
+ * instance, so we unpublish it, kick out the writers blocked on the
+ * queue, and wait for all the references to go away before freeing it.
+ * Called under the sched_lock, in process context. */
+static void
+sched_port_destroy(struct rl_sched *sched)
+{
+    WRITE_ONCE(sched->lower_flow->upper.sched, NULL);
+    remove_wait_queue(sched->lower_flow->txrx.tx_wqh, &sched->tx_wait);
+
+    spin_lock_bh(&sched->qlock);
+    sched->dead = true;
+    spin_unlock_bh(&sched->qlock);
+    wake_up_interruptible_all(&sched->wqh);
+
+    /* After the grace period no one can take new references. */
+    synchronize_rcu();
+    sched_port_put(sched);
+    wait_for_completion(&sched->released);
+
+    cancel_work_sync(&sched->deq_work);
+    list_del_init(&sched->node);
+    sched_free(sched);
+}
+
+/* Create the instances for all the output ports currently referenced by
+ * the PDUFT. Called under the sched_lock. */
+static void
+sched_ports_create_all(struct rl_normal *priv)
+{
+    struct flow_entry **flows;
+    unsigned int n = 0;
+    unsigned int i;
+
+    flows = rl_pduft_flows_get(priv, &n);
+    for (i = 0; i < n; i++) {
+        if (sched_port_create(priv, flows[i])) {
+            PW("Failed to create PDU scheduler for port %u\n",
+               flows[i]->local_port);
         }
+        flow_put(flows[i]);
+    }
+    if (flows) {
+        rl_free(flows, RL_MT_PDUFT);
     }
 }
 
@@ -1135,10 +2777,14 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
 {
     struct rl_sched_ops *ops = NULL;
     struct rl_sched *sched   = NULL;
-    struct rl_sched *old     = priv->sched;
+    struct rl_sched *old, *port, *tmp;
+
+    mutex_lock(&priv->sched_lock);
+    old = priv->sched;
 
     if (old && sched_name && !strcmp(old->ops.name, sched_name)) {
         /* Nothing to do. */
+        mutex_unlock(&priv->sched_lock);
         return 0;
     }
 
@@ -1146,6 +2792,7 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
         /* Do not allow scheduler changes if this IPCP is being
          * use by some flow. There is a race condition that
          * needs to be addressed, though. */
+        mutex_unlock(&priv->sched_lock);
         return -EBUSY;
     }
 
@@ -1160,60 +2807,109 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
         }
         if (ops == NULL) {
             /* Could not find a PDU scheduler named 'sched_name'. */
+            mutex_unlock(&priv->sched_lock);
             return -1;
         }
     }
 
     if (ops) {
-        sched = rl_alloc(sizeof(*sched) + ops->priv_size,
-                         GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+        sched = sched_alloc(ops);
         if (!sched) {
+            mutex_unlock(&priv->sched_lock);
             return -1;
         }
 
-        sched->ops = *ops;
-        INIT_LIST_HEAD(&sched->ops.node);
         if (sched->ops.init(sched)) {
             rl_free(sched, RL_MT_SHIM);
+            mutex_unlock(&priv->sched_lock);
             return -1;
         }
-
-        spin_lock_init(&sched->qlock);
-        init_waitqueue_head(&sched->wqh);
     }
 
+    /* Tear down the per-port instances of the old scheduler, and create
+     * the ones of the new scheduler. */
+    list_for_each_entry_safe (port, tmp, &priv->sched_ports, node) {
+        sched_port_destroy(port);
+    }
     priv->sched = sched;
+    if (sched) {
+        sched_ports_create_all(priv);
+    }
+
+    mutex_unlock(&priv->sched_lock);
 
     if (old) {
-        if (old->ops.fini) {
-            old->ops.fini(old);
-        }
-        rl_free(old, RL_MT_SHIM);
+        sched_free(old);
     }
 
     return 0;
 }
 
+static int
+rl_normal_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
+                    struct flow_entry *flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    int ret;
+
+    /* Make sure that the output port has its scheduler instance before
+     * the route makes it reachable by rmt_tx(). */
+    mutex_lock(&priv->sched_lock);
+    ret = sched_port_create(priv, flow);
+    mutex_unlock(&priv->sched_lock);
+    if (ret) {
+        return ret;
+    }
+
+    return rl_pduft_set(ipcp, match, flow);
+}
+
+/* Called when the N-1 flow is going away. */
+static int
+rl_normal_pduft_flush_by_flow(struct ipcp_entry *ipcp,
+                              const struct flow_entry *flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    int ret;
+
+    ret = rl_pduft_flush_by_flow(ipcp, flow);
+
+    mutex_lock(&priv->sched_lock);
+    if (flow->upper.sched) {
+        sched_port_destroy(flow->upper.sched);
+    }
+    mutex_unlock(&priv->sched_lock);
+
+    return ret;
+}
+
 /* Called under DTP lock */
 static int
 rl_rtxq_push(struct flow_entry *flow, struct rl_buf *rb)
 {
-    struct rl_buf *crb = rl_buf_clone(rb, GFP_ATOMIC);
-    struct dtp *dtp    = &flow->dtp;
+    struct dtp *dtp = &flow->dtp;
+    struct rl_buf *crb;
+
+    if (unlikely(rtx_heap_reserve(dtp))) {
+        RPV(1, "Out of memory\n");
+        return -ENOMEM;
+    }
 
+    crb = rl_buf_clone(rb, GFP_ATOMIC);
     if (unlikely(!crb)) {
         RPV(1, "Out of memory\n");
         return -ENOMEM;
     }
 
     /* Record the rtx expiration time and current time. */
-    RL_BUF_RTX(crb).jiffies     = jiffies;
-    RL_BUF_RTX(crb).rtx_jiffies = RL_BUF_RTX(crb).jiffies + rtt_to_rtx(flow);
+    RL_BUF_RTX(crb).tx_time     = ktime_get_ns();
+    RL_BUF_RTX(crb).rtx_jiffies = jiffies + rtt_to_rtx(flow);
+    RL_BUF_RTX(crb).sacked      = false;
 
     /* Add to the rtx queue and start the rtx timer if not already
      * started. */
     rb_list_enq(crb, &dtp->rtxq);
-    dtp->rtxq_len++;
+    rtx_heap_insert(dtp, crb);
     if (!timer_pending(&dtp->rtx_tmr)) {
         NPD("Forward rtx timer by %u\n",
             jiffies_to_msecs(RL_BUF_RTX(crb).rtx_jiffies - jiffies));
@@ -1238,54 +2934,39 @@ flow_blocked(struct rl_flow_config *cfg, struct dtp *dtp)
 static bool
 rl_normal_flow_writeable(struct flow_entry *flow)
 {
-    return !flow_blocked(&flow->cfg, &flow->dtp);
+    struct dtp *dtp = &flow->dtp;
+
+    /* A full pacer queue is drained by the pacer work, which wakes up
+     * the pollers. */
+    return !flow_blocked(&flow->cfg, dtp) &&
+           dtp->pacer.qlen < RL_PACER_QLEN_MAX;
 }
 
+/* Prepare a PDU for transmission on 'flow', under the DTP lock.
+ * Returns 0 if the PDU must be passed to rmt_tx() with the flags
+ * stored in '*flags', 1 if the PDU must be pushed into the cwq, 2 if
+ * the PDU must be pushed into the pacer queue (see pacer_enq()), or
+ * a negative error code. On error the caller still owns the PDU;
+ * -EAGAIN is the backpressure signal. */
 static int
-rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
-                    struct rl_buf *rb, unsigned flags)
+rl_normal_sdu_write_locked(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                           struct rl_buf *rb, unsigned *flags)
 {
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-    struct rl_normal *priv      = (struct rl_normal *)ipcp->priv;
-    struct dtp *dtp             = &flow->dtp;
-    struct dtcp_config *dc      = &flow->cfg.dtcp;
-    bool dtcp_present           = DTCP_PRESENT(flow->cfg.dtcp);
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct dtp *dtp        = &flow->dtp;
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    bool dtcp_present      = DTCP_PRESENT(flow->cfg.dtcp);
     struct rina_pci *pci;
+    bool paced = false;
+    u64 now    = 0;
     unsigned len;
-    int ret;
-
-    spin_lock_bh(&dtp->lock);
-
-    /* Token bucket traffic shaping. */
-    if (flow->cfg.dtcp.bandwidth) {
-        len = rb->len;
-        while (dtp->tkbk.bucket_size < len) {
-            ktime_t now;
-            unsigned long us;
-
-            if (!(flags & RL_RMT_F_MAYSLEEP)) {
-                spin_unlock_bh(&dtp->lock);
-                return -EAGAIN;
-            }
 
-            /* We are going to sleep, stop the inactivity timer
-             * (see below). */
-            del_timer(&dtp->snd_inact_tmr);
-
-            spin_unlock_bh(&dtp->lock);
-            msleep(dtp->tkbk.intval_ms);
-            spin_lock_bh(&dtp->lock);
-
-            now = ktime_get();
-            us  = ktime_to_us(ktime_sub(now, dtp->tkbk.t_last_refill));
-            if (dtp->tkbk.bucket_size < len &&
-                us >= dtp->tkbk.intval_ms * 1000) {
-                dtp->tkbk.bucket_size +=
-                    ((flow->cfg.dtcp.bandwidth / 8) * us) / 1000000;
-                dtp->tkbk.t_last_refill = now;
-            }
-        }
-        dtp->tkbk.bucket_size -= len;
+    if (unlikely(dtp->flags & DTP_F_TX_PENDING)) {
+        /* Another PDU is on its way to the RMT, and may still be given
+         * back (see rl_normal_sdu_write()). The writer is restarted when
+         * the RMT decides. */
+        dtp->flags |= DTP_F_TX_WAITERS;
+        return -EAGAIN;
     }
 
     if (unlikely(flow_blocked(&flow->cfg, dtp))) {
@@ -1295,19 +2976,30 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
          * started again when we will be invoked again. */
         del_timer(&dtp->snd_inact_tmr);
 
-        spin_unlock_bh(&dtp->lock);
-
         /* Backpressure. Don't drop the PDU, we will be
          * invoked again. */
         return -EAGAIN;
     }
 
+    if (dtp->pacer.next_ns) {
+        now = ktime_get_ns();
+        if (dtp->pacer.qlen || now < dtp->pacer.next_ns) {
+            /* Too early for the pacer, or PDUs already waiting for it.
+             * Writers that cannot sleep have the PDU queued, so that
+             * they do not have to retry. The others are woken up when
+             * the pacer queue is empty. */
+            if ((*flags & RL_RMT_F_MAYSLEEP) ||
+                dtp->pacer.qlen >= RL_PACER_QLEN_MAX) {
+                del_timer(&dtp->snd_inact_tmr);
+                pacer_arm(dtp);
+                return -EAGAIN;
+            }
+            paced = true;
+        }
+    }
+
     if (unlikely(rl_buf_pci_push(rb))) {
         PE("pci_push() failed\n");
-        spin_unlock_bh(&dtp->lock);
-        stats->tx_err++;
-        rl_buf_free(rb);
-
         return -ENOSPC;
     }
 
@@ -1329,8 +3021,8 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pci->pdu_flags |= PDU_F_DRF;
     }
 
-    if (priv->csum) {
-        pci->pdu_csum = inet_wrapsum(inet_csum(pci, len, 0));
+    if (flow->cfg.dtcp.bandwidth && !paced) {
+        pacer_charge(flow, len, now ? now : ktime_get_ns());
     }
 
     if (!dtcp_present) {
@@ -1343,14 +3035,12 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                 /* PDU not in the sender window, let's
                  * insert it into the Closed Window Queue.
                  * Because of the check above, we are sure
-                 * that dtp->cwq_len < dtp->max_cwq_len. */
-                rb_list_enq(rb, &dtp->cwq);
-                dtp->cwq_len++;
-                spin_unlock_bh(&dtp->lock);
+                 * that dtp->cwq_len < dtp->max_cwq_len. The caller
+                 * does the insertion, since the rb may still be linked
+                 * into a batch list. */
                 NPD("push [%lu] into cwq\n", (long unsigned)pci->seqnum);
-                rb = NULL; /* Ownership passed. */
 
-                return 0;
+                return 1;
             }
             /* PDU in the sender window. */
             /* POL: TxControl. */
@@ -1359,14 +3049,10 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                 (long unsigned)pci->seqnum);
         }
 
-        if (rb && (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL)) {
+        if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
             int ret = rl_rtxq_push(flow, rb);
 
             if (unlikely(ret)) {
-                spin_unlock_bh(&dtp->lock);
-                stats->tx_err++;
-                rl_buf_free(rb);
-
                 return ret;
             }
 
@@ -1379,23 +3065,261 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
              * that the receiver could not distinguish the duplicated data
              * because the second copy would come with a different sequence
              * number. */
-            flags |= RL_RMT_F_CONSUME;
+            *flags |= RL_RMT_F_CONSUME;
         }
 
         mod_timer(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
     }
 
+    return paced ? 2 : 0;
+}
+
+/* Push a PDU sequenced by rl_normal_sdu_write_locked() into the pacer
+ * queue, under the DTP lock. The pacer work will release it. */
+static inline void
+pacer_enq(struct dtp *dtp, struct rl_buf *rb)
+{
+    rb_list_enq(rb, &dtp->pacer.q);
+    dtp->pacer.qlen++;
+    pacer_arm(dtp);
+}
+
+/* Undo the transmission state set up by rl_normal_sdu_write_locked() for a
+ * PDU that rmt_tx() refused with -EAGAIN, so that the PDU can be written
+ * again later without leaving a hole in the sequence number space. No
+ * other PDU can have been sequenced in the meantime, because of
+ * DTP_F_TX_PENDING, although the sender state may have been reset by the
+ * inactivity timer. The RMT never refuses PDUs of flows with
+ * retransmission control (RL_RMT_F_CONSUME), so the rtxq is not involved.
+ * Called under the DTP lock. */
+static void
+rl_normal_sdu_unwrite(struct flow_entry *flow, struct rl_buf *rb,
+                      u64 pacer_next_ns)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+    struct dtp *dtp      = &flow->dtp;
+
+    if (dtp->next_seq_num_to_use == pci->seqnum + 1) {
+        dtp->next_seq_num_to_use = pci->seqnum;
+        if (dtp->last_seq_num_sent == pci->seqnum) {
+            dtp->last_seq_num_sent = pci->seqnum - 1;
+        }
+        if (pci->pdu_flags & PDU_F_DRF) {
+            dtp->flags |= DTP_F_DRF_SET;
+        }
+        /* The pacer queue is empty, otherwise the PDU would have been
+         * paced, so nobody else charged the pacer. */
+        dtp->pacer.next_ns = pacer_next_ns;
+    } /* else the PDU is just sequenced again from the reset state. */
+    /* As for the FlowControlOverrun case, the sender inactivity timer
+     * will be started again when we are invoked again. */
+    del_timer(&dtp->snd_inact_tmr);
+
+    rl_buf_pci_pop(rb);
+}
+
+static int
+rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                    struct rl_buf *rb, unsigned flags)
+{
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
+    bool refusable                       = false;
+    bool restart                         = false;
+    u64 pacer_next_ns;
+    unsigned len;
+    int ret;
+
+    spin_lock_bh(&dtp->lock);
+    pacer_next_ns = dtp->pacer.next_ns;
+    ret           = rl_normal_sdu_write_locked(ipcp, flow, rb, &flags);
+    if (ret == 0 && !(flags & (RL_RMT_F_MAYSLEEP | RL_RMT_F_CONSUME))) {
+        /* rmt_tx() may refuse the PDU. Don't sequence any other PDU until
+         * we know, so that the transmission can be undone. */
+        dtp->flags |= DTP_F_TX_PENDING;
+        refusable = true;
+    } else if (ret == 1) {
+        rb_list_enq(rb, &dtp->cwq);
+        dtp->cwq_len++;
+    } else if (ret == 2) {
+        pacer_enq(dtp, rb);
+    }
     spin_unlock_bh(&dtp->lock);
 
+    if (unlikely(ret)) {
+        if (ret > 0) {
+            return 0; /* Ownership passed. */
+        }
+        if (ret != -EAGAIN) {
+            this_cpu_inc(stats->tx_err);
+            rl_buf_free(rb);
+        }
+        return ret;
+    }
+
+    len = rb->len;
     ret = rmt_tx(ipcp, rb, flags);
-    if (likely(ret != -EAGAIN)) {
-        stats->tx_pkt++;
-        stats->tx_byte += len;
+
+    if (refusable) {
+        spin_lock_bh(&dtp->lock);
+        if (unlikely(ret == -EAGAIN)) {
+            rl_normal_sdu_unwrite(flow, rb, pacer_next_ns);
+        }
+        dtp->flags &= ~DTP_F_TX_PENDING;
+        if (dtp->flags & DTP_F_TX_WAITERS) {
+            dtp->flags &= ~DTP_F_TX_WAITERS;
+            restart = true;
+        }
+        spin_unlock_bh(&dtp->lock);
+
+        if (restart) {
+            rl_write_restart_flow(flow);
+        }
+        if (unlikely(ret == -EAGAIN)) {
+            return -EAGAIN; /* The caller still owns the SDU. */
+        }
     }
 
+    this_cpu_inc(stats->tx_pkt);
+    this_cpu_add(stats->tx_byte, len);
+
     return ret;
 }
 
+/* Batched version of rl_normal_sdu_write(), which takes the DTP lock only
+ * once for all the PDUs in 'rbs'. PDUs are consumed from the head of the
+ * list, in order, and the number of PDUs consumed is returned. On
+ * backpressure or error, the PDUs that were not consumed are left in
+ * 'rbs'. */
+static int
+rl_normal_sdu_write_multi(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                          struct rb_list *rbs, unsigned flags)
+{
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
+    unsigned txflags                     = flags;
+    struct rl_buf *rb, *tmp;
+    struct rb_list txq;
+    int n   = 0;
+    int ret = 0;
+
+    if (!(flags & RL_RMT_F_MAYSLEEP) &&
+        !(flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL)) {
+        /* rmt_tx() may refuse a PDU after it has been sequenced. Write
+         * one PDU at a time, so that the refused PDU can be given back
+         * to the caller before the following ones are sequenced. */
+        while (!rb_list_empty(rbs)) {
+            rb = rb_list_front(rbs);
+            rb_list_del(rb);
+            ret = rl_normal_sdu_write(ipcp, flow, rb, flags);
+            if (ret == -EAGAIN) {
+                rb_list_enq_head(rb, rbs);
+                break;
+            }
+            if (unlikely(ret < 0)) {
+                break; /* rb already released */
+            }
+            n++;
+        }
+
+        return n ? n : ret;
+    }
+
+    /* From here on rmt_tx() never refuses a PDU, since it either sleeps
+     * or consumes it. Every PDU that gets a sequence number is therefore
+     * consumed, in submission order. */
+    rb_list_init(&txq);
+
+    spin_lock_bh(&dtp->lock);
+    while (!rb_list_empty(rbs)) {
+        txflags = flags;
+        rb      = rb_list_front(rbs);
+        ret     = rl_normal_sdu_write_locked(ipcp, flow, rb, &txflags);
+        if (ret == -EAGAIN) {
+            break;
+        }
+        rb_list_del(rb);
+        if (unlikely(ret < 0)) {
+            this_cpu_inc(stats->tx_err);
+            rl_buf_free(rb);
+            break;
+        }
+        if (ret == 0) {
+            rb_list_enq(rb, &txq);
+        } else if (ret == 1) {
+            rb_list_enq(rb, &dtp->cwq);
+            dtp->cwq_len++;
+        } else {
+            pacer_enq(dtp, rb);
+        }
+        n++;
+        ret = 0;
+    }
+    spin_unlock_bh(&dtp->lock);
+
+    /* All the PDUs in 'txq' get the same flags, since these only depend on
+     * the flow configuration. */
+    while (!rb_list_empty(&txq)) {
+        struct flow_entry *lower_flow;
+        struct rb_list run;
+        unsigned len;
+        int err;
+
+        rb         = rb_list_front(&txq);
+        lower_flow = rmt_lower_flow(ipcp->priv, RL_BUF_PCI(rb));
+        if (!lower_flow || READ_ONCE(lower_flow->upper.sched) ||
+            !lower_flow->txrx.ipcp->ops.sdu_write_multi) {
+            /* Regular path, one PDU at a time. */
+            rb_list_del(rb);
+            len = rb->len;
+            err = rmt_tx(ipcp, rb, txflags);
+            if (unlikely(err == -EAGAIN)) {
+                /* Not expected, see above. */
+                this_cpu_inc(stats->rmt.queue_drop);
+                rl_buf_free(rb);
+            } else if (unlikely(err)) {
+                this_cpu_inc(stats->tx_err);
+            } else {
+                this_cpu_inc(stats->tx_pkt);
+                this_cpu_add(stats->tx_byte, len);
+            }
+            continue;
+        }
+
+        /* Pass the run of PDUs routed to the same N-1 flow to the lower
+         * IPCP in a single call, so that it can coalesce them (e.g., UDP
+         * GSO in shim-udp4). */
+        rb_list_init(&run);
+        len = 0;
+        rb_list_foreach_safe (rb, tmp, &txq) {
+            if (rb_list_empty(&run) ||
+                rmt_lower_flow(ipcp->priv, RL_BUF_PCI(rb)) == lower_flow) {
+                rb_list_del(rb);
+                rb_list_enq(rb, &run);
+                len += rb->len;
+                continue;
+            }
+            break;
+        }
+
+        err = rmt_tx_to_lower_multi(ipcp, lower_flow, &run, txflags);
+        if (err > 0) {
+            this_cpu_add(stats->tx_pkt, err);
+        }
+        rb_list_foreach_safe (rb, tmp, &run) {
+            /* Not transmitted (e.g. interrupted by a signal). The PDU
+             * has already been sequenced, so it counts as consumed. */
+            rb_list_del(rb);
+            len -= rb->len;
+            this_cpu_inc(stats->tx_err);
+            rl_buf_free(rb);
+        }
+        this_cpu_add(stats->tx_byte, len);
+    }
+
+    return n ? n : ret;
+}
+
 /* Get N-1 flow and N-1 IPCP where the mgmt PDU should be
  * written and prepare the mgmt SDU. This does not take ownership
  * of the PDU, since it's not a transmission routine. */
@@ -1462,7 +3386,9 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
     pci->pdu_csum  = 0;
     pci->seqnum    = 0; /* Not valid. */
 
-    if (priv->csum) {
+    /* Management PDUs are written directly to the lower flow, without
+     * going through rmt_tx_to_lower(). */
+    if (rmt_csum_needed(priv, *lower_flow)) {
         pci->pdu_csum = inet_wrapsum(inet_csum(pci, rb->len, 0));
     }
 
@@ -1530,7 +3456,9 @@ static int
 rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    int ret                = -ENOSYS;
+    struct rl_sched *port;
+    int ret = -ENOSYS;
+    size_t i;
 
     if (rl_ipcp_has_flows(ipcp, /*report_all=*/false)) {
         /* Do not allow scheduler changes if this IPCP is being
@@ -1539,8 +3467,11 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
         return -EBUSY;
     }
 
+    mutex_lock(&priv->sched_lock);
+
     if (!priv->sched) {
-        return -ENXIO;
+        ret = -ENXIO;
+        goto out;
     }
 
     /* Check that the configuration message matches the current
@@ -1548,16 +3479,36 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
     switch (bmsg->hdr.msg_type) {
     case RLITE_KER_IPCP_SCHED_WRR:
         if (strcmp(rl_sched_wrr_ops.name, priv->sched->ops.name)) {
-            return -ENXIO;
+            ret = -ENXIO;
+            goto out;
         }
         break;
     case RLITE_KER_IPCP_SCHED_PFIFO:
         if (strcmp(rl_sched_pfifo_ops.name, priv->sched->ops.name)) {
-            return -ENXIO;
+            ret = -ENXIO;
+            goto out;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_DRR:
+        if (strcmp(rl_sched_drr_ops.name, priv->sched->ops.name)) {
+            ret = -ENXIO;
+            goto out;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_PRIO_DRR:
+        if (strcmp(rl_sched_prio_drr_ops.name, priv->sched->ops.name)) {
+            ret = -ENXIO;
+            goto out;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_FQ_CODEL:
+        if (strcmp(rl_sched_fq_codel_ops.name, priv->sched->ops.name)) {
+            ret = -ENXIO;
+            goto out;
         }
         break;
     default:
-        return -ENOSYS;
+        goto out;
         break;
     }
 
@@ -1565,6 +3516,33 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
     if (priv->sched->ops.config) {
         ret = priv->sched->ops.config(priv->sched, bmsg);
     }
+    if (ret) {
+        goto out;
+    }
+
+    /* Propagate the new configuration to the output ports. The new
+     * queues are built aside and swapped in under the port lock; the
+     * PDUs queued in the old ones are dropped. */
+    list_for_each_entry (port, &priv->sched_ports, node) {
+        struct rl_sched *tmp = sched_alloc(&port->ops);
+
+        if (!tmp || tmp->ops.clone(tmp, priv->sched)) {
+            if (tmp) {
+                sched_free(tmp);
+            }
+            ret = -ENOMEM;
+            break;
+        }
+        spin_lock_bh(&port->qlock);
+        swap(tmp->stash, port->stash);
+        for (i = 0; i < port->ops.priv_size; i++) {
+            swap(tmp->priv[i], port->priv[i]);
+        }
+        spin_unlock_bh(&port->qlock);
+        sched_free(tmp);
+    }
+out:
+    mutex_unlock(&priv->sched_lock);
 
     return ret;
 }
@@ -1580,16 +3558,16 @@ rl_normal_qos_supported(struct ipcp_entry *ipcp, struct rina_flow_spec *spec)
 
 static struct rl_buf *
 ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
-               uint8_t pdu_type)
+               uint8_t pdu_type, const void *data, size_t data_len)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct rl_buf *rb =
-        rl_buf_alloc(sizeof(struct rina_pci_ctrl), ipcp->txhdroom,
+        rl_buf_alloc(sizeof(struct rina_pci_ctrl) + data_len, ipcp->txhdroom,
                      ipcp->tailroom, GFP_ATOMIC);
     struct rina_pci_ctrl *pcic;
 
     if (likely(rb)) {
-        rl_buf_append(rb, sizeof(struct rina_pci_ctrl));
+        rl_buf_append(rb, sizeof(struct rina_pci_ctrl) + data_len);
         pcic                         = (struct rina_pci_ctrl *)RL_BUF_DATA(rb);
         pcic->base.dst_addr          = flow->remote_addr;
         pcic->base.src_addr          = ipcp->addr;
@@ -1598,6 +3576,11 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->base.src_cep           = flow->local_cep;
         pcic->base.pdu_type          = pdu_type;
         pcic->base.pdu_flags         = 0;
+        if (flow->dtp.flags & DTP_F_ECN_ECHO) {
+            /* Echo the congestion mark to the sender. */
+            pcic->base.pdu_flags |= PDU_F_ECN;
+            flow->dtp.flags &= ~DTP_F_ECN_ECHO;
+        }
         pcic->base.pdu_len           = rb->len;
         pcic->base.pdu_ttl           = priv->ttl;
         pcic->base.pdu_csum          = 0;
@@ -1609,8 +3592,8 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->new_lwe = flow->dtp.last_lwe_sent = flow->dtp.rcv_lwe;
         pcic->my_rwe                            = flow->dtp.snd_rwe;
         pcic->my_lwe                            = flow->dtp.snd_lwe;
-        if (priv->csum) {
-            pcic->base.pdu_csum = inet_wrapsum(inet_csum(pcic, rb->len, 0));
+        if (data_len) {
+            memcpy(pcic + 1, data, data_len);
         }
     }
 
@@ -1631,6 +3614,10 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     bool ack                     = ack_immediate || !a;
     uint8_t pdu_type             = 0;
 
+    /* Congestion marks are echoed without delay, so that the sender
+     * can react before the queues overflow. */
+    ack |= !!(flow->dtp.flags & DTP_F_ECN_ECHO);
+
     /* We send a flow control ack if we have more than an half window of PDUs
      * that have been correctly consumed by the flow user but yet not published
      * to the sender, i.e.
@@ -1672,7 +3659,7 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
             (long unsigned)flow->dtp.last_lwe_sent + win_size);
         /* Stop the A timer, we are going to send a control PDU. */
         del_timer(&flow->dtp.a_tmr);
-        return ctrl_pdu_alloc(ipcp, flow, pdu_type);
+        return ctrl_pdu_alloc(ipcp, flow, pdu_type, NULL, 0);
     }
 
     /* We are not sending an immediate control PDU, so we need
@@ -1685,66 +3672,342 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return NULL;
 }
 
-#define SEQQ_MAX_LEN 64
+/*
+ * The sequencing queue is a ring of RL_SEQQ_SLOTS PDUs, where each PDU
+ * is stored in the slot indexed by the lower bits of its sequence number.
+ * Only PDUs less than RL_SEQQ_SLOTS ahead of rcv_next_seq_num can be
+ * queued, so that insertion is O(1) and in-order delivery only looks at
+ * the slots that follow rcv_next_seq_num, whatever the amount of
+ * reordering. A slot may contain a stale PDU left behind by a reset of
+ * the receiver state, which is detected by comparing the sequence numbers.
+ * All the functions below are called under the DTP lock.
+ */
+static inline struct rl_buf **
+seqq_slot(struct dtp *dtp, rlm_seq_t seqnum)
+{
+    return &dtp->seqq[seqnum & (RL_SEQQ_SLOTS - 1)];
+}
 
 /* Takes the ownership of the rb. */
 static void
 seqq_push(struct flow_entry *flow, struct rl_buf *rb)
 {
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    rl_seq_t seqnum             = RL_BUF_PCI(rb)->seqnum;
-    struct dtp *dtp             = &flow->dtp;
-    struct rb_list *pos         = &dtp->seqq;
-    struct rl_buf *cur;
+    struct rl_ipcp_stats __percpu *stats = flow->txrx.ipcp->stats;
+    rl_seq_t seqnum                      = RL_BUF_PCI(rb)->seqnum;
+    struct dtp *dtp                      = &flow->dtp;
+    struct rl_buf **slot;
 
-    if (unlikely(dtp->seqq_len >= SEQQ_MAX_LEN)) {
+    if (unlikely(seqnum - dtp->rcv_next_seq_num >= RL_SEQQ_SLOTS)) {
         RPD(1, "seqq overrun: dropping PDU [%lu]\n", (long unsigned)seqnum);
-        stats->rx_err++;
+        this_cpu_inc(stats->rx_err);
         rl_buf_free(rb);
         return;
     }
 
-    rb_list_foreach (cur, &dtp->seqq) {
-        struct rina_pci *pci = RL_BUF_PCI(cur);
+    if (unlikely(!dtp->seqq)) {
+        dtp->seqq = rl_alloc(RL_SEQQ_SLOTS * sizeof(dtp->seqq[0]),
+                             GFP_ATOMIC | __GFP_ZERO, RL_MT_MISC);
+        if (unlikely(!dtp->seqq)) {
+            RPV(1, "Out of memory\n");
+            this_cpu_inc(stats->rx_err);
+            rl_buf_free(rb);
+            return;
+        }
+    }
 
-        if (seqnum < pci->seqnum) {
-            pos = rl_buf_listnode(cur);
-            break;
-        } else if (seqnum == pci->seqnum) {
+    slot = seqq_slot(dtp, seqnum);
+    if (*slot) {
+        if (RL_BUF_PCI(*slot)->seqnum == seqnum) {
             /* This is a duplicate amongst the gaps, we can
              * drop it. */
-            stats->rx_err++;
+            this_cpu_inc(stats->rx_err);
             rl_buf_free(rb);
             RPD(1, "Duplicate amongst the gaps [%lu] dropped\n",
                 (long unsigned)seqnum);
 
             return;
         }
+        /* Stale PDU. */
+        rl_buf_free(*slot);
+        this_cpu_inc(stats->rx_err);
+        dtp->seqq_len--;
     }
 
-    /* Insert the rb right before 'pos'. */
-    rb_list_enq(rb, pos);
+    *slot = rb;
     dtp->seqq_len++;
-    stats->rx_pkt++;
-    stats->rx_byte += rb->len;
+    this_cpu_inc(stats->rx_pkt);
+    this_cpu_add(stats->rx_byte, rb->len);
     RPD(1, "[%lu] inserted\n", (long unsigned)seqnum);
 }
 
 static void
 seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
 {
-    struct rl_buf *qrb, *tmp;
+    rlm_seq_t seqnum;
 
     rb_list_init(qrbs);
-    rb_list_foreach_safe (qrb, tmp, &dtp->seqq) {
-        struct rina_pci *pci = RL_BUF_PCI(qrb);
 
-        if (pci->seqnum - dtp->rcv_next_seq_num <= max_sdu_gap) {
-            rb_list_del(qrb);
-            dtp->seqq_len--;
-            rb_list_enq(qrb, qrbs);
-            dtp->rcv_next_seq_num = pci->seqnum + 1;
-            RPD(1, "[%lu] popped out from seqq\n", (long unsigned)pci->seqnum);
+    /* Scan the slots that follow rcv_next_seq_num, as long as the
+     * distance from the last popped PDU does not exceed max_sdu_gap. */
+    for (seqnum = dtp->rcv_next_seq_num;
+         dtp->seqq_len && seqnum - dtp->rcv_next_seq_num <= max_sdu_gap &&
+         seqnum - dtp->rcv_next_seq_num < RL_SEQQ_SLOTS;
+         seqnum++) {
+        struct rl_buf **slot = seqq_slot(dtp, seqnum);
+        struct rl_buf *qrb   = *slot;
+
+        if (!qrb) {
+            continue;
+        }
+        *slot = NULL;
+        dtp->seqq_len--;
+        if (unlikely(RL_BUF_PCI(qrb)->seqnum != (rl_seq_t)seqnum)) {
+            rl_buf_free(qrb); /* stale */
+            continue;
+        }
+        rb_list_enq(qrb, qrbs);
+        dtp->rcv_next_seq_num = seqnum + 1;
+        RPD(1, "[%lu] popped out from seqq\n", (long unsigned)seqnum);
+    }
+}
+
+/* Build a SACK control PDU describing the first RL_SACK_BLOCKS_MAX
+ * contiguous runs of PDUs sitting in the seqq. The cumulative ACK is
+ * carried as usual by the ack_nack_seq_num field. Called under the DTP
+ * lock. */
+static struct rl_buf *
+sack_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow)
+{
+    struct rina_sack_block blocks[RL_SACK_BLOCKS_MAX];
+    const struct dtcp_config *dc = &flow->cfg.dtcp;
+    uint8_t pdu_type             = PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_SACK;
+    struct dtp *dtp              = &flow->dtp;
+    unsigned int found           = 0;
+    unsigned int n               = 0;
+    rlm_seq_t seqnum;
+
+    for (seqnum = dtp->rcv_next_seq_num;
+         found < dtp->seqq_len &&
+         seqnum - dtp->rcv_next_seq_num < RL_SEQQ_SLOTS;
+         seqnum++) {
+        struct rl_buf *qrb = *seqq_slot(dtp, seqnum);
+
+        if (!qrb || RL_BUF_PCI(qrb)->seqnum != (rl_seq_t)seqnum) {
+            continue;
+        }
+        found++;
+        if (n && blocks[n - 1].end == seqnum) {
+            blocks[n - 1].end++;
+            continue;
+        }
+        if (n == RL_SACK_BLOCKS_MAX) {
+            break;
+        }
+        blocks[n].start = seqnum;
+        blocks[n].end   = seqnum + 1;
+        n++;
+    }
+
+    if ((dc->flags & DTCP_CFG_FLOW_CTRL) &&
+        (dc->fc.fc_type == RLITE_FC_T_WIN)) {
+        pdu_type |= PDU_T_FC_BIT;
+    }
+
+    /* Stop the A timer, we are going to send a control PDU. */
+    del_timer(&dtp->a_tmr);
+
+    return ctrl_pdu_alloc(ipcp, flow, pdu_type, blocks, n * sizeof(blocks[0]));
+}
+
+/* Update the RTT estimate with an acked PDU, unless the PDU has been
+ * retransmitted. Returns the RTT sample in nanoseconds, or 0 if the
+ * PDU cannot be used. Called under the DTP lock. */
+static u64
+rtt_update(struct dtp *dtp, struct rl_buf *rb, u64 now)
+{
+    unsigned cur_rtt;
+    int cur_rttdev;
+    u64 sample;
+
+    if (!RL_BUF_RTX(rb).tx_time) {
+        return 0;
+    }
+
+    sample = now - RL_BUF_RTX(rb).tx_time;
+    if (!sample) {
+        sample = 1;
+    }
+
+    /* The rtx timeout is managed in jiffies. */
+    cur_rtt = nsecs_to_jiffies(sample);
+    if (!cur_rtt) {
+        cur_rtt = 1;
+    }
+    cur_rttdev = (int)cur_rtt - dtp->rtt;
+    if (cur_rttdev < 0) {
+        cur_rttdev = -cur_rttdev;
+    } else if (!cur_rttdev) {
+        cur_rttdev = 1;
+    }
+
+    /* RTT <== RTT * (112/128) + SAMPLE * (16/128)*/
+    dtp->rtt        = (dtp->rtt * 112 + (cur_rtt << 4)) >> 7;
+    dtp->rtt_stddev = (dtp->rtt_stddev * 3 + cur_rttdev) >> 2;
+    NPD(1, "RTT est %u msecs +/- %u msecs\n", jiffies_to_msecs(dtp->rtt),
+        jiffies_to_msecs(dtp->rtt_stddev));
+
+    return sample;
+}
+
+/* Remove from the rtxq all the PDUs with sequence number smaller than
+ * 'ack_seq' (cumulative ACK). Returns the number of PDUs removed, and
+ * updates '*rtt_ns' with the last RTT sample. Called under the DTP lock. */
+static unsigned int
+rtxq_ack(struct dtp *dtp, rl_seq_t ack_seq, u64 *rtt_ns)
+{
+    u64 now            = ktime_get_ns();
+    unsigned int acked = 0;
+    struct rl_buf *cur, *tmp;
+
+    rb_list_foreach_safe (cur, tmp, &dtp->rtxq) {
+        struct rina_pci *pci = RL_BUF_PCI(cur);
+        u64 sample;
+
+        if (pci->seqnum >= ack_seq) {
+            /* The rtxq is sorted by seqnum, so we can safely
+             * stop here. */
+            break;
+        }
+        NPD("Remove [%lu] from rtxq\n", (long unsigned)pci->seqnum);
+        rb_list_del(cur);
+        rtx_heap_remove(dtp, cur);
+        sample = rtt_update(dtp, cur, now);
+        if (sample) {
+            *rtt_ns = sample;
+        }
+        rl_buf_free(cur);
+        acked++;
+    }
+
+    return acked;
+}
+
+/* Clone a PDU of the rtxq into 'rrbq' for an immediate retransmission,
+ * and reschedule its rtx timeout. Called under the DTP lock. */
+static void
+rtxq_retransmit(struct flow_entry *flow, struct rl_buf *rb,
+                struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats __percpu *stats = flow->txrx.ipcp->stats;
+    struct dtp *dtp                      = &flow->dtp;
+    struct rl_buf *crb;
+
+    /* As in rtx_tmr_cb(), RTT is not updated on retransmitted PDUs. */
+    RL_BUF_RTX(rb).rtx_jiffies = jiffies + rtt_to_rtx(flow);
+    RL_BUF_RTX(rb).tx_time     = 0;
+    RL_BUF_RTX(rb).sacked      = false;
+    rtx_heap_update(dtp, rb);
+
+    crb = rl_buf_clone(rb, GFP_ATOMIC);
+    if (unlikely(!crb)) {
+        RPV(1, "Out of memory\n");
+        return;
+    }
+    rb_list_enq(crb, rrbq);
+    this_cpu_inc(stats->rtx_pkt);
+    this_cpu_add(stats->rtx_byte, rb->len);
+}
+
+static inline bool
+sack_blocks_contain(const struct rina_sack_block *blocks, unsigned int n,
+                    rl_seq_t seqnum)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (blocks[i].start <= seqnum && seqnum < blocks[i].end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Number of PDUs that must be SACKed beyond a hole before the PDUs in
+ * the hole are considered lost, to tolerate some reordering. */
+#define RL_SACK_REORDER_THRESH 3
+
+/* Process the blocks of a SACK. The SACKed PDUs are only marked, since
+ * the receiver may still discard them from its seqq: they are released
+ * when the cumulative ACK covers them, and in the meantime they are
+ * excluded from timeout and fast retransmission (see rtx_tmr_cb()).
+ * The holes followed by enough SACKed PDUs are considered lost and
+ * cloned into 'rrbq'. Each PDU is fast-retransmitted at most once: if
+ * the retransmission gets lost too, the rtx timer takes care of it.
+ * Returns the number of newly SACKed PDUs and updates '*rtt_ns' like
+ * rtxq_ack(). Called under the DTP lock. */
+static unsigned int
+rtxq_sack(struct flow_entry *flow, const struct rina_sack_block *blocks,
+          unsigned int n, struct rb_list *rrbq, u64 *rtt_ns)
+{
+    struct dtp *dtp    = &flow->dtp;
+    u64 now            = ktime_get_ns();
+    unsigned int acked = 0;
+    struct rl_buf *cur;
+    rl_seq_t high = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (blocks[i].end > high) {
+            high = blocks[i].end;
+        }
+    }
+
+    rb_list_foreach (cur, &dtp->rtxq) {
+        rl_seq_t seqnum = RL_BUF_PCI(cur)->seqnum;
+
+        if (seqnum >= high) {
+            break;
+        }
+
+        if (sack_blocks_contain(blocks, n, seqnum)) {
+            /* Postpone the reneging check of rtx_tmr_cb(). */
+            RL_BUF_RTX(cur).rtx_jiffies = jiffies + rtt_to_rtx(flow);
+            rtx_heap_update(dtp, cur);
+            if (!RL_BUF_RTX(cur).sacked) {
+                u64 sample;
+
+                NPD("Mark SACKed [%lu] in rtxq\n", (long unsigned)seqnum);
+                RL_BUF_RTX(cur).sacked = true;
+                sample                 = rtt_update(dtp, cur, now);
+                if (sample) {
+                    *rtt_ns = sample;
+                }
+                RL_BUF_RTX(cur).tx_time = 0;
+                acked++;
+            }
+        } else if (seqnum + RL_SACK_REORDER_THRESH < high &&
+                   !RL_BUF_RTX(cur).sacked && RL_BUF_RTX(cur).tx_time) {
+            RPD(1, "Fast retransmission of [%lu]\n", (long unsigned)seqnum);
+            rtxq_retransmit(flow, cur, rrbq);
+        }
+    }
+
+    return acked;
+}
+
+/* Retransmit the PDUs requested by a NACK or SNACK, regardless of their
+ * rtx timeout. Called under the DTP lock. */
+static void
+rtxq_nack(struct flow_entry *flow, const struct rina_sack_block *blocks,
+          unsigned int n, struct rb_list *rrbq)
+{
+    struct rl_buf *cur;
+
+    rb_list_foreach (cur, &flow->dtp.rtxq) {
+        if (sack_blocks_contain(blocks, n, RL_BUF_PCI(cur)->seqnum)) {
+            RPD(1, "NACK for [%lu]\n", (long unsigned)RL_BUF_PCI(cur)->seqnum);
+            rtxq_retransmit(flow, cur, rrbq);
         }
     }
 }
@@ -1752,20 +4015,21 @@ seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
 static int
 sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
 {
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-    struct rina_pci_ctrl *pcic  = RL_BUF_PCI_CTRL(rb);
-    struct dtp *dtp             = &flow->dtp;
-    struct rb_list qrbs;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct rina_pci_ctrl *pcic           = RL_BUF_PCI_CTRL(rb);
+    struct dtp *dtp                      = &flow->dtp;
+    struct rb_list qrbs, rrbq;
     struct rl_buf *qrb, *tmp;
 
     if (unlikely((pcic->base.pdu_type & PDU_T_CTRL) != PDU_T_CTRL)) {
         PE("Unknown PDU type %X\n", pcic->base.pdu_type);
         rl_buf_free(rb);
-        stats->rx_err++;
+        this_cpu_inc(stats->rx_err);
         return 0;
     }
 
     rb_list_init(&qrbs);
+    rb_list_init(&rrbq);
 
     spin_lock_bh(&dtp->lock);
 
@@ -1832,85 +4096,69 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
                     rl_rtxq_push(flow, qrb);
                 }
 
-                stats->tx_pkt++;
-                stats->tx_byte += qrb->len;
+                this_cpu_inc(stats->tx_pkt);
+                this_cpu_add(stats->tx_byte, qrb->len);
             }
         }
     }
 
     if (pcic->base.pdu_type & PDU_T_ACK_BIT) {
-        struct rl_buf *cur, *tmp;
-        unsigned now = jiffies;
-        unsigned cur_rtt;
-        int cur_rttdev;
+        const struct rina_sack_block *blocks =
+            (const struct rina_sack_block *)(pcic + 1);
+        struct rina_sack_block nack;
+        unsigned int nblocks = 0;
+
+        if ((pcic->base.pdu_type & PDU_T_ACK_MASK) != PDU_T_ACK &&
+            rb->len > sizeof(*pcic)) {
+            nblocks = (rb->len - sizeof(*pcic)) / sizeof(*blocks);
+            if (nblocks > RL_SACK_BLOCKS_MAX) {
+                nblocks = RL_SACK_BLOCKS_MAX;
+            }
+        }
 
         switch (pcic->base.pdu_type & PDU_T_ACK_MASK) {
         case PDU_T_ACK:
-            rb_list_foreach_safe (cur, tmp, &dtp->rtxq) {
-                struct rina_pci *pci = RL_BUF_PCI(cur);
-
-                if (pci->seqnum < pcic->ack_nack_seq_num) {
-                    NPD("Remove [%lu] from rtxq\n", (long unsigned)pci->seqnum);
-                    rb_list_del(cur);
-                    dtp->rtxq_len--;
-
-                    if (RL_BUF_RTX(cur).jiffies) {
-                        /* Update our RTT estimate. */
-                        cur_rtt = now - RL_BUF_RTX(cur).jiffies;
-                        if (!cur_rtt) {
-                            cur_rtt = 1;
-                        }
-                        cur_rttdev = (int)cur_rtt - dtp->rtt;
-                        if (cur_rttdev < 0) {
-                            cur_rttdev = -cur_rttdev;
-                        } else if (!cur_rttdev) {
-                            cur_rttdev = 1;
-                        }
-
-                        /* RTT <== RTT * (112/128) + SAMPLE * (16/128)*/
-                        dtp->rtt = (dtp->rtt * 112 + (cur_rtt << 4)) >> 7;
-                        dtp->rtt_stddev =
-                            (dtp->rtt_stddev * 3 + cur_rttdev) >> 2;
-                        NPD(1, "RTT est %u msecs +/- %u msecs\n",
-                            jiffies_to_msecs(dtp->rtt),
-                            jiffies_to_msecs(dtp->rtt_stddev));
-                    }
-
-                    rl_buf_free(cur);
-                } else {
-                    /* The rtxq is sorted by seqnum, so we can safely
-                     * stop here. Let's update the rtx timer
-                     * expiration time, if necessary. */
-                    NPD("Forward rtx timer by %u\n",
-                        jiffies_to_msecs(RL_BUF_RTX(cur).rtx_jiffies -
-                                         jiffies));
-                    mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(cur).rtx_jiffies);
-                    break;
-                }
-            }
-
-            if (rb_list_empty(&dtp->rtxq)) {
-                /* Everything has been acked, we can stop the rtx timer. */
-                del_timer(&dtp->rtx_tmr);
+        case PDU_T_SACK: {
+            /* The receiver echoes the congestion marks set by the
+             * PDU schedulers along the path. */
+            bool congested = pcic->base.pdu_flags & PDU_F_ECN;
+            unsigned int acked;
+            u64 rtt_ns = 0;
+
+            acked = rtxq_ack(dtp, pcic->ack_nack_seq_num, &rtt_ns);
+
+            if (nblocks) {
+                acked += rtxq_sack(flow, blocks, nblocks, &rrbq, &rtt_ns);
+                congested |= !rb_list_empty(&rrbq);
             }
 
-            /* Update the congestion control window size (up to a maximum).
-             * In case we never experienced retransmissions we double the
-             * size, otherwise we increment it linearly. */
-            if (dtp->cgwin < RL_CGWIN_MAX) {
-                if (stats->rtx_pkt) {
-                    dtp->cgwin++;
-                } else {
-                    dtp->cgwin <<= 1;
+            if (congested) {
+                if (pcic->ack_nack_seq_num >= dtp->rtx_recover_seq) {
+                    /* React to the first fast retransmission or
+                     * congestion mark of this window. */
+                    dtp->rtx_recover_seq = dtp->next_seq_num_to_use;
+                    dtp->cc->on_congestion(dtp);
                 }
+            } else if (acked) {
+                dtp->cc->on_ack(dtp, acked, rtt_ns);
             }
 
+            /* Update the rtx timer expiration time, or stop the timer if
+             * everything has been acked. */
+            rtx_tmr_update(dtp);
             break;
+        }
 
         case PDU_T_NACK:
-        case PDU_T_SACK:
+            nack.start = pcic->ack_nack_seq_num;
+            nack.end   = nack.start + 1;
+            rtxq_nack(flow, &nack, 1, &rrbq);
+            rtx_tmr_update(dtp);
+            break;
+
         case PDU_T_SNACK:
-            PI("Missing support for PDU type [%X]\n", pcic->base.pdu_type);
+            rtxq_nack(flow, blocks, nblocks, &rrbq);
+            rtx_tmr_update(dtp);
             break;
         }
     }
@@ -1920,6 +4168,14 @@ out:
 
     rl_buf_free(rb);
 
+    /* Send the PDUs to be retransmitted because of SACK or NACK, if any. */
+    rb_list_foreach_safe (qrb, tmp, &rrbq) {
+        RPD(1, "sending [%lu] from rtxq\n",
+            (long unsigned)RL_BUF_PCI(qrb)->seqnum);
+        rb_list_del(qrb);
+        rmt_tx(ipcp, qrb, RL_RMT_F_CONSUME);
+    }
+
     /* Send PDUs popped out from cwq, if any. Note that the qrbs list
      * is not emptied and must not be used after the scan.*/
     rb_list_foreach_safe (qrb, tmp, &qrbs) {
@@ -1928,8 +4184,8 @@ out:
         NPD("sending [%lu] from cwq\n", (long unsigned)RL_BUF_PCI(qrb)->seqnum);
         rb_list_del(qrb);
         rmt_tx(ipcp, qrb, RL_RMT_F_CONSUME);
-        stats->tx_pkt++;
-        stats->tx_byte += len;
+        this_cpu_inc(stats->tx_pkt);
+        this_cpu_add(stats->tx_byte, len);
     }
 
     /* This could be done conditionally. */
@@ -1942,9 +4198,9 @@ static struct rl_buf *
 rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
                  struct flow_entry *lower_flow)
 {
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
-    struct rl_normal *priv      = ipcp->priv;
-    struct rina_pci *pci        = RL_BUF_PCI(rb);
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct rl_normal *priv               = ipcp->priv;
+    struct rina_pci *pci                 = RL_BUF_PCI(rb);
     struct flow_entry *flow;
     rl_seq_t seqnum    = pci->seqnum;
     struct rl_buf *crb = NULL;
@@ -1964,15 +4220,15 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     if (unlikely(rb->len < sizeof(struct rina_pci))) {
         RPD(1, "Dropping PDU shorter [%zu] than PCI\n", rb->len);
         rl_buf_free(rb);
-        stats->rmt.other_drop++;
+        this_cpu_inc(stats->rmt.other_drop);
         return NULL; /* -EINVAL */
     }
 
-    if (priv->csum) {
+    if (rmt_csum_needed(priv, lower_flow)) {
         if (unlikely(inet_csum(pci, rb->len, 0) != 0xFFFF)) {
             RPD(1, "Dropping PDU on wrong checksum\n");
             rl_buf_free(rb);
-            stats->rmt.csum_drop++;
+            this_cpu_inc(stats->rmt.csum_drop);
             return NULL;
         }
     }
@@ -1995,7 +4251,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         if (!ipcp->mgmt_txrx) {
             PW("Missing mgmt_txrx\n");
             rl_buf_free(rb);
-            stats->rmt.other_drop++;
+            this_cpu_inc(stats->rmt.other_drop);
             return NULL; /* -EINVAL */
         }
         RL_BUF_RX(rb).cons_seqnum = pci->seqnum;
@@ -2040,25 +4296,15 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         /* Check TTL. */
         if (unlikely(pci->pdu_ttl-- == 0)) {
             RPD(1, "Dropping PDU on zero TTL\n");
-            stats->rmt.ttl_drop++;
+            this_cpu_inc(stats->rmt.ttl_drop);
             rl_buf_free(rb);
             return NULL; /* -EINVAL */
         }
-        /* Update the checksum incrementally. */
-        if (priv->csum) {
-            uint32_t sum = pci->pdu_csum;
-            /* We need to use ntohs() on the increment, as we are doing
-             * swapped order computations on little endian machines. */
-            sum += ntohs(0x0100);
-            if (sum > 0xFFFF) {
-                sum -= 0xFFFF;
-            }
-            pci->pdu_csum = (uint16_t)sum;
-        }
+        /* The checksum is recomputed in rmt_tx_to_lower(), if needed. */
 
         rmt_tx(ipcp, rb, RL_RMT_F_CONSUME);
-        stats->rmt.fwd_pkt++;
-        stats->rmt.fwd_byte += len;
+        this_cpu_inc(stats->rmt.fwd_pkt);
+        this_cpu_add(stats->rmt.fwd_byte, len);
 
         return NULL;
     }
@@ -2066,7 +4312,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     flow = flow_get_by_cep(ipcp->dm, pci->dst_cep);
     if (!flow) {
         RPD(1, "No flow for cep-id %u: dropping PDU\n", pci->dst_cep);
-        stats->rmt.noflow_drop++;
+        this_cpu_inc(stats->rmt.noflow_drop);
         rl_buf_free(rb);
         return NULL;
     }
@@ -2094,6 +4340,11 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
     }
 
+    if (unlikely(pci->pdu_flags & PDU_F_ECN)) {
+        /* Congestion experienced along the path. */
+        dtp->flags |= DTP_F_ECN_ECHO;
+    }
+
     if (unlikely((dtp->flags & DTP_F_DRF_EXPECTED) ||
                  (pci->pdu_flags & PDU_F_DRF))) {
         /* If we expect DRF being set (new PDU run) we pretend it's there
@@ -2104,6 +4355,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         dtp->flags &= ~DTP_F_DRF_EXPECTED;
 
         /* Flush reassembly queue */
+        this_cpu_add(stats->rx_err, dtp_seqq_flush(dtp));
 
         /* Init receiver state. The rcv_rwe is not initialized here, but the
          * first time sdu_rx_sv_update is called. */
@@ -2113,8 +4365,8 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
 
         crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
 
-        stats->rx_pkt++;
-        stats->rx_byte += rb->len;
+        this_cpu_inc(stats->rx_pkt);
+        this_cpu_add(stats->rx_byte, rb->len);
 
         if (pci->pdu_flags & PDU_F_DRF) {
             /* If the DRF is set, we know the sender has reset its state,
@@ -2147,14 +4399,15 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
          * if the flow configuration does not require it. */
         RPD(1, "Dropping duplicate PDU [seq=%lu]\n", (long unsigned)seqnum);
         rl_buf_free(rb);
-        stats->rx_err++;
+        this_cpu_inc(stats->rx_err);
 
         if ((flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) &&
             dtp->rcv_next_seq_num >= dtp->last_lwe_sent) {
             /* Send ACK control PDU. */
             crb = ctrl_pdu_alloc(
                 ipcp, flow,
-                PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK | PDU_T_FC_BIT);
+                PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK | PDU_T_FC_BIT, NULL,
+                0);
         }
 
         spin_unlock_bh(&dtp->lock);
@@ -2210,7 +4463,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     deliver = !drop && (gap <= flow->cfg.max_sdu_gap);
 
     if (deliver) {
-        struct rb_list qrbs;
+        struct rb_list qrbs, burst;
         struct rl_buf *qrb, *tmp;
 
         /* Update rcv_next_seq_num only if this PDU is going to be
@@ -2230,23 +4483,29 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
         spin_unlock_bh(&dtp->lock);
 
-        stats->rx_pkt++;
-        stats->rx_byte += rb->len;
+        this_cpu_inc(stats->rx_pkt);
+        this_cpu_add(stats->rx_byte, rb->len);
 
         RL_BUF_RX(rb).cons_seqnum = seqnum;
         rl_buf_pci_pop(rb);
 
-        ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        if (rb_list_empty(&qrbs)) {
+            ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+            goto snd_crb;
+        }
 
-        /* Also deliver PDUs just extracted from the seqq. Note
-         * that we must use the safe version of list scanning, since
-         * rl_sdu_rx_flow() will modify qrb->node. */
+        /* Also deliver the PDUs just extracted from the seqq, together
+         * with this one as a single in-order burst. Note that we must
+         * use the safe version of list scanning, since we move qrb. */
+        rb_list_init(&burst);
+        rb_list_enq(rb, &burst);
         rb_list_foreach_safe (qrb, tmp, &qrbs) {
             rb_list_del(qrb);
-            RL_BUF_RX(qrb).cons_seqnum = seqnum;
+            RL_BUF_RX(qrb).cons_seqnum = RL_BUF_PCI(qrb)->seqnum;
             rl_buf_pci_pop(qrb);
-            ret |= rl_sdu_rx_flow(ipcp, flow, qrb, qlimit);
+            rb_list_enq(qrb, &burst);
         }
+        ret = rl_sdu_rx_flow_multi(ipcp, flow, &burst, qlimit);
 
         goto snd_crb;
     }
@@ -2257,13 +4516,18 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         rl_buf_free(rb);
         rb  = NULL;
         crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
-        stats->rx_err++;
+        this_cpu_inc(stats->rx_err);
 
     } else {
         /* What is not dropped nor delivered goes in the sequencing queue.
-         * Don't ack here, we have to wait for the gap to be filled. */
+         * The cumulative ACK cannot move until the gap is filled, but
+         * with RTX control we tell the sender which PDUs are waiting in
+         * the seqq, so that it can retransmit only the missing ones. */
         seqq_push(flow, rb);
         rb = NULL;
+        if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
+            crb = sack_pdu_alloc(ipcp, flow);
+        }
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -2326,15 +4590,15 @@ rl_normal_create(struct ipcp_entry *ipcp)
     ipcp->max_sdu_size = (1 << 16) - 1 - ipcp->txhdroom;
 
     priv->ipcp = ipcp;
-    hash_init(priv->pdu_ft);
-    hash_init(priv->pdu_ft_perflow);
-    priv->perflow_present = false;
-    priv->pduft_dflt      = NULL;
-    rwlock_init(&priv->pduft_lock);
+    if (rl_pduft_init(priv)) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
     priv->ttl  = RL_TTL_DFLT;
     priv->csum = false;
 
-    INIT_WORK(&priv->sched_deq_work, sched_deq_worker);
+    INIT_LIST_HEAD(&priv->sched_ports);
+    mutex_init(&priv->sched_lock);
 
     PD("New IPC created [%p]\n", priv);
 
@@ -2346,10 +4610,9 @@ rl_normal_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    cancel_work_sync(&priv->sched_deq_work);
     rl_sched_replace(priv, NULL);
 
-    rl_pduft_flush(ipcp);
+    rl_pduft_fini(priv);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -2376,11 +4639,12 @@ static struct ipcp_factory normal_factory = {
     .ops.flow_allocate_resp  = NULL, /* Reflect to userspace. */
     .ops.flow_init           = rl_normal_flow_init,
     .ops.sdu_write           = rl_normal_sdu_write,
+    .ops.sdu_write_multi     = rl_normal_sdu_write_multi,
     .ops.config              = rl_normal_config,
     .ops.config_get          = rl_normal_config_get,
-    .ops.pduft_set           = rl_pduft_set,
+    .ops.pduft_set           = rl_normal_pduft_set,
     .ops.pduft_flush         = rl_pduft_flush,
-    .ops.pduft_flush_by_flow = rl_pduft_flush_by_flow,
+    .ops.pduft_flush_by_flow = rl_normal_pduft_flush_by_flow,
     .ops.pduft_del           = rl_pduft_del,
     .ops.pduft_del_addr      = rl_pduft_del_addr,
     .ops.mgmt_sdu_build      = rl_normal_mgmt_sdu_build,
@@ -2413,6 +4677,15 @@ rl_normal_init(void)
     /* Build the (static) list of PDU schedulers. */
     list_add_tail(&rl_sched_pfifo_ops.node, &rl_pdu_schedulers);
     list_add_tail(&rl_sched_wrr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_drr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_prio_drr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_fq_codel_ops.node, &rl_pdu_schedulers);
+
+    /* Build the (static) list of congestion control algorithms. */
+    BUILD_BUG_ON(sizeof(struct rl_cc_reno) > RL_CC_PRIV_SIZE);
+    BUILD_BUG_ON(sizeof(struct rl_cc_cubic) > RL_CC_PRIV_SIZE);
+    list_add_tail(&rl_cc_reno_ops.node, &rl_cc_algos);
+    list_add_tail(&rl_cc_cubic_ops.node, &rl_cc_algos);
 
     return rl_ipcp_factory_register(&normal_factory);
 }
@@ -32,6 +32,7 @@
 #include <linux/wait.h>
 #include <linux/hrtimer.h>
 #include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <linux/interrupt.h>
 #include <linux/timer.h>
 #include <linux/types.h>
@@ -42,6 +43,7 @@
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/hashtable.h>
+#include <linux/rhashtable.h>
 
 #include "kerconfig.h"
 
@@ -56,6 +58,10 @@
 #include <linux/socket.h> /* memcpy_{to,from}iovecend */
 #endif
 
+#ifndef RL_HAVE_WAIT_QUEUE_ENTRY
+typedef wait_queue_t wait_queue_entry_t;
+#endif
+
 /* Enable if you wish to enable RMT queues. This is currently disabled because
  * it is not SMP scalable, and its advantages are still not clear.
  * We may reintroduce RMT queues once we add support for RMT scheduling; in
@@ -147,6 +153,7 @@ struct rina_pci;
 
 #ifndef RL_SKB
 struct rl_buf;
+struct sk_buff;
 #else /* RL_SKB */
 #include <linux/skbuff.h>
 #define rl_buf sk_buff /* just map on sk_buff */
@@ -159,24 +166,51 @@ struct rl_buf *rl_buf_clone(struct rl_buf *rb, gfp_t gfp);
 
 void __rl_buf_free(struct rl_buf *rb);
 
+#ifndef RL_SKB
+/* Wrap a received skb into a rl_buf without copying. */
+struct rl_buf *rl_buf_adopt_skb(struct sk_buff *skb);
+
+/* Build an skb around the data of a rl_buf, without copying. */
+struct sk_buff *rl_buf_build_skb(struct rl_buf *rb, unsigned int hdroom,
+                                 unsigned int tailroom);
+#endif /* !RL_SKB */
+
+int rl_bufs_init(void);
+
+void rl_bufs_fini(void);
+
 union rl_buf_ctx {
     struct {
         /* Used in the TX datapath when this rb ends up into
          * a retransmission queue. */
         unsigned long rtx_jiffies;
-        unsigned long jiffies;
+        /* Transmission time in nanoseconds, or 0 if the rb has been
+         * retransmitted and cannot be used for RTT samples. */
+        u64 tx_time;
+        unsigned int heap_idx; /* position in the dtp rtx_heap */
+        /* The receiver reported this PDU through a SACK, so it is not
+         * retransmitted until the receiver reneges on it. */
+        bool sacked;
     } rtx;
 
     struct {
         /* Used in the TX datapath when this rb ends up into
          * an RMT queue. */
         struct flow_entry *lower_flow;
+        /* Time (ns) when the rb entered a PDU scheduler queue. */
+        u64 enq_time;
     } rmt;
 
     struct {
         /* Used in the RX datapath for flow control. */
         rlm_seq_t cons_seqnum;
     } rx;
+
+    struct {
+        /* Used by shim-loopback while the rb waits for delivery. */
+        struct flow_entry *rx_flow;
+        u64 deliver_time; /* ns */
+    } lb;
 };
 
 #ifndef RL_SKB
@@ -186,6 +220,10 @@ union rl_buf_ctx {
 struct rl_rawbuf {
     size_t size;
     atomic_t refcnt;
+    uint32_t cls;  /* size class, see bufs.c */
+    uint8_t *data; /* start of the buffer, either 'buf' or skb->head */
+    struct sk_buff *skb; /* adopted skb, if any */
+    bool lent;           /* data referenced by an skb, see bufs.c */
     uint8_t buf[0];
 };
 
@@ -203,6 +241,7 @@ struct rl_buf {
 #define RL_BUF_RTX(rb) (rb)->u.rtx
 #define RL_BUF_RX(rb) (rb)->u.rx
 #define RL_BUF_RMT(rb) (rb)->u.rmt
+#define RL_BUF_LB(rb) (rb)->u.lb
 
 /* Amount of memory consumed by this packet. */
 static inline unsigned int
@@ -228,7 +267,7 @@ rl_buf_custom_pop(struct rl_buf *rb, size_t len)
 static inline int
 rl_buf_custom_push(struct rl_buf *rb, size_t len)
 {
-    if (unlikely((uint8_t *)(rb->pci) - len < &rb->raw->buf[0])) {
+    if (unlikely((uint8_t *)(rb->pci) - len < rb->raw->data)) {
         RPD(1, "No space to push %zu bytes\n", len);
         return -1;
     }
@@ -243,20 +282,29 @@ static inline void
 rl_buf_append(struct rl_buf *rb, size_t len)
 {
     rb->len += len;
-    BUG_ON((uint8_t *)(rb->pci) + rb->len > rb->raw->buf + rb->raw->size);
+    BUG_ON((uint8_t *)(rb->pci) + rb->len > rb->raw->data + rb->raw->size);
 }
 
+/* Copy the first 'bytes' of the rb to the user buffer, at offset 'ofs'.
+ * An iov_iter keeps track of the offset by itself. */
 #ifdef RL_HAVE_CHRDEV_RW_ITER
 static inline int
-rl_buf_copy_to_user(struct rl_buf *rb, struct iov_iter *to, size_t bytes)
+rl_buf_copy_to_user(struct rl_buf *rb, struct iov_iter *to, size_t ofs,
+                    size_t bytes)
 {
-    return copy_to_iter(RL_BUF_DATA(rb), bytes, to);
+    (void)ofs;
+    if (copy_to_iter(RL_BUF_DATA(rb), bytes, to) != bytes) {
+        return -EFAULT;
+    }
+
+    return bytes;
 }
 #else  /* AIO_RW */
 static inline int
-rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
+rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t ofs,
+                    size_t bytes)
 {
-    int ret = memcpy_toiovecend(to, RL_BUF_DATA(rb), 0, bytes);
+    int ret = memcpy_toiovecend(to, RL_BUF_DATA(rb), ofs, bytes);
 
     return ret ? ret : bytes;
 }
@@ -273,6 +321,7 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define rb_list list_head
 #define rb_list_init(l) INIT_LIST_HEAD((l))
 #define rb_list_enq(rb, q) list_add_tail_safe(&(rb)->node, q)
+#define rb_list_enq_head(rb, q) list_add(&(rb)->node, q)
 #define rb_list_del(rb) list_del_init(&(rb)->node)
 #define rb_list_empty(l) list_empty(l)
 #define rb_list_front(l) list_first_entry(l, struct rl_buf, node)
@@ -291,6 +340,7 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define RL_BUF_RTX(rb) ((union rl_buf_ctx *)((rb)->cb))->rtx
 #define RL_BUF_RX(rb) ((union rl_buf_ctx *)((rb)->cb))->rx
 #define RL_BUF_RMT(rb) ((union rl_buf_ctx *)((rb)->cb))->rmt
+#define RL_BUF_LB(rb) ((union rl_buf_ctx *)((rb)->cb))->lb
 
 static inline unsigned int
 rl_buf_truesize(struct rl_buf *rb)
@@ -328,17 +378,22 @@ rl_buf_custom_push(struct rl_buf *rb, size_t len)
 
 #ifdef RL_HAVE_CHRDEV_RW_ITER
 static inline int
-rl_buf_copy_to_user(struct rl_buf *rb, struct iov_iter *to, size_t bytes)
+rl_buf_copy_to_user(struct rl_buf *rb, struct iov_iter *to, size_t ofs,
+                    size_t bytes)
 {
-    int ret = skb_copy_datagram_iter(rb, 0, to, bytes);
+    int ret;
+
+    (void)ofs;
+    ret = skb_copy_datagram_iter(rb, 0, to, bytes);
 
     return ret ? ret : bytes;
 }
 #else  /* AIO_RW */
 static inline int
-rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
+rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t ofs,
+                    size_t bytes)
 {
-    int ret = skb_copy_datagram_iovec(rb, 0, to, bytes);
+    int ret = skb_copy_datagram_const_iovec(rb, 0, to, ofs, bytes);
 
     return ret ? ret : bytes;
 }
@@ -380,6 +435,16 @@ rb_list_enq(struct rl_buf *elem, struct rb_list *list)
     list->prev       = elem;
 }
 
+static inline void
+rb_list_enq_head(struct rl_buf *elem, struct rb_list *list)
+{
+    BUG_ON(elem->prev != NULL || elem->next != NULL);
+    list->next->prev = elem;
+    elem->prev       = (struct rl_buf *)list;
+    elem->next       = list->next;
+    list->next       = elem;
+}
+
 static inline void
 rb_list_del(struct rl_buf *elem)
 {
@@ -406,6 +471,13 @@ rb_list_front(struct rb_list *list)
 
 #endif /* RL_SKB */
 
+/* Bulk allocation and release of buffers, for batched datapaths. */
+unsigned int rl_buf_alloc_bulk(size_t size, size_t hdroom, size_t tailroom,
+                               gfp_t gfp, struct rb_list *list,
+                               unsigned int n);
+
+void rl_buf_free_bulk(struct rb_list *list);
+
 /*
  * Kernel data-structures.
  */
@@ -445,6 +517,11 @@ struct ipcp_ops {
 #define RL_RMT_F_CONSUME 2
     int (*sdu_write)(struct ipcp_entry *ipcp, struct flow_entry *flow,
                      struct rl_buf *rb, unsigned flags);
+    /* Optional batched version of sdu_write. PDUs are consumed from the
+     * head of 'rbs', and the number of PDUs consumed is returned. On
+     * backpressure the remaining PDUs are left in 'rbs'. */
+    int (*sdu_write_multi)(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                           struct rb_list *rbs, unsigned flags);
     struct rl_buf *(*sdu_rx)(struct ipcp_entry *ipcp, struct rl_buf *rb,
                              struct flow_entry *lower_flow);
     int (*config)(struct ipcp_entry *ipcp, const char *param_name,
@@ -468,6 +545,8 @@ struct ipcp_ops {
     int (*sched_config)(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg);
 };
 
+struct rl_io_ring;
+
 struct txrx {
     /* Read operation support. */
     struct rb_list rx_q;
@@ -476,6 +555,9 @@ struct txrx {
     spinlock_t rx_lock;
 #define RL_TXRX_EOF (1 << 0)
     uint8_t flags;
+    /* Shared-memory ring attached by the application, if any
+     * (protected by rx_lock). */
+    struct rl_io_ring *ring;
 
     /* Write operation support. */
     struct ipcp_entry *ipcp;
@@ -505,6 +587,7 @@ struct ipcp_entry {
 
 #define RL_K_IPCP_USE_CEP_IDS (1 << 0)
 #define RL_K_IPCP_ZOMBIE (1 << 1)
+#define RL_K_IPCP_INTEGRITY (1 << 2)
     uint32_t flags;
 
     /* Receive side optimization. Fields protected by 'lock'. */
@@ -524,14 +607,12 @@ struct ipcp_entry {
 
     wait_queue_head_t tx_wqh;
 
-    /* Per-cpu lossy statistics, to allow accounting without cacheline
-     * ping-pongs between more CPUs accessing the same IPCP. We accept the
-     * risk of being preempted between the moment we get the per-CPU pointer
-     * and the moment we dereference it; we therefore use raw_cpu_ptr()
-     * instead of the regular this_cpu_ptr(), which would dump a warning
-     * and a stack trace. Should a race happen, we would pay the cost of a
-     * cache ping pong and we risk a lost increment. This is not a concern,
-     * as we do not require strict mutual exclusion for the counters. */
+    /* Per-cpu statistics, to allow accounting without cacheline
+     * ping-pongs between more CPUs accessing the same IPCP. Counters are
+     * only updated through this_cpu_inc() and this_cpu_add(), which are
+     * safe against preemption and interrupts, so that no increment is
+     * lost even when the datapath runs in process context. The per-CPU
+     * copies are summed up by rl_ipcp_get_stats(). */
     struct rl_ipcp_stats __percpu *stats;
 
     /* The module that owns this IPC process. */
@@ -547,24 +628,63 @@ struct ipcp_factory {
     struct module *owner;
     const char *dif_type;
     bool use_cep_ids;
+    /* The underlying transport already detects corrupted PDUs, so the
+     * upper IPCPs don't need to checksum them. */
+    bool integrity;
     void *(*create)(struct ipcp_entry *ipcp);
     struct ipcp_ops ops;
 
     struct list_head node;
 };
 
+struct rl_sched;
+
 struct upper_ref {
     struct rl_ctrl *rc;
     struct ipcp_entry *ipcp;
+    /* PDU scheduler instance of the upper IPCP for this output port,
+     * if any. */
+    struct rl_sched *sched;
 };
 
-/* Support for token bucket traffic shaping. */
-struct tkbk {
-    ktime_t t_last_refill;
-    unsigned long bucket_size;
-    unsigned long intval_ms;
+/* Sender pacing, active only if dtcp.bandwidth is configured. PDUs are
+ * not released before 'next_ns'. PDUs written by callers that cannot
+ * sleep are sequenced and queued in 'q', which 'work' drains when
+ * 'timer' fires. The writers blocked on the pacer are woken up by
+ * 'work' once 'q' is empty. */
+struct rl_pacer {
+    struct hrtimer timer;
+    struct work_struct work;
+    u64 next_ns; /* 0 if pacing has never been active */
+    struct rb_list q;
+    unsigned int qlen;
 };
 
+#define RL_SEQQ_SLOTS 128 /* must be a power of two */
+
+struct dtp;
+
+/* A congestion control algorithm for the DTCP sender, in charge of
+ * the cgwin. All the callbacks are invoked under the DTP lock. */
+struct rl_cc_ops {
+    const char *name;
+    uint8_t type; /* RLITE_CC_T_* */
+    /* Reset the algorithm state, when the sender state is reset. */
+    void (*init)(struct dtp *dtp);
+    /* New PDUs have been acked. 'rtt_ns' is the most recent RTT
+     * sample, or 0 if none is available. */
+    void (*on_ack)(struct dtp *dtp, unsigned int acked, u64 rtt_ns);
+    /* Loss detected by fast retransmission, or congestion mark. Called
+     * at most once per window. */
+    void (*on_congestion)(struct dtp *dtp);
+    /* Retransmission timeout. */
+    void (*on_rto)(struct dtp *dtp);
+    struct list_head node;
+};
+
+#define RL_CC_PRIV_SIZE 64
+#define RL_CC_PRIV(_dtp) ((void *)(_dtp)->cc_priv)
+
 struct dtp {
     spinlock_t lock;
 
@@ -584,11 +704,21 @@ struct dtp {
     unsigned int rtxq_len;
     unsigned int max_rtxq_len;
     struct timer_list rtx_tmr;
-    struct rl_buf *rtx_tmr_next; /* the packet is going to expire next */
+    /* Min-heap of the rtxq PDUs ordered by retransmission time, so that
+     * the rtx timer only touches expired PDUs. It contains rtxq_len
+     * entries. */
+    struct rl_buf **rtx_heap;
+    unsigned int rtx_heap_cap;
     unsigned rtt;                /* estimated round trip time, in jiffies. */
     unsigned rtt_stddev;
     unsigned cgwin; /* number of PDUs in the congestion window */
-    struct tkbk tkbk;
+    /* The congestion window is halved at most once per window of
+     * fast retransmissions, i.e. until this seqnum gets acked. */
+    rlm_seq_t rtx_recover_seq;
+    /* Congestion control algorithm and its private state. */
+    const struct rl_cc_ops *cc;
+    u64 cc_priv[RL_CC_PRIV_SIZE / sizeof(u64)];
+    struct rl_pacer pacer;
 
     /* Receiver state. */
     rlm_seq_t rcv_lwe;
@@ -599,13 +729,18 @@ struct dtp {
     rlm_seq_t last_seq_num_acked;
     rlm_seq_t next_snd_ctl_seq;
     struct timer_list rcv_inact_tmr;
-    struct rb_list seqq;
+    /* Sequencing queue: a ring of RL_SEQQ_SLOTS PDUs indexed by sequence
+     * number, allocated on the first out-of-order arrival. */
+    struct rl_buf **seqq;
     unsigned int seqq_len;
     struct timer_list a_tmr;
 
 #define DTP_F_DRF_SET (1 << 0)
 #define DTP_F_DRF_EXPECTED (1 << 1)
 #define DTP_F_TIMERS_INITIALIZED (1 << 2)
+#define DTP_F_ECN_ECHO (1 << 3) /* echo a congestion mark to the sender */
+#define DTP_F_TX_PENDING (1 << 4) /* a PDU may still be refused by the RMT */
+#define DTP_F_TX_WAITERS (1 << 5) /* writers refused for DTP_F_TX_PENDING */
     uint8_t flags;
 };
 
@@ -630,7 +765,9 @@ struct flow_entry {
 
     void *priv;
 
-    struct rl_flow_stats stats;
+    /* Per-cpu rl_io statistics, updated as the IPCP ones and summed up
+     * by rl_flow_get_stats(). */
+    struct rl_flow_stats __percpu *stats;
     uint32_t uid;             /* unique id */
     struct list_head node_rm; /* for flows_removeq */
     unsigned long expires;    /* absolute time in jiffies */
@@ -646,10 +783,20 @@ struct flow_entry {
     struct hlist_node node_cep;
 };
 
+/* Key of the destination-based PDUFT: the destination address, with
+ * the lowest 'range_bits' bits cleared, and the number of range bits. */
+struct pduft_dst_key {
+    rlm_addr_t addr;
+    uint32_t range_bits;
+};
+
 struct pduft_entry {
     struct rl_pci_match match;
+    struct pduft_dst_key dkey;
     struct flow_entry *flow;
-    struct hlist_node node; /* for the pdu_ft hash table */
+    struct rhash_head node; /* for the pdu_ft hash tables */
+    struct list_head lnode; /* for the list of all the entries */
+    struct rcu_head rcu;    /* for deferred free */
 };
 
 int __ipcp_put(struct ipcp_entry *entry);
@@ -701,6 +848,9 @@ int rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port);
 int rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                    struct rl_buf *rb, bool qlimit);
 
+int rl_sdu_rx_flow_multi(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                         struct rb_list *rbs, bool qlimit);
+
 struct rl_buf *rl_sdu_rx_shortcut(struct ipcp_entry *ipcp, struct rl_buf *rb);
 
 void rl_write_restart_flow(struct flow_entry *flow);
@@ -754,16 +904,17 @@ txrx_init(struct txrx *txrx, struct ipcp_entry *ipcp)
     init_waitqueue_head(&txrx->__tx_wqh);
     txrx->tx_wqh = &txrx->__tx_wqh; /* Use per-flow tx_wqh by default. */
     txrx->flags  = 0;
+    txrx->ring   = NULL;
 }
 
-struct rl_sched;
-
 struct rl_sched_ops {
     const char *name;
     size_t priv_size;
     int (*init)(struct rl_sched *);
     void (*fini)(struct rl_sched *);
     int (*config)(struct rl_sched *, const struct rl_msg_base *bmsg);
+    /* Copy the configuration of another instance, with empty queues. */
+    int (*clone)(struct rl_sched *, struct rl_sched *src);
     int (*enq)(struct rl_sched *, struct rl_buf *);
     struct rl_buf *(*deq)(struct rl_sched *);
     struct list_head node;
@@ -773,6 +924,23 @@ struct rl_sched {
     struct rl_sched_ops ops;
     wait_queue_head_t wqh;
     spinlock_t qlock;
+
+    /* The fields below are only used by per-port instances. */
+    struct ipcp_entry *ipcp;
+    struct flow_entry *lower_flow;
+    struct list_head node; /* in rl_normal.sched_ports */
+    /* Registered on the lower flow tx_wqh, to restart the dequeue when
+     * the lower IPCP has write space again. */
+    wait_queue_entry_t tx_wait;
+    struct work_struct deq_work;
+    /* PDU dequeued but refused by the lower IPCP, to be sent first. */
+    struct rl_buf *stash;
+    /* References held by rmt_tx() while using the instance. The last
+     * one completes 'released' (see sched_port_destroy()). */
+    atomic_t refcnt;
+    struct completion released;
+    bool dead; /* being destroyed, blocked writers must give up */
+
 #define RL_SCHED_PRIV(_sched) ((void *)(_sched)->priv)
     /* Private data allocated at the end of the struct. */
     char priv[0];
@@ -784,27 +952,46 @@ struct rl_normal {
     uint16_t ttl; /* time to live */
     bool csum;    /* compute/check internet checksum on each PDU */
 
-    /* Implementation of the PDU Forwarding Table (PDUFT): a lock, a
-     * default entry, and two hash tables. One of the has tables maps
+    /* Implementation of the PDU Forwarding Table (PDUFT): a default
+     * entry, and two resizable hash tables. One of the hash tables maps
      * (dst_addr) --> (lower_flow). The other maps
      * (dst_addr, src_addr, dst_cepid, src_cepid, qosid) --> (lower_flow)
+     * Lookups are lockless (RCU), while updates are serialized by the
+     * pduft_lock, which also protects the list of all the entries.
+     * Entries of the first table may match a range of destination
+     * addresses: the bitmask 'pduft_ranges' tells which range sizes
+     * are currently in use, so that lookups only need to probe those
+     * (longest match first). The number of entries for each range size
+     * is kept in 'pduft_range_cnt'.
      */
-    rwlock_t pduft_lock;
-    struct flow_entry *pduft_dflt;
+    spinlock_t pduft_lock;
+    struct pduft_entry __rcu *pduft_dflt;
     bool perflow_present;
-#define PDUFT_HASHTABLE_BITS 3
-    DECLARE_HASHTABLE(pdu_ft, PDUFT_HASHTABLE_BITS);
-    DECLARE_HASHTABLE(pdu_ft_perflow, PDUFT_HASHTABLE_BITS);
-
-    /* Support for PDU scheduling. May be NULL if no PDU scheduler is
-     * actually installed. */
+    u64 pduft_ranges;
+    unsigned int pduft_range_cnt[RL_PCI_MATCH_RANGE_BITS_MAX + 1];
+    struct rhashtable pdu_ft;
+    struct rhashtable pdu_ft_perflow;
+    struct list_head pduft_entries;
+
+    /* Support for PDU scheduling. The 'sched' instance is NULL if no
+     * PDU scheduler is installed, otherwise it holds the configuration
+     * of the scheduler, but no PDUs. Each output port (N-1 flow) gets
+     * its own instance, cloned from 'sched' and linked in 'sched_ports',
+     * with its own queue lock and dequeue work. The sched_lock mutex
+     * serializes changes to these fields. */
     struct rl_sched *sched;
-    struct work_struct sched_deq_work;
+    struct list_head sched_ports;
+    struct mutex sched_lock;
 };
 
 void dtp_init(struct dtp *dtp);
 void dtp_fini(struct dtp *dtp);
+unsigned int dtp_seqq_flush(struct dtp *dtp);
 void dtp_dump(struct dtp *dtp);
+int rl_pduft_init(struct rl_normal *priv);
+void rl_pduft_fini(struct rl_normal *priv);
+struct flow_entry **rl_pduft_flows_get(struct rl_normal *priv,
+                                       unsigned int *num);
 int rl_pduft_del_addr(struct ipcp_entry *ipcp,
                       const struct rl_pci_match *match);
 int rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry);
@@ -849,10 +1036,14 @@ void *rl_alloc(size_t size, gfp_t gfp, rl_memtrack_t type);
 char *rl_strdup(const char *s, gfp_t gfp, rl_memtrack_t type);
 void rl_free(void *obj, rl_memtrack_t type);
 void rl_memtrack_dump_stats(void);
+void rl_memtrack_account(rl_memtrack_t type, int delta);
 #else /* ! RL_MEMTRACK */
 #define rl_alloc(_sz, _gfp, _ty) kmalloc(_sz, _gfp)
 #define rl_strdup(_s, _gfp, _ty) kstrdup(_s, _gfp)
 #define rl_free(_obj, _ty) kfree(_obj)
+#define rl_memtrack_account(_ty, _delta)                                       \
+    do {                                                                       \
+    } while (0)
 #endif /* ! RL_MEMTRACK */
 
 #endif /* __RLITE_KERNEL_H__ */
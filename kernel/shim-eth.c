@@ -39,6 +39,7 @@
 #include <linux/rtnetlink.h>
 #include <linux/rwlock.h>
 #include <linux/if_ether.h>
+#include <linux/jhash.h>
 
 #define ETH_P_RLITE 0xD1F0
 
@@ -58,6 +59,10 @@ struct arpt_entry {
     /* The flow entry associated to the remote THA. */
     struct flow_entry *flow;
 
+    /* Flow hash and TX queue of the flow, chosen when the flow is bound. */
+    u32 txhash;
+    u16 txq;
+
     /* Used on flow allocator slave side while the flow is in pending state. */
     struct rb_list rx_tmpq;
     unsigned int rx_tmpq_len;
@@ -67,7 +72,8 @@ struct arpt_entry {
 };
 
 /* Per TX-queue structure, padded to the cacheline boundary to avoid false
- * sharing. */
+ * sharing. Backpressure is tracked per TX queue, so that a full queue only
+ * blocks the flows mapped to it. */
 struct eth_tx_queue {
 #define RL_TXQ_XMIT_BUSY 0
     unsigned long xmit_busy;
@@ -293,8 +299,23 @@ arp_resolver_cb(
 }
 
 static void
-arpt_flow_bind(struct arpt_entry *entry, struct flow_entry *flow)
+arpt_flow_bind(struct rl_shim_eth *priv, struct arpt_entry *entry,
+               struct flow_entry *flow)
 {
+    /* Pin the flow to a TX queue chosen by flow hash, so that its PDUs are
+     * not reordered, while different flows spread across the queues of
+     * multi-queue devices. The queue is also the one where backpressure
+     * is tracked. */
+    entry->txhash = jhash_1word(flow->local_port, 0);
+#ifdef RL_HAVE_DEV_DIRECT_XMIT
+    entry->txq = reciprocal_scale(entry->txhash,
+                                  priv->netdev->real_num_tx_queues);
+#else  /* !RL_HAVE_DEV_DIRECT_XMIT */
+    /* The TX queue is picked by the network stack, so backpressure can
+     * only be tracked for the whole device. */
+    entry->txq = 0;
+#endif /* !RL_HAVE_DEV_DIRECT_XMIT */
+
     /* We cannot flow_get() here, otherwise flows wouldn't never be
      * removed. However, it would not be necessary, since the core
      * will notify us with ops->flow_deallocated, so that we can
@@ -332,7 +353,7 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
         if (entry->flow) {
             ret = -EBUSY;
         } else {
-            arpt_flow_bind(entry, flow);
+            arpt_flow_bind(priv, entry, flow);
             ret = 0;
         }
 
@@ -363,7 +384,7 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
     entry->fa_req_arrived = false;
     rb_list_init(&entry->rx_tmpq);
     entry->rx_tmpq_len = 0;
-    arpt_flow_bind(entry, flow);
+    arpt_flow_bind(priv, entry, flow);
     list_add_tail(&entry->node, &priv->arp_table);
 
     write_unlock_bh(&priv->arpt_lock);
@@ -433,7 +454,7 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
             rl_sdu_rx_flow(ipcp, flow, rb, true);
         }
         entry->rx_tmpq_len = 0;
-        arpt_flow_bind(entry, flow);
+        arpt_flow_bind(priv, entry, flow);
         ret = 0;
     }
 
@@ -590,28 +611,41 @@ arpt_rx_lookup(struct rl_shim_eth *priv, char *source_mac)
     return NULL;
 }
 
+/* Takes ownership of 'skb'. */
 static void
 shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
 {
     struct ipcp_entry *ipcp = priv->ipcp;
     struct rl_buf *rb;
-    struct ethhdr *hh = eth_hdr(skb);
     struct arpt_entry *entry;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    /* The source MAC is saved, since the skb may be gone once the PDU
+     * has been passed up. */
+    uint8_t src_mac[ETH_ALEN];
     unsigned len;
 
+    memcpy(src_mac, eth_hdr(skb)->h_source, ETH_ALEN);
     NPD("SHIM ETH PDU from %02X:%02X:%02X:%02X:%02X:%02X [%d]\n",
-        hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
-        hh->h_source[4], hh->h_source[5], skb->len);
+        src_mac[0], src_mac[1], src_mac[2], src_mac[3], src_mac[4],
+        src_mac[5], skb->len);
 
 #ifndef RL_SKB
-    rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom, GFP_ATOMIC);
+    /* Try to wrap the skb into a rl_buf, which avoids copying the PDU.
+     * Fall back to copying if this is not possible (e.g. the skb data
+     * is not linear). */
+    rb = rl_buf_adopt_skb(skb);
     if (unlikely(!rb)) {
-        RPV(1, "Out of memory\n");
-        return;
+        rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom,
+                          GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            RPV(1, "Out of memory\n");
+            dev_kfree_skb_any(skb);
+            return;
+        }
+        skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
+        rl_buf_append(rb, skb->len);
+        dev_kfree_skb_any(skb);
     }
-    skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
-    rl_buf_append(rb, skb->len);
 #else /* RL_SKB */
     rb                       = skb;
 #endif
@@ -619,8 +653,8 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
     len = rb->len;
     /* Try to shortcut the packet to the upper IPCP. */
     if ((rb = rl_sdu_rx_shortcut(ipcp, rb)) == NULL) {
-        stats->rx_pkt++;
-        stats->rx_byte += len;
+        this_cpu_inc(stats->rx_pkt);
+        this_cpu_add(stats->rx_byte, len);
         return;
     }
 
@@ -628,14 +662,14 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
      * the source MAC address. */
     read_lock_bh(&priv->arpt_lock);
 
-    entry = arpt_rx_lookup(priv, hh->h_source);
+    entry = arpt_rx_lookup(priv, (char *)src_mac);
 
     if (likely(entry && entry->flow)) {
         struct flow_entry *flow = entry->flow;
 
         read_unlock_bh(&priv->arpt_lock);
-        stats->rx_pkt++;
-        stats->rx_byte += len;
+        this_cpu_inc(stats->rx_pkt);
+        this_cpu_add(stats->rx_byte, len);
         rl_sdu_rx_flow(ipcp, flow, rb, true);
 
         return;
@@ -646,13 +680,13 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
      * allocation initiator. We need to do the lookup again, as we
      * have dropped the read lock. */
     write_lock_bh(&priv->arpt_lock);
-    entry = arpt_rx_lookup(priv, hh->h_source);
+    entry = arpt_rx_lookup(priv, (char *)src_mac);
     if (!entry) {
         RPD(1,
             "PDU from unknown source MAC "
             "%02X:%02X:%02X:%02X:%02X:%02X\n",
-            hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
-            hh->h_source[4], hh->h_source[5]);
+            src_mac[0], src_mac[1], src_mac[2], src_mac[3], src_mac[4],
+            src_mac[5]);
         goto drop;
     }
 
@@ -701,13 +735,13 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
     }
     write_unlock_bh(&priv->arpt_lock);
 
-    stats->rx_pkt++;
-    stats->rx_byte += len;
+    this_cpu_inc(stats->rx_pkt);
+    this_cpu_add(stats->rx_byte, len);
     return;
 
 drop:
     write_unlock_bh(&priv->arpt_lock);
-    stats->rx_err++;
+    this_cpu_inc(stats->rx_err);
     rl_buf_free(rb);
 }
 
@@ -738,13 +772,6 @@ shim_eth_rx_handler(struct sk_buff **skbp)
     } else if (ethertype == ETH_P_RLITE) {
         /* This is a RLITE shim-eth PDU. */
         shim_eth_pdu_rx(priv, skb);
-
-#ifndef RL_SKB
-        /* We should use dev_consume_skb_any(),
-         * for those kernel where this is defined (this would require figure out
-         * the kernel features at configuration time. */
-        dev_kfree_skb_any(skb);
-#endif /* !RL_SKB */
     } else {
         /* This frame doesn't belong to us, do not touch it. */
         return RX_HANDLER_PASS;
@@ -754,78 +781,108 @@ shim_eth_rx_handler(struct sk_buff **skbp)
     return RX_HANDLER_CONSUMED;
 }
 
+/* Called when an skb is released, either because it was transmitted or
+ * because it was dropped. The TX queue is the one the flow was pinned to
+ * by arpt_flow_bind(). */
 static void
-shim_eth_skb_destructor(struct sk_buff *skb)
+shim_eth_tx_done(struct flow_entry *flow, struct sk_buff *skb)
 {
-    struct flow_entry *flow =
-        (struct flow_entry *)(skb_shinfo(skb)->destructor_arg);
     struct ipcp_entry *ipcp  = flow->txrx.ipcp;
     struct rl_shim_eth *priv = ipcp->priv;
-
-    if (test_and_clear_bit(RL_TXQ_XMIT_BUSY,
-                           &priv->txq[skb_get_queue_mapping(skb)].xmit_busy)) {
+    struct arpt_entry *entry = READ_ONCE(flow->priv);
+#ifdef RL_HAVE_DEV_DIRECT_XMIT
+    u16 txq = entry ? entry->txq : skb_get_queue_mapping(skb);
+#else  /* !RL_HAVE_DEV_DIRECT_XMIT */
+    u16 txq = 0;
+#endif /* !RL_HAVE_DEV_DIRECT_XMIT */
+
+    if (test_and_clear_bit(RL_TXQ_XMIT_BUSY, &priv->txq[txq].xmit_busy)) {
         rl_write_restart_flows(ipcp);
     }
 }
 
+static void
+shim_eth_skb_destructor(struct sk_buff *skb)
+{
+    struct flow_entry *flow =
+        (struct flow_entry *)(skb_shinfo(skb)->destructor_arg);
+
+    shim_eth_tx_done(flow, skb);
+}
+
 static bool
 rl_shim_eth_flow_writeable(struct flow_entry *flow)
 {
     struct rl_shim_eth *priv = (struct rl_shim_eth *)flow->txrx.ipcp->priv;
-    int i;
+    struct arpt_entry *entry = READ_ONCE(flow->priv);
 
-    for (i = 0; i < priv->netdev->num_tx_queues; i++) {
-        if (!test_bit(RL_TXQ_XMIT_BUSY, &priv->txq[i].xmit_busy)) {
-            return true;
-        }
-    }
-    return false;
+    return !entry ||
+           !test_bit(RL_TXQ_XMIT_BUSY, &priv->txq[entry->txq].xmit_busy);
 }
 
 static int
 rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                       struct rl_buf *rb, unsigned flags)
 {
-    struct rl_shim_eth *priv    = ipcp->priv;
-    struct net_device *netdev   = priv->netdev;
-    struct sk_buff *skb         = NULL;
-    struct arpt_entry *entry    = flow->priv;
-    size_t len                  = rb->len;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rl_shim_eth *priv             = ipcp->priv;
+    struct net_device *netdev            = priv->netdev;
+    struct sk_buff *skb                  = NULL;
+    struct arpt_entry *entry             = flow->priv;
+    size_t len                           = rb->len;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    bool zcopy                           = false;
     int hhlen;
     int ret;
 
     if (unlikely(!entry)) {
         rl_buf_free(rb);
-        stats->tx_err++;
+        this_cpu_inc(stats->tx_err);
         RPD(1, "called on deallocated entry\n");
         return -ENXIO;
     }
 
     if (unlikely(len > ETH_DATA_LEN)) {
         rl_buf_free(rb);
-        stats->tx_err++;
+        this_cpu_inc(stats->tx_err);
         RPD(1, "Exceeding maximum ethernet payload (%d)\n", ETH_DATA_LEN);
         return -EMSGSIZE;
     }
 
 #ifndef RL_SKB
-    hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length. */
-    skb   = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
-    if (!skb) {
-        rl_buf_free(rb);
-        stats->tx_err++;
-        return -ENOMEM;
+    if (unlikely(
+            test_bit(RL_TXQ_XMIT_BUSY, &priv->txq[entry->txq].xmit_busy))) {
+        /* The TX queue of this flow is full, don't even try. */
+        return -EAGAIN;
     }
+#endif /* !RL_SKB */
+
+#ifndef RL_SKB
+    hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length. */
+    /* Transmit the PDU in place if the buffer allows it (the txhdroom of
+     * the IPCPs above us includes the hardware header length), otherwise
+     * copy it into a new skb. */
+    skb = rl_buf_build_skb(rb, hhlen, netdev->needed_tailroom);
+    if (skb) {
+        zcopy = true;
+    } else {
+        skb = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
+        if (!skb) {
+            rl_buf_free(rb);
+            this_cpu_inc(stats->tx_err);
+            return -ENOMEM;
+        }
 
-    skb_reserve(skb, hhlen); /* needed by dev_hard_header */
-#else                        /* RL_SKB */
+        skb_reserve(skb, hhlen); /* needed by dev_hard_header */
+    }
+#else  /* RL_SKB */
     (void)hhlen;
+    (void)zcopy;
     skb = rb;
-#endif                       /* RL_SKB */
+#endif /* RL_SKB */
     skb_reset_network_header(skb);
     skb->dev      = netdev;
     skb->protocol = htons(ETH_P_RLITE);
+    skb_set_hash(skb, entry->txhash, PKT_HASH_TYPE_L4);
 
     /* dev_hard_header() will call eth_header(), which skb_push() and
      * initialize the Ethernet header. */
@@ -838,16 +895,28 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
         return ret;
     }
 
-    skb->destructor                 = &shim_eth_skb_destructor;
-    skb_shinfo(skb)->destructor_arg = (void *)flow;
-
 #ifndef RL_SKB
-    /* Copy data into the skb. */
-    memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
+    if (!zcopy) {
+        /* Copy data into the skb. */
+        memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
+    }
 #endif /* !RL_SKB */
+    skb->destructor                 = &shim_eth_skb_destructor;
+    skb_shinfo(skb)->destructor_arg = (void *)flow;
 
     /* Send the skb to the device for transmission. */
-    ret = dev_queue_xmit(skb);
+#ifdef RL_HAVE_DEV_DIRECT_XMIT
+    if (netdev->real_num_tx_queues > 1) {
+        /* dev_queue_xmit() would pick the TX queue again (XPS first, then
+         * the hash of the stack), so transmit on the queue of the flow,
+         * where backpressure is tracked. Like PACKET_QDISC_BYPASS, this
+         * skips the qdisc of multi-queue devices. */
+        ret = dev_direct_xmit(skb, entry->txq);
+    } else
+#endif /* RL_HAVE_DEV_DIRECT_XMIT */
+    {
+        ret = dev_queue_xmit(skb);
+    }
     if (unlikely(ret != NET_XMIT_SUCCESS && netif_running(netdev) &&
                  netif_carrier_ok(netdev))) {
         /* If we did not get NET_XMIT_SUCCESS (and device is up and running),
@@ -856,21 +925,17 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
          * carrier we don't get NET_XMIT_SUCCESS, but we cannot propagate
          * backpressure (or we get stuck in rmt_tx() for ever). In the latter
          * case we need to return success, with the packet being silently
-         * dropped. */
-        int i;
-
+         * dropped. Only the TX queue of this flow is marked as busy. */
         RPV(1, "dev_queue_xmit() failed [%d]\n", ret);
-        stats->tx_err++;
-        for (i = 0; i < priv->netdev->num_tx_queues; i++) {
-            set_bit(RL_TXQ_XMIT_BUSY, &priv->txq[i].xmit_busy);
-        }
+        this_cpu_inc(stats->tx_err);
+        set_bit(RL_TXQ_XMIT_BUSY, &priv->txq[entry->txq].xmit_busy);
 #ifndef RL_SKB
         return -EAGAIN; /* backpressure */
 #endif
     }
 
-    stats->tx_pkt++;
-    stats->tx_byte += len;
+    this_cpu_inc(stats->tx_pkt);
+    this_cpu_add(stats->tx_byte, len);
 
 #ifndef RL_SKB
     rl_buf_free(rb);
@@ -1162,6 +1227,7 @@ static struct ipcp_factory shim_eth_factory = {
     .owner                  = THIS_MODULE,
     .dif_type               = SHIM_DIF_TYPE,
     .use_cep_ids            = false,
+    .integrity              = true, /* Ethernet FCS */
     .create                 = rl_shim_eth_create,
     .ops.destroy            = rl_shim_eth_destroy,
     .ops.flow_allocate_req  = rl_shim_eth_fa_req,
@@ -35,15 +35,14 @@
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
-struct rx_entry {
-    struct rl_buf *rb;
-    struct flow_entry *tx_flow;
-    struct flow_entry *rx_flow;
-};
+/* Default maximum number of PDUs waiting for delivery. */
+#define RX_ENTRIES 256
 
-#define RX_POW 8
-#define RX_ENTRIES (1 << RX_POW)
+#define PPM 1000000U
 
 struct rl_shim_loopback {
     struct ipcp_entry *ipcp;
@@ -51,40 +50,169 @@ struct rl_shim_loopback {
     uint32_t drop_fract;
     uint32_t drop_cur;
 
-    /* Queuing data structures. */
+    /* Link emulation parameters. Delays are in nanoseconds. */
+    u64 delay;
+    u64 jitter;
+    uint32_t rate_kbps;
+    uint32_t loss_ppm;   /* average loss rate, in parts per million */
+    uint32_t loss_burst; /* average length of a loss burst, in PDUs */
+    uint32_t loss_gb;    /* good --> bad transition probability (ppm) */
+    bool loss_bad;       /* state of the Gilbert loss model */
+    uint32_t seed;
+    uint32_t rnd; /* PRNG state */
+
+    /* Queuing data structures. PDUs are delivered in order, when their
+     * delivery time expires. */
     uint16_t queued; /* bool */
-    struct rx_entry rxr[RX_ENTRIES];
-    unsigned int rdh;
-    unsigned int rdt;
+    uint32_t queue_len;
+    struct rb_list rxq;
+    unsigned int rxq_len;
+    u64 link_free; /* end of the last emulated transmission (ns) */
+    u64 last_time; /* delivery time of the last PDU queued (ns) */
+    struct hrtimer rcv_tmr;
 
     spinlock_t lock;
     struct work_struct rcv;
 };
 
+/* Deterministic pseudo-random generator (xorshift32), so that the same
+ * seed reproduces the same losses and jitter. Called under priv->lock. */
+static inline uint32_t
+loopback_rand(struct rl_shim_loopback *priv)
+{
+    uint32_t x = priv->rnd;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return priv->rnd = x;
+}
+
+static inline bool
+loopback_emulated(struct rl_shim_loopback *priv)
+{
+    return priv->queued || priv->delay || priv->jitter || priv->rate_kbps;
+}
+
+/* Returns true if the next PDU has to be dropped. Losses are independent
+ * if loss_burst is not greater than 1, otherwise they follow a two-state
+ * (Gilbert) model, where all the PDUs are lost in the bad state. Called
+ * under priv->lock. */
+static bool
+loopback_loss(struct rl_shim_loopback *priv)
+{
+    if (priv->drop_fract && ++priv->drop_cur >= priv->drop_fract) {
+        priv->drop_cur = 0;
+        return true;
+    }
+
+    if (!priv->loss_ppm) {
+        return false;
+    }
+
+    if (priv->loss_burst <= 1) {
+        return loopback_rand(priv) % PPM < priv->loss_ppm;
+    }
+
+    if (priv->loss_bad) {
+        priv->loss_bad = loopback_rand(priv) % PPM >= PPM / priv->loss_burst;
+    } else {
+        priv->loss_bad = loopback_rand(priv) % PPM < priv->loss_gb;
+    }
+
+    return priv->loss_bad;
+}
+
+/* Choose the good --> bad transition probability of the loss model, so
+ * that the average loss rate is loss_ppm, given that the bad state lasts
+ * loss_burst PDUs on average. Called under priv->lock. */
+static void
+loopback_loss_update(struct rl_shim_loopback *priv)
+{
+    uint32_t bg; /* bad --> good transition probability */
+
+    priv->loss_gb  = 0;
+    priv->loss_bad = false;
+    if (priv->loss_burst <= 1) {
+        return; /* independent losses */
+    }
+    if (priv->loss_ppm >= PPM) {
+        priv->loss_gb = PPM;
+        return;
+    }
+    bg            = PPM / priv->loss_burst;
+    priv->loss_gb = (uint32_t)min_t(
+        u64, PPM, div_u64((u64)bg * priv->loss_ppm, PPM - priv->loss_ppm));
+}
+
+/* Compute the delivery time of a PDU of 'len' bytes sent at 'now'. A PDU
+ * is never delivered before the previous ones, so jitter does not cause
+ * reordering. Called under priv->lock. */
+static u64
+loopback_deliver_time(struct rl_shim_loopback *priv, u64 now, size_t len)
+{
+    u64 t = now;
+
+    if (priv->rate_kbps) {
+        /* Serialization on the emulated link. */
+        if (priv->link_free > t) {
+            t = priv->link_free;
+        }
+        t += div_u64((u64)len * 8 * NSEC_PER_MSEC, priv->rate_kbps);
+        priv->link_free = t;
+    }
+
+    t += priv->delay;
+    if (priv->jitter) {
+        t += mul_u64_u32_shr(priv->jitter, loopback_rand(priv), 32);
+    }
+
+    if (t < priv->last_time) {
+        t = priv->last_time;
+    }
+    priv->last_time = t;
+
+    return t;
+}
+
+static enum hrtimer_restart
+rcv_tmr_cb(struct hrtimer *tmr)
+{
+    struct rl_shim_loopback *priv =
+        container_of(tmr, struct rl_shim_loopback, rcv_tmr);
+
+    /* PDUs cannot be delivered in hardirq context. */
+    schedule_work(&priv->rcv);
+
+    return HRTIMER_NORESTART;
+}
+
 static void
 rcv_work(struct work_struct *w)
 {
     struct rl_shim_loopback *priv =
         container_of(w, struct rl_shim_loopback, rcv);
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(priv->ipcp->stats);
+    struct rl_ipcp_stats __percpu *stats = priv->ipcp->stats;
+    bool restart                         = false;
+    u64 next                             = 0;
 
     for (;;) {
         struct rl_buf *rb = NULL;
         struct flow_entry *rx_flow;
-        struct flow_entry *tx_flow;
         int ret;
 
         spin_lock_bh(&priv->lock);
-        if (priv->rdh != priv->rdt) {
-            rb        = priv->rxr[priv->rdh].rb;
-            rx_flow   = priv->rxr[priv->rdh].rx_flow;
-            tx_flow   = priv->rxr[priv->rdh].tx_flow;
-            priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
-
-            stats->tx_pkt++;
-            stats->tx_byte += rb->len;
-            stats->rx_pkt++;
-            stats->rx_byte += rb->len;
+        if (!rb_list_empty(&priv->rxq)) {
+            rb = rb_list_front(&priv->rxq);
+            if (RL_BUF_LB(rb).deliver_time > ktime_get_ns()) {
+                /* Not yet. */
+                next = RL_BUF_LB(rb).deliver_time;
+                rb   = NULL;
+            } else {
+                rb_list_del(rb);
+                priv->rxq_len--;
+            }
         }
         spin_unlock_bh(&priv->lock);
 
@@ -92,17 +220,27 @@ rcv_work(struct work_struct *w)
             break;
         }
 
-        ret = rl_sdu_rx_flow(priv->ipcp, rx_flow, rb, true);
+        this_cpu_inc(stats->tx_pkt);
+        this_cpu_add(stats->tx_byte, rb->len);
+        this_cpu_inc(stats->rx_pkt);
+        this_cpu_add(stats->rx_byte, rb->len);
+
+        rx_flow = RL_BUF_LB(rb).rx_flow;
+        ret     = rl_sdu_rx_flow(priv->ipcp, rx_flow, rb, true);
         if (unlikely(ret)) {
-            spin_lock_bh(&priv->lock);
-            stats->tx_err++;
-            stats->rx_err++;
-            spin_unlock_bh(&priv->lock);
+            this_cpu_inc(stats->tx_err);
+            this_cpu_inc(stats->rx_err);
         }
         flow_put(rx_flow);
+        restart = true;
+    }
+
+    if (next) {
+        hrtimer_start(&priv->rcv_tmr, ns_to_ktime(next), HRTIMER_MODE_ABS);
+    }
 
+    if (restart) {
         rl_write_restart_flows(priv->ipcp);
-        flow_put(tx_flow);
     }
 }
 
@@ -119,9 +257,19 @@ rl_shim_loopback_create(struct ipcp_entry *ipcp)
     priv->ipcp       = ipcp;
     priv->drop_fract = 0; /* No drops by default. */
     priv->queued     = 0; /* No queue by default. */
+    priv->queue_len  = RX_ENTRIES;
+    priv->seed       = 1;
+    priv->rnd        = priv->seed;
+    rb_list_init(&priv->rxq);
     INIT_WORK(&priv->rcv, rcv_work);
+#ifdef RL_HAVE_HRTIMER_SETUP
+    hrtimer_setup(&priv->rcv_tmr, rcv_tmr_cb, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+    hrtimer_init(&priv->rcv_tmr, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    priv->rcv_tmr.function = rcv_tmr_cb;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
     spin_lock_init(&priv->lock);
-    priv->rdt = priv->rdh = 0;
 
     PD("New IPC created [%p]\n", priv);
 
@@ -132,12 +280,17 @@ static void
 rl_shim_loopback_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_shim_loopback *priv = ipcp->priv;
+    struct rl_buf *rb, *tmp;
 
+    /* The timer schedules the work, which may rearm the timer. */
+    hrtimer_cancel(&priv->rcv_tmr);
     cancel_work_sync(&priv->rcv);
+    hrtimer_cancel(&priv->rcv_tmr);
 
-    while (priv->rdh != priv->rdt) {
-        rl_buf_free(priv->rxr[priv->rdh].rb);
-        priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
+    rb_list_foreach_safe (rb, tmp, &priv->rxq) {
+        rb_list_del(rb);
+        flow_put(RL_BUF_LB(rb).rx_flow);
+        rl_buf_free(rb);
     }
 
     rl_free(priv, RL_MT_SHIM);
@@ -256,16 +409,18 @@ rl_shim_loopback_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return 0;
 }
 
-/* Called under FLOCK. */
 static int
 rl_shim_loopback_flow_deallocated(struct ipcp_entry *ipcp,
                                   struct flow_entry *flow)
 {
-    struct flow_entry *remote_flow = flow_lookup(ipcp->dm, flow->remote_port);
+    struct flow_entry *remote_flow;
 
+    rcu_read_lock();
+    remote_flow = flow_lookup(ipcp->dm, flow->remote_port);
     if (remote_flow) {
         rl_flow_shutdown(remote_flow);
     }
+    rcu_read_unlock();
 
     return 0;
 }
@@ -276,10 +431,8 @@ rl_shim_loopback_flow_writeable(struct flow_entry *flow)
     struct rl_shim_loopback *priv = flow->txrx.ipcp->priv;
     bool ret                      = true;
 
-    if (priv->queued) {
-        spin_lock_bh(&priv->lock);
-        ret = (((priv->rdt + 1) & (RX_ENTRIES - 1)) != priv->rdh);
-        spin_unlock_bh(&priv->lock);
+    if (loopback_emulated(priv)) {
+        ret = READ_ONCE(priv->rxq_len) < READ_ONCE(priv->queue_len);
     }
 
     return ret;
@@ -289,19 +442,16 @@ static int
 rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
                            struct rl_buf *rb, unsigned flags)
 {
-    struct rl_ipcp_stats *stats   = raw_cpu_ptr(ipcp->stats);
-    struct rl_shim_loopback *priv = ipcp->priv;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct rl_shim_loopback *priv        = ipcp->priv;
     struct flow_entry *rx_flow;
     int ret = 0;
 
-    if (unlikely(priv->drop_fract)) {
-        bool drop = false;
+    if (unlikely(priv->drop_fract || priv->loss_ppm)) {
+        bool drop;
 
         spin_lock_bh(&priv->lock);
-        if (++priv->drop_cur >= priv->drop_fract) {
-            priv->drop_cur = 0;
-            drop           = true;
-        }
+        drop = loopback_loss(priv);
         spin_unlock_bh(&priv->lock);
 
         if (drop) {
@@ -316,19 +466,24 @@ rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
         return -ENXIO;
     }
 
-    if (priv->queued) {
-        unsigned int next;
+    if (loopback_emulated(priv)) {
+        u64 now  = ktime_get_ns();
+        bool arm = false;
+        u64 t    = 0;
 
         spin_lock_bh(&priv->lock);
-        next = (priv->rdt + 1) & (RX_ENTRIES - 1);
-        if (unlikely(next == priv->rdh)) {
+        if (unlikely(priv->rxq_len >= priv->queue_len)) {
             ret = -EAGAIN;
         } else {
-            flow_get_ref(tx_flow);
-            priv->rxr[priv->rdt].rb      = rb;
-            priv->rxr[priv->rdt].tx_flow = tx_flow;
-            priv->rxr[priv->rdt].rx_flow = rx_flow;
-            priv->rdt                    = next;
+            t = loopback_deliver_time(priv, now, rb->len);
+
+            RL_BUF_LB(rb).rx_flow      = rx_flow;
+            RL_BUF_LB(rb).deliver_time = t;
+            /* If the queue is not empty, the timer or the work are
+             * already in charge of it. */
+            arm = rb_list_empty(&priv->rxq);
+            rb_list_enq(rb, &priv->rxq);
+            priv->rxq_len++;
         }
         spin_unlock_bh(&priv->lock);
 
@@ -336,25 +491,29 @@ rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
             flow_put(rx_flow);
             return ret;
         }
-        schedule_work(&priv->rcv);
+        if (arm) {
+            if (t <= now) {
+                schedule_work(&priv->rcv);
+            } else {
+                hrtimer_start(&priv->rcv_tmr, ns_to_ktime(t),
+                              HRTIMER_MODE_ABS);
+            }
+        }
 
     } else {
         size_t len = rb->len;
 
         ret = rl_sdu_rx_flow(ipcp, rx_flow, rb, true);
-
-        spin_lock_bh(&priv->lock);
         if (unlikely(ret)) {
-            stats->tx_err++;
-            stats->rx_err++;
+            this_cpu_inc(stats->tx_err);
+            this_cpu_inc(stats->rx_err);
 
         } else {
-            stats->tx_pkt++;
-            stats->tx_byte += len;
-            stats->rx_pkt++;
-            stats->rx_byte += len;
+            this_cpu_inc(stats->tx_pkt);
+            this_cpu_add(stats->tx_byte, len);
+            this_cpu_inc(stats->rx_pkt);
+            this_cpu_add(stats->rx_byte, len);
         }
-        spin_unlock_bh(&priv->lock);
 
         flow_put(rx_flow);
     }
@@ -379,7 +538,112 @@ rl_shim_loopback_config(struct ipcp_entry *ipcp, const char *param_name,
         ret = rl_configstr_to_u32(param_value, &priv->drop_fract, NULL);
         priv->drop_cur = 0;
         spin_unlock_bh(&priv->lock);
+
+    } else if (strcmp(param_name, "delay-us") == 0) {
+        uint32_t us;
+
+        ret = rl_configstr_to_u32(param_value, &us, NULL);
+        if (ret == 0) {
+            spin_lock_bh(&priv->lock);
+            priv->delay = (u64)us * NSEC_PER_USEC;
+            spin_unlock_bh(&priv->lock);
+        }
+
+    } else if (strcmp(param_name, "jitter-us") == 0) {
+        uint32_t us;
+
+        ret = rl_configstr_to_u32(param_value, &us, NULL);
+        if (ret == 0) {
+            spin_lock_bh(&priv->lock);
+            priv->jitter = (u64)us * NSEC_PER_USEC;
+            spin_unlock_bh(&priv->lock);
+        }
+
+    } else if (strcmp(param_name, "rate-kbps") == 0) {
+        spin_lock_bh(&priv->lock);
+        ret = rl_configstr_to_u32(param_value, &priv->rate_kbps, NULL);
+
+        priv->link_free = 0;
+        spin_unlock_bh(&priv->lock);
+
+    } else if (strcmp(param_name, "loss-ppm") == 0) {
+        uint32_t ppm;
+
+        ret = rl_configstr_to_u32(param_value, &ppm, NULL);
+        if (ret == 0 && ppm > PPM) {
+            ret = -EINVAL;
+        }
+        if (ret == 0) {
+            spin_lock_bh(&priv->lock);
+            priv->loss_ppm = ppm;
+            loopback_loss_update(priv);
+            spin_unlock_bh(&priv->lock);
+        }
+
+    } else if (strcmp(param_name, "loss-burst") == 0) {
+        spin_lock_bh(&priv->lock);
+        ret = rl_configstr_to_u32(param_value, &priv->loss_burst, NULL);
+        loopback_loss_update(priv);
+        spin_unlock_bh(&priv->lock);
+
+    } else if (strcmp(param_name, "queue-len") == 0) {
+        uint32_t val;
+
+        ret = rl_configstr_to_u32(param_value, &val, NULL);
+        if (ret == 0 && val == 0) {
+            ret = -EINVAL;
+        }
+        if (ret == 0) {
+            spin_lock_bh(&priv->lock);
+            priv->queue_len = val;
+            spin_unlock_bh(&priv->lock);
+            rl_write_restart_flows(ipcp);
+        }
+
+    } else if (strcmp(param_name, "seed") == 0) {
+        spin_lock_bh(&priv->lock);
+        ret = rl_configstr_to_u32(param_value, &priv->seed, NULL);
+        /* Zero is not a valid state for xorshift. */
+        priv->rnd      = priv->seed ? priv->seed : 1;
+        priv->loss_bad = false;
+        spin_unlock_bh(&priv->lock);
+    }
+
+    return ret;
+}
+
+static int
+rl_shim_loopback_config_get(struct ipcp_entry *ipcp, const char *param_name,
+                            char *buf, int buflen)
+{
+    struct rl_shim_loopback *priv = (struct rl_shim_loopback *)ipcp->priv;
+    int ret                       = 0;
+
+    spin_lock_bh(&priv->lock);
+    if (strcmp(param_name, "queued") == 0) {
+        snprintf(buf, buflen, "%u", priv->queued);
+    } else if (strcmp(param_name, "drop-fract") == 0) {
+        snprintf(buf, buflen, "%u", priv->drop_fract);
+    } else if (strcmp(param_name, "delay-us") == 0) {
+        snprintf(buf, buflen, "%llu",
+                 (unsigned long long)div_u64(priv->delay, NSEC_PER_USEC));
+    } else if (strcmp(param_name, "jitter-us") == 0) {
+        snprintf(buf, buflen, "%llu",
+                 (unsigned long long)div_u64(priv->jitter, NSEC_PER_USEC));
+    } else if (strcmp(param_name, "rate-kbps") == 0) {
+        snprintf(buf, buflen, "%u", priv->rate_kbps);
+    } else if (strcmp(param_name, "loss-ppm") == 0) {
+        snprintf(buf, buflen, "%u", priv->loss_ppm);
+    } else if (strcmp(param_name, "loss-burst") == 0) {
+        snprintf(buf, buflen, "%u", priv->loss_burst);
+    } else if (strcmp(param_name, "queue-len") == 0) {
+        snprintf(buf, buflen, "%u", priv->queue_len);
+    } else if (strcmp(param_name, "seed") == 0) {
+        snprintf(buf, buflen, "%u", priv->seed);
+    } else {
+        ret = -ENOSYS;
     }
+    spin_unlock_bh(&priv->lock);
 
     return ret;
 }
@@ -389,6 +653,7 @@ rl_shim_loopback_config(struct ipcp_entry *ipcp, const char *param_name,
 static struct ipcp_factory shim_loopback_factory = {
     .owner                  = THIS_MODULE,
     .dif_type               = SHIM_DIF_TYPE,
+    .integrity              = true,
     .create                 = rl_shim_loopback_create,
     .ops.destroy            = rl_shim_loopback_destroy,
     .ops.appl_register      = rl_shim_loopback_register,
@@ -397,6 +662,7 @@ static struct ipcp_factory shim_loopback_factory = {
     .ops.flow_deallocated   = rl_shim_loopback_flow_deallocated,
     .ops.sdu_write          = rl_shim_loopback_sdu_write,
     .ops.config             = rl_shim_loopback_config,
+    .ops.config_get         = rl_shim_loopback_config_get,
     .ops.flow_writeable     = rl_shim_loopback_flow_writeable,
 };
 
@@ -41,12 +41,9 @@
 #include <linux/version.h>
 #include <net/sock.h>
 
+/* This struct is unnecessary, but we keep it to ease future extensions. */
 struct rl_shim_tcp4 {
     struct ipcp_entry *ipcp;
-    struct work_struct txw;
-    spinlock_t txq_lock;
-    unsigned int txq_len;
-    struct list_head txq;
 };
 
 struct shim_tcp4_flow {
@@ -67,15 +64,22 @@ struct shim_tcp4_flow {
     bool cur_rx_hdr;
 
     struct mutex rxw_lock;
+
+    /* Transmit queue, drained by tcp4_txq_flush(). */
+    struct rb_list txq;
+    unsigned int txq_len;
+    spinlock_t txq_lock;
+    /* Bytes of the head of txq (header included) already sent. */
+    size_t tx_off;
+    /* Runs tcp4_txq_flush(). A work item never runs concurrently with
+     * itself, so PDUs are not interleaved. */
+    struct work_struct txw;
 };
 
+/* Maximum number of PDUs queued on a flow. */
 #define INET4_MAX_TXQ_LEN 64
-
-struct txq_entry {
-    struct rl_buf *rb;
-    struct shim_tcp4_flow *flow_priv;
-    struct list_head node;
-};
+/* Maximum number of PDUs passed to a single kernel_sendmsg(). */
+#define INET4_TX_BATCH 16
 
 static void tcp4_tx_worker(struct work_struct *w);
 
@@ -91,11 +95,6 @@ rl_shim_tcp4_create(struct ipcp_entry *ipcp)
 
     priv->ipcp = ipcp;
 
-    priv->txq_len = 0;
-    INIT_LIST_HEAD(&priv->txq);
-    INIT_WORK(&priv->txw, tcp4_tx_worker);
-    spin_lock_init(&priv->txq_lock);
-
     /* The max_sdu_size for this IPCP is limited by the the TCP
      * send socket buffer (which is configurable). The default
      * size is contained in the kernel variable sysctl_wmem_default,
@@ -121,9 +120,9 @@ rl_shim_tcp4_destroy(struct ipcp_entry *ipcp)
 static void
 tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
 {
-    struct flow_entry *flow     = priv->flow;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct socket *sock         = priv->sock;
+    struct flow_entry *flow              = priv->flow;
+    struct rl_ipcp_stats __percpu *stats = flow->txrx.ipcp->stats;
+    struct socket *sock                  = priv->sock;
     struct msghdr msghdr;
     struct iovec iov;
     int ret;
@@ -155,7 +154,7 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
         } else if (unlikely(ret <= 0)) {
             if (ret) {
                 PE("recvmsg(%zu): %d\n", iov.iov_len, ret);
-                stats->rx_err++;
+                this_cpu_inc(stats->rx_err);
             } else {
                 PI("Exit rx loop\n");
             }
@@ -178,7 +177,7 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
                     priv->cur_rx_rblen, priv->flow->txrx.ipcp->rxhdroom,
                     priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
                 if (unlikely(!priv->cur_rx_rb)) {
-                    stats->rx_err++;
+                    this_cpu_inc(stats->rx_err);
                     RPV(1, "Out of memory\n");
                     break;
                 }
@@ -192,8 +191,8 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
             /* We have completely read the SDU. */
             rl_sdu_rx_flow(flow->txrx.ipcp, flow, priv->cur_rx_rb, true);
 
-            stats->rx_pkt++;
-            stats->rx_byte += priv->cur_rx_rblen;
+            this_cpu_inc(stats->rx_pkt);
+            this_cpu_add(stats->rx_byte, priv->cur_rx_rblen);
 
             priv->cur_rx_rb    = NULL;
             priv->cur_rx_hdr   = true;
@@ -235,7 +234,12 @@ tcp4_write_space(struct sock *sk)
 {
     struct shim_tcp4_flow *priv = sk->sk_user_data;
 
-    rl_write_restart_flow(priv->flow);
+    if (sk_stream_wspace(sk) >= sk_stream_min_wspace(sk)) {
+        /* Resume transmission of the queued PDUs, which in turn
+         * restarts the writers. */
+        clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
+        schedule_work(&priv->txw);
+    }
 }
 
 static int
@@ -275,6 +279,11 @@ rl_shim_tcp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     priv->sock = sock;
     INIT_WORK(&priv->rxw, tcp4_rx_worker);
     mutex_init(&priv->rxw_lock);
+    rb_list_init(&priv->txq);
+    priv->txq_len = 0;
+    priv->tx_off  = 0;
+    spin_lock_init(&priv->txq_lock);
+    INIT_WORK(&priv->txw, tcp4_tx_worker);
 
     /* Initialize TCP reader state machine. */
     priv->cur_rx_rb     = NULL;
@@ -317,6 +326,10 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     sock->sk->sk_user_data   = NULL;
     write_unlock_bh(&sock->sk->sk_callback_lock);
 
+    /* Drop the PDUs that were not transmitted. */
+    cancel_work_sync(&priv->txw);
+    rl_buf_free_bulk(&priv->txq);
+
     /* Decrement the file descriptor reference counter, in order to
      * match flow_init(). */
     fput(sock->file);
@@ -329,91 +342,145 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     return 0;
 }
 
-static int
-tcp4_xmit(struct shim_tcp4_flow *flow_priv, struct rl_buf *rb)
+/* Transmit the PDUs queued on the flow, passing up to INET4_TX_BATCH
+ * length-prefixed PDUs to each kernel_sendmsg(). MSG_MORE is set while
+ * more PDUs are queued, so that TCP can build full segments. On partial
+ * writes the remainder is sent when the socket becomes writeable again
+ * (see tcp4_write_space()). This must only be called by the txw work,
+ * since it may sleep, while the writers may not. */
+static void
+tcp4_txq_flush(struct shim_tcp4_flow *priv)
 {
-    struct rl_ipcp_stats *stats =
-        raw_cpu_ptr(flow_priv->flow->txrx.ipcp->stats);
-    struct msghdr msghdr;
-    struct iovec iov[2];
-    uint16_t lenhdr = htons(rb->len);
-    int totlen      = rb->len + sizeof(lenhdr);
-    int ret;
-
-    memset(&msghdr, 0, sizeof(msghdr));
-    iov[0].iov_base = &lenhdr;
-    iov[0].iov_len  = sizeof(lenhdr);
-    iov[1].iov_base = RL_BUF_DATA(rb);
-    iov[1].iov_len  = rb->len;
-
-    msghdr.msg_flags = MSG_DONTWAIT;
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msghdr, (struct kvec *)iov, 2, totlen);
-
-    if (unlikely(ret != totlen)) {
-        PD("wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
-           sock_wspace(flow_priv->sock->sk));
-        if (ret < 0) {
-            PE("kernel_sendmsg(): failed [%d]\n", ret);
+    struct rl_ipcp_stats __percpu *stats = priv->flow->txrx.ipcp->stats;
+    struct kvec iov[2 * INET4_TX_BATCH];
+    uint16_t lenhdr[INET4_TX_BATCH];
+    bool restart = false;
 
-        } else {
-            PI("kernel_sendmsg(): partial write %d/%zu\n", ret, rb->len);
+    for (;;) {
+        struct msghdr msghdr;
+        struct rl_buf *rb, *tmp;
+        struct rb_list sentq;
+        unsigned int first = 0;
+        unsigned int n     = 0;
+        size_t totlen      = 0;
+        size_t skip        = priv->tx_off;
+        size_t sent;
+        bool more;
+        int ret;
+
+        /* Only this function removes PDUs from txq, so they can be
+         * accessed after releasing the lock. */
+        spin_lock_bh(&priv->txq_lock);
+        rb_list_foreach (rb, &priv->txq) {
+            if (n == INET4_TX_BATCH) {
+                break;
+            }
+            lenhdr[n]               = htons(rb->len);
+            iov[2 * n].iov_base     = &lenhdr[n];
+            iov[2 * n].iov_len      = sizeof(lenhdr[n]);
+            iov[2 * n + 1].iov_base = RL_BUF_DATA(rb);
+            iov[2 * n + 1].iov_len  = rb->len;
+            totlen += sizeof(lenhdr[n]) + rb->len;
+            n++;
         }
+        more = priv->txq_len > n;
+        spin_unlock_bh(&priv->txq_lock);
 
-        stats->tx_err++;
-    } else {
-        NPD("kernel_sendmsg(%zu + 2)\n", rb->len);
-        stats->tx_pkt++;
-        stats->tx_byte += rb->len;
-    }
+        if (!n) {
+            break;
+        }
 
-    rl_buf_free(rb);
+        /* Skip what was already sent in a previous partial write. */
+        totlen -= skip;
+        while (skip) {
+            if (skip >= iov[first].iov_len) {
+                skip -= iov[first].iov_len;
+                first++;
+            } else {
+                iov[first].iov_base = (uint8_t *)iov[first].iov_base + skip;
+                iov[first].iov_len -= skip;
+                skip = 0;
+            }
+        }
 
-    return ret;
-}
+        memset(&msghdr, 0, sizeof(msghdr));
+        msghdr.msg_flags = MSG_DONTWAIT | (more ? MSG_MORE : 0);
+        ret = kernel_sendmsg(priv->sock, &msghdr, iov + first, 2 * n - first,
+                             totlen);
+        if (ret == -EAGAIN || ret == 0) {
+            /* Socket buffer full. */
+            break;
+        }
 
-static void
-tcp4_tx_worker(struct work_struct *w)
-{
-    struct rl_shim_tcp4 *priv = container_of(w, struct rl_shim_tcp4, txw);
-    int totlen;
+        rb_list_init(&sentq);
 
-    for (;;) {
-        struct txq_entry *qe = NULL;
+        if (unlikely(ret < 0)) {
+            /* The connection is not usable, drop everything. */
+            PE("kernel_sendmsg(): failed [%d]\n", ret);
+            spin_lock_bh(&priv->txq_lock);
+            rb_list_foreach_safe (rb, tmp, &priv->txq) {
+                rb_list_del(rb);
+                rb_list_enq(rb, &sentq);
+                this_cpu_inc(stats->tx_err);
+            }
+            priv->txq_len = 0;
+            spin_unlock_bh(&priv->txq_lock);
+            priv->tx_off = 0;
+            rl_buf_free_bulk(&sentq);
+            restart = true;
+            break;
+        }
 
+        /* Dequeue the PDUs that have been sent completely. */
+        sent = priv->tx_off + ret;
         spin_lock_bh(&priv->txq_lock);
-        if (priv->txq_len) {
-            qe = list_first_entry(&priv->txq, struct txq_entry, node);
-            list_del_init(&qe->node);
+        rb_list_foreach_safe (rb, tmp, &priv->txq) {
+            size_t len = sizeof(uint16_t) + rb->len;
+
+            if (sent < len) {
+                break;
+            }
+            sent -= len;
+            rb_list_del(rb);
+            rb_list_enq(rb, &sentq);
             priv->txq_len--;
+            this_cpu_inc(stats->tx_pkt);
+            this_cpu_add(stats->tx_byte, rb->len);
         }
         spin_unlock_bh(&priv->txq_lock);
+        priv->tx_off = sent;
+        NPD("kernel_sendmsg(%zu): %d\n", totlen, ret);
 
-        if (!qe) {
-            break;
+        if (!rb_list_empty(&sentq)) {
+            rl_buf_free_bulk(&sentq);
+            restart = true;
         }
 
-        totlen = qe->rb->len + sizeof(uint16_t);
-
-        if (sk_stream_wspace(qe->flow_priv->sock->sk) < totlen + 2) {
-            /* Cannot backpressure here, we have to drop */
-            RPD(1, "Dropping SDU [len=%zu]\n", qe->rb->len);
-            rl_buf_free(qe->rb);
-        } else {
-            tcp4_xmit(qe->flow_priv, qe->rb);
+        if ((size_t)ret < totlen) {
+            /* Partial write, wait for tcp4_write_space(). */
+            break;
         }
+    }
 
-        flow_put(qe->flow_priv->flow);
-        rl_free(qe, RL_MT_SHIMDATA);
+    if (restart) {
+        rl_write_restart_flow(priv->flow);
     }
 }
 
+static void
+tcp4_tx_worker(struct work_struct *w)
+{
+    struct shim_tcp4_flow *priv = container_of(w, struct shim_tcp4_flow, txw);
+
+    tcp4_txq_flush(priv);
+}
+
 static bool
 rl_shim_tcp4_flow_writeable(struct flow_entry *flow)
 {
     struct shim_tcp4_flow *flow_priv = flow->priv;
 
-    return sk_stream_wspace(flow_priv->sock->sk) > 0;
+    return READ_ONCE(flow_priv->txq_len) < INET4_MAX_TXQ_LEN;
 }
 
 static int
@@ -421,49 +488,55 @@ rl_shim_tcp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                        struct rl_buf *rb, unsigned flags)
 {
     struct shim_tcp4_flow *flow_priv = flow->priv;
-    struct rl_shim_tcp4 *shim        = ipcp->priv;
-    int totlen                       = rb->len + sizeof(uint16_t);
 
-    if (sk_stream_wspace(flow_priv->sock->sk) < totlen + 2) {
+    spin_lock_bh(&flow_priv->txq_lock);
+    if (flow_priv->txq_len >= INET4_MAX_TXQ_LEN) {
+        spin_unlock_bh(&flow_priv->txq_lock);
         /* Backpressure: We will be called again. */
         return -EAGAIN;
     }
+    rb_list_enq(rb, &flow_priv->txq);
+    flow_priv->txq_len++;
+    spin_unlock_bh(&flow_priv->txq_lock);
 
-    if (!(flags & RL_RMT_F_MAYSLEEP)) {
-        struct txq_entry *qe =
-            rl_alloc(sizeof(*qe), GFP_ATOMIC, RL_MT_SHIMDATA);
-        bool drop = false;
+    /* Transmit in process context. The caller may be about to sleep
+     * (RL_RMT_F_MAYSLEEP), and kernel_sendmsg() must not be called
+     * when the task is not running. */
+    schedule_work(&flow_priv->txw);
 
-        if (unlikely(!qe)) {
-            rl_buf_free(rb);
-            RPV(1, "Out of memory, dropping packet\n");
-            return -ENOMEM;
-        }
+    return 0;
+}
 
-        qe->rb = rb;
-        flow_get_ref(flow);
-        qe->flow_priv = flow_priv;
-        spin_lock_bh(&shim->txq_lock);
-        if (shim->txq_len > INET4_MAX_TXQ_LEN) {
-            drop = true;
-        } else {
-            list_add_tail(&qe->node, &shim->txq);
-            shim->txq_len++;
-        }
-        spin_unlock_bh(&shim->txq_lock);
+/* Batched version of rl_shim_tcp4_sdu_write(), so that the PDUs can be
+ * sent with a single kernel_sendmsg(). */
+static int
+rl_shim_tcp4_sdu_write_multi(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                             struct rb_list *rbs, unsigned flags)
+{
+    struct shim_tcp4_flow *flow_priv = flow->priv;
+    struct rl_buf *rb, *tmp;
+    int n = 0;
 
-        if (drop) {
-            NPD(2, "Queue full, dropping PDU [len=%u]\n", rb->len);
-            rl_buf_free(rb);
-            return -ENOSPC;
+    spin_lock_bh(&flow_priv->txq_lock);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        if (flow_priv->txq_len >= INET4_MAX_TXQ_LEN) {
+            break;
         }
+        rb_list_del(rb);
+        rb_list_enq(rb, &flow_priv->txq);
+        flow_priv->txq_len++;
+        n++;
+    }
+    spin_unlock_bh(&flow_priv->txq_lock);
 
-        schedule_work(&shim->txw);
-
-        return 0;
+    if (!n) {
+        /* Backpressure: We will be called again. */
+        return -EAGAIN;
     }
 
-    return tcp4_xmit(flow_priv, rb);
+    schedule_work(&flow_priv->txw); /* see rl_shim_tcp4_sdu_write() */
+
+    return n;
 }
 
 static int
@@ -483,6 +556,7 @@ static struct ipcp_factory shim_tcp4_factory = {
     .owner                  = THIS_MODULE,
     .dif_type               = SHIM_DIF_TYPE,
     .use_cep_ids            = false,
+    .integrity              = true, /* TCP checksum */
     .create                 = rl_shim_tcp4_create,
     .ops.destroy            = rl_shim_tcp4_destroy,
     .ops.appl_register      = NULL, /* Reflect to userspace. */
@@ -491,6 +565,7 @@ static struct ipcp_factory shim_tcp4_factory = {
     .ops.flow_init          = rl_shim_tcp4_flow_init,
     .ops.flow_deallocated   = rl_shim_tcp4_flow_deallocated,
     .ops.sdu_write          = rl_shim_tcp4_sdu_write,
+    .ops.sdu_write_multi    = rl_shim_tcp4_sdu_write_multi,
     .ops.config             = rl_shim_tcp4_config,
     .ops.flow_writeable     = rl_shim_tcp4_flow_writeable,
 };
@@ -40,11 +40,39 @@
 #include <linux/file.h>
 #include <linux/version.h>
 #include <linux/udp.h>
+#include <linux/ip.h>
+#include <linux/socket.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
 #include <net/sock.h>
+#ifdef RL_HAVE_UDP_TUNNEL_SOCK
+#include <net/udp_tunnel.h>
+#endif /* RL_HAVE_UDP_TUNNEL_SOCK */
+#ifdef RL_HAVE_UDP_GRO
+#include <linux/sockptr.h>
+#endif /* RL_HAVE_UDP_GRO */
+
+/* Maximum number of PDUs coalesced into a single UDP GSO send. The
+ * iovec is kept on the stack, so we don't go as far as UDP_MAX_SEGMENTS. */
+#define RL_SHIM_UDP4_GSO_SEGS 16
+
+/* Maximum number of segments in a GRO datagram (see UDP_GRO_CNT_MAX). */
+#define RL_SHIM_UDP4_GRO_SEGS 64
+
+#define RL_SHIM_UDP4_ENCAP_HBITS 7
 
-/* This struct is unnecessary, but we keep it to ease future extensions. */
 struct rl_shim_udp4 {
     struct ipcp_entry *ipcp;
+
+    /* Optional UDP encapsulation socket shared by all the flows, enabled
+     * through the "encap-port" parameter. PDUs received on this socket
+     * are demultiplexed to flows in softirq context, looking up the
+     * remote address and port in 'encap_flows'. */
+    struct socket *encap_sock;
+    uint16_t encap_port;
+    DECLARE_HASHTABLE(encap_flows, RL_SHIM_UDP4_ENCAP_HBITS);
+    /* Serializes updates of 'encap_flows'. */
+    spinlock_t encap_lock;
 };
 
 struct shim_udp4_flow {
@@ -59,8 +87,17 @@ struct shim_udp4_flow {
     );
     void (*sk_write_space)(struct sock *sk);
     struct sockaddr_in remote_addr;
-
+    /* Set if the route does not support UDP GSO. */
+    bool gso_off;
+    /* Set if the flow transmits and receives on the shared encapsulation
+     * socket. The flow socket is then only used for the PDUs that were
+     * received before flow allocation completed (see uipcp-shim-udp4.c). */
+    bool encap;
+    struct hlist_node encap_node;
+
+    /* Protects the receive path, including rx_iov. */
     struct mutex rxw_lock;
+    struct kvec rx_iov[RL_SHIM_UDP4_GRO_SEGS];
 };
 
 static void *
@@ -74,6 +111,8 @@ rl_shim_udp4_create(struct ipcp_entry *ipcp)
     }
 
     priv->ipcp = ipcp;
+    hash_init(priv->encap_flows);
+    spin_lock_init(&priv->encap_lock);
 
     /* Set max_sdu_size for the IPCP, considering that the SDU is going
      * to be encapsulated in an UDP packet, and the UDP packet is going
@@ -90,19 +129,114 @@ rl_shim_udp4_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_shim_udp4 *priv = ipcp->priv;
 
+#ifdef RL_HAVE_UDP_TUNNEL_SOCK
+    if (priv->encap_sock) {
+        udp_tunnel_sock_release(priv->encap_sock);
+        /* Wait for udp4_encap_rcv() to complete. */
+        synchronize_rcu();
+    }
+#endif /* RL_HAVE_UDP_TUNNEL_SOCK */
+
     rl_free(priv, RL_MT_SHIM);
 }
 
+static inline u32
+udp4_encap_key(__be32 ip, __be16 port)
+{
+    return (__force u32)ip ^ ((__force u32)port << 16);
+}
+
+/* Must be called under RCU read lock (or under the encap_lock). */
+static struct shim_udp4_flow *
+udp4_encap_lookup(struct rl_shim_udp4 *priv, __be32 ip, __be16 port)
+{
+    struct shim_udp4_flow *fp;
+
+    hash_for_each_possible_rcu(priv->encap_flows, fp, encap_node,
+                               udp4_encap_key(ip, port))
+    {
+        if (fp->remote_addr.sin_addr.s_addr == ip &&
+            fp->remote_addr.sin_port == port) {
+            return fp;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns true if a flow on the shared socket talks to the remote host
+ * 'ip', whatever its port. Must be called under RCU read lock (or under
+ * the encap_lock). */
+static bool
+udp4_encap_host_in_use(struct rl_shim_udp4 *priv, __be32 ip)
+{
+    struct shim_udp4_flow *fp;
+    int bucket;
+
+    hash_for_each_rcu(priv->encap_flows, bucket, fp, encap_node)
+    {
+        if (fp->remote_addr.sin_addr.s_addr == ip) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Learn the UDP port used by the remote endpoint of the flow. For flows
+ * on the shared socket, the flow is rehashed under the new port, unless
+ * another flow already uses that remote endpoint. Returns true if the flow
+ * is now bound to 'port'. */
+static bool
+udp4_remote_port_update(struct shim_udp4_flow *fp, __be16 port)
+{
+    struct rl_shim_udp4 *priv = fp->flow->txrx.ipcp->priv;
+    __be32 ip                 = fp->remote_addr.sin_addr.s_addr;
+    bool ret;
+
+    if (!fp->encap) {
+        fp->remote_addr.sin_port = port;
+        return true;
+    }
+
+    spin_lock_bh(&priv->encap_lock);
+    rcu_read_lock();
+    if (fp->remote_addr.sin_port == htons(RL_SHIM_UDP_PORT) &&
+        !udp4_encap_lookup(priv, ip, port)) {
+        hash_del_rcu(&fp->encap_node);
+        fp->remote_addr.sin_port = port;
+        hash_add_rcu(priv->encap_flows, &fp->encap_node,
+                     udp4_encap_key(ip, port));
+    }
+    rcu_read_unlock();
+    ret = fp->remote_addr.sin_port == port;
+    spin_unlock_bh(&priv->encap_lock);
+
+    return ret;
+}
+
+static inline struct socket *
+udp4_tx_sock(struct shim_udp4_flow *fp)
+{
+    struct rl_shim_udp4 *priv = fp->flow->txrx.ipcp->priv;
+
+    return fp->encap ? priv->encap_sock : fp->sock;
+}
+
 /* Peek in the UDP socket receive queue to get the size of the
  * next datagram. Conceptually equivalent to the SIOCINQ ioctl.
+ * If the datagram aggregates multiple segments (UDP GRO, or GSO over
+ * loopback), the segment size is returned in 'gso_size', otherwise 0.
  * The initial version of this function comes from drivers/vhost/net.c. */
 static inline int
-peek_head_len(struct sock *sk)
+peek_head_len(struct sock *sk, unsigned int *gso_size)
 {
     struct sk_buff *head;
     unsigned long flags;
     int len = 0;
 
+    *gso_size = 0;
+
 #ifdef RL_HAVE_UDP_READER_QUEUE
     /* Newer kernels have and additional 'reader_queue' inside the
      * UDP socket, to reduce contention between the ingress datapath
@@ -111,7 +245,8 @@ peek_head_len(struct sock *sk)
     spin_lock_irqsave(&udp_sk(sk)->reader_queue.lock, flags);
     head = skb_peek(&udp_sk(sk)->reader_queue);
     if (likely(head)) {
-        len = head->len;
+        len       = head->len;
+        *gso_size = skb_shinfo(head)->gso_size;
     }
     spin_unlock_irqrestore(&udp_sk(sk)->reader_queue.lock, flags);
 
@@ -123,14 +258,17 @@ peek_head_len(struct sock *sk)
     spin_lock_irqsave(&sk->sk_receive_queue.lock, flags);
     head = skb_peek(&sk->sk_receive_queue);
     if (head) {
-        len = head->len;
+        len       = head->len;
+        *gso_size = skb_shinfo(head)->gso_size;
     }
     spin_unlock_irqrestore(&sk->sk_receive_queue.lock, flags);
 
     return len;
 }
 
-/* This must be called in process context. */
+/* This must be called in process context. Each datagram is received
+ * directly into a burst of rl_bufs, one per UDP segment, which is then
+ * passed to the upper layer in one go. */
 static void
 udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
 {
@@ -139,10 +277,11 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
      * destination. The endpoint port is learned upon receiving the first
      * packet (i.e., right now).*/
     bool update_port = (priv->remote_addr.sin_port == htons(RL_SHIM_UDP_PORT));
-    struct flow_entry *flow     = priv->flow;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct socket *sock         = priv->sock;
-    struct msghdr msg           = {
+    struct flow_entry *flow              = priv->flow;
+    struct ipcp_entry *ipcp              = flow->txrx.ipcp;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct socket *sock                  = priv->sock;
+    struct msghdr msg                    = {
         .msg_control    = NULL,
         .msg_controllen = 0,
         .msg_name       = NULL,
@@ -154,48 +293,76 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
 
     for (;;) {
         struct sockaddr_in remote_addr;
-        struct rl_buf *rb;
-        struct iovec iov;
+        unsigned int gso_size;
+        unsigned int nsegs;
+        struct rl_buf *rb, *tmp;
+        struct rb_list rbs;
+        size_t left;
+        int len;
         int ret;
+        int i = 0;
 
-        ret = peek_head_len(sock->sk);
-        if (!ret) {
+        len = peek_head_len(sock->sk, &gso_size);
+        if (!len) {
             break;
         }
 
-        rb = rl_buf_alloc(ret, priv->flow->txrx.ipcp->rxhdroom,
-                          priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
-        if (unlikely(!rb)) {
-            stats->rx_err++;
+        if (!gso_size || gso_size >= len) {
+            gso_size = len;
+        }
+        nsegs = DIV_ROUND_UP(len, gso_size);
+        if (unlikely(nsegs > RL_SHIM_UDP4_GRO_SEGS)) {
+            /* Should never happen, receive the datagram as a whole. */
+            RPD(1, "Too many segments (%u x %u)\n", nsegs, gso_size);
+            gso_size = len;
+            nsegs    = 1;
+        }
+
+        rb_list_init(&rbs);
+        if (unlikely(rl_buf_alloc_bulk(gso_size, ipcp->rxhdroom,
+                                       ipcp->tailroom, GFP_ATOMIC, &rbs,
+                                       nsegs) != nsegs)) {
+            rl_buf_free_bulk(&rbs);
+            this_cpu_inc(stats->rx_err);
             RPV(1, "Out of memory\n");
             break;
         }
-        rl_buf_append(rb, ret);
+
+        left = len;
+        rb_list_foreach (rb, &rbs) {
+            size_t seglen = min_t(size_t, left, gso_size);
+
+            rl_buf_append(rb, seglen);
+            priv->rx_iov[i].iov_base = RL_BUF_DATA(rb);
+            priv->rx_iov[i].iov_len  = seglen;
+            left -= seglen;
+            i++;
+        }
 
         if (unlikely(update_port)) {
             msg.msg_name    = &remote_addr;
             msg.msg_namelen = sizeof(remote_addr);
         }
-        iov.iov_base = RL_BUF_DATA(rb);
-        iov.iov_len  = rb->len;
 
-        ret = kernel_recvmsg(sock, &msg, (struct kvec *)&iov, 1, iov.iov_len,
+        ret = kernel_recvmsg(sock, &msg, priv->rx_iov, nsegs, len,
                              msg.msg_flags);
         if (ret == -EAGAIN) {
+            rl_buf_free_bulk(&rbs);
             break;
         } else if (unlikely(ret <= 0)) {
             if (ret) {
-                PE("recvmsg(%zu): %d\n", iov.iov_len, ret);
-                stats->rx_err++;
+                PE("recvmsg(%d): %d\n", len, ret);
+                this_cpu_inc(stats->rx_err);
             } else {
                 PI("Exit rx loop\n");
             }
+            rl_buf_free_bulk(&rbs);
             break;
         }
 
         if (unlikely(update_port)) {
             /* Grab the right (source) UDP port used by the other side. */
-            priv->remote_addr.sin_port = remote_addr.sin_port;
+            udp4_remote_port_update(priv, remote_addr.sin_port);
             PD("sock %p updated with port %u\n", priv->sock,
                ntohs(priv->remote_addr.sin_port));
             update_port     = false;
@@ -203,11 +370,24 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
             msg.msg_namelen = 0;
         }
 
-        NPD("read %d bytes\n", ret);
-        rb->len = ret;
-        rl_sdu_rx_flow(flow->txrx.ipcp, flow, rb, true);
-        stats->rx_pkt++;
-        stats->rx_byte += ret;
+        NPD("read %d bytes (%u segments)\n", ret, nsegs);
+        this_cpu_add(stats->rx_pkt, nsegs);
+        this_cpu_add(stats->rx_byte, ret);
+        if (unlikely(ret < len)) {
+            /* Short read, trim the burst. */
+            left = ret;
+            rb_list_foreach_safe (rb, tmp, &rbs) {
+                if (!left) {
+                    rb_list_del(rb);
+                    rl_buf_free(rb);
+                    this_cpu_dec(stats->rx_pkt);
+                    continue;
+                }
+                rb->len = min_t(size_t, left, rb->len);
+                left -= rb->len;
+            }
+        }
+        rl_sdu_rx_flow_multi(ipcp, flow, &rbs, true);
     }
 
     mutex_unlock(&priv->rxw_lock);
@@ -245,9 +425,134 @@ udp4_write_space(struct sock *sk)
     rl_write_restart_flow(priv->flow);
 }
 
+#ifdef RL_HAVE_UDP_TUNNEL_SOCK
+/* Receive handler of the shared encapsulation socket, called in softirq
+ * context with the UDP checksum already verified. The skb is always
+ * consumed. */
+static int
+udp4_encap_rcv(struct sock *sk, struct sk_buff *skb)
+{
+    struct rl_shim_udp4 *priv = rcu_dereference_sk_user_data(sk);
+    struct rl_ipcp_stats __percpu *stats;
+    struct shim_udp4_flow *fp;
+    struct rl_buf *rb;
+    __be32 saddr;
+    __be16 sport;
+    unsigned len;
+
+    if (unlikely(!priv)) {
+        goto drop;
+    }
+    stats = priv->ipcp->stats;
+
+    saddr = ip_hdr(skb)->saddr;
+    sport = udp_hdr(skb)->source;
+    __skb_pull(skb, sizeof(struct udphdr));
+
+    fp = udp4_encap_lookup(priv, saddr, sport);
+    if (unlikely(!fp)) {
+        /* This may be the first PDU sent by the remote endpoint of a
+         * flow we allocated, which is still waiting to learn the remote
+         * port. */
+        fp = udp4_encap_lookup(priv, saddr, htons(RL_SHIM_UDP_PORT));
+        if (!fp) {
+            RPD(1, "PDU from unknown endpoint %pI4:%u\n", &saddr,
+                ntohs(sport));
+            this_cpu_inc(stats->rx_err);
+            goto drop;
+        }
+        if (!udp4_remote_port_update(fp, sport)) {
+            /* Another PDU already taught the flow a different port. */
+            RPD(1, "PDU from unexpected endpoint %pI4:%u\n", &saddr,
+                ntohs(sport));
+            this_cpu_inc(stats->rx_err);
+            goto drop;
+        }
+        PD("flow %p updated with port %u\n", fp, ntohs(sport));
+    }
+
+#ifndef RL_SKB
+    /* Same as shim-eth, try to avoid copying the PDU. */
+    rb = rl_buf_adopt_skb(skb);
+    if (unlikely(!rb)) {
+        struct ipcp_entry *ipcp = priv->ipcp;
+
+        rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom,
+                          GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            RPV(1, "Out of memory\n");
+            this_cpu_inc(stats->rx_err);
+            goto drop;
+        }
+        skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
+        rl_buf_append(rb, skb->len);
+        kfree_skb(skb);
+    }
+#else  /* RL_SKB */
+    rb = skb;
+#endif /* RL_SKB */
+
+    len = rb->len;
+    this_cpu_inc(stats->rx_pkt);
+    this_cpu_add(stats->rx_byte, len);
+    rl_sdu_rx_flow(priv->ipcp, fp->flow, rb, true);
+
+    return 0;
+drop:
+    kfree_skb(skb);
+    return 0;
+}
+
+static void
+udp4_encap_write_space(struct sock *sk)
+{
+    struct rl_shim_udp4 *priv;
+
+    rcu_read_lock();
+    priv = rcu_dereference_sk_user_data(sk);
+    if (priv && sock_writeable(sk)) {
+        rl_write_restart_flows(priv->ipcp);
+    }
+    rcu_read_unlock();
+}
+
+static int
+udp4_encap_sock_create(struct rl_shim_udp4 *priv)
+{
+    struct net *net = rl_ipcp_net(priv->ipcp);
+    struct udp_tunnel_sock_cfg tunnel_cfg;
+    struct udp_port_cfg udp_conf;
+    struct socket *sock;
+    int ret;
+
+    memset(&udp_conf, 0, sizeof(udp_conf));
+    udp_conf.family          = AF_INET;
+    udp_conf.local_ip.s_addr = htonl(INADDR_ANY);
+    udp_conf.local_udp_port  = htons(priv->encap_port);
+    ret                      = udp_sock_create(net, &udp_conf, &sock);
+    if (ret) {
+        return ret;
+    }
+
+    sock->sk->sk_write_space = udp4_encap_write_space;
+    sock_reset_flag(sock->sk, SOCK_USE_WRITE_QUEUE);
+
+    memset(&tunnel_cfg, 0, sizeof(tunnel_cfg));
+    tunnel_cfg.sk_user_data = priv;
+    tunnel_cfg.encap_type   = 1;
+    tunnel_cfg.encap_rcv    = udp4_encap_rcv;
+    setup_udp_tunnel_sock(net, sock, &tunnel_cfg);
+
+    WRITE_ONCE(priv->encap_sock, sock);
+
+    return 0;
+}
+#endif /* RL_HAVE_UDP_TUNNEL_SOCK */
+
 static int
 rl_shim_udp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
+    struct rl_shim_udp4 *shim = ipcp->priv;
     struct shim_udp4_flow *priv;
     struct socket *sock;
     int err;
@@ -270,6 +575,8 @@ rl_shim_udp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     flow->priv = priv;
     priv->flow = flow;
     priv->sock = sock;
+    priv->gso_off = false;
+    priv->encap   = false;
     INIT_WORK(&priv->rxw, udp4_rx_worker);
     mutex_init(&priv->rxw_lock);
 
@@ -289,9 +596,51 @@ rl_shim_udp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 
     sock_reset_flag(sock->sk, SOCK_USE_WRITE_QUEUE);
 
+#ifdef RL_HAVE_UDP_GRO
+    {
+        /* Let the UDP stack hand us aggregated datagrams, which are
+         * split again by udp4_drain_socket_rxq(). */
+        int one = 1;
+
+        err = sock->ops->setsockopt(sock, SOL_UDP, UDP_GRO,
+                                    KERNEL_SOCKPTR(&one), sizeof(one));
+        if (err) {
+            PD("Cannot enable UDP GRO on socket %p [%d]\n", sock, err);
+        }
+    }
+#endif /* RL_HAVE_UDP_GRO */
+
     PD("Got socket %p, IP %08x, port %u\n", sock, ntohl(flow->cfg.inet_ip),
        ntohs(flow->cfg.inet_port));
 
+    if (READ_ONCE(shim->encap_sock)) {
+        __be32 ip   = priv->remote_addr.sin_addr.s_addr;
+        __be16 port = priv->remote_addr.sin_port;
+
+        /* All the flows on the shared socket send from the same local
+         * endpoint, which the remote uipcp uses to tell flows apart while
+         * they are being allocated. Moreover, the remote port of a flow
+         * is only learnt later. Therefore only one flow towards each
+         * remote host can use the shared socket; the other ones keep
+         * using their own socket. */
+        spin_lock_bh(&shim->encap_lock);
+        rcu_read_lock();
+        if (!udp4_encap_host_in_use(shim, ip)) {
+            /* From now on, PDUs are exchanged through the shared
+             * socket. */
+            priv->encap = true;
+            rl_flow_share_tx_wqh(flow);
+            hash_add_rcu(shim->encap_flows, &priv->encap_node,
+                         udp4_encap_key(ip, port));
+        }
+        rcu_read_unlock();
+        spin_unlock_bh(&shim->encap_lock);
+        if (!priv->encap) {
+            PD("Remote host %pI4 in use, flow %p keeps socket %p\n", &ip,
+               priv, sock);
+        }
+    }
+
     /* It often happens then the remote endpoint sent some data before
      * this flow_init() function is called, and therefore before we
      * have the chance to intercept that data with the sk_data_ready()
@@ -314,6 +663,16 @@ rl_shim_udp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
         return 0;
     }
 
+    if (priv->encap) {
+        struct rl_shim_udp4 *shim = ipcp->priv;
+
+        spin_lock_bh(&shim->encap_lock);
+        hash_del_rcu(&priv->encap_node);
+        spin_unlock_bh(&shim->encap_lock);
+        /* Wait for udp4_encap_rcv() to complete. */
+        synchronize_rcu();
+    }
+
     cancel_work_sync(&priv->rxw);
 
     sock = priv->sock;
@@ -336,42 +695,72 @@ rl_shim_udp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     return 0;
 }
 
+/* Send 'niov' PDUs with a single sendmsg(). If 'gso_size' is not zero, the
+ * UDP stack segments the payload into datagrams of 'gso_size' bytes (the
+ * last one may be shorter), so that each PDU gets its own datagram. */
+static int
+udp4_sendmsg(struct shim_udp4_flow *flow_priv, struct kvec *iov,
+             unsigned int niov, size_t len, u16 gso_size, unsigned flags)
+{
+#ifdef RL_HAVE_UDP_SEGMENT
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(u16))];
+    } cmsgbuf;
+#endif /* RL_HAVE_UDP_SEGMENT */
+    struct msghdr msg = {
+        .msg_name       = (struct sockaddr *)&flow_priv->remote_addr,
+        .msg_namelen    = sizeof(flow_priv->remote_addr),
+        .msg_control    = NULL,
+        .msg_controllen = 0,
+        .msg_flags      = (flags & RL_RMT_F_MAYSLEEP) ? 0 : MSG_DONTWAIT,
+    };
+
+#ifdef RL_HAVE_UDP_SEGMENT
+    if (gso_size) {
+        struct cmsghdr *cmsg;
+
+        msg.msg_control    = &cmsgbuf;
+        msg.msg_controllen = sizeof(cmsgbuf);
+        cmsg               = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level   = SOL_UDP;
+        cmsg->cmsg_type    = UDP_SEGMENT;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(u16));
+
+        *(u16 *)CMSG_DATA(cmsg) = gso_size;
+    }
+#endif /* RL_HAVE_UDP_SEGMENT */
+
+    return kernel_sendmsg(udp4_tx_sock(flow_priv), &msg, iov, niov, len);
+}
+
 static int
 rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                        struct rl_buf *rb, unsigned flags)
 {
-    struct rl_ipcp_stats *stats      = raw_cpu_ptr(ipcp->stats);
-    struct shim_udp4_flow *flow_priv = flow->priv;
-    struct msghdr msg;
-    struct iovec iov;
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct shim_udp4_flow *flow_priv     = flow->priv;
+    struct kvec iov;
     int ret;
 
     iov.iov_base = RL_BUF_DATA(rb);
     iov.iov_len  = rb->len;
 
-    msg.msg_name       = (struct sockaddr *)&flow_priv->remote_addr;
-    msg.msg_namelen    = sizeof(flow_priv->remote_addr);
-    msg.msg_control    = NULL;
-    msg.msg_controllen = 0;
-    msg.msg_flags      = (flags & RL_RMT_F_MAYSLEEP) ? 0 : MSG_DONTWAIT;
-
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msg, (struct kvec *)&iov, 1, rb->len);
+    ret = udp4_sendmsg(flow_priv, &iov, 1, rb->len, 0, flags);
 
     if (unlikely(ret != rb->len)) {
-        RPD(1, "wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
-            sock_wspace(flow_priv->sock->sk));
+        RPD(1, "wspace: %lu\n", sock_wspace(udp4_tx_sock(flow_priv)->sk));
         if (ret == -EAGAIN) {
             /* Backpressure. Don't destroy the packet, we will called again. */
             return -EAGAIN;
         }
 
         PE("kernel_sendmsg(%zu): failed [%d]\n", rb->len, ret);
-        stats->tx_err++;
+        this_cpu_inc(stats->tx_err);
     } else {
         NPD("kernel_sendmsg(%zu)\n", rb->len);
-        stats->tx_pkt++;
-        stats->tx_byte += rb->len;
+        this_cpu_inc(stats->tx_pkt);
+        this_cpu_add(stats->tx_byte, rb->len);
     }
 
     rl_buf_free(rb);
@@ -379,25 +768,150 @@ rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return ret;
 }
 
+#ifdef RL_HAVE_UDP_SEGMENT
+/* Batched version of rl_shim_udp4_sdu_write(). Trains of PDUs with the
+ * same length (except for the last one, which may be shorter) are sent
+ * with a single UDP GSO sendmsg(). */
+static int
+rl_shim_udp4_sdu_write_multi(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                             struct rb_list *rbs, unsigned flags)
+{
+    struct rl_ipcp_stats __percpu *stats = ipcp->stats;
+    struct shim_udp4_flow *flow_priv     = flow->priv;
+    struct kvec iov[RL_SHIM_UDP4_GSO_SEGS];
+    int n   = 0;
+    int ret = 0;
+
+    while (!rb_list_empty(rbs)) {
+        unsigned int maxsegs = flow_priv->gso_off ? 1 : RL_SHIM_UDP4_GSO_SEGS;
+        size_t seglen        = rb_list_front(rbs)->len;
+        unsigned int nsegs   = 0;
+        size_t len           = 0;
+        struct rl_buf *rb;
+
+        /* Build the train. */
+        rb_list_foreach (rb, rbs) {
+            if (nsegs == maxsegs || rb->len > seglen ||
+                len + rb->len > U16_MAX - 8 /* UDP hdr */ - 40 /* IP hdr */) {
+                break;
+            }
+            iov[nsegs].iov_base = RL_BUF_DATA(rb);
+            iov[nsegs].iov_len  = rb->len;
+            len += rb->len;
+            nsegs++;
+            if (rb->len < seglen) {
+                break; /* only the last one can be shorter */
+            }
+        }
+
+        ret = udp4_sendmsg(flow_priv, iov, nsegs, len,
+                           nsegs > 1 ? seglen : 0, flags);
+        if (ret == -EAGAIN) {
+            /* Backpressure. Leave the train in 'rbs'. */
+            break;
+        }
+        if (unlikely(nsegs > 1 && (ret == -EINVAL || ret == -EIO))) {
+            /* The route (e.g., the MTU or the lack of checksum offload)
+             * does not allow UDP GSO. Fall back to one PDU per sendmsg. */
+            PD("UDP GSO not available on flow %p [%d]\n", flow_priv, ret);
+            flow_priv->gso_off = true;
+            continue;
+        }
+
+        if (unlikely(ret != len)) {
+            PE("kernel_sendmsg(%zu): failed [%d]\n", len, ret);
+            this_cpu_add(stats->tx_err, nsegs);
+        } else {
+            NPD("kernel_sendmsg(%zu, %u segments)\n", len, nsegs);
+            this_cpu_add(stats->tx_pkt, nsegs);
+            this_cpu_add(stats->tx_byte, len);
+            ret = 0;
+        }
+
+        for (; nsegs > 0; nsegs--) {
+            rb = rb_list_front(rbs);
+            rb_list_del(rb);
+            rl_buf_free(rb);
+            n++;
+        }
+
+        if (unlikely(ret)) {
+            break;
+        }
+    }
+
+    return n ? n : ret;
+}
+#endif /* RL_HAVE_UDP_SEGMENT */
+
 static bool
 rl_shim_udp4_flow_writeable(struct flow_entry *flow)
 {
     struct shim_udp4_flow *flow_priv = flow->priv;
 
-    return sock_writeable(flow_priv->sock->sk);
+    return sock_writeable(udp4_tx_sock(flow_priv)->sk);
 }
 
 static int
 rl_shim_udp4_config(struct ipcp_entry *ipcp, const char *param_name,
                     const char *param_value, int *notify)
 {
+    struct rl_shim_udp4 *priv = ipcp->priv;
+
     if (strcmp(param_name, "mss") == 0) {
         return -EPERM; /* deny */
     }
 
+    if (strcmp(param_name, "encap-port") == 0) {
+#ifdef RL_HAVE_UDP_TUNNEL_SOCK
+        uint16_t port;
+        int ret;
+
+        if (priv->encap_sock) {
+            /* The encapsulation port can only be set once, as flows
+             * may be using the shared socket. */
+            return -EBUSY;
+        }
+        ret = rl_configstr_to_u16(param_value, &port, NULL);
+        if (ret) {
+            return ret;
+        }
+        if (port == 0 || port == RL_SHIM_UDP_PORT) {
+            /* The latter is reserved for flow allocation. */
+            return -EINVAL;
+        }
+        priv->encap_port = port;
+        ret              = udp4_encap_sock_create(priv);
+        if (ret) {
+            PE("Cannot create encapsulation socket on port %u [%d]\n", port,
+               ret);
+            priv->encap_port = 0;
+        }
+        return ret;
+#else  /* !RL_HAVE_UDP_TUNNEL_SOCK */
+        return -EOPNOTSUPP;
+#endif /* !RL_HAVE_UDP_TUNNEL_SOCK */
+    }
+
     return -ENOSYS;
 }
 
+static int
+rl_shim_udp4_config_get(struct ipcp_entry *ipcp, const char *param_name,
+                        char *buf, int buflen)
+{
+    struct rl_shim_udp4 *priv = ipcp->priv;
+    int ret                   = 0;
+
+    if (strcmp(param_name, "encap-port") == 0) {
+        snprintf(buf, buflen, "%u", priv->encap_port);
+    } else {
+        ret = -ENOSYS;
+    }
+
+    return ret;
+}
+
 #define SHIM_DIF_TYPE "shim-udp4"
 
 static struct ipcp_factory shim_udp4_factory = {
@@ -412,7 +926,11 @@ static struct ipcp_factory shim_udp4_factory = {
     .ops.flow_init          = rl_shim_udp4_flow_init,
     .ops.flow_deallocated   = rl_shim_udp4_flow_deallocated,
     .ops.sdu_write          = rl_shim_udp4_sdu_write,
+#ifdef RL_HAVE_UDP_SEGMENT
+    .ops.sdu_write_multi    = rl_shim_udp4_sdu_write_multi,
+#endif /* RL_HAVE_UDP_SEGMENT */
     .ops.config             = rl_shim_udp4_config,
+    .ops.config_get         = rl_shim_udp4_config_get,
     .ops.flow_writeable     = rl_shim_udp4_flow_writeable,
 };
 
@@ -26,6 +26,8 @@ rlite-ctl dif-policy-param-mod dd enrollment keepalive 4s
 rlite-ctl dif-policy-param-mod dd enrollment keepalive-thresh 2
 
 rlite-ctl dif-policy-param-mod dd flowalloc force-flow-control true
+rlite-ctl dif-policy-param-mod dd flowalloc congestion-control reno
+rlite-ctl dif-policy-param-mod dd flowalloc qos-delay-bounds 1000,10000
 
 rlite-ctl dif-policy-param-mod dd resalloc reliable-flows true
 rlite-ctl dif-policy-param-mod dd resalloc reliable-n-flows true
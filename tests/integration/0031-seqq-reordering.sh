@@ -0,0 +1,40 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Create two namespaces, a veth pair, and assign each end of the pair
+# to a different namespace.
+create_veth_pair veth red green
+create_namespace green
+create_namespace red
+add_veth_to_namespace green veth.green
+add_veth_to_namespace red veth.red
+
+# Reorder a good fraction of the frames sent by the client, so that
+# the server-side sequencing queue is always busy.
+ip netns exec red tc qdisc add dev veth.red root netem delay 2ms reorder 25% 50%
+
+# Normal over shim eth setup in the green namespace
+ip netns exec green rlite-ctl ipcp-create green.eth shim-eth edif
+ip netns exec green rlite-ctl ipcp-config green.eth netdev veth.green
+ip netns exec green rlite-ctl ipcp-config green.eth flow-del-wait-ms 100
+ip netns exec green rlite-ctl ipcp-create green.n normal mydif
+ip netns exec green rlite-ctl ipcp-config green.n flow-del-wait-ms 900
+ip netns exec green rlite-ctl ipcp-enroller-enable green.n
+ip netns exec green rlite-ctl ipcp-register green.n edif
+start_daemon_namespace green rinaperf -lw -z rpinst1
+
+# Normal over shim eth setup in the red namespace
+ip netns exec red rlite-ctl ipcp-create red.eth shim-eth edif
+ip netns exec red rlite-ctl ipcp-config red.eth netdev veth.red
+ip netns exec red rlite-ctl ipcp-config red.eth flow-del-wait-ms 100
+ip netns exec red rlite-ctl ipcp-create red.n normal mydif
+ip netns exec red rlite-ctl ipcp-config red.n flow-del-wait-ms 900
+ip netns exec red rlite-ctl ipcp-register red.n edif
+ip netns exec red rlite-ctl ipcp-enroll red.n mydif edif green.n
+
+# Reliable (in-order) perf run across the reordering link. The
+# goodput reported by rinaperf measures the cost of out-of-order
+# reassembly on the receiver.
+ip netns exec red rinaperf -z rpinst1 -t perf -g 0 -s 1000 -D 3
+ip netns exec red rinaperf -z rpinst1 -t perf -g 0 -s 1000 -c 20000
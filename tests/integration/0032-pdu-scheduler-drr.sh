@@ -0,0 +1,114 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Create a normal IPCP
+rlite-ctl ipcp-create pippo normal dd
+rlite-ctl ipcp-config pippo flow-del-wait-ms 250
+
+# Check that we can set the DRR scheduler and configure it
+rlite-ctl ipcp-config pippo sched drr
+rlite-ctl ipcp-config-get pippo sched | grep "\<drr\>"
+rlite-ctl ipcp-sched-config pippo drr && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1600 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 0 weights 1,2 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1600 weights 0,2 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1600 weights 1,2,4
+rlite-ctl ipcp-sched-config pippo wrr qsize 65535 quantum 1600 weights 1,2 && false
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 1 quantum 1600 weights 1,2 && false
+
+# Check that we can switch to the hierarchical scheduler and configure it
+rlite-ctl ipcp-config pippo sched prio-drr
+rlite-ctl ipcp-config-get pippo sched | grep "\<prio-drr\>"
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 quantum 1600 weights 1,2 && false
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 1 quantum 1600 && false
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 2 quantum 1600 weights 1,3
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 0 quantum 1600 weights 5
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1600 weights 1,2 && false
+rlite-ctl ipcp-destroy pippo
+
+# Flows local to an IPCP never reach the scheduler, so measure the
+# schedulers on the N-1 flow between two normal IPCPs in different
+# namespaces. The veth is rate limited in both directions, so that
+# PDUs queue up in the scheduler of the sending IPCP: 'drr' is used
+# from red to green, and 'prio-drr' from green to red.
+create_veth_pair veth red green
+create_namespace green
+create_namespace red
+add_veth_to_namespace green veth.green
+add_veth_to_namespace red veth.red
+ip netns exec red tc qdisc add dev veth.red root tbf rate 20mbit burst 8kb limit 16kb
+ip netns exec green tc qdisc add dev veth.green root tbf rate 20mbit burst 8kb limit 16kb
+
+ip netns exec green rlite-ctl ipcp-create green.eth shim-eth edif
+ip netns exec green rlite-ctl ipcp-config green.eth netdev veth.green
+ip netns exec green rlite-ctl ipcp-config green.eth flow-del-wait-ms 100
+ip netns exec green rlite-ctl ipcp-create green.n normal mydif
+ip netns exec green rlite-ctl ipcp-config green.n flow-del-wait-ms 250
+ip netns exec green rlite-ctl ipcp-config green.n sched prio-drr
+ip netns exec green rlite-ctl ipcp-sched-config green.n prio-drr qsize 65535 levels 1 quantum 1600 weights 1,3
+ip netns exec green rlite-ctl ipcp-enroller-enable green.n
+ip netns exec green rlite-ctl ipcp-register green.n edif
+ip netns exec green rlite-ctl dif-policy-param-mod mydif addralloc nack-wait 1s
+
+ip netns exec red rlite-ctl ipcp-create red.eth shim-eth edif
+ip netns exec red rlite-ctl ipcp-config red.eth netdev veth.red
+ip netns exec red rlite-ctl ipcp-config red.eth flow-del-wait-ms 100
+ip netns exec red rlite-ctl ipcp-create red.n normal mydif
+ip netns exec red rlite-ctl ipcp-config red.n flow-del-wait-ms 250
+ip netns exec red rlite-ctl ipcp-config red.n sched drr
+ip netns exec red rlite-ctl ipcp-sched-config red.n drr qsize 65535 quantum 1600 weights 1,4
+ip netns exec red rlite-ctl ipcp-register red.n edif
+ip netns exec red rlite-ctl ipcp-enroll red.n mydif edif green.n
+
+# Flows asking for a maximum delay of at most 1ms get QoS id 0, flows
+# asking for at most 100ms get QoS id 1, the others get QoS id 2.
+ip netns exec red rlite-ctl dif-policy-param-mod mydif flowalloc qos-delay-bounds 1000,100000
+ip netns exec green rlite-ctl dif-policy-param-mod mydif flowalloc qos-delay-bounds 1000,100000
+
+start_daemon_namespace green rinaperf -lw -z rpgreen
+start_daemon_namespace red rinaperf -lw -z rpred
+ip netns exec red rinaperf -z rpgreen -c 4 -i 10
+ip netns exec green rinaperf -z rpred -c 4 -i 10
+
+OUT1=$(mktemp)
+OUT2=$(mktemp)
+OUT3=$(mktemp)
+cumulative_trap "rm -f $OUT1 $OUT2 $OUT3" "EXIT"
+
+# DRR: two greedy flows in the classes with weights 1 and 4 must share
+# the link in the same proportion.
+ip netns exec red rinaperf -z rpgreen -t perf -s 1000 -i 0 -D 5 -E 1000 > $OUT1 &
+pid1=$!
+ip netns exec red rinaperf -z rpgreen -t perf -s 1000 -i 0 -D 5 > $OUT2 &
+pid2=$!
+# Check that we cannot change the scheduler while the IPCP
+# is supporting flows
+sleep 1
+ip netns exec red rlite-ctl ipcp-config red.n sched prio-drr && false
+wait $pid1
+wait $pid2
+cat $OUT1 $OUT2
+kpps1=$(awk '/^Receiver/ {print $3}' $OUT1)
+kpps2=$(awk '/^Receiver/ {print $3}' $OUT2)
+awk -v a="$kpps1" -v b="$kpps2" 'BEGIN { r = b / a; print "DRR ratio " r; exit !(r > 2.5 && r < 6) }'
+
+# Prio-DRR: a rate-limited flow in the priority class (8 Mbps out of 20)
+# must not lose PDUs, while two greedy flows in the DRR classes with
+# weights 1 and 3 share what is left in the same proportion.
+ip netns exec green rinaperf -z rpred -t perf -s 1000 -i 1000 -D 5 -E 1000 > $OUT1 &
+pid1=$!
+ip netns exec green rinaperf -z rpred -t perf -s 1000 -i 0 -D 5 -E 100000 > $OUT2 &
+pid2=$!
+ip netns exec green rinaperf -z rpred -t perf -s 1000 -i 0 -D 5 > $OUT3 &
+pid3=$!
+wait $pid1
+wait $pid2
+wait $pid3
+cat $OUT1 $OUT2 $OUT3
+sent=$(awk '/^Sender/ {print $2}' $OUT1)
+rcvd=$(awk '/^Receiver/ {print $2}' $OUT1)
+awk -v s="$sent" -v r="$rcvd" 'BEGIN { print "priority delivered " r "/" s; exit !(s > 0 && r >= 0.95 * s) }'
+kpps2=$(awk '/^Receiver/ {print $3}' $OUT2)
+kpps3=$(awk '/^Receiver/ {print $3}' $OUT3)
+awk -v a="$kpps2" -v b="$kpps3" 'BEGIN { r = b / a; print "DRR ratio " r; exit !(r > 1.8 && r < 4.5) }'
@@ -0,0 +1,79 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Create a normal IPCP
+rlite-ctl ipcp-create pippo normal dd
+rlite-ctl ipcp-config pippo flow-del-wait-ms 250
+
+# Check that we can set the FQ-CoDel scheduler and configure it
+rlite-ctl ipcp-config pippo sched fq-codel
+rlite-ctl ipcp-config-get pippo sched | grep "\<fq-codel\>"
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 0 && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 flows 0 && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 ecn maybe && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 target 5000 interval 1000 && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 target && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 xyz 3 && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 quantum 1500 flows 128 target 2000 interval 50000 ecn off
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 65535 flows 16 ecn on
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1600 weights 1,2 && false
+rlite-ctl ipcp-stats pippo | grep "rmt.ecn_mark"
+rlite-ctl ipcp-destroy pippo
+
+# Flows local to an IPCP never reach the scheduler, so load the N-1 flow
+# between two normal IPCPs in different namespaces. The veth is rate
+# limited from red to green, so that PDUs queue up in the scheduler of
+# red.n.
+create_veth_pair veth red green
+create_namespace green
+create_namespace red
+add_veth_to_namespace green veth.green
+add_veth_to_namespace red veth.red
+ip netns exec red tc qdisc add dev veth.red root tbf rate 20mbit burst 8kb limit 16kb
+
+ip netns exec green rlite-ctl ipcp-create green.eth shim-eth edif
+ip netns exec green rlite-ctl ipcp-config green.eth netdev veth.green
+ip netns exec green rlite-ctl ipcp-config green.eth flow-del-wait-ms 100
+ip netns exec green rlite-ctl ipcp-create green.n normal mydif
+ip netns exec green rlite-ctl ipcp-config green.n flow-del-wait-ms 250
+ip netns exec green rlite-ctl ipcp-enroller-enable green.n
+ip netns exec green rlite-ctl ipcp-register green.n edif
+ip netns exec green rlite-ctl dif-policy-param-mod mydif addralloc nack-wait 1s
+start_daemon_namespace green rinaperf -lw -z rpgreen
+
+ip netns exec red rlite-ctl ipcp-create red.eth shim-eth edif
+ip netns exec red rlite-ctl ipcp-config red.eth netdev veth.red
+ip netns exec red rlite-ctl ipcp-config red.eth flow-del-wait-ms 100
+ip netns exec red rlite-ctl ipcp-create red.n normal mydif
+ip netns exec red rlite-ctl ipcp-config red.n flow-del-wait-ms 250
+ip netns exec red rlite-ctl ipcp-config red.n sched fq-codel
+ip netns exec red rlite-ctl ipcp-sched-config red.n fq-codel qsize 262144 flows 1024 target 2000 interval 20000 ecn on
+ip netns exec red rlite-ctl ipcp-register red.n edif
+ip netns exec red rlite-ctl ipcp-enroll red.n mydif edif green.n
+ip netns exec red rinaperf -z rpgreen -c 4 -i 10
+
+OUT1=$(mktemp)
+OUT2=$(mktemp)
+cumulative_trap "rm -f $OUT1 $OUT2" "EXIT"
+
+# Saturate the link with a greedy flow, whose queue delay builds up to
+# tens of milliseconds at 20 Mbps. A ping flow hashed to a different queue
+# must not wait behind it.
+ip netns exec red rinaperf -z rpgreen -t perf -s 1000 -i 0 -D 6 > $OUT1 &
+pid1=$!
+sleep 1
+# Check that we cannot change the scheduler while the IPCP
+# is supporting flows
+ip netns exec red rlite-ctl ipcp-config red.n sched none && false
+ip netns exec red rinaperf -z rpgreen -c 40 -i 50000 > $OUT2
+wait $pid1
+cat $OUT1 $OUT2
+avg=$(awk -F'[/ ]' '/^rtt/ {print $8}' $OUT2)
+awk -v a="$avg" 'BEGIN { print "ping avg " a " ms"; exit !(a > 0 && a < 30) }'
+
+# The standing queue of the greedy flow must have been ECN marked.
+ip netns exec red rlite-ctl ipcp-stats red.n
+marks=$(ip netns exec red rlite-ctl ipcp-stats red.n | awk '/rmt.ecn_mark/ {print $3}')
+test "$marks" -gt 0
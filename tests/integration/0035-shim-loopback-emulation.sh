@@ -0,0 +1,30 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+rlite-ctl ipcp-create sl shim-loopback dd
+rlite-ctl ipcp-config sl flow-del-wait-ms 100
+# Link emulation parameters
+rlite-ctl ipcp-config sl delay-us 2000
+rlite-ctl ipcp-config sl jitter-us 500
+rlite-ctl ipcp-config sl rate-kbps 100000
+rlite-ctl ipcp-config sl queue-len 512
+rlite-ctl ipcp-config sl seed 7
+rlite-ctl ipcp-config-get sl delay-us | grep "\<2000\>"
+rlite-ctl ipcp-config-get sl jitter-us | grep "\<500\>"
+rlite-ctl ipcp-config-get sl rate-kbps | grep "\<100000\>"
+rlite-ctl ipcp-config-get sl queue-len | grep "\<512\>"
+rlite-ctl ipcp-config-get sl seed | grep "\<7\>"
+rlite-ctl ipcp-config sl loss-ppm 20000
+rlite-ctl ipcp-config sl loss-burst 4
+rlite-ctl ipcp-config-get sl loss-ppm | grep "\<20000\>"
+rlite-ctl ipcp-config-get sl loss-burst | grep "\<4\>"
+# Negative tests
+rlite-ctl ipcp-config sl loss-ppm 1000001 && exit 1
+rlite-ctl ipcp-config sl queue-len 0 && exit 1
+# Check connectivity over the emulated link, without losses
+rlite-ctl ipcp-config sl loss-ppm 0
+start_daemon rinaperf -lw -z rpinstance9
+rinaperf -z rpinstance9 -p2 -c 4 -i 0
+rinaperf -z rpinstance9 -t perf -c 100 -i 0
+rlite-ctl ipcp-destroy sl
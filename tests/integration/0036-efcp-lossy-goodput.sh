@@ -0,0 +1,50 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Create two namespaces, a veth pair, and assign each end of the pair
+# to a different namespace. The link from red to green has 10ms of RTT
+# and loses 0.5% of the frames.
+create_veth_pair veth red green
+create_namespace green
+create_namespace red
+add_veth_to_namespace green veth.green
+add_veth_to_namespace red veth.red
+ip netns exec red tc qdisc add dev veth.red root netem delay 5ms loss 0.5% rate 50mbit limit 1000
+ip netns exec green tc qdisc add dev veth.green root netem delay 5ms
+
+# Normal over shim eth setup in the green namespace
+ip netns exec green rlite-ctl ipcp-create green.eth shim-eth edif
+ip netns exec green rlite-ctl ipcp-config green.eth netdev veth.green
+ip netns exec green rlite-ctl ipcp-config green.eth flow-del-wait-ms 100
+ip netns exec green rlite-ctl ipcp-create green.n normal mydif
+ip netns exec green rlite-ctl ipcp-config green.n flow-del-wait-ms 250
+ip netns exec green rlite-ctl ipcp-enroller-enable green.n
+ip netns exec green rlite-ctl ipcp-register green.n edif
+ip netns exec green rlite-ctl dif-policy-param-mod mydif addralloc nack-wait 1s
+start_daemon_namespace green rinaperf -lw -z rpgreen
+
+# Normal over shim eth setup in the red namespace
+ip netns exec red rlite-ctl ipcp-create red.eth shim-eth edif
+ip netns exec red rlite-ctl ipcp-config red.eth netdev veth.red
+ip netns exec red rlite-ctl ipcp-config red.eth flow-del-wait-ms 100
+ip netns exec red rlite-ctl ipcp-create red.n normal mydif
+ip netns exec red rlite-ctl ipcp-config red.n flow-del-wait-ms 250
+ip netns exec red rlite-ctl ipcp-register red.n edif
+ip netns exec red rlite-ctl ipcp-enroll red.n mydif edif green.n
+
+OUT=$(mktemp)
+cumulative_trap "rm -f $OUT" "EXIT"
+
+# Run a reliable flow over the lossy link. Holes must be recovered by
+# selective retransmissions, not by waiting for the rtx timer, so the
+# goodput must stay within the same order of magnitude as the link rate.
+ip netns exec red rinaperf -z rpgreen -t perf -g 0 -s 1000 -i 0 -D 5 > $OUT
+cat $OUT
+mbps=$(awk '/^Receiver/ {print $4}' $OUT)
+awk -v m="$mbps" 'BEGIN { print "goodput " m " Mbps"; exit !(m > 5) }'
+
+# Losses must have actually happened and been repaired.
+ip netns exec red rlite-ctl ipcp-stats red.n
+rtx=$(ip netns exec red rlite-ctl ipcp-stats red.n | awk '/rtx_pkt/ {print $3}')
+test "$rtx" -gt 0
@@ -0,0 +1,142 @@
+#!/bin/bash
+
+# Measure the aggregate receive rate of N concurrent rinaperf perf flows,
+# for increasing values of N. This exercises the per-PDU flow lookups
+# (by port-id and by CEP-id) from many flows at the same time.
+# To compare two kernels, run the benchmark on the first one saving the
+# results with -o, and then on the second one passing the saved file
+# with -b.
+
+function usage {
+    echo "$0 [-f \"FLOW_COUNTS\"] [-D DURATION] [-s SIZE] [-d DIF] [-o OUTFILE] [-b BASEFILE]"
+}
+
+F="1 2 4 8 16 32"
+D=5
+S=64
+DIF=""
+OUTFILE=""
+BASEFILE=""
+
+# Option parsing
+while [[ $# > 0 ]]
+do
+    key="$1"
+    case $key in
+        "-f")
+        if [ -n "$2" ]; then
+            F="$2"
+            shift
+        else
+            echo "-f requires a list of flow counts"
+            exit 255
+        fi
+        ;;
+
+        "-D")
+        if [ -n "$2" ]; then
+            D="$2"
+            shift
+        else
+            echo "-D requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-s")
+        if [ -n "$2" ]; then
+            S="$2"
+            shift
+        else
+            echo "-s requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-d")
+        if [ -n "$2" ]; then
+            DIF="$2"
+            shift
+        else
+            echo "-d requires a DIF name"
+            exit 255
+        fi
+        ;;
+
+        "-o")
+        if [ -n "$2" ]; then
+            OUTFILE="$2"
+            shift
+        else
+            echo "-o requires a file name"
+            exit 255
+        fi
+        ;;
+
+        "-b")
+        if [ -n "$2" ]; then
+            BASEFILE="$2"
+            shift
+        else
+            echo "-b requires a file name"
+            exit 255
+        fi
+        ;;
+
+        "-h")
+            usage
+            exit 0
+        ;;
+
+        *)
+        echo "Unknown option '$key'"
+        exit 255
+        ;;
+    esac
+    shift
+done
+
+# Unless a DIF is specified, create a normal IPCP for the benchmark.
+if [ -z "$DIF" ]; then
+    DIF=mfbench.DIF
+    rlite-ctl ipcp-create mfbench.IPCP normal $DIF || exit 1
+    trap "pkill -f 'rinaperf -lw -z mfbench-server' ; rlite-ctl ipcp-destroy mfbench.IPCP" EXIT
+else
+    trap "pkill -f 'rinaperf -lw -z mfbench-server'" EXIT
+fi
+rinaperf -lw -z mfbench-server -d $DIF || exit 1
+
+RES=$(mktemp)
+if [ -n "$OUTFILE" ]; then
+    rm -f $OUTFILE.tmp
+fi
+
+printf "%8s %12s %12s" "Flows" "Kpps" "Mbps"
+if [ -n "$BASEFILE" ]; then
+    printf " %12s %8s" "Base Kpps" "Change"
+fi
+printf "\n"
+
+for n in $F; do
+    # Each worker prints its own report, sum up the receiver side.
+    rinaperf -z mfbench-server -d $DIF -t perf -p $n -s $S -i 0 -D $D > $RES
+    kpps=$(awk '/^Receiver/ {s += $3} END {printf "%.3f", s}' $RES)
+    mbps=$(awk '/^Receiver/ {s += $4} END {printf "%.3f", s}' $RES)
+    printf "%8s %12s %12s" $n $kpps $mbps
+    if [ -n "$BASEFILE" ]; then
+        base=$(awk -v n=$n '$1 == n {print $2}' $BASEFILE)
+        if [ -n "$base" ]; then
+            change=$(awk -v a=$base -v b=$kpps 'BEGIN {printf "%+.1f%%", (b - a) * 100 / a}')
+            printf " %12s %8s" $base $change
+        fi
+    fi
+    printf "\n"
+    if [ -n "$OUTFILE" ]; then
+        echo "$n $kpps $mbps" >> $OUTFILE.tmp
+    fi
+done
+
+rm -f $RES
+if [ -n "$OUTFILE" ]; then
+    mv $OUTFILE.tmp $OUTFILE
+fi
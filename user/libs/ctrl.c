@@ -37,6 +37,7 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #include "rlite/kernel-msg.h"
 #include "rlite/utils.h"
 #include "rlite/ctrl.h"
@@ -700,3 +701,192 @@ rina_flow_mss_get(int fd)
 
     return mss;
 }
+
+int
+rina_flow_write_multi(int fd, const struct rina_sdu *sdus, unsigned int num)
+{
+    struct rl_sdu_desc descs[RL_SDU_BATCH_MAX];
+    struct rl_ioctl_sdu_batch batch;
+    unsigned int i;
+
+    if (num > RL_SDU_BATCH_MAX) {
+        num = RL_SDU_BATCH_MAX;
+    }
+
+    memset(descs, 0, num * sizeof(descs[0]));
+    for (i = 0; i < num; i++) {
+        descs[i].buf = (uint64_t)(uintptr_t)sdus[i].buf;
+        descs[i].len = sdus[i].len;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.descs = (uint64_t)(uintptr_t)descs;
+    batch.num   = num;
+
+    return ioctl(fd, RLITE_IOCTL_SDU_WRITE_MULTI, &batch);
+}
+
+int
+rina_flow_read_multi(int fd, struct rina_sdu *sdus, unsigned int num)
+{
+    struct rl_sdu_desc descs[RL_SDU_BATCH_MAX];
+    struct rl_ioctl_sdu_batch batch;
+    unsigned int i;
+    int ret;
+
+    if (num > RL_SDU_BATCH_MAX) {
+        num = RL_SDU_BATCH_MAX;
+    }
+
+    memset(descs, 0, num * sizeof(descs[0]));
+    for (i = 0; i < num; i++) {
+        descs[i].buf = (uint64_t)(uintptr_t)sdus[i].buf;
+        descs[i].len = sdus[i].len;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.descs = (uint64_t)(uintptr_t)descs;
+    batch.num   = num;
+
+    ret = ioctl(fd, RLITE_IOCTL_SDU_READ_MULTI, &batch);
+    for (i = 0; (int)i < ret; i++) {
+        sdus[i].len = descs[i].len;
+    }
+
+    return ret;
+}
+
+struct rina_ring {
+    int fd;
+    void *mem;
+    size_t size;
+    struct rl_ring_hdr *rx;
+    struct rl_ring_hdr *tx;
+    uint32_t num_slots;
+    uint32_t slot_size;
+};
+
+struct rina_ring *
+rina_flow_ring_attach(int fd, unsigned int num_slots, unsigned int slot_size)
+{
+    struct rl_ioctl_ring_req req;
+    struct rina_ring *ring;
+
+    memset(&req, 0, sizeof(req));
+    req.num_slots = num_slots;
+    req.slot_size = slot_size;
+    if (ioctl(fd, RLITE_IOCTL_RING_SETUP, &req)) {
+        return NULL;
+    }
+
+    ring = rl_alloc(sizeof(*ring), RL_MT_API);
+    if (!ring) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ring->mem =
+        mmap(NULL, req.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring->mem == MAP_FAILED) {
+        rl_free(ring, RL_MT_API);
+        return NULL;
+    }
+    ring->fd        = fd;
+    ring->size      = req.mmap_size;
+    ring->rx        = (struct rl_ring_hdr *)((char *)ring->mem + req.rx_ofs);
+    ring->tx        = (struct rl_ring_hdr *)((char *)ring->mem + req.tx_ofs);
+    ring->num_slots = req.num_slots;
+    ring->slot_size = req.slot_size;
+
+    return ring;
+}
+
+void
+rina_flow_ring_detach(struct rina_ring *ring)
+{
+    munmap(ring->mem, ring->size);
+    rl_free(ring, RL_MT_API);
+}
+
+int
+rina_ring_send(struct rina_ring *ring, const void *buf, unsigned int len)
+{
+    struct rl_ring_hdr *tx = ring->tx;
+    uint32_t head          = tx->head; /* we are the only producer */
+    uint32_t tail          = __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    if (len > ring->slot_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (head - tail >= ring->num_slots) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    i = head & (ring->num_slots - 1);
+    memcpy(RL_RING_BUF(tx, i), buf, len);
+    RL_RING_SLOT(tx, i)->len = len;
+    __atomic_store_n(&tx->head, head + 1, __ATOMIC_RELEASE);
+
+    /* Kick the kernel if it went idle. The full barrier pairs with the
+     * one in the kernel worker, so that either the worker sees the new
+     * head or we see the flag. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tx->flags, __ATOMIC_RELAXED) & RL_RING_F_NEED_KICK) {
+        /* On failure, the SDU is still transmitted at the next poll(). */
+        (void)ioctl(ring->fd, RLITE_IOCTL_RING_KICK);
+    }
+
+    return len;
+}
+
+int
+rina_ring_recv(struct rina_ring *ring, void *buf, unsigned int len)
+{
+    struct rl_ring_hdr *rx = ring->rx;
+    uint32_t tail          = rx->tail; /* we are the only consumer */
+    uint32_t flags, head, i;
+
+    /* Load the flags before the head, so that EOF is reported only
+     * after all the SDUs have been consumed. */
+    flags = __atomic_load_n(&rx->flags, __ATOMIC_ACQUIRE);
+    head  = __atomic_load_n(&rx->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        if (flags & RL_RING_F_EOF) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    i = tail & (ring->num_slots - 1);
+    if (RL_RING_SLOT(rx, i)->len > len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    len = RL_RING_SLOT(rx, i)->len;
+    memcpy(buf, RL_RING_BUF(rx, i), len);
+    __atomic_store_n(&rx->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+unsigned int
+rina_ring_tx_pending(struct rina_ring *ring)
+{
+    return ring->tx->head - __atomic_load_n(&ring->tx->tail, __ATOMIC_ACQUIRE);
+}
+
+int
+rina_ring_poll(struct rina_ring *ring, short events, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd     = ring->fd;
+    pfd.events = events;
+
+    return poll(&pfd, 1, timeout);
+}
@@ -105,6 +105,8 @@
  */
 
 #define SDU_SIZE_MAX 65535
+#define RP_BATCH_MAX 64
+#define RP_RING_SLOTS 256
 #define RP_MAX_WORKERS 1023
 
 #define RP_OPCODE_PING 0
@@ -184,6 +186,8 @@ struct rinaperf {
     int cli_flow_allocated; /* client flows allocated ? */
     int background;         /* server runs as a daemon process */
     int cdf;                /* report CDF percentiles */
+    int batch;              /* SDUs per read/write syscall (perf test) */
+    int ring;               /* use shared-memory rings (perf test) */
 
     /* Synchronization between client threads and main thread. */
     sem_t cli_barrier;
@@ -545,6 +549,8 @@ perf_client(struct worker *w)
     struct timespec t_start, t_end;
     struct timespec w1, w2;
     char buf[SDU_SIZE_MAX];
+    struct rina_sdu sdus[RP_BATCH_MAX];
+    struct rina_ring *ring = NULL;
     long long ns;
     struct pollfd pfd[2];
     unsigned int i = 0;
@@ -567,16 +573,45 @@ perf_client(struct worker *w)
     pfd[0].events = POLLOUT;
     pfd[1].events = POLLIN;
 
+    if (rp->ring) {
+        ring = rina_flow_ring_attach(w->dfd, RP_RING_SLOTS, size);
+        if (!ring) {
+            perror("rina_flow_ring_attach()");
+            return -1;
+        }
+    }
+
     memset(buf, 'x', size);
+    for (i = 0; i < rp->batch; i++) {
+        /* All the SDUs of a batch share the same buffer. */
+        sdus[i].buf = buf;
+        sdus[i].len = size;
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-    for (i = 0; !rp->cli_stop && (!limit || i < limit); i++) {
-        ret = write(w->dfd, buf, size);
+    for (i = 0; !rp->cli_stop && (!limit || i < limit);) {
+        unsigned int n = 1;
+
+        if (ring) {
+            /* Post on the TX ring, which is drained by the kernel. */
+            ret = rina_ring_send(ring, buf, size);
+        } else if (rp->batch > 1) {
+            n = rp->batch;
+            if (limit && n > limit - i) {
+                n = limit - i;
+            }
+            ret = rina_flow_write_multi(w->dfd, sdus, n);
+        } else {
+            ret = write(w->dfd, buf, size);
+        }
         if (ret < 0 && errno == EAGAIN) {
             ret = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (ret < 0) {
                 perror("poll(flow)");
+                if (ring) {
+                    rina_flow_ring_detach(ring);
+                }
                 return -1;
             } else if (ret == 0) {
                 /* Timeout */
@@ -586,7 +621,6 @@ perf_client(struct worker *w)
             }
             if (pfd[0].revents & POLLOUT) {
                 /* Ready to write. */
-                i--;
                 continue;
             }
             /* Nothing to write and stop signal received. */
@@ -595,6 +629,12 @@ perf_client(struct worker *w)
                 PRINTF("Stopped\n");
             }
             break;
+        } else if (rp->batch > 1) {
+            if (ret <= 0) {
+                perror("rina_flow_write_multi()");
+                break;
+            }
+            n = ret; /* the batch may have been written partially */
         } else {
             if (ret != size) {
                 if (ret < 0) {
@@ -605,6 +645,7 @@ perf_client(struct worker *w)
                 break;
             }
         }
+        i += n;
 
         if (interval && --cdown == 0) {
             if (interval > 50) { /* slack default is 50 us*/
@@ -623,6 +664,16 @@ perf_client(struct worker *w)
         }
     }
 
+    if (ring) {
+        /* Flush the SDUs still pending on the TX ring. */
+        while (!timeout && rina_ring_tx_pending(ring) > 0) {
+            if (rina_ring_poll(ring, POLLOUT, RP_DATA_WAIT_MSECS) <= 0) {
+                timeout = 1;
+            }
+        }
+        rina_flow_ring_detach(ring);
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &t_end);
     ns = nanodiff(&t_end, &t_start);
     if (timeout) {
@@ -696,11 +747,16 @@ perf_server(struct worker *w)
     unsigned long long rate_bytes       = 0;
     struct timespec rate_ts, t_start, t_end;
     char buf[SDU_SIZE_MAX];
+    struct rina_sdu sdus[RP_BATCH_MAX];
+    char *bbuf = NULL; /* buffers for batched reads */
+    struct rina_ring *ring = NULL;
     long long ns;
     struct pollfd pfd[2];
     unsigned int i;
+    int batch   = w->rp->batch;
     int verb    = w->rp->verbose;
     int timeout = 0;
+    int ret     = 0;
     int n;
 
     n = fcntl(w->dfd, F_SETFL, O_NONBLOCK);
@@ -709,6 +765,21 @@ perf_server(struct worker *w)
         return -1;
     }
 
+    if (w->rp->ring) {
+        ring = rina_flow_ring_attach(w->dfd, RP_RING_SLOTS,
+                                     w->test_config.size);
+        if (!ring) {
+            perror("rina_flow_ring_attach()");
+            return -1;
+        }
+    } else if (batch > 1) {
+        bbuf = malloc(batch * SDU_SIZE_MAX);
+        if (!bbuf) {
+            PRINTF("Out of memory\n");
+            return -1;
+        }
+    }
+
     pfd[0].fd     = w->dfd;
     pfd[1].fd     = w->cfd;
     pfd[0].events = pfd[1].events = POLLIN;
@@ -716,7 +787,9 @@ perf_server(struct worker *w)
     clock_gettime(CLOCK_MONOTONIC, &rate_ts);
     t_start = rate_ts;
 
-    for (i = 0; !limit || i < limit; i++) {
+    for (i = 0; !limit || i < limit;) {
+        unsigned int cnt = 1;
+
         /* Do a non-blocking read on the data flow. If we are in a livelock
          * situation (or near so), it is highly likely that we will find
          * some data to read; we can therefore read the data directly,
@@ -728,13 +801,32 @@ perf_server(struct worker *w)
          * becomes a bit faster. The only drawback is that we pay the cost of
          * an additional syscall when the receiver is not under pressure, but
          * this is acceptable if we want to maximize throughput.
+         * With batching, a single syscall can read many SDUs, while with
+         * rings the syscall is only needed when the RX ring is empty.
          */
-        n = read(w->dfd, buf, sizeof(buf));
+        if (ring) {
+            n = rina_ring_recv(ring, buf, sizeof(buf));
+        } else if (batch > 1) {
+            int j;
+
+            cnt = batch;
+            if (limit && cnt > limit - i) {
+                cnt = limit - i;
+            }
+            for (j = 0; j < cnt; j++) {
+                sdus[j].buf = bbuf + j * SDU_SIZE_MAX;
+                sdus[j].len = SDU_SIZE_MAX;
+            }
+            n = rina_flow_read_multi(w->dfd, sdus, cnt);
+        } else {
+            n = read(w->dfd, buf, sizeof(buf));
+        }
         if (n < 0 && errno == EAGAIN) {
             n = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (n < 0) {
                 perror("poll(flow)");
-                return -1;
+                ret = -1;
+                goto out;
             } else if (n == 0) {
                 /* Timeout */
                 timeout = 1;
@@ -745,12 +837,10 @@ perf_server(struct worker *w)
             }
 
             if (pfd[0].revents & POLLIN) {
-                /* Ready to read. Adjust 'i' and retry. */
-                i--;
+                /* Ready to read, retry. */
                 continue;
             } else {
                 struct rp_config_msg stop;
-                int ret;
 
                 /* Nothing to read and stop signal received. */
                 assert(pfd[1].revents & POLLIN);
@@ -761,7 +851,7 @@ perf_server(struct worker *w)
 
                 ret = config_msg_read(w->cfd, &stop);
                 if (ret) {
-                    return ret;
+                    goto out;
                 }
 
                 if (!stop.cnt) {
@@ -785,21 +875,31 @@ perf_server(struct worker *w)
                                (long long unsigned)i);
                     }
                 }
-                i--;
                 continue;
             }
         }
         if (n < 0) {
             perror("read(flow)");
-            return -1;
+            ret = -1;
+            goto out;
 
         } else if (n == 0) {
             PRINTF("Flow deallocated remotely\n");
             break;
         }
 
-        rate_bytes += n;
-        rate_cnt++;
+        if (!ring && batch > 1) {
+            int j;
+
+            cnt = n;
+            for (j = 0; j < cnt; j++) {
+                rate_bytes += sdus[j].len;
+            }
+        } else {
+            rate_bytes += n;
+        }
+        rate_cnt += cnt;
+        i += cnt;
 
         if (rate_bytes >= rate_bytes_limit && verb) {
             rate_print(&rate_bytes, &rate_cnt, &rate_bytes_limit, &rate_ts,
@@ -828,7 +928,13 @@ perf_server(struct worker *w)
         PRINTF("Received %u PDUs out of %u\n", i, limit);
     }
 
-    return 0;
+out:
+    if (ring) {
+        rina_flow_ring_detach(ring);
+    }
+    free(bbuf);
+
+    return ret;
 }
 
 static void
@@ -1509,8 +1615,11 @@ usage(void)
         "   -T : print timestamp (unix time + microseconds as in gettimeofday) "
         "before each line in ping test\n"
         "   -C : client prints cumulative density function in ping mode\n"
+        "   -m NUM : in perf mode, read or write up to NUM SDUs "
+        "with a single system call (max %u)\n"
+        "   -r : in perf mode, exchange SDUs through shared-memory rings\n"
         "   -v : be verbose\n",
-        RINA_FLOW_SPEC_LOSS_MAX);
+        RINA_FLOW_SPEC_LOSS_MAX, RP_BATCH_MAX);
 }
 
 int
@@ -1551,11 +1660,13 @@ main(int argc, char **argv)
     pthread_mutex_init(&rp->ticket_lock, NULL);
     rp->background = 0;
     rp->cdf        = 0; /* Don't report CDF percentiles. */
+    rp->batch      = 1; /* One SDU per syscall. */
+    rp->ring       = 0;
 
     /* Start with a default flow configuration (unreliable flow). */
     rina_flow_spec_unreliable(&rp->flowspec);
 
-    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvC")) !=
+    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvCm:r")) !=
            -1) {
         switch (opt) {
         case 'h':
@@ -1674,6 +1785,18 @@ main(int argc, char **argv)
             rp->cdf = 1;
             break;
 
+        case 'm':
+            rp->batch = atoi(optarg);
+            if (rp->batch <= 0 || rp->batch > RP_BATCH_MAX) {
+                PRINTF("    Invalid 'batch' %d\n", rp->batch);
+                return -1;
+            }
+            break;
+
+        case 'r':
+            rp->ring = 1;
+            break;
+
         default:
             PRINTF("    Unrecognized option %c\n", opt);
             usage();
@@ -554,6 +554,47 @@ kernel_control_write(struct rl_msg_base *msg)
     return ret;
 }
 
+/* Parse a comma-separated list of scheduler weights into a newly
+ * allocated array. Returns the number of weights, or -1 on error. */
+static int
+sched_weights_parse(const char *str, uint32_t **parr)
+{
+    char *copy, *ctmp, *saveptr;
+    uint32_t *arr;
+    int n;
+    int i;
+
+    /* Count weights. */
+    n = str_count_elems(str);
+    if (n <= 0) {
+        PE("No valid weights\n");
+        return -1;
+    }
+
+    /* Allocate array for weights. */
+    arr = malloc_or_quit(n * sizeof(arr[0]));
+
+    /* Parse weights into the array. */
+    copy = ctmp = strdup_or_quit(str);
+    for (i = 0; i < n; i++, ctmp = NULL) {
+        char *token = strtok_r(ctmp, ", ", &saveptr);
+        if (token == NULL) {
+            break;
+        }
+        arr[i] = atoi(token);
+        if (arr[i] <= 0 || arr[i] >= 1000) {
+            PE("Invalid weight '%s'\n", token);
+            free(copy);
+            free(arr);
+            return -1;
+        }
+    }
+    free(copy);
+    *parr = arr;
+
+    return n;
+}
+
 static int
 ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
 {
@@ -618,37 +659,11 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
             return -1;
         }
 
-        /* Count weights. */
-        n = str_count_elems(argv[3]);
-        if (n <= 0) {
-            PE("No valid weights\n");
+        n = sched_weights_parse(argv[3], &arr);
+        if (n < 0) {
             return -1;
         }
 
-        /* Allocate array for weights. */
-        arr = malloc_or_quit(n * sizeof(arr[0]));
-
-        /* Parse weights into the array. */
-        {
-            char *copy = strdup_or_quit(argv[3]);
-            char *ctmp = copy;
-            char *saveptr;
-            int i;
-
-            for (i = 0; i < n; i++, ctmp = NULL) {
-                char *token = strtok_r(ctmp, ", ", &saveptr);
-                if (token == NULL) {
-                    break;
-                }
-                arr[i] = atoi(token);
-                if (arr[i] <= 0 || arr[i] >= 1000) {
-                    PE("Invalid weight '%s'\n", token);
-                    return -1;
-                }
-            }
-            free(copy);
-        }
-
         /* Build the request. */
         req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_WRR;
         req.ipcp_hdr.hdr.event_id = 0;
@@ -691,6 +706,191 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
         req.ipcp_hdr.ipcp_id      = attrs->id;
         req.max_queue_size        = qsize;
 
+        return kernel_control_write(RLITE_MB(&req));
+
+    } else if (!strcmp(sched_name, "drr")) {
+        /* Deficit Round Robin configuration. Example:
+         *   ipcp-sched-config x.IPCP drr qsize 65536 quantum 1500 weights
+         * 2,5,10
+         * */
+        struct rl_kmsg_ipcp_sched_drr req;
+        uint32_t *arr;
+        int ret;
+        int n;
+
+        if (argc < 4) {
+            PE("Not enough arguments for drr. Example:\n"
+               "  ipcp-sched-config x.IPCP drr qsize 65536 quantum 1500 "
+               "weights 2,5,10\n");
+            return -1;
+        }
+
+        if (strcmp(argv[0], "quantum")) {
+            PE("Missing 'quantum' argument\n");
+            return -1;
+        }
+        req.quantum = atoi(argv[1]);
+        if (req.quantum == 0 || req.quantum > 1000000) {
+            PE("Invalid quantum '%s'\n", argv[1]);
+            return -1;
+        }
+
+        if (strcmp(argv[2], "weights")) {
+            PE("Missing 'weights' argument\n");
+            return -1;
+        }
+        n = sched_weights_parse(argv[3], &arr);
+        if (n < 0) {
+            return -1;
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_DRR;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+        req.weights.elem_size     = sizeof(arr[0]);
+        req.weights.num_elements  = n;
+        req.weights.slots.dwords  = arr;
+
+        ret = kernel_control_write(RLITE_MB(&req));
+        free(arr);
+
+        return ret;
+
+    } else if (!strcmp(sched_name, "prio-drr")) {
+        /* Strict priority on top of Deficit Round Robin. Example:
+         *   ipcp-sched-config x.IPCP prio-drr qsize 65536 levels 1
+         * quantum 1500 weights 2,5,10
+         * */
+        struct rl_kmsg_ipcp_sched_prio_drr req;
+        uint32_t *arr;
+        int ret;
+        int n;
+
+        if (argc < 6) {
+            PE("Not enough arguments for prio-drr. Example:\n"
+               "  ipcp-sched-config x.IPCP prio-drr qsize 65536 levels 1 "
+               "quantum 1500 weights 2,5,10\n");
+            return -1;
+        }
+
+        if (strcmp(argv[0], "levels")) {
+            PE("Missing 'levels' argument\n");
+            return -1;
+        }
+        req.prio_levels = atoi(argv[1]);
+        if (req.prio_levels > 128) {
+            PE("Invalid number of levels '%s'\n", argv[1]);
+            return -1;
+        }
+
+        if (strcmp(argv[2], "quantum")) {
+            PE("Missing 'quantum' argument\n");
+            return -1;
+        }
+        req.quantum = atoi(argv[3]);
+        if (req.quantum == 0 || req.quantum > 1000000) {
+            PE("Invalid quantum '%s'\n", argv[3]);
+            return -1;
+        }
+
+        if (strcmp(argv[4], "weights")) {
+            PE("Missing 'weights' argument\n");
+            return -1;
+        }
+        n = sched_weights_parse(argv[5], &arr);
+        if (n < 0) {
+            return -1;
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_PRIO_DRR;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+        req.weights.elem_size     = sizeof(arr[0]);
+        req.weights.num_elements  = n;
+        req.weights.slots.dwords  = arr;
+
+        ret = kernel_control_write(RLITE_MB(&req));
+        free(arr);
+
+        return ret;
+
+    } else if (!strcmp(sched_name, "fq-codel")) {
+        /* FQ-CoDel configuration, where all the parameters but qsize are
+         * optional. Example:
+         *   ipcp-sched-config x.IPCP fq-codel qsize 65536 quantum 1500
+         * flows 64 target 5000 interval 100000 ecn on
+         * */
+        struct rl_kmsg_ipcp_sched_fq_codel req;
+
+        memset(&req, 0, sizeof(req));
+        req.quantum     = 1500;
+        req.flows       = 64;
+        req.target_us   = 5000;
+        req.interval_us = 100000;
+        req.ecn         = 1;
+
+        for (; argc > 0; argc -= 2, argv += 2) {
+            const char *param = argv[0];
+            int val;
+
+            if (argc < 2) {
+                PE("Missing value for '%s'\n", param);
+                return -1;
+            }
+
+            if (!strcmp(param, "ecn")) {
+                if (!strcmp(argv[1], "on")) {
+                    req.ecn = 1;
+                } else if (!strcmp(argv[1], "off")) {
+                    req.ecn = 0;
+                } else {
+                    PE("Invalid ecn value '%s' (use on/off)\n", argv[1]);
+                    return -1;
+                }
+                continue;
+            }
+
+            val = atoi(argv[1]);
+            if (!strcmp(param, "quantum")) {
+                if (val <= 0 || val > 1000000) {
+                    PE("Invalid quantum '%s'\n", argv[1]);
+                    return -1;
+                }
+                req.quantum = val;
+            } else if (!strcmp(param, "flows")) {
+                if (val <= 0 || val > 65536) {
+                    PE("Invalid number of flows '%s'\n", argv[1]);
+                    return -1;
+                }
+                req.flows = val;
+            } else if (!strcmp(param, "target")) {
+                if (val <= 0) {
+                    PE("Invalid target '%s'\n", argv[1]);
+                    return -1;
+                }
+                req.target_us = val;
+            } else if (!strcmp(param, "interval")) {
+                if (val <= 0) {
+                    PE("Invalid interval '%s'\n", argv[1]);
+                    return -1;
+                }
+                req.interval_us = val;
+            } else {
+                PE("Unknown fq-codel parameter '%s'\n", param);
+                return -1;
+            }
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_FQ_CODEL;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+
         return kernel_control_write(RLITE_MB(&req));
     }
 
@@ -886,7 +1086,8 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            "    rmt.csum_drop      = %llu\n"
            "    rmt.ttl_drop       = %llu\n"
            "    rmt.noflow_drop    = %llu\n"
-           "    rmt.other_drop     = %llu\n",
+           "    rmt.other_drop     = %llu\n"
+           "    rmt.ecn_mark       = %llu\n",
            attrs->name, (unsigned long long)stats.tx_pkt, sbuf[0],
            (unsigned long long)stats.tx_err, (unsigned long long)stats.rx_pkt,
            sbuf[1], (unsigned long long)stats.rx_err,
@@ -898,7 +1099,8 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            (unsigned long long)stats.rmt.csum_drop,
            (unsigned long long)stats.rmt.ttl_drop,
            (unsigned long long)stats.rmt.noflow_drop,
-           (unsigned long long)stats.rmt.other_drop);
+           (unsigned long long)stats.rmt.other_drop,
+           (unsigned long long)stats.rmt.ecn_mark);
 
     return 0;
 }
@@ -105,6 +105,59 @@ reachable(const RoutingTables &rtables, int src_node, int dst_node,
     return cur == dst && expected_nhops == 0;
 }
 
+/* Longest prefix match on an aggregated forwarding table. Returns -1 if
+ * no range covers 'addr'. */
+static int
+lpm_lookup(const std::map<rlite::LFDB::AddrRange, rl_port_t> &ranges,
+           rlm_addr_t addr)
+{
+    for (unsigned int bits = 0; bits <= rlite::LFDB::kMaxRangeBits; bits++) {
+        rlm_addr_t mask = ~((rlm_addr_t(1) << bits) - 1);
+        auto it = ranges.find(rlite::LFDB::AddrRange(addr & mask, bits));
+
+        if (it != ranges.end()) {
+            return it->second;
+        }
+    }
+    return -1;
+}
+
+/* Returns true if aggregating the forwarding table derived from the
+ * routing table 'nhops' of node 'self' does not change the output port
+ * of any destination. Node N is given address N+1, and the port towards
+ * next hop M is M itself. */
+static bool
+aggregation_correct(const NextHops &nhops, const rlite::NodeId &self,
+                    const bool verbose)
+{
+    std::unordered_map<rlm_addr_t, rl_port_t> table;
+    rlm_addr_t self_addr = std::stoul(self) + 1;
+
+    for (const auto &kv : nhops) {
+        table[std::stoul(kv.first) + 1] = std::stoul(kv.second.front());
+    }
+
+    auto ranges = rlite::LFDB::aggregate_fwd_table(table, {self_addr});
+
+    if (verbose) {
+        std::cout << "Node " << self << ": " << table.size()
+                  << " entries aggregated into " << ranges.size()
+                  << " ranges" << std::endl;
+    }
+    if (ranges.size() > table.size()) {
+        return false;
+    }
+    if (lpm_lookup(ranges, self_addr) != -1) {
+        return false;
+    }
+    for (const auto &kv : table) {
+        if (lpm_lookup(ranges, kv.first) != int(kv.second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -263,6 +316,18 @@ main(int argc, char **argv)
         auto delta = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::system_clock::now() - start);
 
+        /* Check that forwarding table aggregation preserves the next
+         * hop of each destination. */
+        for (const auto &kv : rtables) {
+            if (!aggregation_correct(kv.second.first, kv.first,
+                                     /*verbose=*/verbosity >= 1)) {
+                std::cerr << "Wrong aggregation for node " << kv.first
+                          << std::endl;
+                std::cout << "Test # " << counter << " failed" << std::endl;
+                return -1;
+            }
+        }
+
         /* Use 'rtables' to carry out all the reachability tests defined for
          * this network. */
         for (const auto &rtest : reachability_tests) {
@@ -175,6 +175,8 @@ private:
                           struct rl_flow_config *cfg,
                           rlm_qosid_t *qos_id) const;
     void policies2flowcfg(struct rl_flow_config *cfg, const FlowRequest *freq);
+    uint8_t congestion_control() const;
+    rlm_qosid_t delay_class(uint32_t max_delay) const;
 };
 
 /* Translate a local flow configuration into the standard
@@ -277,9 +279,59 @@ LocalFlowAllocator::policies2flowcfg(struct rl_flow_config *cfg,
     if (p.dtcp_cfg().rtx_ctrl()) {
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
+        cfg->dtcp.rtx.cc_type = congestion_control();
     }
 }
 
+/* Map the congestion-control policy parameter to the algorithm to be
+ * used by the kernel for the local sender. The algorithm is a local
+ * choice, and so it is not included in the FlowRequest. */
+uint8_t
+LocalFlowAllocator::congestion_control() const
+{
+    auto cc = rib->get_param_value<std::string>(FlowAllocator::Prefix,
+                                                "congestion-control");
+
+    if (cc == "reno") {
+        return RLITE_CC_T_RENO;
+    } else if (cc == "cubic") {
+        return RLITE_CC_T_CUBIC;
+    }
+
+    UPW(rib->uipcp, "Unknown congestion control '%s', using the default\n",
+        cc.c_str());
+
+    return RLITE_CC_T_DEFAULT;
+}
+
+/* Map the maximum delay requested by the application to a QoS id, using
+ * the comma-separated list of delay bounds (in microseconds) stored in the
+ * qos-delay-bounds policy parameter. The i-th bound selects QoS id i, so
+ * that flows with tighter bounds get lower QoS ids, which are served
+ * first by the priority-based PDU schedulers. Flows without a delay
+ * requirement, or looser than every bound, get the last QoS id. */
+rlm_qosid_t
+LocalFlowAllocator::delay_class(uint32_t max_delay) const
+{
+    auto bounds = rib->get_param_value<std::string>(FlowAllocator::Prefix,
+                                                    "qos-delay-bounds");
+    stringstream ss(bounds);
+    rlm_qosid_t qos_id = 0;
+    string tok;
+
+    while (getline(ss, tok, ',')) {
+        if (tok.empty()) {
+            continue;
+        }
+        if (max_delay && max_delay <= strtoul(tok.c_str(), nullptr, 10)) {
+            break;
+        }
+        qos_id++;
+    }
+
+    return qos_id;
+}
+
 #ifndef RL_USE_QOS_CUBES
 /* Any modification to this function must be also reported in the inverse
  * function flowcfg2flowspec(). */
@@ -293,7 +345,7 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
     auto initial_a =
         rib->get_param_value<Msecs>(FlowAllocator::Prefix, "initial-a");
 
-    *qos_id = 0; /* default */
+    *qos_id = delay_class(spec->max_delay);
     memset(cfg, 0, sizeof(*cfg));
 
     cfg->max_sdu_gap       = spec->max_sdu_gap;
@@ -313,11 +365,11 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
                 .count();
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
-        cfg->dtcp.initial_a = initial_a.count();
+        cfg->dtcp.rtx.cc_type = congestion_control();
+        cfg->dtcp.initial_a   = initial_a.count();
     }
 
-    /* Delay, loss and jitter ignored for now. */
-    (void)spec->max_delay;
+    /* Loss and jitter ignored for now. The delay only selects the QoS id. */
     (void)spec->max_loss;
     (void)spec->max_jitter;
 
@@ -739,7 +791,9 @@ UipcpRib::fa_lib_init()
           PolicyParam(Msecs(int(LocalFlowAllocator::kATimerMsecsDflt)))},
          {"initial-rtx-timeout",
           PolicyParam(Msecs(int(LocalFlowAllocator::kRtxTimerMsecsDflt)))},
-         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)}});
+         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)},
+         {"congestion-control", PolicyParam(std::string("cubic"))},
+         {"qos-delay-bounds", PolicyParam(std::string(""))}});
 }
 
 } // namespace rlite
@@ -26,6 +26,8 @@
 #include <iostream>
 #include <queue>
 #include <limits>
+#include <vector>
+#include <algorithm>
 
 #include "BaseRIB.pb.h"
 #include "uipcp-normal-lfdb.hpp"
@@ -254,6 +256,84 @@ LFDB::compute_next_hops(const NodeId &local_node)
     return 0;
 }
 
+/* Returns the index of the first destination in [lo, hi) whose address is
+ * not smaller than 'addr'. */
+static size_t
+dsts_lower_bound(const std::vector<std::pair<rlm_addr_t, int>> &dsts,
+                 size_t lo, size_t hi, rlm_addr_t addr)
+{
+    const auto key = std::make_pair(addr, std::numeric_limits<int>::min());
+
+    return std::lower_bound(dsts.begin() + lo, dsts.begin() + hi, key) -
+           dsts.begin();
+}
+
+/* Recursive helper for aggregate_fwd_table(). The destinations in the
+ * range [lo, hi) of 'dsts' (sorted by address) all fall into the aligned
+ * range (base, bits). If they all share the same port, we emit a single
+ * entry for the whole range; otherwise we split the range in two halves. */
+static void
+aggregate_range(const std::vector<std::pair<rlm_addr_t, int>> &dsts,
+                size_t lo, size_t hi, rlm_addr_t base, unsigned int bits,
+                std::map<LFDB::AddrRange, rl_port_t> &result)
+{
+    rlm_addr_t half;
+    size_t mid;
+    bool same = true;
+
+    if (lo == hi) {
+        return; /* Nothing to forward in this range. */
+    }
+
+    for (size_t i = lo + 1; i < hi && same; i++) {
+        same = dsts[i].second == dsts[lo].second;
+    }
+
+    if (same || bits == 0) {
+        if (dsts[lo].second >= 0) {
+            result[LFDB::AddrRange(base, bits)] =
+                static_cast<rl_port_t>(dsts[lo].second);
+        }
+        return;
+    }
+
+    bits--;
+    half = base + (rlm_addr_t(1) << bits);
+    mid  = dsts_lower_bound(dsts, lo, hi, half);
+    aggregate_range(dsts, lo, mid, base, bits, result);
+    aggregate_range(dsts, mid, hi, half, bits, result);
+}
+
+std::map<LFDB::AddrRange, rl_port_t>
+LFDB::aggregate_fwd_table(
+    const std::unordered_map<rlm_addr_t, rl_port_t> &table,
+    const std::set<rlm_addr_t> &exclude)
+{
+    /* Destinations sorted by address. Excluded addresses are marked
+     * with a negative port, so that they cannot be merged with anything. */
+    std::vector<std::pair<rlm_addr_t, int>> dsts;
+    std::map<AddrRange, rl_port_t> result;
+    rlm_addr_t half = rlm_addr_t(1) << kMaxRangeBits;
+    size_t mid;
+
+    for (const auto &kv : table) {
+        if (!exclude.count(kv.first)) {
+            dsts.push_back(std::make_pair(kv.first, int(kv.second)));
+        }
+    }
+    for (const rlm_addr_t addr : exclude) {
+        dsts.push_back(std::make_pair(addr, -1));
+    }
+    std::sort(dsts.begin(), dsts.end());
+
+    /* The whole address space is made of two ranges of kMaxRangeBits. */
+    mid = dsts_lower_bound(dsts, 0, dsts.size(), half);
+    aggregate_range(dsts, 0, mid, 0, kMaxRangeBits, result);
+    aggregate_range(dsts, mid, dsts.size(), half, kMaxRangeBits, result);
+
+    return result;
+}
+
 gpb::LowerFlow *
 LFDB::find(const NodeId &local_node, const NodeId &remote_node)
 {
@@ -23,10 +23,13 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <set>
 #include <unordered_map>
 #include <memory>
 
 #include "BaseRIB.pb.h"
+#include "rlite/common.h"
 #include "rlite/cpputils.hpp"
 
 namespace rlite {
@@ -116,6 +119,23 @@ public:
     /* Dump the routing table. */
     void dump_routing(std::stringstream &ss, const NodeId &local_node) const;
 
+    /* A range of destination addresses, covering all the addresses that
+     * only differ from 'first' in the 'second' lowest bits. A range with
+     * zero bits is an exact match. */
+    using AddrRange = std::pair<rlm_addr_t, unsigned int>;
+
+    /* Maximum number of low-order bits that an address range may ignore,
+     * as supported by the kernel PDUFT. */
+    static constexpr unsigned int kMaxRangeBits = RL_PCI_MATCH_RANGE_BITS_MAX;
+
+    /* Collapse a forwarding table (destination address --> port) into a
+     * smaller one made of aligned address ranges, in such a way that each
+     * range only covers destinations that share the same port. Addresses
+     * contained in 'exclude' (e.g. the local one) are never covered. */
+    static std::map<AddrRange, rl_port_t> aggregate_fwd_table(
+        const std::unordered_map<rlm_addr_t, rl_port_t> &table,
+        const std::set<rlm_addr_t> &exclude);
+
     /* Dump the lower flows database. */
     void dump(std::stringstream &ss) const;
 };
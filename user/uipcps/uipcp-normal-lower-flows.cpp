@@ -79,8 +79,9 @@ public:
 
 private:
     /* The forwarding table computed by compute_fwd_table().
-     * It maps a NodeId --> (dst_addr, local_port). */
-    std::unordered_map<rlm_addr_t, std::pair<NodeId, rl_port_t>> next_ports;
+     * It maps a range of destination addresses --> (NodeId, local_port),
+     * where NodeId is one of the destinations in the range. */
+    std::map<AddrRange, std::pair<NodeId, rl_port_t>> next_ports;
 
     /* Set of ports that are currently down. */
     std::unordered_set<rl_port_t> ports_down;
@@ -127,9 +128,11 @@ RoutingEngine::flow_state_update(struct rl_kmsg_flow_state *upd)
 int
 RoutingEngine::compute_fwd_table()
 {
-    unordered_map<rlm_addr_t, pair<NodeId, rl_port_t>> next_ports_new_,
-        next_ports_new;
+    unordered_map<rlm_addr_t, pair<NodeId, rl_port_t>> next_ports_new_;
+    map<AddrRange, pair<NodeId, rl_port_t>> next_ports_new;
     struct uipcp *uipcp = rib->uipcp;
+    bool aggregation =
+        rib->get_param_value<bool>(Routing::Prefix, "fwd-aggregation");
     unordered_map<rl_port_t, int> port_hits;
     rl_port_t dflt_port;
     int dflt_hits = 0;
@@ -185,22 +188,46 @@ RoutingEngine::compute_fwd_table()
         }
     }
 
+    if (aggregation) {
+        /* Collapse the entries into aligned address ranges, so that the
+         * kernel can use longest prefix match. The local address is never
+         * covered. Ranges corresponding to the default port are pruned out
+         * below, as for the single entries. */
+        unordered_map<rlm_addr_t, rl_port_t> table;
+        map<rlm_addr_t, NodeId> nodes;
+
+        for (const auto &kve : next_ports_new_) {
+            table[kve.first] = kve.second.second;
+            nodes[kve.first] = kve.second.first;
+        }
+        for (const auto &kvr : aggregate_fwd_table(table, {rib->myaddr})) {
+            /* Pick the first destination in the range for the logs. */
+            next_ports_new[kvr.first] =
+                make_pair(nodes.lower_bound(kvr.first.first)->second,
+                          kvr.second);
+        }
+    } else {
+        for (const auto &kve : next_ports_new_) {
+            next_ports_new[AddrRange(kve.first, 0)] = kve.second;
+        }
+    }
+
 #if 1 /* Use default forwarding entry. */
     if (dflt_hits) {
         string any = "";
 
         /* Prune out those entries corresponding to the default port, and
          * replace them with the default entry. */
-        for (const auto &kve : next_ports_new_) {
-            if (kve.second.second != dflt_port) {
-                next_ports_new[kve.first] = kve.second;
+        for (auto it = next_ports_new.begin(); it != next_ports_new.end();) {
+            if (it->second.second == dflt_port) {
+                it = next_ports_new.erase(it);
+            } else {
+                ++it;
             }
         }
-        next_ports_new[RL_ADDR_NULL] = make_pair(any, dflt_port);
-        next_hops[any]               = std::vector<NodeId>(1, dflt_nhop);
+        next_ports_new[AddrRange(RL_ADDR_NULL, 0)] = make_pair(any, dflt_port);
+        next_hops[any] = std::vector<NodeId>(1, dflt_nhop);
     }
-#else /* Avoid using the default forwarding entry. */
-    next_ports_new = next_ports_new_;
 #endif
 
     /* Remove old PDUFT entries first. */
@@ -218,20 +245,21 @@ RoutingEngine::compute_fwd_table()
         }
 
         /* Delete the old one. */
-        match.dst_addr = kve.first;
-        dst_node       = kve.second.first;
-        port_id        = kve.second.second;
-        ret            = uipcp_pduft_del(uipcp, port_id, &match);
+        match.dst_addr       = kve.first.first;
+        match.dst_range_bits = kve.first.second;
+        dst_node             = kve.second.first;
+        port_id              = kve.second.second;
+        ret                  = uipcp_pduft_del(uipcp, port_id, &match);
         if (ret) {
             UPE(uipcp,
-                "Failed to delete PDUFT entry for %s(%lu) "
+                "Failed to delete PDUFT entry for %s(%lu/%u) "
                 "(port_id=%u) [%s]\n",
                 node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                port_id, strerror(errno));
+                match.dst_range_bits, port_id, strerror(errno));
         } else {
-            UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port_id=%u)\n",
+            UPD(uipcp, "Delete PDUFT entry for %s(%lu/%u) (port_id=%u)\n",
                 node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                port_id);
+                match.dst_range_bits, port_id);
         }
     }
 
@@ -249,22 +277,25 @@ RoutingEngine::compute_fwd_table()
         }
 
         /* Add the new one. */
-        match.dst_addr = kve.first;
-        dst_node       = kve.second.first;
-        port_id        = kve.second.second;
-        ret            = uipcp_pduft_set(uipcp, port_id, &match);
+        match.dst_addr       = kve.first.first;
+        match.dst_range_bits = kve.first.second;
+        dst_node             = kve.second.first;
+        port_id              = kve.second.second;
+        ret                  = uipcp_pduft_set(uipcp, port_id, &match);
         if (ret) {
             UPE(uipcp,
-                "Failed to insert %s(%lu) --> %s (port_id=%u) PDUFT "
+                "Failed to insert %s(%lu/%u) --> %s (port_id=%u) PDUFT "
                 "entry [%s]\n",
                 node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                next_hops[dst_node].front().c_str(), port_id, strerror(errno));
+                match.dst_range_bits, next_hops[dst_node].front().c_str(),
+                port_id, strerror(errno));
             /* Trigger re insertion next time. */
             kve.second = make_pair(NodeId(), 0);
         } else {
-            UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (port_id=%u)\n",
+            UPD(uipcp, "Set PDUFT entry %s(%lu/%u) --> %s (port_id=%u)\n",
                 node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                next_hops[dst_node].front().c_str(), port_id);
+                match.dst_range_bits, next_hops[dst_node].front().c_str(),
+                port_id);
         }
     }
 
@@ -765,7 +796,8 @@ UipcpRib::routing_lib_init()
     std::vector<std::pair<std::string, PolicyParam>> link_state_params = {
         {"age-incr-intval",
          PolicyParam(Secs(int(LinkStateRouting::kAgeIncrIntvalSecs)))},
-        {"age-max", PolicyParam(Secs(int(LinkStateRouting::kAgeMaxSecs)))}};
+        {"age-max", PolicyParam(Secs(int(LinkStateRouting::kAgeMaxSecs)))},
+        {"fwd-aggregation", PolicyParam(false)}};
 
     UipcpRib::policy_register(
         Routing::Prefix, "link-state",
@@ -779,9 +811,10 @@ UipcpRib::routing_lib_init()
             return utils::make_unique<LinkStateRouting>(rib, true);
         },
         {Routing::TableName}, link_state_params);
-    UipcpRib::policy_register(Routing::Prefix, "static", [](UipcpRib *rib) {
-        return utils::make_unique<StaticRouting>(rib);
-    });
+    UipcpRib::policy_register(
+        Routing::Prefix, "static",
+        [](UipcpRib *rib) { return utils::make_unique<StaticRouting>(rib); },
+        {}, {{"fwd-aggregation", PolicyParam(false)}});
 }
 
 } // namespace rlite